@@ -0,0 +1,27 @@
+#!/bin/sh
+# Runs usbip_load against usbip_server with simulated devices on loopback and writes the JSON results:
+# the bulk size sweep on one loopback device, session scaling over three loopback devices and a mixed
+# control / interrupt / bulk run. Compare the files between commits.
+#
+#   bench/run_loopback.sh [build dir] [output dir]
+#
+# The bus runs unlimited (-B 0) with no device latency so the server itself is measured.
+set -e
+BUILD=${1:-build}
+OUT=${2:-.}
+PORT=${PORT:-3250}
+SECONDS_PER_RUN=${SECONDS_PER_RUN:-3}
+
+cmake -S "$(dirname "$0")/../native" -B "$BUILD" >/dev/null
+cmake --build "$BUILD" -j >/dev/null
+
+"$BUILD/usbip_server" -p "$PORT" -B 0 -L 0 -d loopback -d loopback -d loopback -d hid &
+SERVER=$!
+trap "kill $SERVER 2>/dev/null" EXIT
+sleep 0.5
+
+LOAD="$BUILD/usbip_load -p $PORT -t $SECONDS_PER_RUN"
+$LOAD -b 1-1 --sweep > "$OUT/sweep.json"
+$LOAD -b 1-1 -b 1-2 -b 1-3 --scale bulk-in:size=16384 bulk-out:size=16384 > "$OUT/scale.json"
+$LOAD -b 1-1 -b 1-4 ctrl bulk-in:bus=1-1 bulk-out:bus=1-1 intr:ep=1,size=4,bus=1-4 > "$OUT/mixed.json"
+echo "results in $OUT/sweep.json $OUT/scale.json $OUT/mixed.json"
@@ -0,0 +1,40 @@
+#!/bin/sh
+# Sweeps the task layouts of main/usbip_sched.c: for each one usbip_server is started with -S and a
+# loopback bulk device, and usbip_load runs a small and a large bulk IN / OUT stream against it.
+# Writes one JSON object keyed by layout, each with the usbip_load result (URB/s and p50/p99/p999) as
+# "load" and the completion to callback latency histogram the server prints on exit as "server".
+#
+#   bench/run_presets.sh [build dir] [output file]
+#
+# On Linux a pinned task is bound to CPU 0 or 1 and priorities are not modelled, so this compares
+# placement only. On the target, build each CONFIG_USBIP_SCHED_* choice and run the same usbip_load
+# streams against the board.
+set -e
+BUILD=${1:-build}
+OUT=${2:-presets.json}
+PORT=${PORT:-3250}
+SECONDS_PER_RUN=${SECONDS_PER_RUN:-3}
+LAYOUTS=${LAYOUTS:-"balanced latency throughput"}
+
+cmake -S "$(dirname "$0")/../native" -B "$BUILD" >/dev/null
+cmake --build "$BUILD" -j >/dev/null
+
+SERVER=
+trap '[ -n "$SERVER" ] && kill $SERVER 2>/dev/null' EXIT
+
+SEP="{"
+for LAYOUT in $LAYOUTS; do
+    "$BUILD/usbip_server" -p "$PORT" -B 0 -L 0 -S "$LAYOUT" -d loopback > "$OUT.server" &
+    SERVER=$!
+    sleep 0.5
+    RESULT=$("$BUILD/usbip_load" -p "$PORT" -t "$SECONDS_PER_RUN" -b 1-1 \
+        bulk-in:size=512 bulk-out:size=512 bulk-in:size=16384 bulk-out:size=16384)
+    kill $SERVER
+    wait $SERVER 2>/dev/null || true
+    SERVER=
+    printf '%s\n"%s": {"load": %s, "server": %s}' "$SEP" "$LAYOUT" "$RESULT" "$(tail -n 1 "$OUT.server")"
+    SEP=","
+done > "$OUT"
+echo "}" >> "$OUT"
+rm -f "$OUT.server"
+echo "results in $OUT"
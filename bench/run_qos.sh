@@ -0,0 +1,38 @@
+#!/bin/sh
+# Interrupt latency next to saturating bulk traffic, the acceptance run of the QoS lanes (usbip_qos.h).
+# usbip_server exports the combo device (a 1 ms keyboard and a bulk source/sink on one connection)
+# with a small socket send buffer like lwIP's, usbip_load reads the replies at LINK bit/s like a WiFi
+# link would. Writes one JSON object keyed by run, each the usbip_load result with the intr stream
+# p50/p99/p999 next to the bulk streams.
+#
+#   bench/run_qos.sh [build dir] [output file]
+set -e
+BUILD=${1:-build}
+OUT=${2:-qos.json}
+PORT=${PORT:-3250}
+SECONDS_PER_RUN=${SECONDS_PER_RUN:-3}
+LINK=${LINK:-8000000}
+SNDBUF=${SNDBUF:-2048}
+
+cmake -S "$(dirname "$0")/../native" -B "$BUILD" >/dev/null
+cmake --build "$BUILD" -j >/dev/null
+
+"$BUILD/usbip_server" -p "$PORT" -B 0 -L 0 -W "$SNDBUF" -d combo &
+SERVER=$!
+trap 'kill $SERVER 2>/dev/null' EXIT
+sleep 0.5
+
+run() {
+    printf '%s\n"%s": %s' "$SEP" "$1" "$(shift; "$BUILD/usbip_load" -p "$PORT" -t "$SECONDS_PER_RUN" --link "$LINK" intr:ep=1 "$@")"
+    SEP=","
+}
+
+SEP="{"
+{
+    run "idle"
+    run "bulk-in 4k x8" bulk-in:size=4096,depth=8
+    run "bulk-in 16k x8" bulk-in:size=16384,depth=8
+    run "bulk-in 16k x16 + bulk-out 16k x4" bulk-in:size=16384,depth=16 bulk-out:size=16384,depth=4
+} > "$OUT"
+echo "}" >> "$OUT"
+echo "results in $OUT"
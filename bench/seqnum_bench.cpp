@@ -0,0 +1,94 @@
+/**
+ * Seqnum dedupe microbenchmark: the old std::vector list from usbip.cpp against SeqnumWindow.
+ *
+ * Build and run on the dev box:
+ *   g++ -O2 -std=c++17 -Imain bench/seqnum_bench.cpp -o seqnum_bench && ./seqnum_bench
+ *
+ * Each simulated URB is one completion lookup+insert, every 16th URB is also unlinked
+ * before it completes, with up to 32 URBs in flight completing out of order.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "usbip_seqnum.hpp"
+
+#define NUM_URBS    200000
+#define IN_FLIGHT   32
+
+// the list as it was used by _event_handler and parse_request
+struct VectorList
+{
+    std::vector<uint32_t> vec;
+
+    void unlink(uint32_t seqnum)
+    {
+        vec.insert(vec.begin(), seqnum);
+    }
+
+    bool complete(uint32_t seqnum)
+    {
+        if (std::find(vec.begin(), vec.end(), seqnum) != vec.end()) return true;
+        vec.insert(vec.begin(), seqnum);
+        if(vec.size() >= 999) vec.pop_back();
+        return false;
+    }
+};
+
+struct WindowList
+{
+    SeqnumWindow<> window;
+
+    void unlink(uint32_t seqnum)
+    {
+        window.mark(seqnum);
+    }
+
+    bool complete(uint32_t seqnum)
+    {
+        return window.test_and_mark(seqnum);
+    }
+};
+
+template <typename T>
+static double run(const char* name, const std::vector<uint32_t>& order, uint32_t& dropped)
+{
+    T list;
+    dropped = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    for (uint32_t seqnum : order)
+    {
+        if (seqnum % 16 == 0) list.unlink(seqnum);
+        if (list.complete(seqnum)) dropped++;
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(t1 - t0).count() / order.size();
+    printf("%-8s %8.1f ns/URB %12.0f URB/s  dropped: %u\n", name, ns, 1e9 / ns, dropped);
+    return ns;
+}
+
+int main()
+{
+    // completion order: seqnums in increasing order, shuffled within each in flight window
+    std::vector<uint32_t> order;
+    uint32_t rnd = 12345;
+    for (uint32_t n = 1; n <= NUM_URBS; n += IN_FLIGHT)
+    {
+        size_t first = order.size();
+        for (uint32_t i = 0; i < IN_FLIGHT; i++) order.push_back(n + i);
+        for (size_t i = order.size() - 1; i > first; i--)
+        {
+            rnd = rnd * 1103515245 + 12345;
+            std::swap(order[i], order[first + (rnd >> 16) % (i - first + 1)]);
+        }
+    }
+
+    uint32_t dropped_vec, dropped_win;
+    double vec_ns = run<VectorList>("vector", order, dropped_vec);
+    double win_ns = run<WindowList>("window", order, dropped_win);
+    printf("speedup: %.1fx, results %s\n", vec_ns / win_ns, dropped_vec == dropped_win ? "match" : "DIFFER");
+
+    return dropped_vec == dropped_win ? 0 : 1;
+}
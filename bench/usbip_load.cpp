@@ -0,0 +1,597 @@
+/**
+ * USB/IP load generator: a client that speaks the wire protocol itself, no vhci-hcd or root needed.
+ *
+ * Built with the native tree (cmake -S native -B build), or on its own:
+ *   g++ -O2 -std=c++17 -pthread bench/usbip_load.cpp -o usbip_load
+ *
+ * Every session imports one busid and keeps `depth` CMD_SUBMITs in flight per stream until the run
+ * time is over. Results go to stdout as JSON: URBs, bytes, URB/s, throughput and p50/p99/p999
+ * round trip latency (CMD_SUBMIT written -> RET_SUBMIT read) per stream. bench/run_loopback.sh
+ * runs it against the simulated devices of usbip_server.
+ *
+ *   usbip_load -b 1-1 bulk-in:ep=0x82,size=4096,depth=4 bulk-out:ep=0x02,size=4096
+ *   usbip_load -b 1-1 -b 1-2 ctrl:depth=2 intr:ep=1,size=8,bus=1-2
+ *   usbip_load -b 1-1 --sweep                 bulk IN and OUT at 512 B, 4 KiB, 16 KiB and 64 KiB
+ *   usbip_load -b 1-1 -b 1-2 --scale          the streams on 1, then 2, ... sessions at once
+ *   usbip_load -b 1-1 --attach                import + enumeration per second, urbs are attaches and
+ *                                             the latency is connect() to the SET_CONFIGURATION reply
+ *   usbip_load --link 8000000 intr:ep=1 bulk-in:size=16384,depth=8
+ *                                             replies are read at 8 Mbit/s like over WiFi, the server's
+ *                                             queues fill up the way they do on the target
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define USBIP_VERSION       0x0111
+#define OP_REQ_IMPORT       0x8003
+#define USBIP_CMD_SUBMIT    1
+#define USBIP_RET_SUBMIT    3
+#define USBIP_DIR_OUT       0
+#define USBIP_DIR_IN        1
+#define HEADER_SIZE         48
+#define IMPORT_REPLY_SIZE   (8 + 0x138)
+
+typedef std::chrono::steady_clock clk;
+
+static const char* host = "127.0.0.1";
+static const char* port = "3240";
+static double duration = 5.0;
+static double warmup = 0.5;
+static uint64_t link_bps = 0;   /*!< --link, 0 reads replies as fast as they come */
+#define LINK_BURST          2048
+
+enum kind_t { CTRL, BULK_IN, BULK_OUT, INTR };
+static const char* kind_names[] = {"ctrl", "bulk-in", "bulk-out", "intr"};
+
+struct stream_t{
+    kind_t kind;
+    uint8_t ep;
+    uint32_t size;
+    uint32_t depth;
+    std::string busid;  /*!< only on this session, all sessions if empty */
+
+    // results
+    uint64_t urbs = 0;
+    uint64_t bytes = 0;
+    uint64_t errors = 0;
+    std::vector<uint32_t> latency_ns;
+};
+
+struct session_t{
+    std::string busid;
+    std::vector<stream_t> streams;
+    uint32_t devid = 0;
+    std::string error;
+};
+
+static void put32(uint8_t* p, uint32_t v) { p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v; }
+static uint32_t get32(const uint8_t* p) { return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+
+static bool parse_stream(const char* spec, stream_t* s)
+{
+    std::string str(spec);
+    std::string name = str.substr(0, str.find(':'));
+    int kind = -1;
+    for (int n = 0; n < 4; n++) if (name == kind_names[n]) kind = n;
+    if (kind < 0) return false;
+
+    s->kind = (kind_t)kind;
+    s->ep = kind == CTRL ? 0 : kind == INTR ? 1 : 2;
+    s->size = kind == CTRL ? 18 : kind == INTR ? 8 : 4096;
+    s->depth = kind == INTR ? 1 : 4;
+
+    size_t pos = str.find(':');
+    while (pos != std::string::npos)
+    {
+        size_t end = str.find(',', pos + 1);
+        std::string kv = str.substr(pos + 1, end == std::string::npos ? std::string::npos : end - pos - 1);
+        size_t eq = kv.find('=');
+        if (eq == std::string::npos) return false;
+        std::string key = kv.substr(0, eq);
+        if (key == "bus")
+        {
+            s->busid = kv.substr(eq + 1);
+            pos = end;
+            continue;
+        }
+        uint32_t value = strtoul(kv.c_str() + eq + 1, NULL, 0);
+        if (key == "ep") s->ep = value & 0x0f;
+        else if (key == "size") s->size = value;
+        else if (key == "depth") s->depth = value ? value : 1;
+        else return false;
+        pos = end;
+    }
+    return true;
+}
+
+static int connect_server()
+{
+    struct addrinfo hints = {};
+    struct addrinfo* res;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res)) return -1;
+
+    int sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    // a small receive window, so what the paced reader leaves behind backs up into the server
+    int rcvbuf = LINK_BURST;
+    if (sock >= 0 && link_bps) setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    if (sock >= 0 && connect(sock, res->ai_addr, res->ai_addrlen))
+    {
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(res);
+    if (sock < 0) return -1;
+
+    int on = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return sock;
+}
+
+static bool recv_all(int sock, uint8_t* buf, size_t len)
+{
+    while (len)
+    {
+        ssize_t n = recv(sock, buf, len, 0);
+        if (n <= 0) return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool import_device(int sock, session_t* session)
+{
+    uint8_t req[8 + 32] = {};
+    req[0] = USBIP_VERSION >> 8;
+    req[1] = USBIP_VERSION & 0xff;
+    req[2] = OP_REQ_IMPORT >> 8;
+    req[3] = OP_REQ_IMPORT & 0xff;
+    strncpy((char*)req + 8, session->busid.c_str(), 31);
+    if (send(sock, req, sizeof(req), 0) != sizeof(req)) return false;
+
+    uint8_t rep[IMPORT_REPLY_SIZE];
+    if (!recv_all(sock, rep, 8)) return false;
+    if (get32(rep + 4) != 0)
+    {
+        session->error = "import status " + std::to_string(get32(rep + 4));
+        return false;
+    }
+    if (!recv_all(sock, rep + 8, sizeof(rep) - 8)) return false;
+    // busnum and devnum follow path[256] and busid[32]
+    session->devid = (get32(rep + 8 + 288) << 16) | get32(rep + 8 + 292);
+    return true;
+}
+
+/**
+ * @brief Drives all streams of the session over one socket until the run time is over
+ */
+static int open_session(session_t* session, clk::time_point* opened)
+{
+    // the previous run's session may still hold the device for a moment after it closed
+    int sock = -1;
+    for (int attempt = 0; attempt < 20 && sock < 0; attempt++)
+    {
+        if (attempt) std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        session->error.clear();
+        if (opened) *opened = clk::now();
+        sock = connect_server();
+        if (sock < 0)
+        {
+            session->error = "connect failed";
+            return -1;
+        }
+        if (!import_device(sock, session))
+        {
+            if (session->error.empty()) session->error = "import failed";
+            close(sock);
+            sock = -1;
+        }
+    }
+    return sock;
+}
+
+static void run_session(session_t* session, clk::time_point start)
+{
+    int sock = open_session(session, NULL);
+    if (sock < 0) return;
+
+    struct urb_t{
+        stream_t* stream;
+        bool in;
+        clk::time_point sent;
+    };
+    std::unordered_map<uint32_t, urb_t> inflight;
+    std::vector<uint8_t> out;
+    size_t out_pos = 0;
+    uint32_t seqnum = 1;
+    uint32_t ctrl_n = 0;
+    std::vector<uint8_t> payload;
+    for (auto& s : session->streams)
+    {
+        if (s.kind == BULK_OUT && payload.size() < s.size) payload.resize(s.size);
+    }
+    for (size_t n = 0; n < payload.size(); n++) payload[n] = n;
+
+    auto submit = [&](stream_t* s) {
+        uint8_t hdr[HEADER_SIZE] = {};
+        bool in = s->kind != BULK_OUT;
+        uint32_t length = s->size;
+        put32(hdr, USBIP_CMD_SUBMIT);
+        put32(hdr + 4, seqnum);
+        put32(hdr + 8, session->devid);
+        put32(hdr + 12, in ? USBIP_DIR_IN : USBIP_DIR_OUT);
+        put32(hdr + 16, s->ep);
+        put32(hdr + 24, length);
+        if (s->kind == INTR) put32(hdr + 36, 1);
+        if (s->kind == CTRL)
+        {
+            // GET_DESCRIPTOR storm: device, configuration and product string in turn
+            static const uint16_t values[] = {0x0100, 0x0200, 0x0302};
+            uint16_t value = values[ctrl_n++ % 3];
+            uint16_t index = (value >> 8) == 3 ? 0x0409 : 0;
+            uint8_t setup[8] = {0x80, 0x06, (uint8_t)value, (uint8_t)(value >> 8), (uint8_t)index, (uint8_t)(index >> 8),
+                                (uint8_t)length, (uint8_t)(length >> 8)};
+            memcpy(hdr + 40, setup, 8);
+        }
+        out.insert(out.end(), hdr, hdr + HEADER_SIZE);
+        if (!in) out.insert(out.end(), payload.begin(), payload.begin() + length);
+        inflight[seqnum] = {s, in, clk::now()};
+        seqnum++;
+    };
+
+    for (auto& s : session->streams)
+    {
+        for (uint32_t n = 0; n < s.depth; n++) submit(&s);
+    }
+
+    clk::time_point measure = start + std::chrono::duration_cast<clk::duration>(std::chrono::duration<double>(warmup));
+    clk::time_point end = measure + std::chrono::duration_cast<clk::duration>(std::chrono::duration<double>(duration));
+    std::vector<uint8_t> in(HEADER_SIZE + 1024 * 1024);
+    size_t in_len = 0;
+    // --link: token bucket of received bytes, at most LINK_BURST ahead of the rate
+    clk::time_point link_start = clk::now();
+    uint64_t link_bytes = 0;
+
+    while (!inflight.empty())
+    {
+        size_t room = in.size() - in_len;
+        bool paced = false;
+        if (link_bps)
+        {
+            double elapsed = std::chrono::duration<double>(clk::now() - link_start).count();
+            int64_t allowed = (int64_t)(elapsed * link_bps / 8) - (int64_t)link_bytes;
+            if (allowed > LINK_BURST)
+            {
+                link_bytes += allowed - LINK_BURST;
+                allowed = LINK_BURST;
+            }
+            if (allowed < (int64_t)room) room = allowed > 0 ? allowed : 0;
+            paced = room == 0;
+        }
+        struct pollfd pfd = {sock, (short)((paced ? 0 : POLLIN) | (out_pos < out.size() ? POLLOUT : 0)), 0};
+        int ready = poll(&pfd, 1, paced ? 1 : 5000);
+        if (ready < 0 || (ready == 0 && !paced))
+        {
+            session->error = "timeout waiting for RET_SUBMIT";
+            break;
+        }
+        if (pfd.revents & POLLOUT)
+        {
+            ssize_t n = send(sock, out.data() + out_pos, out.size() - out_pos, MSG_DONTWAIT);
+            if (n > 0) out_pos += n;
+            if (out_pos == out.size())
+            {
+                out.clear();
+                out_pos = 0;
+            }
+        }
+        if (paced || !(pfd.revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+        ssize_t n = recv(sock, in.data() + in_len, room, MSG_DONTWAIT);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EAGAIN) continue;
+            session->error = "connection closed";
+            break;
+        }
+        in_len += n;
+        link_bytes += n;
+
+        size_t pos = 0;
+        while (in_len - pos >= HEADER_SIZE)
+        {
+            const uint8_t* hdr = in.data() + pos;
+            uint32_t seq = get32(hdr + 4);
+            auto it = inflight.find(seq);
+            if (get32(hdr) != USBIP_RET_SUBMIT || it == inflight.end())
+            {
+                session->error = "unexpected reply";
+                inflight.clear();
+                break;
+            }
+            int32_t status = (int32_t)get32(hdr + 20);
+            uint32_t actual = get32(hdr + 24);
+            size_t data = it->second.in ? actual : 0;
+            if (in_len - pos < HEADER_SIZE + data) break;
+
+            clk::time_point now = clk::now();
+            stream_t* s = it->second.stream;
+            if (it->second.sent >= measure && now <= end)
+            {
+                s->urbs++;
+                s->bytes += actual;
+                if (status) s->errors++;
+                s->latency_ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(now - it->second.sent).count());
+            }
+            inflight.erase(it);
+            pos += HEADER_SIZE + data;
+            if (now < end) submit(s);
+        }
+        memmove(in.data(), in.data() + pos, in_len - pos);
+        in_len -= pos;
+    }
+    close(sock);
+}
+
+/**
+ * @brief One control transfer on EP0, waits for its RET_SUBMIT and leaves IN data in data[1024].
+ * Returns the status, -1 when the connection failed.
+ */
+static int control(int sock, const session_t* session, uint32_t seqnum, uint8_t request_type, uint8_t request,
+                   uint16_t value, uint16_t index, uint16_t length, uint8_t* data)
+{
+    uint8_t hdr[HEADER_SIZE] = {};
+    bool in = request_type & 0x80;
+    put32(hdr, USBIP_CMD_SUBMIT);
+    put32(hdr + 4, seqnum);
+    put32(hdr + 8, session->devid);
+    put32(hdr + 12, in ? USBIP_DIR_IN : USBIP_DIR_OUT);
+    put32(hdr + 24, in ? length : 0);
+    uint8_t setup[8] = {request_type, request, (uint8_t)value, (uint8_t)(value >> 8), (uint8_t)index, (uint8_t)(index >> 8),
+                        (uint8_t)length, (uint8_t)(length >> 8)};
+    memcpy(hdr + 40, setup, 8);
+    if (send(sock, hdr, sizeof(hdr), 0) != sizeof(hdr)) return -1;
+
+    uint8_t rep[HEADER_SIZE];
+    if (!recv_all(sock, rep, HEADER_SIZE)) return -1;
+    uint32_t actual = get32(rep + 24);
+    if (get32(rep) != USBIP_RET_SUBMIT || get32(rep + 4) != seqnum || actual > 1024) return -1;
+    if (in && !recv_all(sock, data, actual)) return -1;
+    return (int32_t)get32(rep + 20);
+}
+
+/**
+ * @brief Imports the device and runs the requests Linux sends when a device is attached, again and again
+ * until the run time is over. Every attach is timed from connect() to the reply of SET_CONFIGURATION.
+ */
+static void run_attach(session_t* session, clk::time_point start)
+{
+    clk::time_point measure = start + std::chrono::duration_cast<clk::duration>(std::chrono::duration<double>(warmup));
+    clk::time_point end = measure + std::chrono::duration_cast<clk::duration>(std::chrono::duration<double>(duration));
+    stream_t s;
+    parse_stream("ctrl", &s);
+    s.depth = 1;
+
+    while (clk::now() < end)
+    {
+        clk::time_point opened;
+        int sock = open_session(session, &opened);
+        if (sock < 0) break;
+
+        struct{ uint8_t type; uint8_t request; uint16_t value; uint16_t index; uint16_t length; }sequence[] = {
+            {0x80, 0x06, 0x0100, 0, 64},        // GET_DESCRIPTOR device, the first 64 bytes like usb_new_device()
+            {0x80, 0x06, 0x0100, 0, 18},
+            {0x80, 0x06, 0x0200, 0, 9},         // configuration header, then all of it
+            {0x80, 0x06, 0x0200, 0, 0},
+            {0x80, 0x06, 0x0300, 0, 255},       // LANGID table, manufacturer, product, serial
+            {0x80, 0x06, 0x0301, 0x0409, 255},
+            {0x80, 0x06, 0x0302, 0x0409, 255},
+            {0x80, 0x06, 0x0303, 0x0409, 255},
+            {0x80, 0x00, 0, 0, 2},              // GET_STATUS
+            {0x00, 0x09, 1, 0, 0},              // SET_CONFIGURATION 1
+        };
+        uint8_t data[1024];
+        uint32_t seqnum = 1;
+        uint16_t total = 9;
+        int status = 0;
+        for (auto& r : sequence)
+        {
+            // the full configuration is read with the wTotalLength of its header
+            uint16_t length = r.length ? r.length : std::min(total, (uint16_t)sizeof(data));
+            status = control(sock, session, seqnum++, r.type, r.request, r.value, r.index, length, data);
+            if (status) break;
+            if (r.value == 0x0200 && r.length == 9) total = data[2] | (data[3] << 8);
+        }
+        close(sock);
+        if (status < 0 && session->error.empty()) session->error = "attach failed";
+
+        clk::time_point now = clk::now();
+        if (opened >= measure && now <= end)
+        {
+            s.urbs++;
+            if (status) s.errors++;
+            s.latency_ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(now - opened).count());
+        }
+        if (status < 0) break;
+    }
+    session->streams = {s};
+}
+
+static uint32_t percentile(std::vector<uint32_t>& v, double p)
+{
+    if (v.empty()) return 0;
+    size_t k = std::min(v.size() - 1, (size_t)(p * v.size()));
+    std::nth_element(v.begin(), v.begin() + k, v.end());
+    return v[k];
+}
+
+static void print_run(const char* name, std::vector<session_t>& sessions, bool last)
+{
+    double total_urbs = 0, total_bytes = 0;
+    const char* sep = "";
+    printf("    {\"name\": \"%s\", \"sessions\": %zu, \"streams\": [\n", name, sessions.size());
+    for (auto& session : sessions)
+    {
+        for (auto& s : session.streams)
+        {
+            total_urbs += s.urbs;
+            total_bytes += s.bytes;
+            printf("%s      {\"busid\": \"%s\", \"kind\": \"%s\", \"ep\": %u, \"size\": %u, \"depth\": %u, "
+                   "\"urbs\": %llu, \"errors\": %llu, \"bytes\": %llu, \"urb_per_s\": %.1f, \"kib_per_s\": %.1f, "
+                   "\"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f}%s%s%s}",
+                   sep, session.busid.c_str(), kind_names[s.kind], s.ep, s.size, s.depth,
+                   (unsigned long long)s.urbs, (unsigned long long)s.errors, (unsigned long long)s.bytes,
+                   s.urbs / duration, s.bytes / duration / 1024,
+                   percentile(s.latency_ns, 0.5) / 1000.0, percentile(s.latency_ns, 0.99) / 1000.0,
+                   percentile(s.latency_ns, 0.999) / 1000.0,
+                   session.error.empty() ? "" : ", \"error\": \"", session.error.c_str(), session.error.empty() ? "" : "\"");
+            sep = ",\n";
+        }
+    }
+    printf("\n    ], \"urb_per_s\": %.1f, \"kib_per_s\": %.1f}%s\n", total_urbs / duration, total_bytes / duration / 1024, last ? "" : ",");
+    fflush(stdout);
+}
+
+static session_t make_session(const std::string& busid, const std::vector<stream_t>& streams)
+{
+    session_t session;
+    session.busid = busid;
+    for (auto& s : streams)
+    {
+        if (s.busid.empty() || s.busid == busid) session.streams.push_back(s);
+    }
+    return session;
+}
+
+static void run(const char* name, std::vector<session_t>& sessions, bool last)
+{
+    std::vector<std::thread> threads;
+    clk::time_point start = clk::now();
+    for (auto& session : sessions) threads.emplace_back(run_session, &session, start);
+    for (auto& t : threads) t.join();
+    print_run(name, sessions, last);
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr, "usage: %s [-H host] [-p port] [-b busid]... [-t seconds] [-w seconds] [--link bps] [--sweep | --scale | --attach] [stream]...\n"
+                    "  stream: ctrl|bulk-in|bulk-out|intr[:ep=N,size=N,depth=N,bus=busid]\n"
+                    "  default streams: bulk-in:ep=2,size=4096,depth=4 (the loopback source)\n"
+                    "  --link   read replies at most at this many bit/s, to put a WiFi-like bottleneck behind the server\n"
+                    "  --sweep  bulk-in and bulk-out at 512, 4096, 16384 and 65536 bytes on the first busid\n"
+                    "  --scale  the streams on the first 1, 2, ... n busids at once, one session each\n"
+                    "  --attach import and enumerate the first busid like Linux does, over and over\n", name);
+}
+
+int main(int argc, char** argv)
+{
+    static const struct option options[] = {
+        {"sweep", no_argument, NULL, 'S'},
+        {"scale", no_argument, NULL, 'C'},
+        {"attach", no_argument, NULL, 'A'},
+        {"link", required_argument, NULL, 'L'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    std::vector<std::string> busids;
+    bool sweep = false, scale = false, attach = false;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "H:p:b:t:w:h", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'H': host = optarg; break;
+        case 'p': port = optarg; break;
+        case 'b': busids.push_back(optarg); break;
+        case 't': duration = atof(optarg); break;
+        case 'w': warmup = atof(optarg); break;
+        case 'S': sweep = true; break;
+        case 'C': scale = true; break;
+        case 'A': attach = true; break;
+        case 'L': link_bps = strtoull(optarg, NULL, 0); break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (busids.empty()) busids.push_back("1-1");
+
+    std::vector<stream_t> streams;
+    for (int n = optind; n < argc; n++)
+    {
+        stream_t s;
+        if (!parse_stream(argv[n], &s))
+        {
+            fprintf(stderr, "bad stream: %s\n", argv[n]);
+            usage(argv[0]);
+            return 1;
+        }
+        streams.push_back(s);
+    }
+    if (streams.empty())
+    {
+        stream_t s;
+        parse_stream("bulk-in", &s);
+        streams.push_back(s);
+    }
+
+    printf("{\"server\": \"%s:%s\", \"duration_s\": %.1f, \"runs\": [\n", host, port, duration);
+    if (sweep)
+    {
+        static const uint32_t sizes[] = {512, 4096, 16384, 65536};
+        for (int n = 0; n < 8; n++)
+        {
+            stream_t s;
+            parse_stream(n % 2 ? "bulk-out" : "bulk-in", &s);
+            s.size = sizes[n / 2];
+            std::vector<session_t> sessions = {make_session(busids[0], {s})};
+            std::string name = std::string("sweep ") + kind_names[s.kind] + " " + std::to_string(s.size);
+            run(name.c_str(), sessions, n == 7);
+        }
+    }
+    else if (attach)
+    {
+        session_t session;
+        session.busid = busids[0];
+        run_attach(&session, clk::now());
+        std::vector<session_t> sessions = {session};
+        print_run("attach", sessions, true);
+    }
+    else if (scale)
+    {
+        for (size_t n = 1; n <= busids.size(); n++)
+        {
+            std::vector<session_t> sessions;
+            for (size_t i = 0; i < n; i++) sessions.push_back(make_session(busids[i], streams));
+            std::string name = "scale " + std::to_string(n);
+            run(name.c_str(), sessions, n == busids.size());
+        }
+    }
+    else
+    {
+        std::vector<session_t> sessions;
+        for (auto& busid : busids) sessions.push_back(make_session(busid, streams));
+        run("streams", sessions, true);
+    }
+    printf("]}\n");
+    return 0;
+}
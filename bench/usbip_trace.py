@@ -0,0 +1,156 @@
+#!/usr/bin/env python3
+"""
+URB stage trace side channel client and Chrome trace / Perfetto converter, for CONFIG_USBIP_TRACE.
+
+  bench/usbip_trace.py -H 192.168.4.1 start
+  ... run the workload ...
+  bench/usbip_trace.py -H 192.168.4.1 dump -o trace.json [--raw trace.bin]
+  bench/usbip_trace.py convert trace.bin -o trace.json
+
+Open trace.json in ui.perfetto.dev or chrome://tracing. Every URB is an async slice per session and
+endpoint, split into the time spent in parse (recv -> handed to the URB task), queue (-> submitted to
+the host library), usb (-> transfer callback) and reply (-> RET_SUBMIT written to the socket).
+"""
+import argparse
+import json
+import socket
+import struct
+import sys
+
+MAGIC = 0x43525455
+DUMP_HEADER = struct.Struct("<IHHII")
+RECORD = struct.Struct("<IIIBBBB")
+STAGES = ["recv", "parse", "submit", "complete", "send"]
+SPANS = ["parse", "queue", "usb", "reply"]    # between two consecutive stages
+EP_NONE = 0xff
+
+
+def command(host, port, cmd):
+    with socket.create_connection((host, port), timeout=10) as sock:
+        sock.sendall(cmd)
+        data = bytearray()
+        while True:
+            chunk = sock.recv(65536)
+            if not chunk:
+                return bytes(data)
+            data += chunk
+
+
+def parse_dump(data):
+    magic, version, size, count, lost = DUMP_HEADER.unpack_from(data)
+    if magic != MAGIC or version != 1 or size != RECORD.size:
+        sys.exit("not a usbip trace dump")
+    records = []
+    for n in range(count):
+        time_us, seqnum, _, stage, ep, slot, _ = RECORD.unpack_from(data, DUMP_HEADER.size + n * size)
+        records.append((time_us, seqnum, stage, ep, slot))
+    return records, lost
+
+
+def unwrap(records):
+    """32 bit microseconds to a running time, records come roughly in time order"""
+    out = []
+    base = 0
+    prev = None
+    for time_us, seqnum, stage, ep, slot in records:
+        if prev is not None:
+            delta = (time_us - prev) & 0xffffffff
+            if delta >= 1 << 31:
+                delta -= 1 << 32
+            base += delta
+        prev = time_us
+        out.append((base, seqnum, stage, ep, slot))
+    return out
+
+
+def group(records):
+    """Stamps by URB, a seqnum that shows up again after its RET_SUBMIT was sent belongs to a new connection"""
+    urbs = []
+    open_urbs = {}
+    for time_us, seqnum, stage, ep, slot in records:
+        key = (slot, seqnum)
+        urb = open_urbs.get(key)
+        if urb is None or (stage == 0 and 0 in urb["stamps"]):
+            urb = {"slot": slot, "seqnum": seqnum, "ep": EP_NONE, "stamps": {}}
+            open_urbs[key] = urb
+            urbs.append(urb)
+        if ep != EP_NONE:
+            urb["ep"] = ep
+        # a flushed transfer is submitted again, the last submit is the one that completed
+        urb["stamps"][stage] = time_us
+        if stage == 4:
+            del open_urbs[key]
+    return urbs
+
+
+def to_chrome(urbs, lost):
+    start = min((min(u["stamps"].values()) for u in urbs), default=0)
+    events = []
+    for n, urb in enumerate(urbs):
+        ep = urb["ep"]
+        track = "EP0" if ep & 0x0f == 0 else "EP%d %s" % (ep & 0x0f, "IN" if ep & 0x80 else "OUT")
+        if ep == EP_NONE:
+            track = "EP?"
+        common = {"cat": "urb", "id": n, "pid": urb["slot"], "tid": track}
+        stamps = sorted(urb["stamps"].items())
+        first, last = stamps[0][1], stamps[-1][1]
+        name = "%s seq %d" % (track, urb["seqnum"])
+        args = {STAGES[s]: t - start for s, t in stamps}
+        events.append(dict(common, ph="b", name=name, ts=first - start, args=args))
+        for (s0, t0), (s1, t1) in zip(stamps, stamps[1:]):
+            span = SPANS[s0] if s1 == s0 + 1 else "%s..%s" % (STAGES[s0], STAGES[s1])
+            events.append(dict(common, ph="b", name=span, ts=t0 - start))
+            events.append(dict(common, ph="e", name=span, ts=t1 - start))
+        events.append(dict(common, ph="e", name=name, ts=last - start))
+    for slot in sorted({u["slot"] for u in urbs}):
+        events.append({"ph": "M", "name": "process_name", "pid": slot, "args": {"name": "session %d" % slot}})
+    return {"traceEvents": events, "otherData": {"urbs": len(urbs), "lost_records": lost}}
+
+
+def summary(urbs):
+    """Median and p99 of every span, to stderr"""
+    for n, span in enumerate(SPANS):
+        values = sorted(u["stamps"][n + 1] - u["stamps"][n] for u in urbs if n in u["stamps"] and n + 1 in u["stamps"])
+        if values:
+            print("%-6s n=%-7d p50 %6d us  p99 %6d us" % (span, len(values), values[len(values) // 2],
+                                                       values[min(len(values) - 1, len(values) * 99 // 100)]), file=sys.stderr)
+
+
+def convert(data, out):
+    records, lost = parse_dump(data)
+    urbs = group(unwrap(records))
+    with open(out, "w") as f:
+        json.dump(to_chrome(urbs, lost), f)
+    print("%d records, %d URBs, %d records lost -> %s" % (len(records), len(urbs), lost, out), file=sys.stderr)
+    summary(urbs)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("-H", "--host", default="127.0.0.1")
+    parser.add_argument("-p", "--port", type=int, default=3241)
+    parser.add_argument("-o", "--output", default="trace.json")
+    parser.add_argument("--raw", help="also keep the binary dump")
+    parser.add_argument("action", choices=["start", "stop", "dump", "convert"])
+    parser.add_argument("input", nargs="?", help="binary dump to convert")
+    args = parser.parse_args()
+
+    if args.action == "start":
+        command(args.host, args.port, b"1")
+    elif args.action == "stop":
+        command(args.host, args.port, b"0")
+    elif args.action == "dump":
+        data = command(args.host, args.port, b"d")
+        if args.raw:
+            with open(args.raw, "wb") as f:
+                f.write(data)
+        convert(data, args.output)
+    else:
+        if not args.input:
+            parser.error("convert needs the binary dump")
+        with open(args.input, "rb") as f:
+            convert(f.read(), args.output)
+
+
+if __name__ == "__main__":
+    main()
@@ -13,24 +13,33 @@ USBhostDevice::~USBhostDevice()
 {
 }
 
-esp_err_t USBhostDevice::init(size_t len)
+esp_err_t USBhostDevice::init(usb_device_handle_t dev_hdl, size_t len)
 {
+    this->dev_hdl = dev_hdl;
+    usb_host_get_active_config_descriptor(dev_hdl, &config_desc);
     esp_err_t err = usb_host_transfer_alloc(len, 0, &xfer_ctrl);
-    xfer_ctrl->device_handle = _host->deviceHandle();
+    xfer_ctrl->device_handle = dev_hdl;
     xfer_ctrl->context = this;
     xfer_ctrl->bEndpointAddress = 0;
 
     return err;
 }
 
-IRAM_ATTR usb_transfer_t *USBhostDevice::allocate(size_t _size)
+IRAM_ATTR usb_transfer_t *USBhostDevice::allocate(size_t _size, int num_isoc)
 {
-    usb_transfer_t *transfer = NULL;
+    usb_transfer_t *transfer = pool.get(_size, num_isoc);
+    if (transfer)
+    {
+        transfer->flags = 0;
+        transfer->context = this;
+        return transfer;
+    }
 
-    esp_err_t err = usb_host_transfer_alloc(_size, 0, &transfer);
+    esp_err_t err = usb_host_transfer_alloc(_size, num_isoc, &transfer);
     if (!err)
     {
-        transfer->device_handle = _host->deviceHandle();
+        pool.countFallbackAlloc();
+        transfer->device_handle = dev_hdl;
         transfer->context = this;
     }
     return transfer;
@@ -38,6 +47,9 @@ IRAM_ATTR usb_transfer_t *USBhostDevice::allocate(size_t _size)
 
 IRAM_ATTR esp_err_t USBhostDevice::deallocate(usb_transfer_t *transfer)
 {
+    if (pool.put(transfer)) return ESP_OK;
+
+    pool.countFallbackFree();
     esp_err_t err = usb_host_transfer_free(transfer);
     if (ESP_OK != err)
     {
@@ -47,6 +59,58 @@ IRAM_ATTR esp_err_t USBhostDevice::deallocate(usb_transfer_t *transfer)
     return err;
 }
 
+IRAM_ATTR esp_err_t USBhostDevice::submitTransfer(usb_transfer_t *transfer)
+{
+    if ((transfer->bEndpointAddress & USB_B_ENDPOINT_ADDRESS_EP_NUM_MASK) == 0)
+    {
+        return usb_host_transfer_submit_control(_host->clientHandle(), transfer);
+    }
+    return usb_host_transfer_submit(transfer);
+}
+
+esp_err_t USBhostDevice::flushEndpoint(uint8_t bEndpointAddress)
+{
+    esp_err_t err = usb_host_endpoint_halt(dev_hdl, bEndpointAddress);
+    if (err == ESP_OK) err = usb_host_endpoint_flush(dev_hdl, bEndpointAddress);
+    esp_err_t clear = usb_host_endpoint_clear(dev_hdl, bEndpointAddress);
+    return err == ESP_OK ? clear : err;
+}
+
+esp_err_t USBhostDevice::claimInterface(uint8_t bInterfaceNumber, uint8_t bAlternateSetting)
+{
+    return usb_host_interface_claim(_host->clientHandle(), dev_hdl, bInterfaceNumber, bAlternateSetting);
+}
+
+esp_err_t USBhostDevice::releaseInterface(uint8_t bInterfaceNumber)
+{
+    return usb_host_interface_release(_host->clientHandle(), dev_hdl, bInterfaceNumber);
+}
+
+const usb_device_desc_t* USBhostDevice::deviceDescriptor()
+{
+    const usb_device_desc_t *device_desc = NULL;
+    usb_host_get_device_descriptor(dev_hdl, &device_desc);
+    return device_desc;
+}
+
+const usb_str_desc_t* USBhostDevice::stringDescriptor(uint8_t index)
+{
+    usb_device_info_t info;
+    const usb_device_desc_t* desc = deviceDescriptor();
+    if (index == 0 || desc == NULL || usb_host_device_info(dev_hdl, &info) != ESP_OK) return NULL;
+    if (index == desc->iManufacturer) return info.str_desc_manufacturer;
+    if (index == desc->iProduct) return info.str_desc_product;
+    if (index == desc->iSerialNumber) return info.str_desc_serial_num;
+    return NULL;
+}
+
+usb_speed_t USBhostDevice::speed()
+{
+    usb_device_info_t info;
+    usb_host_device_info(dev_hdl, &info);
+    return info.speed;
+}
+
 void USBhostDevice::onEvent(usb_host_event_cb_t _cb)
 {
     event_cb = _cb;
@@ -56,9 +120,16 @@ bool USBhostDevice::deinit()
 {
     for (size_t n = 0; n < config_desc->bNumInterfaces; n++)
     {
-        usb_host_interface_release(_host->clientHandle(), _host->deviceHandle(), n);
+        usb_host_interface_release(_host->clientHandle(), dev_hdl, n);
     }
 
+    usb_xfer_pool_stats_t stats = pool.stats();
+    ESP_LOGI("", "transfer pool hits: %" PRIu32 ", fallback allocs: %" PRIu32 ", fallback frees: %" PRIu32 ", peak in use: %" PRIu32,
+             stats.hits, stats.fallback_allocs, stats.fallback_frees, stats.peak_in_use);
+    pool.release();
+    usb_host_transfer_free(xfer_ctrl);
+    xfer_ctrl = NULL;
+
     return true;
 }
 
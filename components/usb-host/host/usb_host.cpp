@@ -1,6 +1,6 @@
 #include "sdkconfig.h"
 
-#if defined(CONFIG_IDF_TARGET_ESP32S2) || defined(CONFIG_IDF_TARGET_ESP32S3)
+#if defined(CONFIG_IDF_TARGET_ESP32S2) || defined(CONFIG_IDF_TARGET_ESP32S3) || defined(CONFIG_IDF_TARGET_LINUX)
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
@@ -14,7 +14,7 @@ void _client_event_callback(const usb_host_client_event_msg_t *event_msg, void *
     USBhost *host = (USBhost *)arg;
     if (event_msg->event == USB_HOST_CLIENT_EVENT_NEW_DEV)
     {
-        host->open(event_msg);
+        if (!host->open(event_msg)) return;
         ESP_LOGI("USB_HOST_CLIENT_EVENT_NEW_DEV", "client event: %d, address: %d", event_msg->event, event_msg->new_dev.address);
         if (host->_client_event_cb)
         {
@@ -24,44 +24,73 @@ void _client_event_callback(const usb_host_client_event_msg_t *event_msg, void *
         }
     } else {
         ESP_LOGI("USB_HOST_CLIENT_EVENT_DEV_GONE", "client event: %d", event_msg->event);
+        // a registered callback closes the device itself, once it let go of it
         if (host->_client_event_cb)
         {
             host->_client_event_cb(event_msg, arg);
+        } else {
+            host->close(event_msg->dev_gone.dev_hdl);
         }
-        host->close();
     }
 }
 
-static void client_async_seq_task(void *param)
+/**
+ * @brief Host library daemon, blocks until the library has an event for it
+ */
+void _usb_lib_task(void *param)
 {
     USBhost* host = (USBhost *)param;
-    printf("create async task\n");
     while (1)
     {
-        usb_host_client_handle_t client_hdl = host->client_hdl;
         uint32_t event_flags;
-        if(client_hdl)usb_host_client_handle_events(client_hdl, 1);
-        if (ESP_OK == usb_host_lib_handle_events(1, &event_flags))
+        if (ESP_OK != usb_host_lib_handle_events(portMAX_DELAY, &event_flags)) continue;
+        if (event_flags & USB_HOST_LIB_EVENT_FLAGS_NO_CLIENTS)
         {
-            if (event_flags & USB_HOST_LIB_EVENT_FLAGS_NO_CLIENTS)
-            {
-                ESP_LOGD("", "No more clients\n");
-                do{
-                    if(usb_host_device_free_all() != ESP_ERR_NOT_FINISHED) break;
-                }while(1);
-                usb_host_uninstall();
-                host->init(false);
-            }
-            if (event_flags & USB_HOST_LIB_EVENT_FLAGS_ALL_FREE)
+            ESP_LOGD("", "No more clients\n");
+            do{
+                if(usb_host_device_free_all() != ESP_ERR_NOT_FINISHED) break;
+            }while(1);
+            usb_host_uninstall();
+            host->init(false);
+            xTaskNotifyGive(host->_client_task);
+        }
+        if (event_flags & USB_HOST_LIB_EVENT_FLAGS_ALL_FREE)
+        {
+            ESP_LOGD("", "USB_HOST_LIB_EVENT_FLAGS_ALL_FREE\n");
+            // the client task is blocked on the client, it deregisters it
+            usb_host_client_handle_t client_hdl = host->client_hdl;
+            if (client_hdl)
             {
-                ESP_LOGD("", "USB_HOST_LIB_EVENT_FLAGS_ALL_FREE\n");
-                usb_host_client_deregister(client_hdl);
-                host->client_hdl = NULL;
+                __atomic_store_n(&host->_deregister, true, __ATOMIC_RELEASE);
+                usb_host_client_unblock(client_hdl);
             }
         }
     }
-    printf("delete task\n");
-    vTaskDelete(NULL);
+}
+
+/**
+ * @brief Client events and transfer callbacks, woken by the library as soon as a transfer is done
+ */
+void _usb_client_task(void *param)
+{
+    USBhost* host = (USBhost *)param;
+    while (1)
+    {
+        usb_host_client_handle_t client_hdl = host->client_hdl;
+        if (client_hdl == NULL)
+        {
+            // until the daemon registered the client again
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+        usb_host_client_handle_events(client_hdl, portMAX_DELAY);
+        if (__atomic_exchange_n(&host->_deregister, false, __ATOMIC_ACQ_REL))
+        {
+            // cleared first, the daemon registers the next client as soon as this one is gone
+            host->client_hdl = NULL;
+            usb_host_client_deregister(client_hdl);
+        }
+    }
 }
 
 USBhost::USBhost()
@@ -93,7 +122,8 @@ bool USBhost::init(bool create_tasks)
 
     if (create_tasks)
     {
-        xTaskCreate(client_async_seq_task, "async", 6 * 512, this, 20, NULL);
+        xTaskCreatePinnedToCore(_usb_lib_task, "usb_lib", _lib_task_cfg.stack, this, _lib_task_cfg.priority, NULL, _lib_task_cfg.core);
+        xTaskCreatePinnedToCore(_usb_client_task, "usb_client", _client_task_cfg.stack, this, _client_task_cfg.priority, &_client_task, _client_task_cfg.core);
     }
 
     return true;
@@ -102,14 +132,21 @@ bool USBhost::init(bool create_tasks)
 bool USBhost::open(const usb_host_client_event_msg_t *event_msg)
 {
     esp_err_t err = usb_host_device_open(client_hdl, event_msg->new_dev.address, &dev_hdl);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE("", "device open, address %d: %d", event_msg->new_dev.address, err);
+        dev_hdl = NULL;
+        return false;
+    }
     parseConfig();
 
     return true;
 }
 
-void USBhost::close()
+void USBhost::close(usb_device_handle_t dev_hdl)
 {
     usb_host_device_close(client_hdl, dev_hdl);
+    if (this->dev_hdl == dev_hdl) this->dev_hdl = NULL;
 }
 
 void USBhost::parseConfig()
@@ -0,0 +1,162 @@
+#include "sdkconfig.h"
+
+#if defined(CONFIG_IDF_TARGET_ESP32S2) || defined(CONFIG_IDF_TARGET_ESP32S3) || defined(CONFIG_IDF_TARGET_LINUX)
+
+#include <algorithm>
+#include "esp_log.h"
+#include "usb_xfer_pool.hpp"
+
+#define TAG "usb_xfer_pool"
+
+USBxferPool::USBxferPool()
+{
+}
+
+USBxferPool::~USBxferPool()
+{
+    release();
+}
+
+esp_err_t USBxferPool::addClass(size_t size, uint8_t count, int num_isoc)
+{
+    size_t n = 0;
+    for (; n < num_classes; n++)
+    {
+        if (classes[n].size == size && classes[n].num_isoc == num_isoc)
+        {
+            classes[n].count = std::min<uint32_t>(classes[n].count + count, USB_XFER_POOL_MAX_COUNT);
+            return ESP_OK;
+        }
+        if (classes[n].size > size) break;
+    }
+
+    if (num_classes == USB_XFER_POOL_MAX_CLASSES)
+    {
+        ESP_LOGW(TAG, "no free size class for %u bytes", (unsigned)size);
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (size_t i = num_classes; i > n; i--)
+    {
+        classes[i].size = classes[i - 1].size;
+        classes[i].num_isoc = classes[i - 1].num_isoc;
+        classes[i].count = classes[i - 1].count;
+    }
+    classes[n].size = size;
+    classes[n].num_isoc = num_isoc;
+    classes[n].count = std::min<uint32_t>(count, USB_XFER_POOL_MAX_COUNT);
+    classes[n].free_mask = 0;
+    num_classes++;
+
+    return ESP_OK;
+}
+
+esp_err_t USBxferPool::preallocate(usb_device_handle_t dev_hdl)
+{
+    esp_err_t ret = ESP_OK;
+    for (size_t n = 0; n < num_classes; n++)
+    {
+        size_class_t& cls = classes[n];
+        uint32_t mask = 0;
+        for (size_t i = 0; i < cls.count; i++)
+        {
+            esp_err_t err = usb_host_transfer_alloc(cls.size, cls.num_isoc, &cls.xfers[i]);
+            if (err != ESP_OK)
+            {
+                ESP_LOGE(TAG, "preallocate %u bytes: %d", (unsigned)cls.size, err);
+                cls.count = i;
+                ret = err;
+                break;
+            }
+            cls.xfers[i]->device_handle = dev_hdl;
+            mask |= 1u << i;
+        }
+        cls.free_mask.store(mask, std::memory_order_release);
+        ESP_LOGI(TAG, "size class %u bytes, %d ISO packets x %d", (unsigned)cls.size, cls.num_isoc, cls.count);
+    }
+
+    return ret;
+}
+
+void USBxferPool::release()
+{
+    for (size_t n = 0; n < num_classes; n++)
+    {
+        size_class_t& cls = classes[n];
+        uint32_t mask = cls.free_mask.exchange(0);
+        for (size_t i = 0; i < cls.count; i++)
+        {
+            // a transfer still in flight is leaked rather than freed under the USB stack
+            if (mask & (1u << i)) usb_host_transfer_free(cls.xfers[i]);
+            else ESP_LOGW(TAG, "transfer of %u bytes still in use", (unsigned)cls.size);
+            cls.xfers[i] = NULL;
+        }
+        cls.count = 0;
+    }
+    num_classes = 0;
+}
+
+void USBxferPool::taken()
+{
+    uint32_t now = ++in_use;
+    uint32_t peak = peak_in_use.load(std::memory_order_relaxed);
+    while (now > peak && !peak_in_use.compare_exchange_weak(peak, now, std::memory_order_relaxed));
+}
+
+IRAM_ATTR usb_transfer_t* USBxferPool::get(size_t size, int num_isoc)
+{
+    for (size_t n = 0; n < num_classes; n++)
+    {
+        size_class_t& cls = classes[n];
+        if (cls.size < size || cls.num_isoc != num_isoc) continue;
+
+        uint32_t mask = cls.free_mask.load(std::memory_order_relaxed);
+        while (mask)
+        {
+            uint32_t bit = mask & (~mask + 1);
+            if (cls.free_mask.compare_exchange_weak(mask, mask & ~bit, std::memory_order_acquire, std::memory_order_relaxed))
+            {
+                hits++;
+                taken();
+                return cls.xfers[__builtin_ctz(bit)];
+            }
+        }
+    }
+
+    return NULL;
+}
+
+IRAM_ATTR bool USBxferPool::put(usb_transfer_t* transfer)
+{
+    for (size_t n = 0; n < num_classes; n++)
+    {
+        size_class_t& cls = classes[n];
+        if (cls.size != transfer->data_buffer_size || cls.num_isoc != transfer->num_isoc_packets) continue;
+
+        for (size_t i = 0; i < cls.count; i++)
+        {
+            if (cls.xfers[i] == transfer)
+            {
+                in_use--;
+                cls.free_mask.fetch_or(1u << i, std::memory_order_release);
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+usb_xfer_pool_stats_t USBxferPool::stats()
+{
+    usb_xfer_pool_stats_t stats = {
+        .hits = hits,
+        .fallback_allocs = fallback_allocs,
+        .fallback_frees = fallback_frees,
+        .in_use = in_use,
+        .peak_in_use = peak_in_use,
+    };
+    return stats;
+}
+
+#endif
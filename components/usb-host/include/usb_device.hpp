@@ -1,13 +1,20 @@
 #pragma once
-#if defined(CONFIG_IDF_TARGET_ESP32S2) || defined(CONFIG_IDF_TARGET_ESP32S3)
+#if defined(CONFIG_IDF_TARGET_ESP32S2) || defined(CONFIG_IDF_TARGET_ESP32S3) || defined(CONFIG_IDF_TARGET_LINUX)
 
 #include "esp_err.h"
 
 #include "usb/usb_host.h"
 #include "usb_host.hpp"
+#include "usb_xfer_pool.hpp"
 
 typedef void (*usb_host_event_cb_t)(int, void* data, size_t len);
 
+/**
+ * @brief One opened USB device. Besides the transfer pool this is the host-controller interface the
+ * USB/IP core is written against: it does not call the USB host library directly, so it can be built
+ * with another implementation of this class (native/ for Linux). Transfers complete by calling
+ * transfer->callback from the host library task.
+ */
 class USBhostDevice
 {
 protected:
@@ -16,14 +23,38 @@ protected:
     usb_host_event_cb_t event_cb = nullptr;
 
     usb_transfer_t *xfer_ctrl = NULL;   // every device have EP0
+    usb_device_handle_t dev_hdl = NULL;
+    USBxferPool pool;
 
 public:
     USBhostDevice();
     ~USBhostDevice();
 
-    esp_err_t init(size_t len = 64);
-    usb_transfer_t * allocate(size_t);
+    esp_err_t init(usb_device_handle_t dev_hdl, size_t len = 64);
+    usb_device_handle_t deviceHandle() { return dev_hdl; }
+    usb_transfer_t * allocate(size_t, int num_isoc = 0);
     esp_err_t deallocate(usb_transfer_t *);    
+
+    /**
+     * @brief Queues the transfer on transfer->bEndpointAddress, EP0 transfers start with the setup packet
+     */
+    esp_err_t submitTransfer(usb_transfer_t *);
+    /**
+     * @brief Halts the endpoint, hands every transfer queued on it back as USB_TRANSFER_STATUS_CANCELED and clears it
+     */
+    esp_err_t flushEndpoint(uint8_t bEndpointAddress);
+    esp_err_t claimInterface(uint8_t bInterfaceNumber, uint8_t bAlternateSetting);
+    esp_err_t releaseInterface(uint8_t bInterfaceNumber);
+    const usb_device_desc_t* deviceDescriptor();
+    const usb_config_desc_t* configDescriptor() { return config_desc; }
+    /**
+     * @brief String descriptor the host library read during enumeration (manufacturer, product,
+     * serial number, language 0x0409), NULL for any other index
+     */
+    const usb_str_desc_t* stringDescriptor(uint8_t index);
+    usb_speed_t speed();
+
+    usb_xfer_pool_stats_t poolStats() { return pool.stats(); }
     void onEvent(usb_host_event_cb_t _cb);
     USBhost* _host;
     bool deinit();
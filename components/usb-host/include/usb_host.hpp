@@ -1,23 +1,38 @@
 #pragma once
 #include "sdkconfig.h"
-#if defined(CONFIG_IDF_TARGET_ESP32S2) || defined(CONFIG_IDF_TARGET_ESP32S3)
+#if defined(CONFIG_IDF_TARGET_ESP32S2) || defined(CONFIG_IDF_TARGET_ESP32S3) || defined(CONFIG_IDF_TARGET_LINUX)
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "usb/usb_host.h"
 
 class USBhost
 {
     friend void _client_event_callback(const usb_host_client_event_msg_t *event_msg, void *arg);
+    friend void _usb_lib_task(void *param);
+    friend void _usb_client_task(void *param);
 
 protected:
     usb_device_info_t dev_info;
     
-    usb_device_handle_t dev_hdl;
+    usb_device_handle_t dev_hdl;    /*!< device opened last, getters below refer to it */
     
     usb_host_client_event_cb_t _client_event_cb = nullptr;
     uint8_t _dev_addr;
     uint8_t _configs;
     uint8_t _itfs;
 
+    typedef struct{
+        UBaseType_t priority;
+        BaseType_t core;
+        uint32_t stack;
+    }task_cfg_t;
+
+    task_cfg_t _lib_task_cfg = {20, tskNO_AFFINITY, 6 * 512};
+    task_cfg_t _client_task_cfg = {20, tskNO_AFFINITY, 6 * 512};
+    TaskHandle_t _client_task = NULL;
+    bool _deregister = false;       /*!< set by the daemon on ALL_FREE, the client task deregisters */
+
 public:
     USBhost();
     ~USBhost();
@@ -25,7 +40,7 @@ public:
     usb_host_client_handle_t client_hdl;
     bool init(bool create_tasks = true);
     bool open(const usb_host_client_event_msg_t *event_msg);
-    void close();
+    void close(usb_device_handle_t dev_hdl);
     usb_device_info_t getDeviceInfo();
     const usb_device_desc_t* getDeviceDescriptor();
     const usb_config_desc_t* getConfigurationDescriptor();
@@ -37,7 +52,19 @@ public:
     usb_host_client_handle_t clientHandle();
     usb_device_handle_t deviceHandle();
     
+    /**
+     * @brief Client events after USBhost handled them: NEW_DEV is opened before the callback, on DEV_GONE
+     * the callback has to close() the device itself, from any task, once nothing uses it anymore
+     */
     void registerClientCb(usb_host_client_event_cb_t cb) { _client_event_cb = cb; }
+    /**
+     * @brief Placement of the host library daemon task init() creates, call before init()
+     */
+    void libTaskConfig(UBaseType_t priority, BaseType_t core, uint32_t stack) { _lib_task_cfg = {priority, core, stack}; }
+    /**
+     * @brief Placement of the client task init() creates, it runs the transfer callbacks; call before init()
+     */
+    void clientTaskConfig(UBaseType_t priority, BaseType_t core, uint32_t stack) { _client_task_cfg = {priority, core, stack}; }
 
 };
 
@@ -0,0 +1,68 @@
+#pragma once
+#if defined(CONFIG_IDF_TARGET_ESP32S2) || defined(CONFIG_IDF_TARGET_ESP32S3) || defined(CONFIG_IDF_TARGET_LINUX)
+
+#include <atomic>
+#include "esp_err.h"
+#include "usb/usb_host.h"
+
+#define USB_XFER_POOL_MAX_CLASSES   6
+#define USB_XFER_POOL_MAX_COUNT     32      /*!< transfers per size class, one bit each in free_mask */
+
+typedef struct{
+    uint32_t hits;              /*!< served from the pool */
+    uint32_t fallback_allocs;   /*!< no free transfer big enough, usb_host_transfer_alloc() was used */
+    uint32_t fallback_frees;    /*!< usb_host_transfer_free() on a transfer that is not pooled */
+    uint32_t in_use;
+    uint32_t peak_in_use;
+}usb_xfer_pool_stats_t;
+
+/**
+ * @brief Preallocated usb_transfer_t buffers grouped in size classes.
+ * Isochronous transfers get classes of their own, the number of ISO packets is fixed at allocation.
+ *
+ * get() and put() only flip bits in a per class atomic mask, so they are lock-free and can be
+ * called from the USB client task, the event loop and the network task at the same time.
+ */
+class USBxferPool
+{
+private:
+    struct size_class_t{
+        size_t size;
+        int num_isoc;
+        uint8_t count;
+        std::atomic<uint32_t> free_mask;
+        usb_transfer_t* xfers[USB_XFER_POOL_MAX_COUNT];
+    };
+
+    size_class_t classes[USB_XFER_POOL_MAX_CLASSES];   /*!< sorted by size */
+    uint8_t num_classes = 0;
+
+    std::atomic<uint32_t> hits{0};
+    std::atomic<uint32_t> fallback_allocs{0};
+    std::atomic<uint32_t> fallback_frees{0};
+    std::atomic<uint32_t> in_use{0};
+    std::atomic<uint32_t> peak_in_use{0};
+
+    void taken();
+
+public:
+    USBxferPool();
+    ~USBxferPool();
+
+    /**
+     * @brief Requests count transfers of size bytes, classes of the same size and ISO packets are merged.
+     * Has to be called before preallocate().
+     */
+    esp_err_t addClass(size_t size, uint8_t count, int num_isoc = 0);
+    esp_err_t preallocate(usb_device_handle_t dev_hdl);
+    void release();
+
+    usb_transfer_t* get(size_t size, int num_isoc = 0);
+    bool put(usb_transfer_t* transfer);
+
+    void countFallbackAlloc() { fallback_allocs++; taken(); }
+    void countFallbackFree() { fallback_frees++; in_use--; }
+    usb_xfer_pool_stats_t stats();
+};
+
+#endif
@@ -17,12 +17,11 @@
 #include <esp_vfs_fat.h>
 #include "nvs_flash.h"
 #include "usbip.hpp"
+#include "usbip_sched.h"
 
 
 extern "C" void start_server();
 USBhost* host;
-static USBipDevice* device;
-static bool is_ready = false;
 static USBIP usbip;
 
 void client_event_callback(const usb_host_client_event_msg_t *event_msg, void *arg)
@@ -30,23 +29,27 @@ void client_event_callback(const usb_host_client_event_msg_t *event_msg, void *a
     ESP_LOGW("", "usb_host_client_event_msg_t event: %d", event_msg->event);
     if (event_msg->event == USB_HOST_CLIENT_EVENT_NEW_DEV)
     {
-        host->open(event_msg);
-
-        info = host->getDeviceInfo();
+        // opened by the USBhost client callback right before
+        usb_device_handle_t dev_hdl = host->deviceHandle();
+        usb_device_info_t info = host->getDeviceInfo();
         ESP_LOGI("USB_HOST_CLIENT_EVENT_NEW_DEV", "device speed: %s, device address: %d, max ep_ctrl size: %d, config: %d", info.speed ? "USB_SPEED_FULL" : "USB_SPEED_LOW", info.dev_addr, info.bMaxPacketSize0, info.bConfigurationValue);
-        dev_desc = host->getDeviceDescriptor();
-        
-        device = new USBipDevice();
-        device->init(host);
+        const usb_device_desc_t* dev_desc = host->getDeviceDescriptor();
+        // hubs are handled by the host library, only the devices behind them are exported
+        if (dev_desc->bDeviceClass == USB_CLASS_HUB) return;
 
-        is_ready = true;
+        USBipDevice* device = new USBipDevice();
+        if (!device->init(host, dev_hdl)) delete(device);
     }
     else
     {
-        // TODO: release all interfaces claimed in device.init
-        is_ready = false;
-        device->deinit();
-        delete(device);
+        USBipDevice* device = USBipDevice::find(event_msg->dev_gone.dev_hdl);
+        if (device == NULL)
+        {
+            host->close(event_msg->dev_gone.dev_hdl);
+            return;
+        }
+        // URBs may still be in flight, the teardown releases the interfaces and closes the device once drained
+        device->retire();
     }
 }
 
@@ -54,6 +57,10 @@ void init_usbip()
 {
     host = new USBhost();
     host->registerClientCb(client_event_callback);
+    const usbip_task_cfg_t* usb = usbip_sched_stage(USBIP_STAGE_USB);
+    host->clientTaskConfig(usb->priority, usb->core, usb->stack);
+    const usbip_task_cfg_t* lib = usbip_sched_stage(USBIP_STAGE_USB_LIB);
+    host->libTaskConfig(lib->priority, lib->core, lib->stack);
     host->init();
 }
 
@@ -7,6 +7,7 @@
    CONDITIONS OF ANY KIND, either express or implied.
 */
 #include <string.h>
+#include <stdlib.h>
 #include <sys/param.h>
 
 #include "freertos/FreeRTOS.h"
@@ -25,8 +26,11 @@
 #include "lwip/sys.h"
 #include <lwip/netdb.h>
 #include "lwip/ip_addr.h"
+#include "esp_vfs_eventfd.h"
 
-void parse_request(const int sock, uint8_t* rx_buffer, size_t len);
+#include "usbip_session.h"
+#include "usbip_sched.h"
+#include "usbip_trace.h"
 
 #define PORT                        CONFIG_EXAMPLE_PORT
 #define KEEPALIVE_IDLE              CONFIG_EXAMPLE_KEEPALIVE_IDLE
@@ -36,41 +40,16 @@ void parse_request(const int sock, uint8_t* rx_buffer, size_t len);
 static const char *TAG = "example";
 static EventGroupHandle_t wifi_event_grp;
 
-uint8_t rx_buffer[4*1024];
-void close_socket(int sock)
-{
-        shutdown(sock, 0);
-        close(sock);
-}
-
 static void do_retransmit(void* p)
 {
-    const int sock = (int)p;
-    int len;
-    do {
-        len = recv(sock, rx_buffer, sizeof(rx_buffer), MSG_DONTWAIT);
-        if (len < 0 && errno == EWOULDBLOCK) {
-            vTaskDelay(1);
-            continue;
-        } else if (len < 0) {
-            ESP_LOGE(TAG, "Error occurred during receiving: errno %d", errno);
-            break;
-        } else if (len == 0) {
-            ESP_LOGW(TAG, "Connection closed");
-            break;
-        } else {
-            parse_request(sock, rx_buffer, len);
-        }
-    } while (1);
-
-    close_socket(sock);
+    usbip_connection((int)(intptr_t)p);
     vTaskDelete(NULL);
 }
 
 static void tcp_server_task(void *pvParameters)
 {
     char addr_str[128];
-    int addr_family = (int)pvParameters;
+    int addr_family = (int)(intptr_t)pvParameters;
     int ip_protocol = 0;
     int keepAlive = 0;
     int keepIdle = KEEPALIVE_IDLE;
@@ -119,7 +98,7 @@ static void tcp_server_task(void *pvParameters)
     }
     ESP_LOGI(TAG, "Socket bound, port %d", PORT);
 
-    err = listen(listen_sock, 1);
+    err = listen(listen_sock, CONFIG_USBIP_MAX_SESSIONS);
     if (err != 0) {
         ESP_LOGE(TAG, "Error occurred during listen: errno %d", errno);
         goto CLEAN_UP;
@@ -153,7 +132,7 @@ static void tcp_server_task(void *pvParameters)
 #endif
         ESP_LOGI(TAG, "Socket accepted ip address: %s", addr_str);
 
-        xTaskCreatePinnedToCore(do_retransmit, "tcp_tx", 1 * 4096, (void*)sock, 21, NULL, 1);
+        usbip_sched_create(USBIP_STAGE_CONN, do_retransmit, "tcp_tx", (void*)(intptr_t)sock, NULL);
     }
 
 CLEAN_UP:
@@ -278,5 +257,13 @@ void start_server()
     ESP_ERROR_CHECK(esp_netif_init());
     wifi_init();
 
-    xTaskCreatePinnedToCore(tcp_server_task, "tcp_server", 1 * 4096, (void*)AF_INET, 21, NULL, 1);
+    // one eventfd per connection TX queue
+    esp_vfs_eventfd_config_t eventfd_config = ESP_VFS_EVENTD_CONFIG_DEFAULT();
+    ESP_ERROR_CHECK(esp_vfs_eventfd_register(&eventfd_config));
+
+    // accepts only, on the core of the connections it starts
+    usbip_sched_create(USBIP_STAGE_CONN, tcp_server_task, "tcp_server", (void*)AF_INET, NULL);
+#ifdef CONFIG_USBIP_TRACE
+    usbip_trace_server_start(CONFIG_USBIP_TRACE_PORT);
+#endif
 }
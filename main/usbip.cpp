@@ -1,246 +1,694 @@
 #include "freertos/FreeRTOS.h"
-#include "freertos/semphr.h"
+#include "freertos/task.h"
 #include <string.h>
+#include <atomic>
 #include "esp_log.h"
 #include "esp_event.h"
-#include "byteswap.h"
+#include "esp_cpu.h"
+#include "esp_timer.h"
 #include "lwip/err.h"
 #include "lwip/sockets.h"
 #include "lwip/sys.h"
 #include <lwip/netdb.h>
 
 #include "usbip.hpp"
+#include "usbip_framer.h"
+#include "usbip_ring.h"
+#include "usbip_session.h"
+#include "usbip_trace.h"
+#include "usbip_sched.h"
+#include "usbip_qos.h"
+
+#define USBIP_BUSNUM        1
+#define DEVLIST_HEADER_SIZE 0x0c    /*!< request plus device count */
+#define DEVLIST_DEVICE_SIZE 0x138   /*!< path to bNumInterfaces, the interfaces follow */
 
-// commands
-#define OP_REQ_DEVLIST bswap_constant_16(0x8005)
-#define OP_REP_DEVLIST bswap_constant_16(0x0005)
-#define OP_REQ_IMPORT bswap_constant_16(0x8003)
-#define OP_REP_IMPORT bswap_constant_16(0x0003)
-
-// usbip_header_basic commands
-#define USBIP_CMD_SUBMIT bswap_constant_16(0x01)
-#define USBIP_RET_SUBMIT bswap_constant_32(0x03)
-#define USBIP_CMD_UNLINK bswap_constant_16(0x02)
-#define USBIP_RET_UNLINK bswap_constant_32(0x04)
-
-#define USBIP_VERSION   bswap_constant_16(0x0111)   // v1.11
-#define USB_LOW_SPEED   bswap_constant_32(1)
-#define USB_FULL_SPEED  bswap_constant_32(2)
-
-static usbip_import_t import_data = {};
-static usbip_devlist_t devlist_data = {};
-static uint32_t last_seqnum = 0;
-static uint32_t last_unlink = 0;
-
-usb_device_info_t info;
-const usb_device_desc_t *dev_desc;
 static esp_event_loop_handle_t loop_handle;
-static SemaphoreHandle_t usb_sem;
-static SemaphoreHandle_t usb_sem1;
-static int _sock;
 
-static bool is_ready = false;
-static bool finished = false;
-static usb_transfer_t *_transfer;
+/**
+ * @brief Devices ready for URBs by port, devid is (busnum << 16) | (port + 1). Ports are taken by the
+ * USB client task and given back when the device is deleted, ports_used covers the time a device is
+ * being set up or taken apart.
+ */
+static std::atomic<USBipDevice*> devices[CONFIG_USBIP_MAX_DEVICES];
+static std::atomic<bool> ports_used[CONFIG_USBIP_MAX_DEVICES];
+/**
+ * @brief Devices that went away by port, USB client task -> URB task, see USBipDevice::retire()
+ */
+static std::atomic<USBipDevice*> retiring[CONFIG_USBIP_MAX_DEVICES];
+/**
+ * @brief Session that imported the device on each port, set by OP_REQ_IMPORT and cleared when
+ * the session closes (both on the usbip_events task) or the device goes away
+ */
+static std::atomic<usbip_session_t*> owners[CONFIG_USBIP_MAX_DEVICES];
+
+#define USBIP_SESSION_CLOSED    0x1003
+#define USBIP_DEVICE_GONE       0x1004
 
-#define USB_CTRL_RESP   0x1001
-#define USB_EPx_RESP    0x1002
+/**
+ * @brief Control requests handed to the usbip_events task, the reply goes to the session that asked
+ */
+typedef struct{
+    usbip_session_t* session;
+    char busid[USBIP_BUSID_SIZE];   /*!< OP_REQ_IMPORT only */
+}op_request_t;
+
+#define TX_PUSH_WAIT        pdMS_TO_TICKS(100)
+#define TX_CONTROL_RESERVE  4   /*!< TX queue entries kept for replies that do not hold a URB slot */
+#define URB_UNLINK_RESERVE  2   /*!< URB slots CMD_SUBMITs leave for CMD_UNLINK */
 
 ESP_EVENT_DECLARE_BASE( USBIP_EVENT_BASE );
 ESP_EVENT_DEFINE_BASE(USBIP_EVENT_BASE);
 
 #define TAG "usbip"
-#include <algorithm>
-#include <vector>
-static std::vector<uint32_t> vec;
+#include "usbip_seqnum.hpp"
+#include "usbip_slab.hpp"
+#include "usbip_alloc_guard.hpp"
+#include "usbip_inflight.hpp"
+static Slab<usbip_urb_t, CONFIG_USBIP_MAX_INFLIGHT_URBS> urbs;
+static usbip_budget_t urb_budget = {CONFIG_USBIP_MAX_INFLIGHT_URBS - URB_UNLINK_RESERVE, CONFIG_USBIP_BUDGET_BYTES};
+static usbip_budget_t hold_budget = {CONFIG_USBIP_MAX_INFLIGHT_URBS, CONFIG_USBIP_HOLD_BYTES};   /*!< streamed payloads waiting for urb_budget */
+
+static TaskHandle_t urb_task_hdl;
+static usbip_ring_t completions;    /*!< finished transfers, USB client task -> URB task */
+static std::atomic<usbip_session_t*> sessions[CONFIG_USBIP_MAX_SESSIONS];
+
+// seqnums are only unique per client, so everything keyed by them is kept per session slot;
+// only touched from the usbip_urb task, session_gens is read by a connection task while it takes the slot
+static SeqnumWindow<> finished_seqnums[CONFIG_USBIP_MAX_SESSIONS];    /*!< answered or unlinked URBs */
+static InflightIndex<usbip_urb_t, CONFIG_USBIP_MAX_INFLIGHT_URBS> inflight[CONFIG_USBIP_MAX_SESSIONS];  /*!< unanswered CMD_SUBMITs by seqnum */
+static uint16_t session_gens[CONFIG_USBIP_MAX_SESSIONS];    /*!< bumped when a session leaves the slot */
+// answered URBs whose session had no TX queue space, each keeps its slot and transfer until push_parked() gets its reply out
+static usbip_urb_t* parked[CONFIG_USBIP_MAX_SESSIONS];
+static usbip_urb_t* parked_tail[CONFIG_USBIP_MAX_SESSIONS];
+
+/**
+ * @brief Only written by the URB task, except dropped: the USB client task counts those
+ */
+static struct{
+    uint32_t wakeups;
+    uint32_t submits;
+    uint32_t completions;
+    uint32_t unlinks;
+    uint32_t unlink_hits;   /*!< unlinked before the RET_SUBMIT, answered with -ECONNRESET */
+    uint32_t unlink_misses; /*!< already answered (or unknown), answered with 0 */
+    uint32_t flushes;       /*!< endpoints halted and flushed for an unlink */
+    uint32_t resubmits;     /*!< transfers cancelled by a flush and posted again */
+    std::atomic<uint32_t> dropped;  /*!< completions that did not fit the ring, relaxed */
+    uint32_t parked;        /*!< replies that found the TX queue of their session full */
+    uint32_t cached;        /*!< control requests answered from the descriptor cache */
+    uint64_t cycles;        /*!< spent in the URB task on the submits, completions and unlinks above */
+    usbip_lane_stats_t lanes[USBIP_LANES];  /*!< queued by the connection task -> taken by the URB task */
+}pipeline_stats;
+
+static usbip_qos_t submit_qos;
+static uint8_t submit_rr[USBIP_LANES];  /*!< session slot each lane is served from next */
+
+/**
+ * @brief Any task, frees a URB slot and gives an admitted CMD_SUBMIT back to the in-flight budgets
+ */
+static void discard_urb(usbip_urb_t* urb)
+{
+    USBipDevice* dev = urb->dev;
+    if (urb->admitted) dev->release(urb->address, urb->cost);
+    urbs.free(urb);
+    if (dev) dev->unref();
+}
+
+static void usb_xfer_cb(usb_transfer_t *transfer)
+{
+    usbip_urb_t* urb = (usbip_urb_t*)transfer->context;
+    // read-ahead transfers do not belong to a URB yet
+    if (USBIP_TRACE_ON() && urbs.owns(urb))
+    {
+        usbip_trace_stamp(USBIP_TRACE_COMPLETE, urb->slot, urb->req.header.seqnum, transfer->bEndpointAddress, usbip_trace_now());
+    }
+    // every transfer in flight holds a URB slot or a read-ahead slot and the ring has room for all of them
+    if (!usbip_ring_push(&completions, transfer))
+    {
+        pipeline_stats.dropped.fetch_add(1, std::memory_order_relaxed);
+        if (urbs.owns(urb))
+        {
+            urb->dev->deallocate(transfer);
+            discard_urb(urb);
+        }
+        return;
+    }
+    xTaskNotifyGive(urb_task_hdl);
+}
+
+/**
+ * @brief URB task, the session a URB came from, NULL once it is gone and nobody waits for the reply
+ */
+static usbip_session_t* urb_session(const usbip_urb_t* urb)
+{
+    if (urb->gen != session_gens[urb->slot]) return NULL;
+    return sessions[urb->slot].load(std::memory_order_acquire);
+}
+
+/**
+ * @brief URB task, true when the URB must not be answered (anymore): unlinked, answered or its session is gone
+ */
+static bool urb_finished(const usbip_urb_t* urb)
+{
+    return urb_session(urb) == NULL || urb->unlinked || finished_seqnums[urb->slot].contains(urb->seqnum);
+}
+
+/**
+ * @brief URB task, true when the URB is to be answered now; its seqnum is marked, so a second reply is dropped
+ */
+static bool claim_reply(const usbip_urb_t* urb)
+{
+    return urb_session(urb) && !urb->unlinked && !finished_seqnums[urb->slot].test_and_mark(urb->seqnum);
+}
+
+/**
+ * @brief URB task, frees a URB slot and gives it back to the session's budget
+ */
+static void free_urb(usbip_urb_t* urb)
+{
+    usbip_session_t* session = urb_session(urb);
+    if (session) __atomic_fetch_sub(&session->inflight, 1, __ATOMIC_RELEASE);
+    discard_urb(urb);
+}
+
+/**
+ * @brief URB task, frees the slot of an answered or dropped CMD_SUBMIT
+ */
+static void release_urb(usbip_urb_t* urb)
+{
+    if (urb_session(urb)) inflight[urb->slot].erase(urb->seqnum, urb);
+    free_urb(urb);
+}
+
+/**
+ * @brief Device a CMD_SUBMIT or CMD_UNLINK is routed to
+ */
+static USBipDevice* device_by_devid(uint32_t devid)
+{
+    uint32_t port = (devid & 0xffff) - 1;
+    if ((devid >> 16) != USBIP_BUSNUM || port >= CONFIG_USBIP_MAX_DEVICES) return NULL;
+    return devices[port].load(std::memory_order_acquire);
+}
+
+static void queue_reply(usbip_session_t* session, usbip_tx_item_t* item)
+{
+    if (session == NULL)
+    {
+        if (item->done) item->done(item->arg);
+        return;
+    }
+    usbip_txq_push(&session->txq, item, TX_PUSH_WAIT);
+}
 
-static void usb_ctrl_cb(usb_transfer_t *transfer)
+static void release_transfer(void* arg)
 {
-    esp_event_post_to(loop_handle, USBIP_EVENT_BASE, USB_CTRL_RESP, (void*)&transfer, sizeof(usb_transfer_t*), 10);
+    usb_transfer_t* transfer = (usb_transfer_t*)arg;
+    USBipDevice* dev = static_cast<USBipDevice*>((USBhostDevice*)transfer->context);
+    dev->deallocate(transfer);
+    dev->unref();
 }
 
-static void usb_read_cb(usb_transfer_t *transfer)
+/**
+ * @brief URB task, queues the reply of an answered URB without waiting: the header copied from the request
+ * slot, rewritten in place, plus urb->reply straight from the completed transfer buffer. The transfer goes
+ * back to the pool once the connection task has written it, lwIP copies it into the TCP send buffer before
+ * sendmsg() returns. False when the TX queue is full.
+ */
+static bool push_reply(usbip_session_t* session, usbip_urb_t* urb)
 {
-    esp_event_post_to(loop_handle, USBIP_EVENT_BASE, USB_EPx_RESP, (void*)&transfer, sizeof(usb_transfer_t*), 10);
+    usbip_tx_item_t item = {};
+    memcpy(item.hdr, &urb->req, sizeof(usbip_submit_t));
+    item.hdr_len = sizeof(usbip_submit_t);
+    item.data = urb->reply;
+    item.data_len = urb->reply_len;
+    item.lane = urb->lane;
+    if (urb->transfer)
+    {
+        item.done = release_transfer;
+        item.arg = urb->transfer;
+        urb->transfer->context = (USBhostDevice*)urb->dev;
+        // the device is not deleted while its transfers wait in a TX queue
+        urb->dev->ref();
+    }
+    return usbip_txq_try_push(&session->txq, &item);
 }
 
-static void _event_handler(void* event_handler_arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+/**
+ * @brief URB task, queues the reply the URB was answered with and frees its slot. The URB task serves every
+ * session, so it never waits for a full TX queue: the URB is parked with its reply instead, and so is every
+ * later one of the session to keep their order, until the connection task made room. A parked URB keeps its
+ * slot, which keeps the session throttled.
+ */
+static void answer_urb(usbip_urb_t* urb, const uint8_t* data, uint32_t len)
 {
-    switch (event_id)
+    usbip_session_t* session = urb_session(urb);
+    if (session == NULL)
     {
-    case USB_CTRL_RESP:{
-        USBipDevice* dev = (USBipDevice*)event_handler_arg;
-        usb_transfer_t *transfer = *(usb_transfer_t **)event_data;
-        usbip_submit_t* req = (usbip_submit_t*)transfer->context;
-        uint32_t seqnum = __bswap_32(req->header.seqnum);
-        if (std::find(vec.begin(), vec.end(), seqnum) != vec.end())
+        if (urb->transfer) urb->dev->deallocate(urb->transfer);
+        free_urb(urb);
+        return;
+    }
+    inflight[urb->slot].erase(urb->seqnum, urb);
+    urb->reply = data;
+    urb->reply_len = len;
+    if (parked[urb->slot] == NULL)
+    {
+        if (push_reply(session, urb))
         {
-            delete req;
-            dev->deallocate(transfer);
-            break;
+            free_urb(urb);
+            return;
         }
-        vec.insert(vec.begin(), seqnum);
-        if(vec.size() >= 999) vec.pop_back();
+        // set before the last try, so a connection task that makes room in between wakes this task
+        __atomic_store_n(&session->parked, true, __ATOMIC_SEQ_CST);
+        if (push_reply(session, urb))
+        {
+            __atomic_store_n(&session->parked, false, __ATOMIC_RELAXED);
+            free_urb(urb);
+            return;
+        }
+    }
+    pipeline_stats.parked++;
+    urb->next = NULL;
+    if (parked_tail[urb->slot]) {
+        parked_tail[urb->slot]->next = urb;
+    } else {
+        parked[urb->slot] = urb;
+    }
+    parked_tail[urb->slot] = urb;
+}
 
-        int _len = transfer->actual_num_bytes - 8; //__bswap_32(req->length);
-        if(_len < 0) {
-            dev->deallocate(transfer);   
-            break;
+/**
+ * @brief URB task, queues parked replies in order as long as the TX queues take them
+ */
+static void push_parked()
+{
+    for (int n = 0; n < CONFIG_USBIP_MAX_SESSIONS; n++)
+    {
+        usbip_urb_t* urb = parked[n];
+        if (urb == NULL) continue;
+        // dropping the session empties the list, so the URBs on it still have theirs
+        usbip_session_t* session = urb_session(urb);
+        while (urb && push_reply(session, urb))
+        {
+            parked[n] = urb->next;
+            free_urb(urb);
+            urb = parked[n];
         }
-        if (req->header.direction == 0) // 0: USBIP_DIR_OUT
-        {
-            _len = 0;
-        }
-
-        req->header.command = USBIP_RET_SUBMIT;
-        req->header.devid = 0;
-        req->header.direction = 0;
-        req->header.ep = 0;
-        req->status = 0;
-        // TODO: transfer_buffer. If direction is USBIP_DIR_IN then n equals actual_length; 
-        // otherwise n equals 0. 
-        // For ISO transfers the padding between each ISO packets is not transmitted.
-        req->length = __bswap_32(_len);
-        req->padding = 0;
-        if(_len) memcpy(&req->transfer_buffer[0], transfer->data_buffer + 8, _len);
-        // req->transfer_buffer = transfer->data_buffer + 8;
-        if(transfer->status != USB_TRANSFER_STATUS_COMPLETED) {
-            _len = 0;
-            req->length = 0;
-            req->status = -ETIME;
-            req->error_count = 1;
-        }
-        int to_write = 0x30 + _len;
-        ESP_LOG_BUFFER_HEX_LEVEL("USB_CTRL_RESP", (void*)req, to_write, ESP_LOG_WARN);
-        send(_sock, (void*)req, to_write, MSG_DONTWAIT);
-        delete req;
-        dev->deallocate(transfer);
-        break;
-    }
-
-    case USB_EPx_RESP:{
-        USBipDevice* dev = (USBipDevice*)event_handler_arg;
-        usb_transfer_t *transfer = *(usb_transfer_t **)event_data;
-        usbip_submit_t* req = (usbip_submit_t*)transfer->context;
-        uint32_t seqnum = __bswap_32(req->header.seqnum);
-        if (std::find(vec.begin(), vec.end(), seqnum) != vec.end())
-        {
-            delete req;
-            dev->deallocate(transfer);
-            break;
+        if (urb == NULL)
+        {
+            parked_tail[n] = NULL;
+            __atomic_store_n(&session->parked, false, __ATOMIC_SEQ_CST);
         }
-        vec.insert(vec.begin(), seqnum);
-        if(vec.size() >= 999) vec.pop_back();
+    }
+}
 
-        int _len = transfer->actual_num_bytes;
-        if(_len <= 0) {
-            dev->deallocate(transfer);   
-            break;
+/**
+ * @brief URB task, answers a CMD_SUBMIT that could not be queued to the device with an error
+ */
+static void fail_urb(usbip_urb_t* urb, int32_t status)
+{
+    usbip_ret_submit(&urb->req, status, 0, 0);
+    urb->req.start_frame = 0;
+    urb->req.num_packets = 0;
+    answer_urb(urb, NULL, 0);
+}
+
+/**
+ * @brief RET_SUBMIT for a CMD_SUBMIT that could not be queued to the device
+ */
+static void send_submit_error(usbip_session_t* session, const usbip_submit_t* cmd, int32_t status)
+{
+    usbip_tx_item_t item = {};
+    usbip_submit_t* ret = (usbip_submit_t*)item.hdr;
+    *ret = *cmd;
+    usbip_ret_submit(ret, status, 0, 0);
+    ret->start_frame = 0;
+    ret->num_packets = 0;
+    item.hdr_len = sizeof(usbip_submit_t);
+    queue_reply(session, &item);
+}
+
+/**
+ * @brief Turns an isochronous transfer into the RET_SUBMIT payload in place: received packets moved
+ * back to back (the host puts them back at their offsets), followed by the descriptors that
+ * req_iso_xfer() prepared behind the packets. Returns the payload length.
+ */
+static int iso_ret_submit(usb_transfer_t* transfer, usbip_submit_t* req)
+{
+    uint8_t* buf = transfer->data_buffer;
+    int num_packets = transfer->num_isoc_packets;
+    usbip_iso_desc_t* desc = (usbip_iso_desc_t*)(buf + transfer->num_bytes);
+    bool in = transfer->bEndpointAddress & 0x80;
+    size_t pos = 0;
+    size_t actual = 0;
+    uint32_t errors = 0;
+
+    for (int n = 0; n < num_packets; n++)
+    {
+        usb_isoc_packet_desc_t* packet = &transfer->isoc_packet_desc[n];
+        bool ok = packet->status == USB_TRANSFER_STATUS_COMPLETED;
+        int len = ok ? packet->actual_num_bytes : 0;
+        if (in && len) memmove(buf + actual, buf + pos, len);
+        pos += packet->num_bytes;
+        actual += len;
+        desc[n].actual_length = len;
+        desc[n].status = ok ? 0 : (uint32_t)-EXDEV;
+        if (!ok) errors++;
+    }
+
+    size_t data = in ? actual : 0;
+    memmove(buf + data, desc, num_packets * sizeof(usbip_iso_desc_t));
+    // errors are reported per packet, start_frame and num_packets are echoed
+    usbip_ret_submit(req, 0, actual, errors);
+    return data + num_packets * sizeof(usbip_iso_desc_t);
+}
+
+/**
+ * @brief URB task, RET_SUBMIT for a finished transfer
+ */
+static void complete_urb(usb_transfer_t* transfer)
+{
+    usbip_urb_t* urb = (usbip_urb_t*)transfer->context;
+    USBipDevice* dev = urb->dev;
+    usbip_submit_t* req = &urb->req;
+    // control data stage follows the 8 bytes setup packet
+    bool ctrl = (transfer->bEndpointAddress & 0x0f) == 0;
+    int offset = ctrl ? sizeof(usb_setup_packet_t) : 0;
+    int _len;
+    {
+        USBIP_NO_ALLOC_SECTION();
+        _len = transfer->actual_num_bytes - offset;
+        if (!claim_reply(urb) || _len < 0)
+        {
+            release_urb(urb);
+            dev->deallocate(transfer);
+            return;
         }
-        if (req->header.direction == 0)
+        bool out = req->header.direction == USBIP_DIR_OUT;
+        if (ctrl && !out && transfer->status == USB_TRANSFER_STATUS_COMPLETED) dev->control_done(transfer);
+        if (transfer->num_isoc_packets)
+        {
+            _len = iso_ret_submit(transfer, req);
+        }
+        else
+        {
+            int requested = urb->length;
+            int32_t status = 0;
+            uint32_t errors = 0;
+            if (_len > requested)
+            {
+                // IN transfers are rounded up to wMaxPacketSize
+                _len = requested;
+                status = -EOVERFLOW;
+            }
+            if (transfer->status != USB_TRANSFER_STATUS_COMPLETED)
+            {
+                _len = 0;
+                status = -ETIME;
+                errors = 1;
+            }
+            // actual_length of an OUT URB is what went to the device, only IN data follows the header
+            usbip_ret_submit(req, status, _len, errors);
+            if (!ctrl) req->start_frame = 0;
+            if (out) _len = 0;
+        }
+    }
+    ESP_LOG_BUFFER_HEX_LEVEL(ctrl ? "USB_CTRL_RESP" : "USB_EPx_RESP", (void*)req, sizeof(usbip_submit_t), ESP_LOG_WARN);
+    answer_urb(urb, transfer->data_buffer + offset, _len);
+}
+
+static void drain_lanes(usbip_session_t* session);
+
+/**
+ * @brief URB task, RET_UNLINK. A URB that was not answered yet is cancelled and never gets a RET_SUBMIT,
+ * the host then expects -ECONNRESET. One that already got its RET_SUBMIT is answered with 0.
+ */
+static void unlink_urb(usbip_urb_t* urb)
+{
+    usbip_unlink_t* req = (usbip_unlink_t*)&urb->req;
+    uint32_t seqnum = req->unlink_seqnum;
+    usbip_urb_t* victim = inflight[urb->slot].find(seqnum);
+    usbip_session_t* owner = urb_session(urb);
+    if (victim == NULL && owner)
+    {
+        // the unlink came on the control lane, its URB may still wait on a lower one
+        drain_lanes(owner);
+        victim = inflight[urb->slot].find(seqnum);
+    }
+    int32_t status = 0;
+    if (victim)
+    {
+        pipeline_stats.unlink_hits++;
+        status = -ECONNRESET;
+        victim->unlinked = true;
+        finished_seqnums[urb->slot].mark(seqnum);
+        inflight[urb->slot].erase(seqnum, victim);
+        victim->dev->cancel(victim);
+    } else {
+        pipeline_stats.unlink_misses++;
+    }
+    req->header.command = USBIP_RET_UNLINK;
+    req->header.devid = 0;
+    req->header.direction = 0;
+    req->header.ep = 0;
+    req->status = (uint32_t)status;
+    ESP_LOG_BUFFER_HEX(TAG, (void*)req, 48);
+    answer_urb(urb, NULL, 0);
+}
+
+static void submit_urb(usbip_urb_t* urb)
+{
+    if (urb->req.header.command == USBIP_CMD_UNLINK)
+    {
+        pipeline_stats.unlinks++;
+        unlink_urb(urb);
+        return;
+    }
+
+    pipeline_stats.submits++;
+    urb->posted = false;
+    // every slot is indexed at most once, so the index can not be full
+    inflight[urb->slot].insert(urb->seqnum, urb);
+    if (urb->dev->retired())
+    {
+        fail_urb(urb, -ENODEV);
+        return;
+    }
+    if (urb->dev->readahead(urb)) return;
+    if (urb->req.header.ep == 0 && urb->dev->answer_cached(urb))
+    {
+        pipeline_stats.cached++;
+        complete_urb(urb->transfer);
+        return;
+    }
+    if (urb->dev->submit(urb) != ESP_OK) fail_urb(urb, -EPIPE);
+}
+
+/**
+ * @brief URB task, takes a URB off its lane: queue time and starvation guard bookkeeping
+ */
+static void take_submit(usbip_urb_t* urb, uint32_t ready)
+{
+    usbip_lane_t lane = (usbip_lane_t)urb->lane;
+    if (usbip_qos_served(&submit_qos, lane, ready)) pipeline_stats.lanes[lane].promoted++;
+    usbip_lane_wait(&pipeline_stats.lanes[lane], (uint32_t)esp_timer_get_time() - urb->queued_us);
+}
+
+/**
+ * @brief URB task, submits what the session queued on the lanes below control
+ */
+static void drain_lanes(usbip_session_t* session)
+{
+    for (int lane = USBIP_LANE_CTRL + 1; lane < USBIP_LANES; lane++)
+    {
+        usbip_urb_t* urb;
+        while ((urb = (usbip_urb_t*)usbip_ring_pop(&session->submits[lane])))
         {
-            _len = 0;
+            take_submit(urb, 1u << lane);
+            submit_urb(urb);
         }
+    }
+}
 
-        req->header.command = USBIP_RET_SUBMIT;
-        req->header.devid = 0;
-        req->header.direction = 0;
-        req->header.ep = 0;
-        req->status = 0;
-        // TODO: transfer_buffer. If direction is USBIP_DIR_IN then n equals actual_length; 
-        // otherwise n equals 0. 
-        // For ISO transfers the padding between each ISO packets is not transmitted.
-        req->length = __bswap_32(_len);
-        req->start_frame = 0;
-        req->padding = 0;
-        memcpy(&req->transfer_buffer[0], transfer->data_buffer, transfer->actual_num_bytes);
-        if(transfer->status != USB_TRANSFER_STATUS_COMPLETED) {
-            _len = 0;
-            req->length = 0;
-            req->status = -ETIME;
-            req->error_count = 1;
+static void log_budget(const char* what, const usbip_budget_t* budget)
+{
+    ESP_LOGI(TAG, "%s URBs: %" PRIu32 "/%" PRIu32 ", peak: %" PRIu32 ", bytes: %" PRIu32 "/%" PRIu32 ", peak: %" PRIu32 ", refused: %" PRIu32,
+             what, budget->urbs, budget->max_urbs, budget->peak_urbs, budget->bytes, budget->max_bytes, budget->peak_bytes, budget->refused);
+}
+
+/**
+ * @brief URB task, the connection task stopped producing: throw away what it queued and let it free the session
+ */
+static void drop_session(int slot)
+{
+    usbip_session_t* session = sessions[slot].load(std::memory_order_relaxed);
+    usbip_urb_t* urb;
+    for (int lane = 0; lane < USBIP_LANES; lane++)
+    {
+        while ((urb = (usbip_urb_t*)usbip_ring_pop(&session->submits[lane])))
+        {
+            if (urb->transfer) urb->dev->deallocate(urb->transfer);
+            discard_urb(urb);
         }
-        int to_write = 0x30 + _len;
-        ESP_LOG_BUFFER_HEX_LEVEL("USB_EPx_RESP", (void*)req, to_write, ESP_LOG_WARN);
+    }
 
-        send(_sock, (void*)req, to_write, MSG_DONTWAIT);
-        delete req;
-        dev->deallocate(transfer);
-        break;
+    while ((urb = parked[slot]))
+    {
+        parked[slot] = urb->next;
+        if (urb->transfer) urb->dev->deallocate(urb->transfer);
+        discard_urb(urb);
     }
+    parked_tail[slot] = NULL;
 
-    default:
-        break;
+    // read-ahead data belongs to the session that imported the device
+    for (int n = 0; n < CONFIG_USBIP_MAX_DEVICES; n++)
+    {
+        USBipDevice* dev = devices[n].load(std::memory_order_acquire);
+        if (dev && owners[n].load(std::memory_order_acquire) == session)
+        {
+            dev->readahead_reset();
+            dev->log_endpoints();
+        }
     }
+    // URBs still on the bus are dropped when they complete, the new generation no longer matches them
+    finished_seqnums[slot].clear();
+    inflight[slot].clear();
+    session_gens[slot]++;
+    sessions[slot].store(nullptr, std::memory_order_release);
+
+    uint32_t handled = pipeline_stats.submits + pipeline_stats.completions + pipeline_stats.unlinks;
+    ESP_LOGI(TAG, "URB task submits: %" PRIu32 ", completions: %" PRIu32 ", unlinks: %" PRIu32 ", wakeups: %" PRIu32 ", dropped: %" PRIu32 ", %" PRIu32 " cycles/URB",
+             pipeline_stats.submits, pipeline_stats.completions, pipeline_stats.unlinks, pipeline_stats.wakeups, pipeline_stats.dropped.load(std::memory_order_relaxed),
+             handled ? (uint32_t)(pipeline_stats.cycles / handled) : 0);
+    ESP_LOGI(TAG, "unlink hits: %" PRIu32 ", misses: %" PRIu32 ", flushes: %" PRIu32 ", resubmits: %" PRIu32 ", cached: %" PRIu32 ", parked: %" PRIu32,
+             pipeline_stats.unlink_hits, pipeline_stats.unlink_misses, pipeline_stats.flushes, pipeline_stats.resubmits, pipeline_stats.cached, pipeline_stats.parked);
+    usbip_qos_log(TAG, "submit", pipeline_stats.lanes);
+    log_budget("in flight", &urb_budget);
+    log_budget("held", &hold_budget);
+    xTaskNotifyGive(session->task);
 }
 
-static void _event_handler1(void* event_handler_arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+/**
+ * @brief URB task, lanes with submits queued by any session, sessions that are closing are dropped
+ */
+static uint32_t submit_lanes_ready()
 {
-    switch (event_id)
+    uint32_t ready = 0;
+    for (int n = 0; n < CONFIG_USBIP_MAX_SESSIONS; n++)
     {
-    case USBIP_CMD_SUBMIT:{
-        USBipDevice* dev = (USBipDevice*)event_handler_arg;
-        urb_data_t* data = (urb_data_t*)event_data;
-        int socket = data->socket;
-        uint8_t* rx_buffer = (uint8_t*) data->rx_buffer;
-        int len = data->len;
-        int start = 0;
-        int _len = len;
-        usbip_submit_t* __req = (usbip_submit_t*)(rx_buffer);
-        uint32_t seqnum = __bswap_32(__req->header.seqnum);
+        usbip_session_t* session = sessions[n].load(std::memory_order_acquire);
+        if (session == NULL) continue;
 
-        do
+        if (__atomic_load_n(&session->closing, __ATOMIC_ACQUIRE))
+        {
+            drop_session(n);
+            continue;
+        }
+        for (int lane = 0; lane < USBIP_LANES; lane++)
+        {
+            if (usbip_ring_count(&session->submits[lane])) ready |= 1u << lane;
+        }
+    }
+    return ready;
+}
+
+/**
+ * @brief URB task, next URB of the lane, the sessions take turns
+ */
+static usbip_urb_t* next_submit(usbip_lane_t lane)
+{
+    for (int i = 0; i < CONFIG_USBIP_MAX_SESSIONS; i++)
+    {
+        int n = (submit_rr[lane] + i) % CONFIG_USBIP_MAX_SESSIONS;
+        usbip_session_t* session = sessions[n].load(std::memory_order_acquire);
+        if (session == NULL) continue;
+        usbip_urb_t* urb = (usbip_urb_t*)usbip_ring_pop(&session->submits[lane]);
+        if (urb)
         {
-            ESP_LOGW(TAG, "USBIP_CMD_SUBMIT: start 0x%02x, len: %d", start, _len);
-            ESP_LOG_BUFFER_HEX("SUBMIT", rx_buffer + start, 48);
+            submit_rr[lane] = (n + 1) % CONFIG_USBIP_MAX_SESSIONS;
+            return urb;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief URB task, URBs were given back: sessions with a CMD_SUBMIT waiting for the in-flight budgets try again
+ */
+static void wake_waiting()
+{
+    for (int n = 0; n < CONFIG_USBIP_MAX_SESSIONS; n++)
+    {
+        usbip_session_t* session = sessions[n].load(std::memory_order_acquire);
+        if (session && __atomic_load_n(&session->waiting, __ATOMIC_SEQ_CST)) usbip_txq_wake(&session->txq);
+    }
+}
 
-            usbip_submit_t* _req = (usbip_submit_t*)(rx_buffer + start);
-            usbip_submit_t* req = new usbip_submit_t();
-            int tl = 0;
-            if(_req->header.direction == 0) tl = __bswap_32(_req->length);
+/**
+ * @brief URB task, devices that went away: hands them to the usbip_events task for deletion once drained.
+ * When the event loop is full, the next pass tries again.
+ */
+static void retire_devices()
+{
+    for (int n = 0; n < CONFIG_USBIP_MAX_DEVICES; n++)
+    {
+        USBipDevice* dev = retiring[n].load(std::memory_order_acquire);
+        if (dev == NULL || !dev->drain()) continue;
+        if (esp_event_post_to(loop_handle, USBIP_EVENT_BASE, USBIP_DEVICE_GONE, &dev, sizeof(dev), 0) == ESP_OK)
+        {
+            retiring[n].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+}
 
-            memcpy(req, _req, 0x30 + tl);
-            
-            ESP_LOGW(TAG, "request ep: %d", __bswap_32(req->header.ep));
-            int tlen = 0;
+/**
+ * @brief Submits what the connection tasks prepared and turns finished transfers into RET_SUBMIT,
+ * woken by a task notification from either side. This is the only task touching finished_seqnums and inflight.
+ */
+static void urb_task(void* arg)
+{
+    while (1)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        pipeline_stats.wakeups++;
 
-            if(req->header.ep == 0) // EP0
+        bool busy;
+        do
+        {
+            busy = false;
+            // replies that waited for TX queue space go before any new one of their session
+            push_parked();
+            // completions first, they free URB slots and TX queue space for the submits behind them
+            usb_transfer_t* transfer;
+            while ((transfer = (usb_transfer_t*)usbip_ring_pop(&completions)))
             {
-                tlen = dev->req_ctrl_xfer(req);
-                if(tlen > 0){
-                    ESP_LOG_BUFFER_HEX_LEVEL("SUBMIT 7", rx_buffer + start, 48 + tlen, ESP_LOG_ERROR);
-                }
-                tlen = 0;
-            } else { // EPx
-                tlen = dev->req_ep_xfer(req);
-                if(tlen > 0){
-                    ESP_LOG_BUFFER_HEX_LEVEL("SUBMIT 10", rx_buffer + start, 48 + tlen, ESP_LOG_ERROR);
+                uint32_t start = esp_cpu_get_cycle_count();
+                usbip_urb_t* urb = (usbip_urb_t*)transfer->context;
+                if (urbs.owns(urb)) {
+                    if (urb->dev->transfer_done(urb)) complete_urb(transfer);
+                } else {
+                    ((usbip_readahead_t*)transfer->context)->dev->readahead_done(transfer);
                 }
+                pipeline_stats.cycles += esp_cpu_get_cycle_count() - start;
+                pipeline_stats.completions++;
+                busy = true;
             }
-            start += 0x30 + tlen;
-            _len -= 0x30 + tlen;
-            ESP_LOGI(TAG, "USBIP_CMD_SUBMIT: end 0x%02x, len: %d", start, _len);
-        } 
-        while (_len >= 0x30);
-        break;
-    }
-
-    case USBIP_CMD_UNLINK:{
-        usbip_unlink_t* req = *(usbip_unlink_t**)event_data;
-        req->header.command = USBIP_RET_UNLINK;
-        req->header.devid = 0;
-        req->header.direction = 0;
-        req->header.ep = 0;
-        req->status = 0;
-        int to_write = 48;
-        send(_sock, (void*)req, to_write, MSG_DONTWAIT);
-        ESP_LOG_BUFFER_HEX(TAG, (void*)req, 48);
-        delete req;
-        break;
-    }
 
-    default:
-        break;
+            // one URB at a time from the lane usbip_qos_pick() chooses, control and interrupt go first
+            uint32_t ready;
+            while ((ready = submit_lanes_ready()))
+            {
+                uint32_t start = esp_cpu_get_cycle_count();
+                usbip_urb_t* urb = next_submit(usbip_qos_pick(&submit_qos, ready));
+                take_submit(urb, ready);
+                submit_urb(urb);
+                pipeline_stats.cycles += esp_cpu_get_cycle_count() - start;
+                busy = true;
+            }
+        } while (busy);
+        retire_devices();
+        wake_waiting();
     }
 }
 
@@ -249,109 +697,346 @@ static void _event_handler2(void* event_handler_arg, esp_event_base_t event_base
     switch(event_id)
     {
         case OP_REQ_DEVLIST:{
-            int to_write = 0;
-            // 0xC + i*0x138 + m_(i-1)*4
-            if(devlist_data.request.version == 0) /*!< assume there is no device connected yet */
+            usbip_session_t* session = ((op_request_t*)event_data)->session;
+            // 0xC + i*0x138 + m_(i-1)*4, built per request, several sessions may be listing at once
+            uint8_t* buf = (uint8_t*)malloc(DEVLIST_HEADER_SIZE + CONFIG_USBIP_MAX_DEVICES * (DEVLIST_DEVICE_SIZE + USBIP_MAX_INTERFACES * sizeof(usbip_interface_t)));
+            if (buf == NULL) {
+                ESP_LOGE(TAG, "no memory for OP_REP_DEVLIST");
+                break;
+            }
+            usbip_devlist_t* reply = (usbip_devlist_t*)buf;
+            reply->request.version = USBIP_VERSION;
+            reply->request.command = OP_REP_DEVLIST;
+            reply->request.status = 0;
+            uint32_t count = 0;
+            size_t to_write = DEVLIST_HEADER_SIZE;
+            for (int n = 0; n < CONFIG_USBIP_MAX_DEVICES; n++)
             {
-                to_write = 12;
-                devlist_data.request.version = USBIP_VERSION;
-                devlist_data.request.command = OP_REP_DEVLIST;
-                devlist_data.request.status = 0;
-                devlist_data.count = 0;
-            } else {
-                to_write = 0x0c + __bswap_32(devlist_data.count) * 0x138 + devlist_data.bNumInterfaces * 4;
+                USBipDevice* dev = devices[n].load(std::memory_order_acquire);
+                if (dev == NULL) continue;
+                const usbip_devlist_t* entry = dev->list_info();
+                size_t len = DEVLIST_DEVICE_SIZE + entry->bNumInterfaces * sizeof(usbip_interface_t);
+                memcpy(buf + to_write, entry->path, len);
+                to_write += len;
+                count++;
             }
-            send(_sock, (void*)&devlist_data, to_write, MSG_DONTWAIT);
+            reply->count = count;
+            usbip_tx_item_t item = {};
+            item.data = buf;
+            item.data_len = to_write;
+            item.done = free;
+            item.arg = buf;
+            queue_reply(session, &item);
             break;
         }
 
         case OP_REQ_IMPORT:{
-            int to_write = sizeof(usbip_import_t);
-            send(_sock, (void*)&import_data, to_write, MSG_DONTWAIT);
+            op_request_t* req = (op_request_t*)event_data;
+            int port = -1;
+            USBipDevice* dev = NULL;
+            for (int n = 0; n < CONFIG_USBIP_MAX_DEVICES && dev == NULL; n++)
+            {
+                dev = devices[n].load(std::memory_order_acquire);
+                if (dev && strncmp(dev->import_info()->busid, req->busid, USBIP_BUSID_SIZE)) dev = NULL;
+                if (dev) port = n;
+            }
+            uint32_t status = 0;
+            usbip_session_t* expected = nullptr;
+            if (dev == NULL) {
+                ESP_LOGE(TAG, "import %.32s: no such device", req->busid);
+                status = ST_NODEV;
+            } else if (!owners[port].compare_exchange_strong(expected, req->session) && expected != req->session) {
+                ESP_LOGE(TAG, "import %.32s: imported by another connection", req->busid);
+                status = ST_DEV_BUSY;
+            } else if (devices[port].load() != dev) {
+                // went away meanwhile, the URB task may already have found the port without an owner
+                expected = req->session;
+                owners[port].compare_exchange_strong(expected, nullptr);
+                ESP_LOGE(TAG, "import %.32s: no such device", req->busid);
+                status = ST_NODEV;
+            }
+
+            usbip_import_t* reply = (usbip_import_t*)malloc(sizeof(usbip_import_t));
+            if (reply == NULL) {
+                ESP_LOGE(TAG, "no memory for OP_REP_IMPORT");
+                break;
+            }
+            usbip_tx_item_t item = {};
+            if (status == 0) {
+                *reply = *dev->import_info();
+                item.data_len = sizeof(usbip_import_t);
+            } else {
+                // only the status goes out, the client stops reading there
+                memset(reply, 0, sizeof(usbip_import_t));
+                reply->request.version = USBIP_VERSION;
+                reply->request.command = OP_REP_IMPORT;
+                reply->request.status = status;
+                item.data_len = sizeof(usbip_request_t);
+            }
+            item.data = reply;
+            item.done = free;
+            item.arg = reply;
+            queue_reply(req->session, &item);
+            break;
+        }
+
+        case USBIP_SESSION_CLOSED:{
+            usbip_session_t* session = ((op_request_t*)event_data)->session;
+            // every request the session posted before is handled, the devices it imported are free again
+            for (int n = 0; n < CONFIG_USBIP_MAX_DEVICES; n++)
+            {
+                usbip_session_t* expected = session;
+                // a device that went away waits for its owner to be gone
+                if (owners[n].compare_exchange_strong(expected, nullptr) && retiring[n].load(std::memory_order_acquire)) xTaskNotifyGive(urb_task_hdl);
+            }
+            xTaskNotifyGive(session->task);
+            break;
+        }
+
+        case USBIP_DEVICE_GONE:{
+            // drained by the URB task; DEVLIST and IMPORT that still saw it published are done as well
+            USBipDevice* dev = *(USBipDevice**)event_data;
+            USBhost* host = dev->_host;
+            usb_device_handle_t dev_hdl = dev->deviceHandle();
+            dev->deinit();
+            delete dev;
+            // the USB client callback leaves closing the device to the teardown
+            if (host) host->close(dev_hdl);
             break;
         }
     }
 }
 
-USBipDevice::USBipDevice()
+/**
+ * @brief ISO transfer buffer: the packets plus room for the RET_SUBMIT descriptors behind them
+ */
+static size_t iso_xfer_size(size_t packets_len, int num_packets)
+{
+    return packets_len + num_packets * sizeof(usbip_iso_desc_t);
+}
+
+/**
+ * @brief Transfers posted at once on an endpoint of the type
+ */
+static uint16_t ep_max_depth(uint8_t type)
 {
-    usb_sem = xSemaphoreCreateBinary();
-    usb_sem1 = xSemaphoreCreateBinary();
-    xSemaphoreGive(usb_sem);
-    xSemaphoreGive(usb_sem1);
+    switch (type)
+    {
+    case USB_TRANSFER_TYPE_CTRL:
+        return CONFIG_USBIP_EP_DEPTH_CTRL;
+    case USB_TRANSFER_TYPE_INTR:
+        return CONFIG_USBIP_EP_DEPTH_INTR;
+    case USB_TRANSFER_TYPE_ISOCHRONOUS:
+        return CONFIG_USBIP_EP_DEPTH_ISO;
+    default:
+        return CONFIG_USBIP_EP_DEPTH_BULK;
+    }
+}
 
-    esp_event_handler_register_with(loop_handle, USBIP_EVENT_BASE, USB_CTRL_RESP, _event_handler, this);
-    esp_event_handler_register_with(loop_handle, USBIP_EVENT_BASE, USB_EPx_RESP, _event_handler, this);
-    esp_event_handler_register_with(loop_handle, USBIP_EVENT_BASE, USBIP_CMD_SUBMIT, _event_handler1, this);
-    esp_event_handler_register_with(loop_handle, USBIP_EVENT_BASE, USBIP_CMD_UNLINK, _event_handler1, this);
+USBipDevice::USBipDevice()
+{
+    memset(eps, 0, sizeof(eps));
+    for (int n = 0; n < USBIP_EP_COUNT; n++) eps[n].type = USBIP_EP_UNUSED;
+    memset(readaheads, 0, sizeof(readaheads));
+    usbip_budget_init(&budget, CONFIG_USBIP_DEVICE_BUDGET_URBS, CONFIG_USBIP_DEVICE_BUDGET_BYTES);
+    memset(ep_admitted, 0, sizeof(ep_admitted));
+    port = CONFIG_USBIP_MAX_DEVICES;
+    intf_urb = NULL;
+    refs = 0;
+    gone = false;
 }
 
 USBipDevice::~USBipDevice()
 {
-    esp_event_handler_unregister_with(loop_handle, USBIP_EVENT_BASE, ESP_EVENT_ANY_ID, _event_handler);
-    esp_event_handler_unregister_with(loop_handle, USBIP_EVENT_BASE, ESP_EVENT_ANY_ID, _event_handler1);
-    memset(&import_data, 0, sizeof(usbip_import_t));
-    memset(&devlist_data, 0, sizeof(usbip_devlist_t));
+    if (port >= CONFIG_USBIP_MAX_DEVICES) return;
+    devices[port].store(nullptr, std::memory_order_release);
+    owners[port].store(nullptr, std::memory_order_release);
+    ports_used[port] = false;
+
+    bool any = false;
+    for (int n = 0; n < CONFIG_USBIP_MAX_DEVICES; n++) any |= ports_used[n];
+    if (!any) usbip_alloc_guard_arm(false);
+}
+
+USBipDevice* USBipDevice::find(usb_device_handle_t dev_hdl)
+{
+    for (int n = 0; n < CONFIG_USBIP_MAX_DEVICES; n++)
+    {
+        USBipDevice* dev = devices[n].load(std::memory_order_acquire);
+        if (dev && dev->deviceHandle() == dev_hdl) return dev;
+    }
+    return nullptr;
+}
+
+void USBipDevice::retire()
+{
+    devices[port].store(nullptr);
+    retiring[port].store(this, std::memory_order_release);
+    xTaskNotifyGive(urb_task_hdl);
+}
+
+void USBipDevice::unref()
+{
+    if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1 && retiring[port].load(std::memory_order_acquire)) xTaskNotifyGive(urb_task_hdl);
+}
+
+bool USBipDevice::drain()
+{
+    if (!gone)
+    {
+        gone = true;
+        readahead_reset();
+        if (intf_urb) interface_retry();
+        // nothing gets posted anymore, the transfers on the bus come back with USB_TRANSFER_STATUS_NO_DEVICE
+        for (int n = 0; n < USBIP_EP_COUNT; n++)
+        {
+            usbip_ep_t* ep = &eps[n];
+            while (ep->pending)
+            {
+                usbip_urb_t* urb = ep->pending;
+                ep->pending = urb->next;
+                deallocate(urb->transfer);
+                urb->transfer = NULL;
+                if (urb_finished(urb)) {
+                    release_urb(urb);
+                } else {
+                    fail_urb(urb, -ENODEV);
+                }
+            }
+            ep->pending_tail = NULL;
+            ep->queued = 0;
+        }
+
+        // the client must not keep the device imported, its connection is closed
+        usbip_session_t* owner = owners[port].load();
+        for (int n = 0; owner && n < CONFIG_USBIP_MAX_SESSIONS; n++)
+        {
+            if (sessions[n].load(std::memory_order_acquire) != owner) continue;
+            __atomic_store_n(&owner->failed, true, __ATOMIC_RELEASE);
+            usbip_txq_wake(&owner->txq);
+        }
+        ESP_LOGW(TAG, "device %s gone", import_data.busid);
+    }
+
+    if (refs.load(std::memory_order_acquire) || owners[port].load()) return false;
+    for (size_t n = 0; n < 15; n++)
+    {
+        if (readaheads[n].posted) return false;
+    }
+    return true;
 }
 
-bool USBipDevice::init(USBhost* host)
+bool USBipDevice::init(USBhost* host, usb_device_handle_t dev_hdl)
 {
+    for (port = 0; port < CONFIG_USBIP_MAX_DEVICES; port++)
+    {
+        if (!ports_used[port]) break;
+    }
+    if (port == CONFIG_USBIP_MAX_DEVICES)
+    {
+        ESP_LOGE(TAG, "no free port, all %d taken", CONFIG_USBIP_MAX_DEVICES);
+        return false;
+    }
+    ports_used[port] = true;
     _host = host;
 
-    usb_device_info_t info = host->getDeviceInfo();
-    USBhostDevice::init(1032);
-    xfer_ctrl->callback = usb_ctrl_cb;
+    USBhostDevice::init(dev_hdl, 1032);
+    xfer_ctrl->callback = usb_xfer_cb;
 
-    config_desc = host->getConfigurationDescriptor();
-    
-    int offset = 0;
-    for (size_t n = 0; n < config_desc->bNumInterfaces; n++)
+    pool.addClass(sizeof(usb_setup_packet_t) + CONFIG_USBIP_XFER_POOL_CTRL_SIZE, CONFIG_USBIP_XFER_POOL_CTRL_COUNT);
+    descriptors.build(this);
+    eps[0].type = USB_TRANSFER_TYPE_CTRL;
+    eps[0].mps = descriptors.device.bMaxPacketSize0;
+    eps[0].max_depth = ep_max_depth(USB_TRANSFER_TYPE_CTRL);
+
+    for (int n = 0; n < descriptors.num_interfaces; n++)
     {
-        const usb_intf_desc_t *intf = usb_parse_interface_descriptor(config_desc, n, 0, &offset);
-        const usb_ep_desc_t *ep = nullptr;
+        const DescriptorCache::intf_t* intf = &descriptors.interfaces[n];
+        uint8_t number = intf->desc->bInterfaceNumber;
+        if (intf->desc->bAlternateSetting)
+        {
+            // ISO endpoints usually only show up in the alternate settings, the host switches to with SET_INTERFACE
+            for (int i = 0; i < intf->num_eps; i++)
+            {
+                const usb_ep_desc_t *ep = descriptors.endpoints[intf->first_ep + i].desc;
+                if (USB_EP_DESC_GET_XFERTYPE(ep) == USB_TRANSFER_TYPE_ISOCHRONOUS)
+                {
+                    pool.addClass(iso_xfer_size(USB_EP_DESC_GET_MPS(ep) * CONFIG_USBIP_ISO_POOL_PACKETS, CONFIG_USBIP_ISO_POOL_PACKETS), CONFIG_USBIP_XFER_POOL_EP_COUNT, CONFIG_USBIP_ISO_POOL_PACKETS);
+                }
+            }
+            continue;
+        }
 
-        for (size_t i = 0; i < intf->bNumEndpoints; i++)
+        for (int i = 0; i < intf->num_eps; i++)
         {
-            int _offset = 0;
-            ep = usb_parse_endpoint_descriptor_by_index(intf, i, config_desc->wTotalLength, &_offset);
+            const usb_ep_desc_t *ep = descriptors.endpoints[intf->first_ep + i].desc;
             uint8_t adr = ep->bEndpointAddress;
-            if (adr & 0x80)
+            ep_setup(&eps[usbip_ep_index(adr)], ep);
+
+            uint16_t mps = USB_EP_DESC_GET_MPS(ep);
+            uint8_t depth = 0;
+            switch (USB_EP_DESC_GET_XFERTYPE(ep))
             {
-                endpoints[adr & 0xf][1] = ep;
-            } else {
-                endpoints[adr & 0xf][0] = ep;
+            case USB_TRANSFER_TYPE_INTR:
+#ifdef CONFIG_USBIP_READAHEAD
+                if (adr & 0x80) depth = CONFIG_USBIP_READAHEAD_INTR_DEPTH;
+#endif
+                pool.addClass(mps, CONFIG_USBIP_XFER_POOL_EP_COUNT + depth);
+                break;
+            case USB_TRANSFER_TYPE_BULK:
+#ifdef CONFIG_USBIP_READAHEAD
+                if (adr & 0x80) depth = CONFIG_USBIP_READAHEAD_BULK_DEPTH;
+#endif
+                pool.addClass(usb_round_up_to_mps(CONFIG_USBIP_XFER_POOL_BULK_SIZE, mps), CONFIG_USBIP_XFER_POOL_EP_COUNT + depth);
+                break;
+            case USB_TRANSFER_TYPE_ISOCHRONOUS:
+                pool.addClass(iso_xfer_size(mps * CONFIG_USBIP_ISO_POOL_PACKETS, CONFIG_USBIP_ISO_POOL_PACKETS), CONFIG_USBIP_XFER_POOL_EP_COUNT, CONFIG_USBIP_ISO_POOL_PACKETS);
+                break;
+            default:
+                break;
+            }
+            if (depth)
+            {
+                usbip_readahead_t* ra = &readaheads[adr & 0xf];
+                ra->dev = this;
+                ra->ep = adr;
+                ra->depth = depth;
+                ra->mps = mps;
+                // interrupt transfers are polled by the host library every bInterval, depth of them are buffered at most
+                ESP_LOGI(TAG, "read-ahead EP 0x%02x: depth %d, mps %d, bInterval %d", adr, depth, mps, ep->bInterval);
             }
-
-            printf("EP num: %d/%d, len: %d, ", i + 1, intf->bNumEndpoints, config_desc->wTotalLength);
-            if (ep)
-                printf("address: 0x%02x, EP max size: %d, dir: %s\n", ep->bEndpointAddress, ep->wMaxPacketSize, (ep->bEndpointAddress & 0x80) ? "IN" : "OUT");
-            else
-                ESP_LOGW("", "error to parse endpoint by index; EP num: %d/%d, len: %d", i + 1, intf->bNumEndpoints, config_desc->wTotalLength);
         }
-        esp_err_t err = usb_host_interface_claim(_host->clientHandle(), _host->deviceHandle(), n, 0);
+        esp_err_t err = claimInterface(number, 0);
         ESP_LOGI("", "interface claim status: %d", err);
+        if (number < USBIP_MAX_INTERFACES) alt_settings[number] = 0;
     }
+    pool.preallocate(dev_hdl);
 
     fill_list_data();
     fill_import_data();
+    devices[port].store(this, std::memory_order_release);
+    usbip_alloc_guard_arm(true);
+    ESP_LOGI(TAG, "exporting device as busid %s", import_data.busid);
     return true;
 }
 
 void USBipDevice::fill_import_data()
 {
+    const usb_device_desc_t *dev_desc = &descriptors.device;
+
     memset(&import_data, 0, sizeof(usbip_import_t));
     import_data.request.version = USBIP_VERSION;
     import_data.request.command = OP_REP_IMPORT;
     import_data.request.status = 0;
-    strcpy(import_data.path, "/espressif/usbip/usb1");
-    strcpy(import_data.busid, "1-1");
-    import_data.busnum = __bswap_32(1);
-    import_data.devnum = __bswap_32(1);
-
-    import_data.speed = info.speed ? __bswap_32(2) : __bswap_32(1);
-    devlist_data.idVendor = __bswap_16(dev_desc->idVendor);
-    devlist_data.idProduct = __bswap_16(dev_desc->idProduct);
-    devlist_data.bcdDevice = __bswap_16(dev_desc->bcdDevice);
+    memcpy(import_data.path, list_data.path, sizeof(import_data.path));
+    memcpy(import_data.busid, list_data.busid, sizeof(import_data.busid));
+    import_data.busnum = list_data.busnum;
+    import_data.devnum = list_data.devnum;
+
+    import_data.speed = descriptors.speed ? USBIP_SPEED_FULL : USBIP_SPEED_LOW;
+    import_data.idVendor = dev_desc->idVendor;
+    import_data.idProduct = dev_desc->idProduct;
+    import_data.bcdDevice = dev_desc->bcdDevice;
     import_data.bDeviceClass = dev_desc->bDeviceClass;
     import_data.bDeviceSubClass = dev_desc->bDeviceSubClass;
     import_data.bDeviceProtocol = dev_desc->bDeviceProtocol;
@@ -362,183 +1047,1350 @@ void USBipDevice::fill_import_data()
 
 void USBipDevice::fill_list_data()
 {
-    int offset = 0;
-    for (size_t n = 0; n < config_desc->bNumInterfaces; n++)
+    const usb_device_desc_t *dev_desc = &descriptors.device;
+
+    memset(&list_data, 0, sizeof(usbip_devlist_t));
+    for (size_t n = 0; n < config_desc->bNumInterfaces && n < USBIP_MAX_INTERFACES; n++)
     {
-        const usb_intf_desc_t *intf = usb_parse_interface_descriptor(config_desc, n, 0, &offset);
-        devlist_data.intfs[n].bInterfaceClass = intf->bInterfaceClass,
-        devlist_data.intfs[n].bInterfaceSubClass = intf->bInterfaceSubClass,
-        devlist_data.intfs[n].bInterfaceProtocol = intf->bInterfaceProtocol,
-        devlist_data.intfs[n].padding  = 0;
+        const DescriptorCache::intf_t* intf = descriptors.interface(n, 0);
+        if (intf == NULL) continue;
+        list_data.intfs[n].bInterfaceClass = intf->desc->bInterfaceClass,
+        list_data.intfs[n].bInterfaceSubClass = intf->desc->bInterfaceSubClass,
+        list_data.intfs[n].bInterfaceProtocol = intf->desc->bInterfaceProtocol,
+        list_data.intfs[n].padding  = 0;
     }
 
-    devlist_data.request.version = USBIP_VERSION;
-    devlist_data.request.command = OP_REP_DEVLIST;
-    devlist_data.request.status = 0;
-    devlist_data.busnum = __bswap_32(1);
-    devlist_data.devnum = __bswap_32(1);
-    devlist_data.count = __bswap_32(1);
-    strcpy(devlist_data.path, "/espressif/usbip/usb1");
-    strcpy(devlist_data.busid, "1-1");
+    list_data.request.version = USBIP_VERSION;
+    list_data.request.command = OP_REP_DEVLIST;
+    list_data.request.status = 0;
+    list_data.busnum = USBIP_BUSNUM;
+    list_data.devnum = port + 1;
+    list_data.count = 1;
+    snprintf(list_data.path, sizeof(list_data.path), "/espressif/usbip/usb%d", port + 1);
+    snprintf(list_data.busid, sizeof(list_data.busid), "%d-%d", USBIP_BUSNUM, port + 1);
 
-    devlist_data.speed = info.speed ? USB_FULL_SPEED : USB_LOW_SPEED;
-    devlist_data.idVendor = __bswap_16(dev_desc->idVendor);
-    devlist_data.idProduct = __bswap_16(dev_desc->idProduct);
-    devlist_data.bcdDevice = __bswap_16(dev_desc->bcdDevice);
-    devlist_data.bDeviceClass = dev_desc->bDeviceClass;
-    devlist_data.bDeviceSubClass = dev_desc->bDeviceSubClass;
-    devlist_data.bDeviceProtocol = dev_desc->bDeviceProtocol;
-    devlist_data.bConfigurationValue = config_desc->bConfigurationValue;
-    devlist_data.bNumConfigurations = dev_desc->bNumConfigurations;
-    devlist_data.bNumInterfaces = config_desc->bNumInterfaces;
+    list_data.speed = descriptors.speed ? USBIP_SPEED_FULL : USBIP_SPEED_LOW;
+    list_data.idVendor = dev_desc->idVendor;
+    list_data.idProduct = dev_desc->idProduct;
+    list_data.bcdDevice = dev_desc->bcdDevice;
+    list_data.bDeviceClass = dev_desc->bDeviceClass;
+    list_data.bDeviceSubClass = dev_desc->bDeviceSubClass;
+    list_data.bDeviceProtocol = dev_desc->bDeviceProtocol;
+    list_data.bConfigurationValue = config_desc->bConfigurationValue;
+    list_data.bNumConfigurations = dev_desc->bNumConfigurations;
+    list_data.bNumInterfaces = config_desc->bNumInterfaces;
 }
 
-int USBipDevice::req_ctrl_xfer(usbip_submit_t* req)
+usb_transfer_t* USBipDevice::allocate_transfer(size_t size, int num_isoc)
 {
-    usb_transfer_t* _xfer_ctrl = allocate(1000);
-    _xfer_ctrl->callback = usb_ctrl_cb;
-    _xfer_ctrl->context = req;
-    _xfer_ctrl->bEndpointAddress = __bswap_32(req->header.ep) | (__bswap_32(req->header.direction) << 7);
+    USBIP_ALLOC_ALLOWED();
+    return allocate(size, num_isoc);
+}
+
+int USBipDevice::req_ctrl_xfer(usbip_urb_t* urb)
+{
+    usbip_submit_t* req = &urb->req;
+    usb_transfer_t* _xfer_ctrl = allocate_transfer(sizeof(usb_setup_packet_t) + urb->length);
+    if(_xfer_ctrl == NULL) return -1;
 
     usb_setup_packet_t * temp = (usb_setup_packet_t *)_xfer_ctrl->data_buffer;
     size_t n = 0;
+    memcpy(temp->val, req->setup, sizeof(usb_setup_packet_t));
     if (req->header.direction == 0) // 0: USBIP_DIR_OUT
     {
-        n = __bswap_32(req->length);
-        memcpy(_xfer_ctrl->data_buffer, (void*)&req->transfer_buffer, n);
+        n = urb->length;
+        // no payload yet when it is streamed from the socket
+        if (urb->payload) memcpy(_xfer_ctrl->data_buffer + sizeof(usb_setup_packet_t), urb->payload, n);
     }
-    int _n = __bswap_32(req->length);
-    memcpy(temp->val, (uint8_t*)&req->setup, 8 + n);
-    // TODO: transfer_buffer. If direction is USBIP_DIR_OUT then n equals transfer_buffer_length; 
-    // otherwise n equals 0. 
-    // For ISO transfers the padding between each ISO packets is not transmitted.
-    _xfer_ctrl->num_bytes = sizeof(usb_setup_packet_t) + __bswap_32(req->length);
-    _xfer_ctrl->bEndpointAddress = __bswap_32(req->header.ep) | (__bswap_32(req->header.direction) << 7);
-    _xfer_ctrl->context = req;
-    
-    esp_err_t err = usb_host_transfer_submit_control(_host->clientHandle(), _xfer_ctrl);
+    _xfer_ctrl->num_bytes = sizeof(usb_setup_packet_t) + urb->length;
+    _xfer_ctrl->bEndpointAddress = req->header.ep | (req->header.direction << 7);
+    _xfer_ctrl->callback = usb_xfer_cb;
+    _xfer_ctrl->context = urb;
+    urb->transfer = _xfer_ctrl;
 
     return  n;
 }
 
-int USBipDevice::req_ep_xfer(usbip_submit_t* req)
+int USBipDevice::req_ep_xfer(usbip_urb_t* urb)
 {
-    size_t _len = __bswap_32(req->length);
-    // ESP_LOG_BUFFER_HEX_LEVEL("xfer ep", req, 48, ESP_LOG_ERROR);
+    usbip_submit_t* req = &urb->req;
+    size_t _len = urb->length;
+    uint32_t num_packets = req->num_packets;
+    if (num_packets != 0 && num_packets != 0xffffffff)
+    {
+        return req_iso_xfer(urb, num_packets);
+    }
 
     uint16_t mps = 64;
 
     if (req->header.direction != 0)
     {
-        uint8_t adr = __bswap_32(req->header.ep);
-        const usb_ep_desc_t *ep = endpoints[adr][1];
-        if (ep)
+        uint8_t adr = req->header.ep;
+        const usbip_ep_t *ep = &eps[usbip_ep_index(adr | 0x80)];
+        if (ep->desc)
         {
-            mps = ep->wMaxPacketSize;
+            mps = ep->mps;
         } else {
             ESP_LOGE("", "missing EP%d\n", adr);
-            return 0;
+            return -1;
         }
 
         _len = usb_round_up_to_mps(_len, mps);
-        // ESP_LOGE("", "mps: %d[%d]\n", mps, _len);
     }
-    else
+    else if (urb->payload)
     {
-        ESP_LOG_BUFFER_HEX("", req, _len);
+        ESP_LOG_BUFFER_HEX("", urb->payload, _len);
     }
 
-    usb_transfer_t *xfer_read = allocate(_len);
-    if(xfer_read == NULL) return 0;
-    xfer_read->callback = &usb_read_cb;
-    xfer_read->context = req;
-    xfer_read->bEndpointAddress = __bswap_32(req->header.ep);
-    // printf("req_ep_xfer ep: %d[%d], dir: %d\n", __bswap_32(req->header.ep), xfer_read->bEndpointAddress, __bswap_32(req->header.direction));
+    usb_transfer_t *xfer_read = allocate_transfer(_len);
+    if(xfer_read == NULL) return -1;
     ESP_LOG_BUFFER_HEX_LEVEL("", req, 48, ESP_LOG_WARN);
 
     int n = 0;
     if (req->header.direction == 0)
     {
-        memcpy(xfer_read->data_buffer, (void*)&req->transfer_buffer, _len);
+        if (urb->payload) memcpy(xfer_read->data_buffer, urb->payload, _len);
         n = _len;
     }
-    int _n = _len;
 
-    // TODO: transfer_buffer. If direction is USBIP_DIR_OUT then n equals transfer_buffer_length; 
-    // otherwise n equals 0. 
-    // For ISO transfers the padding between each ISO packets is not transmitted.
     xfer_read->num_bytes = _len;
-    // if(xfer_read->num_bytes == 0x100 && req->header.direction != 0) xfer_read->num_bytes = 0xff;
-    xfer_read->bEndpointAddress = __bswap_32(req->header.ep) | (__bswap_32(req->header.direction) << 7);
-    // ESP_LOG_BUFFER_HEX("", temp->val, len - 40);
-    // printf("num_bytes_epx[%d/%d]: %d\n", n, _n, xfer_read->num_bytes);
-    xfer_read->context = req;
-
-    esp_err_t err = usb_host_transfer_submit(xfer_read);
+    xfer_read->bEndpointAddress = req->header.ep | (req->header.direction << 7);
+    xfer_read->callback = &usb_xfer_cb;
+    xfer_read->context = urb;
+    urb->transfer = xfer_read;
 
     return n;
 }
 
-// TODO: switch it to events
-extern "C" void parse_request(const int sock, uint8_t* rx_buffer, size_t len)
-{
-    uint32_t cmd = ((usbip_request_t*)rx_buffer)->command;
-    _sock = sock;
-
-    switch (cmd)
-    {
-    case OP_REQ_DEVLIST:{
-        ESP_LOGI(TAG, "OP_REQ_DEVLIST");
-        esp_event_post_to(loop_handle, USBIP_EVENT_BASE, OP_REQ_DEVLIST, NULL, 0, 10);
-        break;
-    }
-    case OP_REQ_IMPORT:{
-        ESP_LOGI(TAG, "OP_REQ_IMPORT");
-        esp_event_post_to(loop_handle, USBIP_EVENT_BASE, OP_REQ_IMPORT, NULL, 0, 10);
-        break;
-    }
-    case USBIP_CMD_SUBMIT:{
-        ESP_LOGI(TAG, "USBIP_CMD_SUBMIT");
-        urb_data_t data = {
-             .socket = sock,
-             .len = (int)len,
-             .rx_buffer = rx_buffer
-        };
-        usbip_submit_t* _req = (usbip_submit_t*)(rx_buffer);
-        esp_event_post_to(loop_handle, USBIP_EVENT_BASE, USBIP_CMD_SUBMIT, &data, len + sizeof(int), 10);
-        break;
-    }
-    case USBIP_CMD_UNLINK:{
-        ESP_LOGI(TAG, "USBIP_CMD_UNLINK");
-        usbip_submit_t* _req = (usbip_submit_t*)(rx_buffer);
-        usbip_submit_t* req = new usbip_submit_t(); // make it heap caps malloc
-        last_unlink = __bswap_32(_req->flags);
-        vec.insert(vec.begin(), last_unlink);
-        memcpy(req, _req, 0x30);
-        esp_event_post_to(loop_handle, USBIP_EVENT_BASE, USBIP_CMD_UNLINK, &req, sizeof(usbip_submit_t*), 10);
-        break;
+int USBipDevice::req_iso_xfer(usbip_urb_t* urb, uint32_t num_packets)
+{
+    usbip_submit_t* req = &urb->req;
+    uint8_t adr = req->header.ep;
+    bool out = req->header.direction == 0;
+    size_t length = urb->length;
+    const usbip_ep_t *ep = &eps[usbip_ep_index(adr | (out ? 0 : 0x80))];
+    if (ep->type != USB_TRANSFER_TYPE_ISOCHRONOUS || num_packets > USBIP_MAX_ISO_PACKETS)
+    {
+        ESP_LOGE("", "no ISO EP%d in the current alternate setting\n", adr);
+        return -1;
     }
-    default:
-        ESP_LOGE(TAG, "unknown command: %" PRIu32, cmd); // PRIu32
-        break;
+
+    // descriptors follow the OUT data, packets sit at their offsets in it
+    const usbip_iso_desc_t* desc = (const usbip_iso_desc_t*)(urb->payload + (out ? length : 0));
+    size_t total = 0;
+    for (size_t n = 0; n < num_packets; n++)
+    {
+        uint32_t offset = desc[n].offset;
+        uint32_t len = desc[n].length;
+        if (offset > length || len > length - offset) return -1;
+        total += len;
     }
-}
 
+    usb_transfer_t* xfer_iso = allocate_transfer(iso_xfer_size(total, num_packets), num_packets);
+    if (xfer_iso == NULL) return -1;
 
-USBIP::USBIP()
-{
-    esp_event_loop_args_t loop_args = {
+    // the host library wants the packets back to back, RET_SUBMIT descriptors are prepared behind them
+    usbip_iso_desc_t* ret = (usbip_iso_desc_t*)(xfer_iso->data_buffer + total);
+    size_t pos = 0;
+    for (size_t n = 0; n < num_packets; n++)
+    {
+        uint32_t len = desc[n].length;
+        xfer_iso->isoc_packet_desc[n].num_bytes = len;
+        if (out) memcpy(xfer_iso->data_buffer + pos, urb->payload + desc[n].offset, len);
+        ret[n].offset = desc[n].offset;
+        ret[n].length = desc[n].length;
+        ret[n].actual_length = 0;
+        ret[n].status = 0;
+        pos += len;
+    }
+
+    xfer_iso->num_bytes = total;
+    xfer_iso->bEndpointAddress = ep->desc->bEndpointAddress;
+    xfer_iso->callback = usb_xfer_cb;
+    xfer_iso->context = urb;
+    urb->transfer = xfer_iso;
+
+    return out ? length : 0;
+}
+
+/**
+ * @brief The counters and waiting URBs stay, transfers of the previous setting may still come back on it
+ */
+void USBipDevice::ep_setup(usbip_ep_t* ep, const usb_ep_desc_t* desc)
+{
+    ep->desc = desc;
+    ep->type = USB_EP_DESC_GET_XFERTYPE(desc);
+    ep->interval = desc->bInterval;
+    ep->mps = USB_EP_DESC_GET_MPS(desc);
+    ep->max_depth = ep_max_depth(ep->type);
+}
+
+void USBipDevice::set_endpoints(const DescriptorCache::intf_t* intf, bool add)
+{
+    for (int i = 0; i < intf->num_eps; i++)
+    {
+        const usb_ep_desc_t *desc = descriptors.endpoints[intf->first_ep + i].desc;
+        usbip_ep_t* ep = &eps[usbip_ep_index(desc->bEndpointAddress)];
+        if (add)
+        {
+            ep_setup(ep, desc);
+            continue;
+        }
+        ep->desc = NULL;
+        ep->type = USBIP_EP_UNUSED;
+        // waited for an endpoint the new setting may not have
+        while (ep->pending)
+        {
+            usbip_urb_t* urb = ep->pending;
+            ep->pending = urb->next;
+            deallocate(urb->transfer);
+            urb->transfer = NULL;
+            if (urb_finished(urb)) {
+                release_urb(urb);
+            } else {
+                fail_urb(urb, -EPIPE);
+            }
+        }
+        ep->pending_tail = NULL;
+        ep->queued = 0;
+    }
+}
+
+usbip_lane_t USBipDevice::lane(uint8_t ep, bool in) const
+{
+    if (ep == 0) return USBIP_LANE_CTRL;
+    switch (eps[usbip_ep_index(ep | (in ? 0x80 : 0))].type)
+    {
+    case USB_TRANSFER_TYPE_INTR:
+        return USBIP_LANE_INTR;
+    case USB_TRANSFER_TYPE_ISOCHRONOUS:
+        return USBIP_LANE_ISO;
+    default:
+        return USBIP_LANE_BULK;
+    }
+}
+
+bool USBipDevice::admit(uint8_t address, uint32_t bytes, bool held)
+{
+    uint16_t* admitted = &ep_admitted[usbip_ep_index(address)];
+    // an endpoint waiting for data (network RX, a keyboard) must not keep the others from getting any;
+    // the global URB count is never gone over, it keeps the URB slots CMD_UNLINK needs
+    bool first = __atomic_fetch_add(admitted, 1, __ATOMIC_SEQ_CST) == 0;
+    if (usbip_budget_take(&urb_budget, held ? 0 : 1, bytes, first ? USBIP_BUDGET_OVER_BYTES : 0))
+    {
+        if (usbip_budget_take(&budget, 1, bytes, first ? USBIP_BUDGET_OVER_BYTES | USBIP_BUDGET_OVER_URBS : 0))
+        {
+            usbip_budget_admitted(&urb_budget);
+            usbip_budget_admitted(&budget);
+            return true;
+        }
+        usbip_budget_give(&urb_budget, held ? 0 : 1, bytes);
+    }
+    __atomic_fetch_sub(admitted, 1, __ATOMIC_SEQ_CST);
+    return false;
+}
+
+void USBipDevice::release(uint8_t address, uint32_t bytes)
+{
+    usbip_budget_give(&budget, 1, bytes);
+    usbip_budget_give(&urb_budget, 1, bytes);
+    __atomic_fetch_sub(&ep_admitted[usbip_ep_index(address)], 1, __ATOMIC_SEQ_CST);
+}
+
+esp_err_t USBipDevice::set_interface(usbip_urb_t* urb)
+{
+    usb_setup_packet_t* setup = (usb_setup_packet_t*)urb->transfer->data_buffer;
+    uint8_t intf = setup->wIndex & 0xff;
+    if (intf >= config_desc->bNumInterfaces || intf >= USBIP_MAX_INTERFACES) return ESP_ERR_INVALID_ARG;
+    if (descriptors.interface(intf, setup->wValue & 0xff) == NULL) return ESP_ERR_NOT_FOUND;
+    const DescriptorCache::intf_t *cur = descriptors.interface(intf, alt_settings[intf]);
+
+    // the host unlinked the URBs of the old setting, whatever is still queued on its endpoints goes now
+    for (int i = 0; i < cur->num_eps; i++)
+    {
+        const usb_ep_desc_t *ep = descriptors.endpoints[cur->first_ep + i].desc;
+        flushEndpoint(ep->bEndpointAddress);
+        if (ep->bEndpointAddress & 0x80) readahead_flush(&readaheads[ep->bEndpointAddress & 0xf]);
+    }
+    intf_urb = urb;
+    hold_interface(cur, true);
+    return switch_interface();
+}
+
+void USBipDevice::hold_interface(const DescriptorCache::intf_t* intf, bool hold)
+{
+    for (int i = 0; i < intf->num_eps; i++)
+    {
+        eps[usbip_ep_index(descriptors.endpoints[intf->first_ep + i].desc->bEndpointAddress)].held = hold;
+    }
+    eps[0].held = hold;
+}
+
+esp_err_t USBipDevice::switch_interface()
+{
+    usb_setup_packet_t* setup = (usb_setup_packet_t*)intf_urb->transfer->data_buffer;
+    uint8_t intf = setup->wIndex & 0xff;
+    uint8_t alt = setup->wValue & 0xff;
+    const DescriptorCache::intf_t *next = descriptors.interface(intf, alt);
+    const DescriptorCache::intf_t *cur = descriptors.interface(intf, alt_settings[intf]);
+
+    esp_err_t err = releaseInterface(intf);
+    if (err == ESP_ERR_INVALID_STATE)
+    {
+        // flushed transfers are handed back by the USB client task, retried as they come in
+        int busy = 0;
+        for (int i = 0; i < cur->num_eps; i++)
+        {
+            uint8_t adr = descriptors.endpoints[cur->first_ep + i].desc->bEndpointAddress;
+            busy += eps[usbip_ep_index(adr)].inflight;
+            if (adr & 0x80) busy += readaheads[adr & 0xf].posted;
+        }
+        if (busy) return err;
+    }
+    intf_urb = NULL;
+    hold_interface(cur, false);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "release interface %d: %d", intf, err);
+        return err;
+    }
+    set_endpoints(cur, false);
+
+    err = claimInterface(intf, alt);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "claim interface %d alt %d: %d", intf, alt, err);
+        alt = alt_settings[intf];
+        next = cur;
+        claimInterface(intf, alt);
+    }
+    set_endpoints(next, true);
+    alt_settings[intf] = alt;
+    ESP_LOGI(TAG, "interface %d alt %d", intf, alt);
+    return err;
+}
+
+void USBipDevice::interface_retry()
+{
+    usbip_urb_t* urb = intf_urb;
+    if (urb_finished(urb) || gone)
+    {
+        // unlinked, its session or the device is gone, the current setting stays
+        usb_setup_packet_t* setup = (usb_setup_packet_t*)urb->transfer->data_buffer;
+        uint8_t intf = setup->wIndex & 0xff;
+        intf_urb = NULL;
+        hold_interface(descriptors.interface(intf, alt_settings[intf]), false);
+        deallocate(urb->transfer);
+        urb->transfer = NULL;
+        if (urb_finished(urb)) {
+            release_urb(urb);
+        } else {
+            fail_urb(urb, -ENODEV);
+        }
+    }
+    else
+    {
+        esp_err_t err = switch_interface();
+        if (intf_urb) return;
+        if (err == ESP_OK) err = post(urb);
+        if (err != ESP_OK)
+        {
+            if (urb->transfer) deallocate(urb->transfer);
+            urb->transfer = NULL;
+            fail_urb(urb, -EPIPE);
+        }
+    }
+    ep_kick(&eps[0]);
+}
+
+esp_err_t USBipDevice::submit(usbip_urb_t* urb)
+{
+    usbip_ep_t* ep = &eps[usbip_ep_index(urb->transfer->bEndpointAddress)];
+    if (ep->held || ep->draining || ep->pending || ep->inflight >= ep->max_depth)
+    {
+        // behind the URBs the flush cancelled or the ones posted, in the order they came
+        ep_queue(ep, urb);
+        return ESP_OK;
+    }
+    return start(urb);
+}
+
+void USBipDevice::ep_queue(usbip_ep_t* ep, usbip_urb_t* urb)
+{
+    urb->next = NULL;
+    if (ep->pending_tail) {
+        ep->pending_tail->next = urb;
+    } else {
+        ep->pending = urb;
+    }
+    ep->pending_tail = urb;
+    if (++ep->queued > ep->peak_queued) ep->peak_queued = ep->queued;
+}
+
+esp_err_t USBipDevice::start(usbip_urb_t* urb)
+{
+    usb_transfer_t* transfer = urb->transfer;
+    if ((transfer->bEndpointAddress & 0x0f) == 0)
+    {
+        usb_setup_packet_t* setup = (usb_setup_packet_t*)transfer->data_buffer;
+        descriptors.submitted(setup);
+        // the host library has to claim the new alternate setting before its endpoints can be used
+        if (setup->bmRequestType == (USB_BM_REQUEST_TYPE_DIR_OUT | USB_BM_REQUEST_TYPE_TYPE_STANDARD | USB_BM_REQUEST_TYPE_RECIP_INTERFACE) &&
+            setup->bRequest == USB_B_REQUEST_SET_INTERFACE)
+        {
+            esp_err_t err = set_interface(urb);
+            // waits in intf_urb, interface_retry() posts it
+            if (err == ESP_ERR_INVALID_STATE && intf_urb == urb) return ESP_OK;
+            if (err != ESP_OK)
+            {
+                deallocate(transfer);
+                urb->transfer = NULL;
+                return err;
+            }
+        }
+    }
+    return post(urb);
+}
+
+esp_err_t USBipDevice::post(usbip_urb_t* urb)
+{
+    usb_transfer_t* transfer = urb->transfer;
+    uint8_t adr = transfer->bEndpointAddress;
+    USBIP_TRACE(USBIP_TRACE_SUBMIT, urb->slot, urb->req.header.seqnum, adr);
+    esp_err_t err = gone ? ESP_ERR_INVALID_STATE : submitTransfer(transfer);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE("", "transfer submit EP%d: %d", adr & 0x0f, err);
+        deallocate(transfer);
+        urb->transfer = NULL;
+        return err;
+    }
+    urb->posted = true;
+    usbip_ep_t* ep = &eps[usbip_ep_index(adr)];
+    if (++ep->inflight > ep->peak_inflight) ep->peak_inflight = ep->inflight;
+    return ESP_OK;
+}
+
+void USBipDevice::cancel(usbip_urb_t* urb)
+{
+    // waiting for read-ahead data or on its endpoint: dropped when it gets there
+    if (!urb->posted) return;
+    uint8_t adr = urb->transfer->bEndpointAddress;
+    // EP0 can not be flushed, the control transfer finishes and its RET_SUBMIT is dropped
+    if ((adr & 0x0f) == 0) return;
+    usbip_ep_t* ep = &eps[usbip_ep_index(adr)];
+    if (ep->draining) return;    // already being flushed, it comes back with the others
+
+    // the USB host library can only cancel everything queued on the endpoint, the other
+    // transfers come back as cancelled and are posted again in transfer_done()
+    ep->draining = ep->inflight;
+    pipeline_stats.flushes++;
+    flushEndpoint(adr);
+}
+
+bool USBipDevice::transfer_done(usbip_urb_t* urb)
+{
+    usb_transfer_t* transfer = urb->transfer;
+    uint8_t adr = transfer->bEndpointAddress;
+    urb->posted = false;
+    usbip_ep_t* ep = &eps[usbip_ep_index(adr)];
+    ep->inflight--;
+    if (intf_urb) interface_retry();
+    if (ep->draining == 0)
+    {
+        ep_kick(ep);
+        return true;
+    }
+
+    ep->draining--;
+    bool victim = transfer->status == USB_TRANSFER_STATUS_CANCELED &&
+                  !urb_finished(urb);
+    if (victim)
+    {
+        urb->next = NULL;
+        if (ep->victims_tail) {
+            ep->victims_tail->next = urb;
+        } else {
+            ep->victims = urb;
+        }
+        ep->victims_tail = urb;
+    }
+    if (ep->draining == 0) ep_resume(ep);
+    return !victim;
+}
+
+bool USBipDevice::answer_cached(usbip_urb_t* urb)
+{
+#ifdef CONFIG_USBIP_DESC_CACHE
+    usb_transfer_t* transfer = urb->transfer;
+    usb_setup_packet_t* setup = (usb_setup_packet_t*)transfer->data_buffer;
+    if (transfer->bEndpointAddress != 0x80 || setup->wLength > urb->length) return false;
+    int len = descriptors.answer(setup, transfer->data_buffer + sizeof(usb_setup_packet_t));
+    if (len < 0) return false;
+    transfer->actual_num_bytes = sizeof(usb_setup_packet_t) + len;
+    transfer->status = USB_TRANSFER_STATUS_COMPLETED;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void USBipDevice::control_done(usb_transfer_t* transfer)
+{
+#ifdef CONFIG_USBIP_DESC_CACHE
+    descriptors.completed((usb_setup_packet_t*)transfer->data_buffer, transfer->data_buffer + sizeof(usb_setup_packet_t),
+                          transfer->actual_num_bytes - sizeof(usb_setup_packet_t));
+#endif
+}
+
+/**
+ * @brief URB task, the flush is over: posts the cancelled transfers again, then the ones that waited meanwhile.
+ * The victims are reused as they are, their buffers and OUT data are still in place. They were posted
+ * before, so they go back regardless of max_depth.
+ */
+void USBipDevice::ep_resume(usbip_ep_t* ep)
+{
+    usbip_urb_t* list = ep->victims;
+    ep->victims = ep->victims_tail = NULL;
+    while (list)
+    {
+        usbip_urb_t* urb = list;
+        list = urb->next;
+        if (urb_finished(urb))
+        {
+            // unlinked while it was off the endpoint, the RET_UNLINK already went out
+            deallocate(urb->transfer);
+            release_urb(urb);
+            continue;
+        }
+        if (ep->held)
+        {
+            // its interface is switching to another setting, like the URBs waiting on it
+            deallocate(urb->transfer);
+            urb->transfer = NULL;
+            fail_urb(urb, -EPIPE);
+            continue;
+        }
+        pipeline_stats.resubmits++;
+        urb->transfer->actual_num_bytes = 0;
+        if (post(urb) != ESP_OK) fail_urb(urb, -EPIPE);
+    }
+    ep_kick(ep);
+}
+
+void USBipDevice::ep_kick(usbip_ep_t* ep)
+{
+    while (ep->pending && !ep->held && ep->draining == 0 && ep->inflight < ep->max_depth)
+    {
+        usbip_urb_t* urb = ep->pending;
+        ep->pending = urb->next;
+        if (ep->pending == NULL) ep->pending_tail = NULL;
+        ep->queued--;
+        if (urb_finished(urb))
+        {
+            // unlinked while it waited, the RET_UNLINK already went out
+            deallocate(urb->transfer);
+            release_urb(urb);
+            continue;
+        }
+        if (start(urb) != ESP_OK) fail_urb(urb, -EPIPE);
+    }
+}
+
+void USBipDevice::log_endpoints()
+{
+    log_budget("device in flight", &budget);
+    budget.peak_urbs = __atomic_load_n(&budget.urbs, __ATOMIC_RELAXED);
+    budget.peak_bytes = __atomic_load_n(&budget.bytes, __ATOMIC_RELAXED);
+    budget.refused = 0;
+    for (int n = 0; n < USBIP_EP_COUNT; n++)
+    {
+        usbip_ep_t* ep = &eps[n];
+        if (ep->peak_inflight == 0) continue;
+        ESP_LOGI(TAG, "EP 0x%02x depth: %d, peak in flight: %d, peak waiting: %d",
+                 n < 2 ? 0 : (n >> 1) | ((n & 1) << 7), ep->max_depth, ep->peak_inflight, ep->peak_queued);
+        ep->peak_inflight = ep->inflight;
+        ep->peak_queued = ep->queued;
+    }
+}
+
+bool USBipDevice::readahead(usbip_urb_t* urb)
+{
+    if (urb->req.header.direction == 0) return false;
+    usbip_readahead_t* ra = &readaheads[urb->req.header.ep & 0xf];
+    // nothing is read while its interface switches settings, the URB waits on the endpoint
+    if (ra->depth == 0 || eps[usbip_ep_index(ra->ep)].held) return false;
+
+    // data comes from the read-ahead transfers, in order, the one prepared for this URB is not needed
+    deallocate(urb->transfer);
+    urb->transfer = NULL;
+    urb->next = NULL;
+    if (ra->pending_tail) {
+        ra->pending_tail->next = urb;
+    } else {
+        ra->pending = urb;
+    }
+    ra->pending_tail = urb;
+
+    if (ra->ready_count) {
+        ra->hits++;
+    } else {
+        ra->misses++;
+    }
+    // a smaller URB than the read-ahead size splits buffered transfers, restart at its size once drained
+    if (ra->active && usb_round_up_to_mps(urb->length, ra->mps) < ra->size) ra->active = false;
+
+    readahead_match(ra);
+    readahead_refill(ra);
+    return true;
+}
+
+void USBipDevice::readahead_done(usb_transfer_t* transfer)
+{
+    usbip_readahead_t* ra = (usbip_readahead_t*)transfer->context;
+    ra->posted--;
+    if (intf_urb) interface_retry();
+    if (ra->discard)
+    {
+        ra->discard--;
+        deallocate(transfer);
+        readahead_refill(ra);
+        return;
+    }
+    // errors (STALL, device gone) are handed to the next URB, reposting waits until it is drained
+    if (transfer->status != USB_TRANSFER_STATUS_COMPLETED) ra->active = false;
+
+    ra->ready[(ra->ready_head + ra->ready_count) % USBIP_READAHEAD_MAX_DEPTH] = transfer;
+    ra->ready_count++;
+    readahead_match(ra);
+    readahead_refill(ra);
+}
+
+void USBipDevice::readahead_match(usbip_readahead_t* ra)
+{
+    while (ra->ready_count && ra->pending)
+    {
+        usbip_urb_t* urb = ra->pending;
+        ra->pending = urb->next;
+        if (ra->pending == NULL) ra->pending_tail = NULL;
+        if (urb_finished(urb))
+        {
+            // unlinked while waiting, the data stays for the next one
+            release_urb(urb);
+            continue;
+        }
+
+        usb_transfer_t* transfer = ra->ready[ra->ready_head];
+        int len = transfer->actual_num_bytes;
+        if (transfer->status == USB_TRANSFER_STATUS_COMPLETED && len > (int)urb->length)
+        {
+            // buffered at a larger size than this URB asked for, it gets the first part and the rest stays in order
+            usb_transfer_t* part = allocate_transfer(urb->length);
+            if (part == NULL)
+            {
+                if (claim_reply(urb)) {
+                    fail_urb(urb, -ENOMEM);
+                } else {
+                    release_urb(urb);
+                }
+                continue;
+            }
+            memcpy(part->data_buffer, transfer->data_buffer, urb->length);
+            memmove(transfer->data_buffer, transfer->data_buffer + urb->length, len - urb->length);
+            transfer->actual_num_bytes = len - urb->length;
+            part->num_bytes = urb->length;
+            part->actual_num_bytes = urb->length;
+            part->status = USB_TRANSFER_STATUS_COMPLETED;
+            part->bEndpointAddress = ra->ep;
+            transfer = part;
+        } else {
+            ra->ready_head = (ra->ready_head + 1) % USBIP_READAHEAD_MAX_DEPTH;
+            ra->ready_count--;
+        }
+        transfer->context = urb;
+        urb->transfer = transfer;
+        complete_urb(transfer);
+    }
+}
+
+void USBipDevice::readahead_refill(usbip_readahead_t* ra)
+{
+    if (!ra->active)
+    {
+        // (re)start once nothing from the previous run is left, sized by the first waiting URB
+        if (ra->posted || ra->ready_count || ra->pending == NULL) return;
+        ra->size = usb_round_up_to_mps(ra->pending->length, ra->mps);
+        ra->active = true;
+    }
+
+    while (ra->posted + ra->ready_count < ra->depth)
+    {
+        usb_transfer_t* transfer = allocate_transfer(ra->size);
+        if (transfer == NULL) break;
+        transfer->num_bytes = ra->size;
+        transfer->bEndpointAddress = ra->ep;
+        transfer->callback = usb_xfer_cb;
+        transfer->context = ra;
+        esp_err_t err = submitTransfer(transfer);
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "read-ahead submit EP 0x%02x: %d", ra->ep, err);
+            deallocate(transfer);
+            ra->active = false;
+            break;
+        }
+        ra->posted++;
+    }
+
+    // nothing will complete for the waiting URBs, fail them instead of leaving them hanging
+    if (ra->posted == 0 && ra->ready_count == 0)
+    {
+        while (ra->pending)
+        {
+            usbip_urb_t* urb = ra->pending;
+            ra->pending = urb->next;
+            if (claim_reply(urb)) {
+                fail_urb(urb, -EPIPE);
+            } else {
+                release_urb(urb);
+            }
+        }
+        ra->pending_tail = NULL;
+    }
+}
+
+void USBipDevice::readahead_reset()
+{
+    for (size_t n = 0; n < 15; n++)
+    {
+        usbip_readahead_t* ra = &readaheads[n];
+        if (ra->depth == 0) continue;
+        if (ra->hits || ra->misses)
+        {
+            ESP_LOGI(TAG, "read-ahead EP 0x%02x hits: %" PRIu32 ", misses: %" PRIu32, ra->ep, ra->hits, ra->misses);
+        }
+        readahead_flush(ra);
+        ra->hits = 0;
+        ra->misses = 0;
+    }
+}
+
+void USBipDevice::readahead_flush(usbip_readahead_t* ra)
+{
+    if (ra->depth == 0) return;
+
+    while (ra->ready_count)
+    {
+        deallocate(ra->ready[ra->ready_head]);
+        ra->ready_head = (ra->ready_head + 1) % USBIP_READAHEAD_MAX_DEPTH;
+        ra->ready_count--;
+    }
+    while (ra->pending)
+    {
+        usbip_urb_t* urb = ra->pending;
+        ra->pending = urb->next;
+        release_urb(urb);
+    }
+    ra->pending_tail = NULL;
+    ra->discard = ra->posted;
+    ra->active = false;
+}
+
+/**
+ * @brief Connection task, the device a CMD_SUBMIT is for, as long as this session imported it
+ */
+static USBipDevice* session_device(usbip_session_t* session, uint32_t devid)
+{
+    uint32_t port = (devid & 0xffff) - 1;
+    if (port >= CONFIG_USBIP_MAX_DEVICES || owners[port].load(std::memory_order_acquire) != session) return NULL;
+    return device_by_devid(devid);
+}
+
+/**
+ * @brief Connection task, RECV and PARSE stamps of a CMD_SUBMIT with its transfer prepared
+ */
+static void trace_parsed(usbip_session_t* session, const usbip_urb_t* urb)
+{
+    uint8_t ep = urb->transfer->bEndpointAddress;
+    usbip_trace_stamp(USBIP_TRACE_RECV, session->slot, urb->seqnum, ep, session->rx_time);
+    usbip_trace_stamp(USBIP_TRACE_PARSE, session->slot, urb->seqnum, ep, usbip_trace_now());
+}
+
+/**
+ * @brief Connection task, takes a URB slot for the command, NULL when all are in flight
+ */
+static usbip_urb_t* alloc_urb(const CmdView& cmd, USBipDevice* dev, const uint8_t* payload)
+{
+    usbip_urb_t* urb = urbs.alloc();
+    if (urb == NULL) return NULL;
+    urb->req = *cmd.header();
+    urb->seqnum = cmd.seqnum;
+    urb->length = cmd.length;
+    urb->payload = payload;
+    urb->transfer = NULL;
+    urb->dev = dev;
+    if (dev) dev->ref();
+    urb->admitted = false;
+    urb->unlinked = false;
+    urb->lane = cmd.command == USBIP_CMD_UNLINK || dev == NULL ? USBIP_LANE_CTRL : dev->lane(cmd.ep & 0x0f, cmd.in);
+    return urb;
+}
+
+/**
+ * @brief Connection task, transfer bytes a CMD_SUBMIT is charged with: its data, the setup packet on EP0
+ * and the RET_SUBMIT descriptors of ISO. The rounding of IN data up to the packet size is left out.
+ */
+static uint32_t urb_cost(const CmdView& cmd)
+{
+    uint32_t cost = cmd.length;
+    if (cmd.ep == 0) cost += sizeof(usb_setup_packet_t);
+    // more packets are refused by req_iso_xfer()
+    if (cmd.iso()) cost += (cmd.num_packets < USBIP_MAX_ISO_PACKETS ? cmd.num_packets : USBIP_MAX_ISO_PACKETS) * sizeof(usbip_iso_desc_t);
+    return cost;
+}
+
+/**
+ * @brief Connection task, takes a URB slot for a CMD_SUBMIT within the in-flight budgets. NULL when
+ * it does not fit, session->waiting is set then so the URB task wakes it once it gives some back.
+ */
+static usbip_urb_t* admit_urb(usbip_session_t* session, const CmdView& cmd, USBipDevice* dev, const uint8_t* payload)
+{
+    uint32_t cost = urb_cost(cmd);
+    uint8_t address = cmd.address();
+    for (int tries = 0; tries < 2; tries++)
+    {
+        if (dev->admit(address, cost))
+        {
+            usbip_urb_t* urb = alloc_urb(cmd, dev, payload);
+            if (urb)
+            {
+                urb->cost = cost;
+                urb->address = address;
+                urb->admitted = true;
+                return urb;
+            }
+            // slots taken by unlinks
+            dev->release(address, cost);
+        }
+        // set before the last try, so a URB given back in between wakes the session
+        __atomic_store_n(&session->waiting, true, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Connection task, takes a URB slot for a streamed CMD_SUBMIT that does not fit the in-flight budgets,
+ * so its payload is received anyway and the commands behind it are read. Only its global URB count is taken,
+ * usbip_session_admit_held() charges the rest once it fits. NULL when that would go over CONFIG_USBIP_HOLD_BYTES.
+ */
+static usbip_urb_t* hold_urb(const CmdView& cmd, USBipDevice* dev)
+{
+    uint32_t cost = urb_cost(cmd);
+    if (!usbip_budget_take(&hold_budget, 1, cost, 0)) return NULL;
+    if (usbip_budget_take(&urb_budget, 1, 0, 0))
+    {
+        usbip_urb_t* urb = alloc_urb(cmd, dev, NULL);
+        if (urb)
+        {
+            usbip_budget_admitted(&hold_budget);
+            urb->cost = cost;
+            urb->address = cmd.address();
+            return urb;
+        }
+        usbip_budget_give(&urb_budget, 1, 0);
+    }
+    usbip_budget_give(&hold_budget, 1, cost);
+    return NULL;
+}
+
+/**
+ * @brief Connection task, gives back what hold_urb() took, the transfer is freed by the caller
+ */
+static void unhold_urb(usbip_urb_t* urb)
+{
+    usbip_budget_give(&hold_budget, 1, urb->cost);
+    usbip_budget_give(&urb_budget, 1, 0);
+    discard_urb(urb);
+}
+
+/**
+ * @brief Connection task, hands a URB to the URB task, its reply goes back to this session
+ */
+static void queue_urb(usbip_session_t* session, usbip_urb_t* urb)
+{
+    urb->slot = session->slot;
+    urb->gen = session->gen;
+    __atomic_fetch_add(&session->inflight, 1, __ATOMIC_RELAXED);
+    urb->queued_us = (uint32_t)esp_timer_get_time();
+    // every ring has room for every URB slot, so this can not fail
+    usbip_ring_push(&session->submits[urb->lane], urb);
+}
+
+typedef enum{
+    SUBMIT_ANSWERED,            /*!< refused with an error reply */
+    SUBMIT_QUEUED,              /*!< handed to the URB task */
+    SUBMIT_WAITING,             /*!< does not fit the in-flight budgets, it stays in the receive buffer */
+}submit_result_t;
+
+/**
+ * @brief Connection task, prepares the transfer for one CMD_SUBMIT and queues it to the URB task.
+ * The OUT payload is copied out here, so the framer can reuse the receive buffer right away.
+ */
+static submit_result_t prepare_submit(usbip_session_t* session, uint8_t* pdu, int pdu_len)
+{
+    ESP_LOGW(TAG, "USBIP_CMD_SUBMIT: len: %d", pdu_len);
+    ESP_LOG_BUFFER_HEX("SUBMIT", pdu, 48);
+
+    CmdView cmd(pdu);
+    USBipDevice* dev = session_device(session, cmd.devid);
+    if (dev == NULL) {
+        ESP_LOGE(TAG, "no device %08" PRIx32, cmd.devid);
+        send_submit_error(session, cmd.header(), -ENODEV);
+        return SUBMIT_ANSWERED;
+    }
+
+    if (cmd.length > CONFIG_USBIP_MAX_URB_SIZE) {
+        send_submit_error(session, cmd.header(), -EMSGSIZE);
+        return SUBMIT_ANSWERED;
+    }
+    // a held URB of the endpoint goes first
+    if (session->held_eps & (1u << usbip_ep_index(cmd.address()))) return SUBMIT_WAITING;
+
+    usbip_urb_t* urb;
+    int tlen = 0;
+    {
+        USBIP_NO_ALLOC_SECTION();
+        urb = admit_urb(session, cmd, dev, cmd.payload());
+        if (urb)
+        {
+            ESP_LOGW(TAG, "request ep: %" PRIu32, cmd.ep);
+
+            if(cmd.ep == 0) // EP0
+            {
+                tlen = dev->req_ctrl_xfer(urb);
+                if(tlen > 0){
+                    ESP_LOG_BUFFER_HEX_LEVEL("SUBMIT 7", pdu, 48 + tlen, ESP_LOG_ERROR);
+                }
+            } else { // EPx
+                tlen = dev->req_ep_xfer(urb);
+                if(tlen > 0){
+                    ESP_LOG_BUFFER_HEX_LEVEL("SUBMIT 10", pdu, 48 + tlen, ESP_LOG_ERROR);
+                }
+            }
+            if (tlen < 0) discard_urb(urb);
+        }
+    }
+    if (urb == NULL) return SUBMIT_WAITING;
+    if (tlen < 0) {
+        send_submit_error(session, cmd.header(), -EPIPE);
+        return SUBMIT_ANSWERED;
+    }
+    if (USBIP_TRACE_ON()) trace_parsed(session, urb);
+    queue_urb(session, urb);
+    return SUBMIT_QUEUED;
+}
+
+/**
+ * @brief Connection task, hands a CMD_UNLINK to the URB task on the control lane. False when no URB slot
+ * is free: like a waiting CMD_SUBMIT it stays in the receive buffer and session->waiting is set, the host
+ * gets its RET_UNLINK once the URB task gave a slot back.
+ */
+static bool queue_unlink(usbip_session_t* session, uint8_t* pdu)
+{
+    ESP_LOGI(TAG, "USBIP_CMD_UNLINK");
+    // control lane: it may overtake its URB on a lower lane, unlink_urb() submits those first then
+    CmdView cmd(pdu);
+    for (int tries = 0; tries < 2; tries++)
+    {
+        usbip_urb_t* urb = alloc_urb(cmd, NULL, NULL);
+        if (urb)
+        {
+            queue_urb(session, urb);
+            return true;
+        }
+        // set before the last try, so a slot given back in between wakes the session
+        __atomic_store_n(&session->waiting, true, __ATOMIC_SEQ_CST);
+    }
+    ESP_LOGW(TAG, "no free URB slot for unlink, waiting");
+    return false;
+}
+
+/**
+ * @brief Connection task, answers a CMD_UNLINK of a held URB right away, false when its URB is not held.
+ * The URB task never saw it, so no RET_SUBMIT follows; waiting for the budgets instead could wait forever
+ * when the host unlinks the URBs of a stuck endpoint from the last one back.
+ */
+static bool unlink_held(usbip_session_t* session, uint8_t* pdu)
+{
+    CmdView cmd(pdu);
+    uint32_t seqnum = cmd.unlink()->unlink_seqnum;
+    usbip_urb_t** link = (usbip_urb_t**)&session->held;
+    while (*link && (*link)->seqnum != seqnum) link = &(*link)->next;
+    usbip_urb_t* victim = *link;
+    if (victim == NULL) return false;
+
+    *link = victim->next;
+    victim->dev->deallocate(victim->transfer);
+    unhold_urb(victim);
+    session->held_eps = 0;
+    for (usbip_urb_t* urb = (usbip_urb_t*)session->held; urb; urb = urb->next)
+    {
+        session->held_eps |= 1u << usbip_ep_index(urb->address);
+    }
+
+    usbip_tx_item_t item = {};
+    usbip_unlink_t* ret = (usbip_unlink_t*)item.hdr;
+    memcpy(ret, pdu, sizeof(usbip_unlink_t));
+    ret->header.command = USBIP_RET_UNLINK;
+    ret->header.devid = 0;
+    ret->header.direction = 0;
+    ret->header.ep = 0;
+    ret->status = (uint32_t)-ECONNRESET;
+    item.hdr_len = sizeof(usbip_unlink_t);
+    queue_reply(session, &item);
+    return true;
+}
+
+/**
+ * @brief Connection task, true when the CMD_SUBMIT seqnum is among the PDUs in front of it that are not handled yet
+ */
+static bool still_buffered(const uint8_t* pdus, size_t len, uint32_t seqnum)
+{
+    size_t start = 0;
+    while (start < len)
+    {
+        int pdu_len = usbip_pdu_length(pdus + start, len - start);
+        if (usbip_pdu_code(pdus + start) == USBIP_CMD_SUBMIT)
+        {
+            CmdView cmd(pdus + start);
+            if (cmd.seqnum == seqnum) return true;
+        }
+        start += pdu_len;
+    }
+    return false;
+}
+
+/**
+ * @brief Connection task, the CMD_SUBMIT at the start of pdus waits for the in-flight budgets: handles the
+ * commands behind it that do not depend on it and cuts them out of the receive buffer. A CMD_SUBMIT goes
+ * when no earlier one of its endpoint waits, so each endpoint keeps its order, a CMD_UNLINK when its URB
+ * is not one of the commands still waiting; those free the budgets of URBs that would never complete on
+ * their own. Anything else ends the look.
+ */
+static bool look_ahead(usbip_session_t* session, uint8_t* pdus, size_t len)
+{
+    bool queued = false;
+    // endpoints with a CMD_SUBMIT waiting
+    uint32_t blocked = session->held_eps | 1u << usbip_ep_index(CmdView(pdus).address());
+    size_t start = usbip_pdu_length(pdus, len);
+    while (start < len)
+    {
+        uint8_t* pdu = pdus + start;
+        int pdu_len = usbip_pdu_length(pdu, len - start);
+        if (pdu_len <= 0) break;
+        uint32_t code = usbip_pdu_code(pdu);
+        if (code != USBIP_CMD_SUBMIT && code != USBIP_CMD_UNLINK) break;
+
+        CmdView cmd(pdu);
+        uint32_t ep = 1u << usbip_ep_index(cmd.address());
+        bool handled = false;
+        if (code == USBIP_CMD_UNLINK)
+        {
+            if (still_buffered(pdus, start, cmd.unlink()->unlink_seqnum) || (!unlink_held(session, pdu) && !queue_unlink(session, pdu))) break;
+            queued = true;
+            handled = true;
+        }
+        else if ((blocked & ep) == 0)
+        {
+            submit_result_t result = prepare_submit(session, pdu, pdu_len);
+            if (result == SUBMIT_WAITING) {
+                blocked |= ep;
+            } else {
+                queued |= result == SUBMIT_QUEUED;
+                handled = true;
+            }
+        }
+
+        if (handled) {
+            usbip_framer_cut(&session->framer, pdu, pdu_len);
+            len -= pdu_len;
+        } else {
+            start += pdu_len;
+        }
+    }
+    return queued;
+}
+
+// a CMD_SUBMIT with less OUT data than the threshold has to fit the receive buffer
+static_assert(CONFIG_USBIP_STREAM_THRESHOLD + sizeof(usbip_submit_t) <= CONFIG_USBIP_RX_BUFFER_SIZE,
+              "CONFIG_USBIP_STREAM_THRESHOLD is larger than CONFIG_USBIP_RX_BUFFER_SIZE allows");
+
+extern "C" size_t usbip_session_stream(usbip_session_t* session, const uint8_t* data, size_t len)
+{
+    if (len < sizeof(usbip_submit_t) || usbip_pdu_code(data) != USBIP_CMD_SUBMIT) return 0;
+
+    CmdView cmd(data);
+    uint32_t length = cmd.length;
+    // ISO descriptors follow the payload, those PDUs stay in the receive buffer
+    if (cmd.in || length < CONFIG_USBIP_STREAM_THRESHOLD || cmd.iso()) {
+        int pdu_len = usbip_pdu_length(data, len);
+        if (pdu_len <= (int)session->framer.size) return 0;
+        // would fill the receive buffer for good, it is refused and read from the socket to be thrown away
+        ESP_LOGE(TAG, "CMD_SUBMIT of %d bytes does not fit the receive buffer", pdu_len);
+        send_submit_error(session, cmd.header(), -EMSGSIZE);
+        session->sink = NULL;
+        session->sink_left = pdu_len - len;
+        session->sink_urb = NULL;
+        return len;
+    }
+
+    USBipDevice* dev = session_device(session, cmd.devid);
+    usbip_urb_t* urb = NULL;
+    int32_t status = 0;
+    if (dev == NULL) {
+        status = -ENODEV;
+    } else if (length > CONFIG_USBIP_MAX_URB_SIZE) {
+        status = -EMSGSIZE;
+    } else if ((session->held_eps & (1u << usbip_ep_index(cmd.address())) || (urb = admit_urb(session, cmd, dev, NULL)) == NULL) &&
+               (urb = hold_urb(cmd, dev)) == NULL) {
+        // stays at the head of the receive buffer until the in-flight budgets have room
+        return 0;
+    } else {
+        // large transfers are not pooled, they come from the heap on demand
+        int tlen = cmd.ep == 0 ? dev->req_ctrl_xfer(urb) : dev->req_ep_xfer(urb);
+        if (tlen < 0) {
+            if (urb->admitted) discard_urb(urb);
+            else unhold_urb(urb);
+            urb = NULL;
+            status = -ENOMEM;
+        }
+    }
+
+    size_t have = len - sizeof(usbip_submit_t);     // the PDU is incomplete, so less than length
+    session->sink = NULL;
+    session->sink_left = length - have;
+    session->sink_urb = NULL;
+    ESP_LOGI(TAG, "USBIP_CMD_SUBMIT: streaming %" PRIu32 " bytes", length);
+    if (status) {
+        // the payload is still read from the socket and thrown away
+        ESP_LOGE(TAG, "can not stream URB: %" PRIi32, status);
+        send_submit_error(session, cmd.header(), status);
+        return len;
+    }
+
+    uint8_t* dst = urb->transfer->data_buffer + (cmd.ep == 0 ? sizeof(usb_setup_packet_t) : 0);
+    memcpy(dst, data + sizeof(usbip_submit_t), have);
+    session->sink = dst + have;
+    session->sink_urb = urb;
+    return len;
+}
+
+extern "C" void usbip_session_stream_done(usbip_session_t* session)
+{
+    usbip_urb_t* urb = (usbip_urb_t*)session->sink_urb;
+    session->sink = NULL;
+    session->sink_urb = NULL;
+    if (urb == NULL) return;
+
+    if (USBIP_TRACE_ON()) trace_parsed(session, urb);
+    if (!urb->admitted)
+    {
+        usbip_urb_t** tail = (usbip_urb_t**)&session->held;
+        while (*tail) tail = &(*tail)->next;
+        urb->next = NULL;
+        *tail = urb;
+        session->held_eps |= 1u << usbip_ep_index(urb->address);
+        return;
+    }
+    queue_urb(session, urb);
+    xTaskNotifyGive(urb_task_hdl);
+}
+
+extern "C" void usbip_session_admit_held(usbip_session_t* session)
+{
+    bool queued = false;
+    uint32_t blocked = 0;   // endpoints with an earlier held URB that still does not fit
+    usbip_urb_t** link = (usbip_urb_t**)&session->held;
+    while (usbip_urb_t* urb = *link)
+    {
+        uint32_t ep = 1u << usbip_ep_index(urb->address);
+        bool admitted = false;
+        for (int tries = 0; tries < 2 && (blocked & ep) == 0 && !admitted; tries++)
+        {
+            admitted = urb->dev->admit(urb->address, urb->cost, true);
+            // set before the last try, so a URB given back in between wakes the session
+            if (!admitted) __atomic_store_n(&session->waiting, true, __ATOMIC_SEQ_CST);
+        }
+        if (!admitted)
+        {
+            blocked |= ep;
+            link = &urb->next;
+            continue;
+        }
+        *link = urb->next;
+        urb->admitted = true;
+        usbip_budget_give(&hold_budget, 1, urb->cost);
+        queue_urb(session, urb);
+        queued = true;
+    }
+    session->held_eps = blocked;
+    if (queued) xTaskNotifyGive(urb_task_hdl);
+}
+
+extern "C" size_t parse_request(usbip_session_t* session, uint8_t* rx_buffer, size_t len)
+{
+    size_t start = 0;
+    bool queued = false;
+
+    while (start < len)
+    {
+        uint8_t* pdu = rx_buffer + start;
+        int pdu_len = usbip_pdu_length(pdu, len - start);
+        if (pdu_len <= 0) break;
+        uint32_t code = usbip_pdu_code(pdu);
+
+        switch (code)
+        {
+        case USBIP_OP(OP_REQ_DEVLIST):{
+            ESP_LOGI(TAG, "OP_REQ_DEVLIST");
+            op_request_t req = {.session = session};
+            esp_event_post_to(loop_handle, USBIP_EVENT_BASE, OP_REQ_DEVLIST, &req, sizeof(req), 10);
+            break;
+        }
+        case USBIP_OP(OP_REQ_IMPORT):{
+            ESP_LOGI(TAG, "OP_REQ_IMPORT");
+            op_request_t req = {.session = session};
+            memcpy(req.busid, pdu + sizeof(usbip_request_t), USBIP_BUSID_SIZE);
+            esp_event_post_to(loop_handle, USBIP_EVENT_BASE, OP_REQ_IMPORT, &req, sizeof(req), 10);
+            break;
+        }
+        case USBIP_CMD_SUBMIT:{
+            submit_result_t result = prepare_submit(session, pdu, pdu_len);
+            if (result == SUBMIT_WAITING)
+            {
+                queued |= look_ahead(session, pdu, len - start);
+                if (queued) xTaskNotifyGive(urb_task_hdl);
+                return start;
+            }
+            queued |= result == SUBMIT_QUEUED;
+            break;
+        }
+        case USBIP_CMD_UNLINK:{
+            if (unlink_held(session, pdu)) break;
+            if (!queue_unlink(session, pdu))
+            {
+                if (queued) xTaskNotifyGive(urb_task_hdl);
+                return start;
+            }
+            queued = true;
+            break;
+        }
+        default:
+            ESP_LOGE(TAG, "unknown command: %" PRIx32, code);
+            break;
+        }
+        start += pdu_len;
+    }
+
+    // one wake-up for the whole batch
+    if (queued) xTaskNotifyGive(urb_task_hdl);
+    return start;
+}
+
+extern "C" void usbip_session_sent(usbip_session_t* session)
+{
+    if (__atomic_load_n(&session->parked, __ATOMIC_SEQ_CST)) xTaskNotifyGive(urb_task_hdl);
+}
+
+extern "C" bool usbip_session_throttled(usbip_session_t* session)
+{
+    return (__atomic_load_n(&session->waiting, __ATOMIC_SEQ_CST) && usbip_framer_full(&session->framer)) ||
+           usbip_txq_depth(&session->txq) + __atomic_load_n(&session->inflight, __ATOMIC_ACQUIRE) + TX_CONTROL_RESERVE >= session->txq.size;
+}
+
+extern "C" esp_err_t usbip_session_attach(usbip_session_t* session)
+{
+    for (int lane = 0; lane < USBIP_LANES; lane++)
+    {
+        if (usbip_ring_init(&session->submits[lane], urbs.size()) != ESP_OK)
+        {
+            while (lane--) usbip_ring_deinit(&session->submits[lane]);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    session->closing = false;
+    session->inflight = 0;
+
+    for (int n = 0; n < CONFIG_USBIP_MAX_SESSIONS; n++)
+    {
+        usbip_session_t* expected = nullptr;
+        if (sessions[n].compare_exchange_strong(expected, session, std::memory_order_acq_rel))
+        {
+            // the previous session of the slot bumped the generation before it let go of the slot
+            session->slot = n;
+            session->gen = session_gens[n];
+            session->txq.trace_slot = n;
+            return ESP_OK;
+        }
+    }
+    for (int lane = 0; lane < USBIP_LANES; lane++) usbip_ring_deinit(&session->submits[lane]);
+    return ESP_ERR_NO_MEM;
+}
+
+extern "C" void usbip_session_detach(usbip_session_t* session)
+{
+    // connection dropped in the middle of a streamed payload
+    usbip_urb_t* urb = (usbip_urb_t*)session->sink_urb;
+    if (urb)
+    {
+        urb->dev->deallocate(urb->transfer);
+        if (urb->admitted) discard_urb(urb);
+        else unhold_urb(urb);
+        session->sink_urb = NULL;
+    }
+    while (usbip_urb_t* urb = (usbip_urb_t*)session->held)
+    {
+        session->held = urb->next;
+        urb->dev->deallocate(urb->transfer);
+        unhold_urb(urb);
+    }
+    session->held_eps = 0;
+
+    // the URB task drops the submit rings and the session, then notifies this task
+    __atomic_store_n(&session->closing, true, __ATOMIC_RELEASE);
+    xTaskNotifyGive(urb_task_hdl);
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    // control replies are queued from the usbip_events task, once it handled this no one holds the session
+    op_request_t req = {.session = session};
+    if (ESP_OK == esp_event_post_to(loop_handle, USBIP_EVENT_BASE, USBIP_SESSION_CLOSED, &req, sizeof(req), portMAX_DELAY))
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+    for (int lane = 0; lane < USBIP_LANES; lane++) usbip_ring_deinit(&session->submits[lane]);
+}
+
+USBIP::USBIP()
+{
+    const usbip_task_cfg_t* events = usbip_sched_stage(USBIP_STAGE_EVENTS);
+    esp_event_loop_args_t loop_args = {
         .queue_size = 100,
         .task_name = "usbip_events",
-        .task_priority = 21,
-        .task_stack_size = 4*1024,
-        .task_core_id = 0
+        .task_priority = events->priority,
+        .task_stack_size = events->stack,
+        .task_core_id = events->core
     };
 
     esp_event_loop_create(&loop_args, &loop_handle);
 
     esp_event_handler_register_with(loop_handle, USBIP_EVENT_BASE, OP_REQ_DEVLIST, _event_handler2, NULL); /*!< handle list USB devices - `usbip list -r myIP` */
     esp_event_handler_register_with(loop_handle, USBIP_EVENT_BASE, OP_REQ_IMPORT, _event_handler2, NULL);
+    esp_event_handler_register_with(loop_handle, USBIP_EVENT_BASE, USBIP_SESSION_CLOSED, _event_handler2, NULL);
+    esp_event_handler_register_with(loop_handle, USBIP_EVENT_BASE, USBIP_DEVICE_GONE, _event_handler2, NULL);
+
+    // URB hot path, USB completions and connection tasks hand over through lock-free rings
+    usbip_ring_init(&completions, urbs.size() + CONFIG_USBIP_MAX_DEVICES * 15 * USBIP_READAHEAD_MAX_DEPTH);
+    usbip_sched_create(USBIP_STAGE_URB, urb_task, "usbip_urb", NULL, &urb_task_hdl);
 }
 
 USBIP::~USBIP() {}
@@ -1,141 +1,246 @@
 #pragma once
 #include <string.h>
+#include <atomic>
 #include "usb/usb_host.h"
 #include "esp_event.h"
 #include "usb_device.hpp"
-
-/* Swap bytes in 16-bit value.  */
-#define bswap_constant_16(x)					\
-  ((__uint16_t) ((((x) >> 8) & 0xff) | (((x) & 0xff) << 8)))
-
-/* Swap bytes in 32-bit value.  */
-#define bswap_constant_32(x)					\
-  ((((x) & 0xff000000u) >> 24) | (((x) & 0x00ff0000u) >> 8)	\
-   | (((x) & 0x0000ff00u) << 8) | (((x) & 0x000000ffu) << 24))
-
-
-typedef struct{
-    uint16_t version;
-    uint16_t command;
-    uint32_t status;
-}usbip_request_t;
-
-typedef struct{
-    uint8_t bInterfaceClass;
-    uint8_t bInterfaceSubClass;
-    uint8_t bInterfaceProtocol;
-    uint8_t padding;
-}usbip_interface_t;
-
-typedef struct{
-    usbip_request_t request;
-    uint32_t count;
-    char path[256];
-    char busid[32];
-    uint32_t busnum;
-    uint32_t devnum;
-    uint32_t speed;
-    uint16_t idVendor;
-    uint16_t idProduct;
-    uint16_t bcdDevice;
-    uint8_t bDeviceClass;
-    uint8_t bDeviceSubClass;
-    uint8_t bDeviceProtocol;
-    uint8_t bConfigurationValue;
-    uint8_t bNumConfigurations;
-    uint8_t bNumInterfaces;
-    usbip_interface_t intfs[10];
-}usbip_devlist_t;
-
-typedef struct{
-    usbip_request_t request;
-    char path[256];
-    char busid[32];
-    uint32_t busnum;
-    uint32_t devnum;
-    uint32_t speed;
-    uint16_t idVendor;
-    uint16_t idProduct;
-    uint16_t bcdDevice;
-    uint8_t bDeviceClass;
-    uint8_t bDeviceSubClass;
-    uint8_t bDeviceProtocol;
-    uint8_t bConfigurationValue;
-    uint8_t bNumConfigurations;
-    uint8_t bNumInterfaces;
-}usbip_import_t;
-
-typedef struct{
-    uint32_t command;   /*!< command */
-    uint32_t seqnum;    /*!< seqnum: sequential number that identifies requests and corresponding responses; incremented per connection */
-    uint32_t devid;     /*!< devid: specifies a remote USB device uniquely instead of busnum and devnum; for client (request), this value is ((busnum << 16) | devnum); for server (response), this shall be set to 0 */
-    uint32_t direction; /*!< direction: only used by client, for server this shall be 0 */
-    uint32_t ep;        /*!< ep: endpoint number only used by client, for server this shall be 0; for UNLINK, this shall be 0 */
-}usbip_header_basic_t;
-
+#include "usbip_desc_cache.hpp"
+#include "usbip_proto.hpp"
+#include "usbip_qos.h"
+#include "usbip_budget.h"
+
+#define USBIP_MAX_ISO_PACKETS       1024    /*!< same limit as the Linux USB/IP drivers */
+#define USBIP_MAX_INTERFACES        10
+
+class USBipDevice;
+
+/**
+ * @brief Request slot of an in flight URB, see CONFIG_USBIP_MAX_INFLIGHT_URBS
+ */
+typedef struct usbip_urb{
+    usbip_submit_t req;         /*!< CMD_SUBMIT header, rewritten in place into RET_SUBMIT */
+    uint32_t seqnum;            /*!< decoded once by the connection task, req is the wire copy */
+    uint32_t length;            /*!< requested transfer_buffer_length */
+    const uint8_t* payload;     /*!< OUT data in the receive buffer, only valid until the transfer is prepared */
+    usb_transfer_t* transfer;   /*!< prepared by the connection task, submitted by the URB task */
+    USBipDevice* dev;
+    uint8_t slot;               /*!< session slot the reply goes to */
+    uint16_t gen;               /*!< session generation, see usbip_session_t */
+    uint8_t lane;               /*!< usbip_lane_t of the submit and of its reply */
+    uint32_t queued_us;         /*!< handed to the URB task */
+    uint32_t cost;              /*!< transfer bytes charged to the in-flight budgets */
+    uint8_t address;            /*!< bEndpointAddress the budgets were charged on */
+    bool admitted;              /*!< CMD_SUBMIT that holds budget, see USBipDevice::admit() */
+    bool unlinked;              /*!< cancelled by a CMD_UNLINK, never answered; finished_seqnums forgets old seqnums */
+    const uint8_t* reply;       /*!< IN data of the reply, in the transfer, while the URB is parked */
+    uint32_t reply_len;
+    struct usbip_urb* next;     /*!< next URB parked on the same endpoint (read-ahead, held or flushed) */
+    bool posted;                /*!< transfer is queued on the endpoint */
+}usbip_urb_t;
+
+#define USBIP_EP_COUNT      32      /*!< EP0 at 0, then (number << 1) | IN for EP1-15; 1 is unused */
+#define USBIP_EP_UNUSED     0xff    /*!< type of an endpoint that is not in the current alternate setting */
+
+static inline uint8_t usbip_ep_index(uint8_t address)
+{
+    return (address & 0x0f) ? ((address & 0x0f) << 1) | (address >> 7) : 0;
+}
+
+/**
+ * @brief Runtime state of one endpoint, the descriptor fields the hot path needs are copied in.
+ * Endpoints are scheduled independently by the URB task: up to max_depth transfers are posted,
+ * the URBs behind them wait in pending, in the order they arrived. A flush (unlink) holds new
+ * URBs back the same way until the cancelled transfers are back.
+ */
 typedef struct{
-    usbip_header_basic_t header;
-    union{
-        uint32_t flags;             /*!< cmd => transfer_flags: possible values depend on the URB transfer_flags (refer to URB doc in USB Request Block (URB)) but with URB_NO_TRANSFER_DMA_MAP masked. */
-        uint32_t status;            /*!< resp => status: zero for successful URB transaction, otherwise some kind of error happened. */
-    };
-    uint32_t length;                /*!< transfer_buffer_length: use URB transfer_buffer_length */
-    uint32_t start_frame;           /*!< start_frame: use URB start_frame; initial frame for ISO transfer; shall be set to 0 if not ISO transfer */
-    uint32_t num_packets;           /*!< number_of_packets: number of ISO packets; shall be set to 0xffffffff if not ISO transfer */
-    union{
-        uint32_t interval;          /*!< cmd => interval: maximum time for the request on the server-side host controller */
-        uint32_t error_count;       /*!< resp => error_count */
-    };
-    union{
-        uint64_t setup;             /*!< cmd => setup: data bytes for USB setup, filled with zeros if not used. */
-        uint64_t padding;           /*!< resp => padding, shall be set to 0 */
-    };
-    /**
-     * @brief 
-     * transfer_buffer. If direction is USBIP_DIR_OUT then n equals transfer_buffer_length; otherwise n equals 0. For ISO transfers the padding between each ISO packets is not transmitted.
-     * transfer_buffer. If direction is USBIP_DIR_IN then n equals actual_length; otherwise n equals 0. For ISO transfers the padding between each ISO packets is not transmitted.
-     */
-    uint8_t transfer_buffer[1024];
-}__attribute__((__packed__))usbip_submit_t;
-
+    uint8_t type;               /*!< usb_transfer_type_t, USBIP_EP_UNUSED when not in the current setting */
+    uint8_t interval;           /*!< bInterval */
+    uint16_t mps;
+    uint16_t max_depth;         /*!< transfers posted at once, CONFIG_USBIP_EP_DEPTH_* by type */
+    uint16_t inflight;          /*!< transfers posted and not returned yet */
+    uint16_t draining;          /*!< returns still expected after a flush */
+    bool held;                  /*!< URBs wait in pending while a SET_INTERFACE switches its interface */
+    uint16_t queued;            /*!< URBs in pending */
+    uint16_t peak_inflight;
+    uint16_t peak_queued;
+    usbip_urb_t* pending;
+    usbip_urb_t* pending_tail;
+    usbip_urb_t* victims;       /*!< cancelled by the flush but not unlinked, reposted in the order they were queued */
+    usbip_urb_t* victims_tail;
+    const usb_ep_desc_t* desc;  /*!< NULL when not in the current setting */
+}usbip_ep_t;
+
+#define USBIP_READAHEAD_MAX_DEPTH   8
+
+/**
+ * @brief Read-ahead state of one IN endpoint, only touched from the URB task.
+ * Buffered data and waiting CMD_SUBMITs are both kept in order, at most one of them is non-empty.
+ */
 typedef struct{
-    usbip_header_basic_t header;
-    union{
-        int32_t unlink_seqnum;
-        int32_t status;
-    };
-    uint8_t padding[24] = {};
-}usbip_unlink_t;
-
-typedef struct{
-    int socket;
-    int len;
-    uint8_t* rx_buffer;
-}urb_data_t;
-
-extern usb_device_info_t info;
-extern const usb_device_desc_t *dev_desc;
-
+    USBipDevice* dev;
+    uint8_t ep;                 /*!< bEndpointAddress */
+    uint8_t depth;              /*!< transfers kept posted plus buffered, 0 disables read-ahead */
+    uint16_t mps;
+    uint16_t size;              /*!< transfer size, taken from the CMD_SUBMIT that (re)started read-ahead */
+    bool active;                /*!< keep reposting; cleared on errors and smaller URBs until drained */
+    uint8_t posted;
+    uint8_t discard;            /*!< posted transfers to throw away when they complete, after a reset */
+    uint8_t ready_head;
+    uint8_t ready_count;
+    usb_transfer_t* ready[USBIP_READAHEAD_MAX_DEPTH];
+    usbip_urb_t* pending;
+    usbip_urb_t* pending_tail;
+    uint32_t hits;              /*!< CMD_SUBMITs answered from buffered data */
+    uint32_t misses;            /*!< CMD_SUBMITs that had to wait for the bus */
+}usbip_readahead_t;
 
 class USBipDevice : public USBhostDevice
 {
 private:
     // friend void usb_ctrl_cb(usb_transfer_t *transfer);
-    const usb_ep_desc_t * ep_out;
-    const usb_ep_desc_t * endpoints[15][2];
-    const usb_config_desc_t *config_desc;
+    usbip_ep_t eps[USBIP_EP_COUNT];     /*!< by usbip_ep_index() */
+    usbip_readahead_t readaheads[15];   /*!< IN endpoints, indexed by endpoint number */
+    uint8_t alt_settings[USBIP_MAX_INTERFACES];
+    usbip_budget_t budget;              /*!< CONFIG_USBIP_DEVICE_BUDGET_*, URBs of this device in flight */
+    uint16_t ep_admitted[USBIP_EP_COUNT];   /*!< admitted CMD_SUBMITs by usbip_ep_index() */
+    uint8_t port;                       /*!< busid 1-(port + 1), devnum port + 1 */
+    usbip_urb_t* intf_urb;              /*!< SET_INTERFACE waiting for the flushed transfers of its interface */
+    std::atomic<uint32_t> refs;         /*!< URB slots and queued replies that use the device */
+    bool gone;                          /*!< URB task: retired, nothing is posted anymore */
+    usbip_devlist_t list_data;
+    usbip_import_t import_data;
+    DescriptorCache descriptors;
 
 public:
     USBipDevice();
     ~USBipDevice();
-    bool init(USBhost*);
+    /**
+     * @brief Takes a free port and publishes the device once it is ready for URBs,
+     * returns false when all CONFIG_USBIP_MAX_DEVICES ports are taken
+     */
+    bool init(USBhost*, usb_device_handle_t dev_hdl);
+    static USBipDevice* find(usb_device_handle_t dev_hdl);
+    /**
+     * @brief USB client task: the device went away. It is unpublished right away and the URB task takes it
+     * apart: waiting URBs fail with -ENODEV, the connection of the session that imported it is closed. Once
+     * nothing uses it anymore the usbip_events task deinit()s and deletes it, then closes dev_hdl.
+     */
+    void retire();
+    /**
+     * @brief URB task: retire() was called, true once the device can be deleted
+     */
+    bool drain();
+    bool retired() const { return gone; }
+    void ref() { refs.fetch_add(1, std::memory_order_relaxed); }
+    /**
+     * @brief Any task: drops a reference from ref(), the URB task checks a retired device again after the last one
+     */
+    void unref();
+    const usbip_devlist_t* list_info() const { return &list_data; }
+    const usbip_import_t* import_info() const { return &import_data; }
+    /**
+     * @brief QoS lane of a transfer on the endpoint, by its type in the current alternate setting
+     */
+    usbip_lane_t lane(uint8_t ep, bool in) const;
+    /**
+     * @brief Connection task: charges a CMD_SUBMIT of bytes on the endpoint to the global and the device
+     * in-flight budget, false when it does not fit. The first URB of an endpoint may go over the bytes
+     * and the device budget, never over the global URB count that keeps the slots of CMD_UNLINK.
+     * held: the URB already has its global URB count, taken when its streamed payload was held.
+     */
+    bool admit(uint8_t address, uint32_t bytes, bool held = false);
+    /**
+     * @brief Gives an admitted CMD_SUBMIT back, from any task
+     */
+    void release(uint8_t address, uint32_t bytes);
+
+    /**
+     * @brief Fill urb->transfer from the request and its OUT payload, the transfer is not submitted yet.
+     * Returns <0 on failure, otherwise the number of OUT bytes copied.
+     */
+    int req_ctrl_xfer(usbip_urb_t* urb);
+    int req_ep_xfer(usbip_urb_t* urb);
+    /**
+     * @brief Submit urb->transfer prepared by req_ctrl_xfer()/req_ep_xfer(), it is released on failure.
+     * URBs for an endpoint that is being flushed or has max_depth transfers posted wait on it.
+     */
+    esp_err_t submit(usbip_urb_t* urb);
+    /**
+     * @brief URB task: the URB got unlinked, halts and flushes its endpoint if the transfer is still queued
+     */
+    void cancel(usbip_urb_t* urb);
+    /**
+     * @brief URB task: bookkeeping for a returned transfer, false when a flush cancelled it and it is
+     * going to be posted again instead of being answered
+     */
+    bool transfer_done(usbip_urb_t* urb);
+    /**
+     * @brief URB task: completes the transfer of a standard EP0 IN request from the descriptor cache,
+     * false when it has to go to the device
+     */
+    bool answer_cached(usbip_urb_t* urb);
+    /**
+     * @brief URB task: a control transfer came back from the device, the cache learns from its reply
+     */
+    void control_done(usb_transfer_t* transfer);
 
-    int req_ctrl_xfer(usbip_submit_t* req);
-    int req_ep_xfer(usbip_submit_t* req);
+    /**
+     * @brief URB task: answers or parks an IN CMD_SUBMIT on a read-ahead endpoint, returns false
+     * when the endpoint does not read ahead and the URB has to be submitted as usual
+     */
+    bool readahead(usbip_urb_t* urb);
+    void readahead_done(usb_transfer_t* transfer);
+    /**
+     * @brief URB task: drops buffered data and waiting URBs, the session they belong to is gone
+     */
+    void readahead_reset();
+    /**
+     * @brief URB task: logs the in-flight budget and per endpoint peak transfers posted and URBs
+     * waiting, then starts the peaks over
+     */
+    void log_endpoints();
 
 private:
     void fill_import_data();
     void fill_list_data();
+    int req_iso_xfer(usbip_urb_t* urb, uint32_t num_packets);
+    /**
+     * @brief allocate() for the URB path: a transfer larger than the pool classes, or one of a class that ran
+     * out, comes from usb_host_transfer_alloc() by design, also inside a USBIP_NO_ALLOC_SECTION()
+     */
+    usb_transfer_t* allocate_transfer(size_t size, int num_isoc = 0);
+    esp_err_t start(usbip_urb_t* urb);
+    esp_err_t post(usbip_urb_t* urb);
+    void ep_setup(usbip_ep_t* ep, const usb_ep_desc_t* desc);
+    void ep_queue(usbip_ep_t* ep, usbip_urb_t* urb);
+    /**
+     * @brief Posts waiting URBs while the endpoint has room
+     */
+    void ep_kick(usbip_ep_t* ep);
+    void ep_resume(usbip_ep_t* ep);
+    /**
+     * @brief Claims another alternate setting before the SET_INTERFACE URB goes to the device,
+     * endpoints of the current one are halted and flushed first. ESP_ERR_INVALID_STATE with the URB
+     * in intf_urb while the flushed transfers are on their way back.
+     */
+    esp_err_t set_interface(usbip_urb_t* urb);
+    /**
+     * @brief Releases the interface of intf_urb and claims the new setting, ESP_ERR_INVALID_STATE with
+     * intf_urb still set while the release has to wait
+     */
+    esp_err_t switch_interface();
+    /**
+     * @brief URB task: a transfer came back while intf_urb waits, posts it once the switch went through
+     */
+    void interface_retry();
+    /**
+     * @brief URBs for EP0 and the endpoints of the setting wait while it is switched
+     */
+    void hold_interface(const DescriptorCache::intf_t* intf, bool hold);
+    void set_endpoints(const DescriptorCache::intf_t* intf, bool add);
+    void readahead_flush(usbip_readahead_t* ra);
+    void readahead_match(usbip_readahead_t* ra);
+    void readahead_refill(usbip_readahead_t* ra);
 };
 
 class USBIP
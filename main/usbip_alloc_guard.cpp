@@ -0,0 +1,100 @@
+#include "sdkconfig.h"
+
+#if CONFIG_USBIP_ASSERT_NO_ALLOC
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_attr.h"
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+
+#include "usbip_alloc_guard.hpp"
+
+#define GUARD_MAX_TASKS 6
+
+typedef struct{
+    TaskHandle_t task;
+    int depth;
+}guard_entry_t;
+
+static guard_entry_t entries[GUARD_MAX_TASKS];
+static volatile bool is_armed = false;
+static portMUX_TYPE guard_mux = portMUX_INITIALIZER_UNLOCKED;
+
+void usbip_alloc_guard_arm(bool armed)
+{
+    is_armed = armed;
+}
+
+static guard_entry_t* entry(TaskHandle_t task, bool create)
+{
+    guard_entry_t* free_entry = NULL;
+    for (size_t n = 0; n < GUARD_MAX_TASKS; n++)
+    {
+        if (entries[n].task == task) return &entries[n];
+        if (entries[n].task == NULL && free_entry == NULL) free_entry = &entries[n];
+    }
+    if (create && free_entry) free_entry->task = task;
+
+    return create ? free_entry : NULL;
+}
+
+/**
+ * @brief Adds delta to the sections the calling task is in, its entry is given back once it left them all,
+ * so connection tasks that come and go do not use up the entries
+ */
+static int enter(int delta)
+{
+    taskENTER_CRITICAL(&guard_mux);
+    guard_entry_t* e = entry(xTaskGetCurrentTaskHandle(), delta > 0);
+    int depth = 0;
+    if (e)
+    {
+        depth = e->depth;
+        e->depth += delta;
+        if (e->depth <= 0) *e = {};
+    }
+    taskEXIT_CRITICAL(&guard_mux);
+    return depth;
+}
+
+USBipAllocGuard::USBipAllocGuard()
+{
+    enter(1);
+}
+
+USBipAllocGuard::~USBipAllocGuard()
+{
+    enter(-1);
+}
+
+USBipAllocPermit::USBipAllocPermit()
+{
+    // only the task itself changes its depth, reading it and leaving the sections need not be atomic
+    depth = enter(0);
+    if (depth) enter(-depth);
+}
+
+USBipAllocPermit::~USBipAllocPermit()
+{
+    if (depth) enter(depth);
+}
+
+/**
+ * @brief Called by the heap component after every allocation (CONFIG_HEAP_USE_HOOKS)
+ */
+extern "C" IRAM_ATTR void esp_heap_trace_alloc_hook(void* ptr, size_t size, uint32_t caps)
+{
+    if (!is_armed) return;
+
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    for (size_t n = 0; n < GUARD_MAX_TASKS; n++)
+    {
+        if (entries[n].task == task && entries[n].depth > 0)
+        {
+            esp_system_abort("usbip: heap allocation in steady state hot path");
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,41 @@
+#pragma once
+#include "sdkconfig.h"
+
+/**
+ * @brief "Allocation-free steady state" assertion mode.
+ *
+ * With CONFIG_USBIP_ASSERT_NO_ALLOC any heap allocation made by a task while it is inside
+ * a USBIP_NO_ALLOC_SECTION() aborts, once the guard is armed (device attached). Socket calls
+ * stay outside the sections, lwIP allocates its pbufs from the heap. USBIP_ALLOC_ALLOWED() lifts
+ * the check for the rest of its scope, around heap allocations that are part of the design.
+ */
+#if CONFIG_USBIP_ASSERT_NO_ALLOC
+
+void usbip_alloc_guard_arm(bool armed);
+
+class USBipAllocGuard
+{
+public:
+    USBipAllocGuard();
+    ~USBipAllocGuard();
+};
+
+class USBipAllocPermit
+{
+    int depth;      /*!< sections of the task it suspends */
+public:
+    USBipAllocPermit();
+    ~USBipAllocPermit();
+};
+
+#define USBIP_NO_ALLOC_SECTION() USBipAllocGuard _alloc_guard
+#define USBIP_ALLOC_ALLOWED() USBipAllocPermit _alloc_permit
+
+#else
+
+static inline void usbip_alloc_guard_arm(bool armed) {}
+
+#define USBIP_NO_ALLOC_SECTION()
+#define USBIP_ALLOC_ALLOWED()
+
+#endif
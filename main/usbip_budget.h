@@ -0,0 +1,78 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief URBs in flight and the transfer memory they hold, against a limit. Connection tasks take,
+ * the URB task gives back, so every field is only touched with atomics.
+ */
+typedef struct{
+    uint32_t max_urbs;
+    uint32_t max_bytes;
+    uint32_t urbs;
+    uint32_t bytes;
+    uint32_t peak_urbs;
+    uint32_t peak_bytes;
+    uint32_t refused;           /*!< takes that did not fit, a waiting CMD_SUBMIT counts again on every try */
+}usbip_budget_t;
+
+static inline void usbip_budget_init(usbip_budget_t* budget, uint32_t max_urbs, uint32_t max_bytes)
+{
+    budget->max_urbs = max_urbs;
+    budget->max_bytes = max_bytes;
+    budget->urbs = budget->bytes = 0;
+    budget->peak_urbs = budget->peak_bytes = 0;
+    budget->refused = 0;
+}
+
+#define USBIP_BUDGET_OVER_BYTES 0x1     /*!< usbip_budget_take() may go over max_bytes */
+#define USBIP_BUDGET_OVER_URBS  0x2     /*!< usbip_budget_take() may go over max_urbs */
+
+/**
+ * @brief Takes urbs URBs (0 or 1) of bytes, false when it does not fit. over is the USBIP_BUDGET_OVER_*
+ * limits it may go over. With no URB only the bytes are checked, the URB already holds its count.
+ * Two tasks taking at once may both be refused when only one would fit, never both admitted.
+ */
+static inline bool usbip_budget_take(usbip_budget_t* budget, uint32_t urbs, uint32_t bytes, unsigned over)
+{
+    uint32_t count = __atomic_add_fetch(&budget->urbs, urbs, __ATOMIC_SEQ_CST);
+    uint32_t total = __atomic_add_fetch(&budget->bytes, bytes, __ATOMIC_SEQ_CST);
+    if ((urbs && count > budget->max_urbs && !(over & USBIP_BUDGET_OVER_URBS)) ||
+        (total > budget->max_bytes && !(over & USBIP_BUDGET_OVER_BYTES)))
+    {
+        __atomic_sub_fetch(&budget->urbs, urbs, __ATOMIC_SEQ_CST);
+        __atomic_sub_fetch(&budget->bytes, bytes, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&budget->refused, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    return true;
+}
+
+static inline void usbip_budget_peak(uint32_t* peak, uint32_t value)
+{
+    uint32_t seen = __atomic_load_n(peak, __ATOMIC_RELAXED);
+    while (value > seen && !__atomic_compare_exchange_n(peak, &seen, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Updates the peaks, once a take is not going to be given back right away
+ */
+static inline void usbip_budget_admitted(usbip_budget_t* budget)
+{
+    usbip_budget_peak(&budget->peak_urbs, __atomic_load_n(&budget->urbs, __ATOMIC_RELAXED));
+    usbip_budget_peak(&budget->peak_bytes, __atomic_load_n(&budget->bytes, __ATOMIC_RELAXED));
+}
+
+static inline void usbip_budget_give(usbip_budget_t* budget, uint32_t urbs, uint32_t bytes)
+{
+    __atomic_sub_fetch(&budget->urbs, urbs, __ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(&budget->bytes, bytes, __ATOMIC_SEQ_CST);
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,175 @@
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "lwip/sockets.h"
+
+#include "usbip_session.h"
+#include "usbip_trace.h"
+
+#define TAG "usbip_conn"
+
+static void close_socket(int sock)
+{
+    shutdown(sock, 0);
+    close(sock);
+}
+
+/**
+ * @brief Queues the held CMD_SUBMITs that fit now, hands the complete PDUs in the receive buffer to
+ * parse_request(), then a large CMD_SUBMIT behind them to usbip_session_stream(). Stops at a command
+ * waiting for the in-flight budgets or a URB slot, which is tried again on the next call. Returns false
+ * on a protocol error.
+ */
+static bool parse_buffered(usbip_session_t* session)
+{
+    uint8_t* pdus;
+    // set again by whatever still does not fit
+    __atomic_store_n(&session->waiting, false, __ATOMIC_SEQ_CST);
+    usbip_session_admit_held(session);
+    int batch = usbip_framer_peek(&session->framer, &pdus);
+    if (batch < 0) {
+        ESP_LOGE(TAG, "Protocol error, dropping connection");
+        return false;
+    }
+    if (batch) {
+        size_t handled = parse_request(session, pdus, batch);
+        usbip_framer_consume(&session->framer, handled);
+        if (handled < (size_t)batch) return true;
+    }
+    size_t pending = usbip_framer_pending(&session->framer, &pdus);
+    if (pending) {
+        usbip_framer_consume(&session->framer, usbip_session_stream(session, pdus, pending));
+    }
+    return true;
+}
+
+void usbip_connection(int sock)
+{
+    int len;
+    bool throttled = false;
+    usbip_session_t* session = (usbip_session_t*)calloc(1, sizeof(usbip_session_t));
+    if (session == NULL || usbip_framer_init(&session->framer, CONFIG_USBIP_RX_BUFFER_SIZE) != ESP_OK) {
+        ESP_LOGE(TAG, "Unable to allocate receive buffer");
+        free(session);
+        close_socket(sock);
+        return;
+    }
+    if (usbip_txq_init(&session->txq, CONFIG_USBIP_TX_QUEUE_DEPTH) != ESP_OK) {
+        ESP_LOGE(TAG, "Unable to allocate TX queue");
+        usbip_framer_deinit(&session->framer);
+        free(session);
+        close_socket(sock);
+        return;
+    }
+    session->sock = sock;
+    session->task = xTaskGetCurrentTaskHandle();
+    if (usbip_session_attach(session) != ESP_OK) {
+        ESP_LOGE(TAG, "Unable to attach session");
+        usbip_txq_deinit(&session->txq);
+        usbip_framer_deinit(&session->framer);
+        free(session);
+        close_socket(sock);
+        return;
+    }
+
+    // wait for commands, queued replies and socket send space together, no polling
+    do {
+        int queued = usbip_txq_depth(&session->txq);
+        int pending = usbip_txq_flush(&session->txq, sock);
+        if (pending < 0) {
+            break;
+        }
+        if (pending < queued) {
+            usbip_session_sent(session);
+        }
+        if (usbip_session_throttled(session)) {
+            if (!throttled) session->txq.stats.throttled++;
+            throttled = true;
+        } else {
+            throttled = false;
+        }
+
+        fd_set rfds, wfds;
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        FD_SET(session->txq.event_fd, &rfds);
+        if (!throttled) FD_SET(sock, &rfds);
+        if (pending) FD_SET(sock, &wfds);
+
+        int ret = select(MAX(sock, session->txq.event_fd) + 1, &rfds, &wfds, NULL, NULL);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            ESP_LOGE(TAG, "Error occurred during select: errno %d", errno);
+            break;
+        }
+        if (FD_ISSET(session->txq.event_fd, &rfds)) {
+            usbip_txq_ack(&session->txq);
+            if (__atomic_load_n(&session->failed, __ATOMIC_ACQUIRE)) {
+                ESP_LOGW(TAG, "Imported device gone");
+                break;
+            }
+            // the URB task gave some of the in-flight budgets back, try the CMD_SUBMIT that waits for them again
+            if (session->waiting) {
+                if (!parse_buffered(session)) {
+                    break;
+                }
+                continue;
+            }
+        }
+        if (!FD_ISSET(sock, &rfds)) {
+            continue;
+        }
+
+        size_t space;
+        uint8_t* rx_buffer = usbip_framer_write_ptr(&session->framer, &space);
+        if (rx_buffer == NULL) {
+            ESP_LOGE(TAG, "Receive buffer full");
+            break;
+        }
+        if (session->sink_left) {
+            // large OUT payload goes straight into its transfer, or is thrown away through the receive buffer
+            if (session->sink) {
+                rx_buffer = session->sink;
+                space = session->sink_left;
+            } else {
+                space = MIN(space, session->sink_left);
+            }
+        }
+        len = recv(sock, rx_buffer, space, MSG_DONTWAIT);
+        USBIP_TRACE_TIME(session->rx_time);
+        if (len < 0 && errno == EWOULDBLOCK) {
+            continue;
+        } else if (len < 0) {
+            ESP_LOGE(TAG, "Error occurred during receiving: errno %d", errno);
+            break;
+        } else if (len == 0) {
+            ESP_LOGW(TAG, "Connection closed");
+            break;
+        } else if (session->sink_left) {
+            session->sink_left -= len;
+            if (session->sink) session->sink += len;
+            if (session->sink_left == 0) usbip_session_stream_done(session);
+        } else {
+            usbip_framer_commit(&session->framer, len);
+            if (!parse_buffered(session)) {
+                break;
+            }
+        }
+    } while (1);
+
+    usbip_session_detach(session);
+    usbip_txq_stats_t* stats = &session->txq.stats;
+    ESP_LOGI(TAG, "TX sent: %" PRIu32 ", writes: %" PRIu32 ", coalesced: %" PRIu32 ", partial: %" PRIu32 ", stalls: %" PRIu32 ", peak depth: %" PRIu32 ", full: %" PRIu32 ", dropped: %" PRIu32 ", throttled: %" PRIu32,
+             stats->sent, stats->writes, stats->coalesced, stats->partial_writes, stats->stalls, stats->peak_depth, stats->full_waits, stats->dropped, stats->throttled);
+    usbip_qos_log(TAG, "TX", stats->lanes);
+    usbip_txq_deinit(&session->txq);
+    usbip_framer_deinit(&session->framer);
+    free(session);
+    close_socket(sock);
+}
@@ -0,0 +1,174 @@
+#include <string.h>
+#include "esp_log.h"
+
+#include "usbip_desc_cache.hpp"
+
+#define TAG "usbip_desc"
+
+#define USB_FEATURE_DEVICE_REMOTE_WAKEUP    1
+#define USB_CONFIG_ATTR_SELF_POWERED        0x40
+
+bool DescriptorCache::build(USBhostDevice* dev)
+{
+    const usb_device_desc_t* dev_desc = dev->deviceDescriptor();
+    config = dev->configDescriptor();
+    if (dev_desc == NULL || config == NULL) return false;
+    memcpy(&device, dev_desc, sizeof(usb_device_desc_t));
+    speed = dev->speed();
+    configuration = config->bConfigurationValue;
+
+    // one pass over the configuration: every endpoint belongs to the interface descriptor before it
+    const uint8_t* p = (const uint8_t*)config;
+    int offset = 0;
+    while (offset + 2 <= config->wTotalLength && p[offset] >= 2)
+    {
+        const usb_standard_desc_t* desc = (const usb_standard_desc_t*)(p + offset);
+        if (desc->bDescriptorType == USB_B_DESCRIPTOR_TYPE_INTERFACE && num_interfaces < USBIP_CACHE_MAX_INTERFACES)
+        {
+            intf_t* intf = &interfaces[num_interfaces++];
+            intf->desc = (const usb_intf_desc_t*)desc;
+            intf->first_ep = num_endpoints;
+            intf->num_eps = 0;
+        }
+        else if (desc->bDescriptorType == USB_B_DESCRIPTOR_TYPE_ENDPOINT && num_interfaces && num_endpoints < USBIP_CACHE_MAX_ENDPOINTS)
+        {
+            endpoints[num_endpoints].desc = (const usb_ep_desc_t*)desc;
+            endpoints[num_endpoints].intf = num_interfaces - 1;
+            num_endpoints++;
+            interfaces[num_interfaces - 1].num_eps++;
+        }
+        offset += desc->bLength;
+    }
+
+    const uint8_t indices[] = {device.iManufacturer, device.iProduct, device.iSerialNumber};
+    for (uint8_t index : indices)
+    {
+        const usb_str_desc_t* str = index ? dev->stringDescriptor(index) : NULL;
+        if (str) add_string(index, 0x0409, (const uint8_t*)str);
+    }
+    ESP_LOGI(TAG, "%d interfaces, %d endpoints, %d strings cached", num_interfaces, num_endpoints, num_strings);
+    return true;
+}
+
+const DescriptorCache::intf_t* DescriptorCache::interface(uint8_t number, uint8_t alt) const
+{
+    for (int n = 0; n < num_interfaces; n++)
+    {
+        if (interfaces[n].desc->bInterfaceNumber == number && interfaces[n].desc->bAlternateSetting == alt) return &interfaces[n];
+    }
+    return nullptr;
+}
+
+const uint8_t* DescriptorCache::string(uint8_t index, uint16_t langid) const
+{
+    for (int n = 0; n < num_strings; n++)
+    {
+        if (strings[n].index == index && strings[n].langid == langid) return string_space + strings[n].offset;
+    }
+    return nullptr;
+}
+
+void DescriptorCache::add_string(uint8_t index, uint16_t langid, const uint8_t* desc)
+{
+    uint8_t len = desc[0];
+    if (len < 2 || desc[1] != USB_B_DESCRIPTOR_TYPE_STRING || string(index, langid)) return;
+    if (num_strings == USBIP_CACHE_MAX_STRINGS || string_used + len > USBIP_CACHE_STRING_SPACE) return;
+    memcpy(string_space + string_used, desc, len);
+    strings[num_strings++] = {index, langid, string_used};
+    string_used += len;
+}
+
+static int reply(uint8_t* data, uint16_t wLength, const void* src, size_t len)
+{
+    if (len > wLength) len = wLength;
+    memcpy(data, src, len);
+    return len;
+}
+
+int DescriptorCache::answer(const usb_setup_packet_t* setup, uint8_t* data)
+{
+    if ((setup->bmRequestType & (USB_BM_REQUEST_TYPE_DIR_IN | USB_BM_REQUEST_TYPE_TYPE_MASK)) != USB_BM_REQUEST_TYPE_DIR_IN) return -1;
+    uint8_t recipient = setup->bmRequestType & USB_BM_REQUEST_TYPE_RECIP_MASK;
+    int len = -1;
+
+    if (recipient == USB_BM_REQUEST_TYPE_RECIP_DEVICE)
+    {
+        switch (setup->bRequest)
+        {
+        case USB_B_REQUEST_GET_DESCRIPTOR:{
+            uint8_t type = setup->wValue >> 8;
+            uint8_t index = setup->wValue & 0xff;
+            if (type == USB_B_DESCRIPTOR_TYPE_DEVICE && index == 0)
+            {
+                len = reply(data, setup->wLength, &device, sizeof(device));
+            }
+            else if (type == USB_B_DESCRIPTOR_TYPE_CONFIGURATION && index == 0)
+            {
+                // the host library runs the first configuration
+                len = reply(data, setup->wLength, config, config->wTotalLength);
+            }
+            else if (type == USB_B_DESCRIPTOR_TYPE_STRING)
+            {
+                const uint8_t* str = string(index, index ? setup->wIndex : 0);
+                if (str) len = reply(data, setup->wLength, str, str[0]);
+            }
+            break;
+        }
+        case USB_B_REQUEST_GET_STATUS:{
+            uint8_t status[2] = {0, 0};
+            if (config->bmAttributes & USB_CONFIG_ATTR_SELF_POWERED) status[0] |= 1;
+            if (remote_wakeup) status[0] |= 2;
+            len = reply(data, setup->wLength, status, sizeof(status));
+            break;
+        }
+        case USB_B_REQUEST_GET_CONFIGURATION:
+            len = reply(data, setup->wLength, &configuration, 1);
+            break;
+        default:
+            break;
+        }
+    }
+    else if (recipient == USB_BM_REQUEST_TYPE_RECIP_INTERFACE && setup->bRequest == USB_B_REQUEST_GET_STATUS)
+    {
+        // all interface status bits are reserved
+        static const uint8_t status[2] = {0, 0};
+        len = reply(data, setup->wLength, status, sizeof(status));
+    }
+
+    if (len < 0) {
+        if (recipient == USB_BM_REQUEST_TYPE_RECIP_DEVICE) misses++;
+    } else {
+        hits++;
+    }
+    return len;
+}
+
+void DescriptorCache::submitted(const usb_setup_packet_t* setup)
+{
+    if (setup->bmRequestType != (USB_BM_REQUEST_TYPE_DIR_OUT | USB_BM_REQUEST_TYPE_TYPE_STANDARD | USB_BM_REQUEST_TYPE_RECIP_DEVICE)) return;
+    switch (setup->bRequest)
+    {
+    case USB_B_REQUEST_SET_CONFIGURATION:
+        configuration = setup->wValue & 0xff;
+        break;
+    case USB_B_REQUEST_SET_FEATURE:
+    case USB_B_REQUEST_CLEAR_FEATURE:
+        if (setup->wValue == USB_FEATURE_DEVICE_REMOTE_WAKEUP) remote_wakeup = setup->bRequest == USB_B_REQUEST_SET_FEATURE;
+        break;
+    default:
+        break;
+    }
+}
+
+void DescriptorCache::completed(const usb_setup_packet_t* setup, const uint8_t* data, int len)
+{
+    if (setup->bmRequestType != (USB_BM_REQUEST_TYPE_DIR_IN | USB_BM_REQUEST_TYPE_TYPE_STANDARD | USB_BM_REQUEST_TYPE_RECIP_DEVICE) ||
+        setup->bRequest != USB_B_REQUEST_GET_DESCRIPTOR || (setup->wValue >> 8) != USB_B_DESCRIPTOR_TYPE_STRING)
+    {
+        return;
+    }
+    // only whole descriptors, a host that reads the length first asks again for the rest
+    if (len < 2 || data[0] > len) return;
+    uint8_t index = setup->wValue & 0xff;
+    add_string(index, index ? setup->wIndex : 0, data);
+}
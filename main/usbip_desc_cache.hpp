@@ -0,0 +1,86 @@
+#pragma once
+#include <stdint.h>
+#include "usb/usb_host.h"
+#include "usb_device.hpp"
+
+#define USBIP_CACHE_MAX_INTERFACES  16      /*!< interface descriptors, alternate settings included */
+#define USBIP_CACHE_MAX_ENDPOINTS   32
+#define USBIP_CACHE_MAX_STRINGS     8
+#define USBIP_CACHE_STRING_SPACE    512     /*!< bytes for all cached string descriptors */
+
+/**
+ * @brief Descriptors of one device, parsed once when it is attached, and the standard requests that
+ * can be answered from them without a bus transfer.
+ *
+ * The device and configuration descriptors are copied or kept as the host library holds them for as
+ * long as the device is open. Strings start with the ones the host library read during enumeration and
+ * are completed from the replies of forwarded GET_DESCRIPTOR(STRING) requests. Built by the USB client
+ * task before the device is published, afterwards only used from the URB task.
+ */
+class DescriptorCache
+{
+public:
+    typedef struct{
+        const usb_intf_desc_t* desc;
+        uint8_t first_ep;           /*!< index into endpoints */
+        uint8_t num_eps;
+    }intf_t;
+
+    typedef struct{
+        const usb_ep_desc_t* desc;
+        uint8_t intf;               /*!< index into interfaces */
+    }ep_t;
+
+    usb_device_desc_t device;
+    const usb_config_desc_t* config = nullptr;
+    usb_speed_t speed = USB_SPEED_FULL;
+    intf_t interfaces[USBIP_CACHE_MAX_INTERFACES];
+    uint8_t num_interfaces = 0;
+    ep_t endpoints[USBIP_CACHE_MAX_ENDPOINTS];
+    uint8_t num_endpoints = 0;
+
+    uint32_t hits = 0;              /*!< control requests answered locally */
+    uint32_t misses = 0;            /*!< standard device requests that had to go to the device */
+
+    /**
+     * @brief Parses the descriptors of an opened device, false when the configuration descriptor is missing
+     */
+    bool build(USBhostDevice* dev);
+    /**
+     * @brief Interface descriptor by number and alternate setting, NULL if there is none
+     */
+    const intf_t* interface(uint8_t number, uint8_t alt) const;
+
+    /**
+     * @brief Answers a standard IN request from the cache: GET_DESCRIPTOR (device, configuration,
+     * string), GET_STATUS of device or interface and GET_CONFIGURATION. Returns the bytes written to
+     * data, at most wLength, or -1 when the request has to go to the device.
+     */
+    int answer(const usb_setup_packet_t* setup, uint8_t* data);
+    /**
+     * @brief Keeps track of the device state answer() depends on, call with every control request
+     * submitted to the device
+     */
+    void submitted(const usb_setup_packet_t* setup);
+    /**
+     * @brief Learns a string descriptor from a completed GET_DESCRIPTOR(STRING) that went to the device
+     */
+    void completed(const usb_setup_packet_t* setup, const uint8_t* data, int len);
+
+private:
+    typedef struct{
+        uint8_t index;
+        uint16_t langid;            /*!< 0 for the LANGID table */
+        uint16_t offset;            /*!< into string_space */
+    }string_t;
+
+    string_t strings[USBIP_CACHE_MAX_STRINGS];
+    uint8_t num_strings = 0;
+    uint8_t string_space[USBIP_CACHE_STRING_SPACE];
+    uint16_t string_used = 0;
+    uint8_t configuration = 0;      /*!< as set by the last SET_CONFIGURATION */
+    bool remote_wakeup = false;
+
+    const uint8_t* string(uint8_t index, uint16_t langid) const;
+    void add_string(uint8_t index, uint16_t langid, const uint8_t* desc);
+};
@@ -0,0 +1,159 @@
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+
+#include "usbip_framer.h"
+
+#define TAG "usbip_framer"
+
+// OP_REQ_* start with the 16-bit version, CMD_* start with a 32-bit command
+#define USBIP_VERSION       0x0111
+#define OP_REQ_DEVLIST      0x8005
+#define OP_REQ_IMPORT       0x8003
+#define CMD_SUBMIT          0x00000001
+#define CMD_UNLINK          0x00000002
+#define IMPORT_BUSID_SIZE   32
+
+// usbip_submit_t field offsets on the wire
+#define OFFSET_DIRECTION    12
+#define OFFSET_LENGTH       24
+#define OFFSET_NUM_PACKETS  32
+
+static inline uint16_t get_be16(const uint8_t* p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t get_be32(const uint8_t* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+int usbip_pdu_length(const uint8_t* data, size_t len)
+{
+    if (len < 4) return 0;
+
+    if (get_be16(data) == USBIP_VERSION)
+    {
+        switch (get_be16(data + 2))
+        {
+        case OP_REQ_DEVLIST:
+            return USBIP_OP_HEADER_SIZE;
+        case OP_REQ_IMPORT:
+            return USBIP_OP_HEADER_SIZE + IMPORT_BUSID_SIZE;
+        default:
+            return -1;
+        }
+    }
+
+    switch (get_be32(data))
+    {
+    case CMD_SUBMIT:{
+        if (len < USBIP_HEADER_SIZE) return 0;
+        size_t pdu = USBIP_HEADER_SIZE;
+        if (get_be32(data + OFFSET_DIRECTION) == 0) // 0: USBIP_DIR_OUT
+        {
+            pdu += get_be32(data + OFFSET_LENGTH);
+        }
+        uint32_t num_packets = get_be32(data + OFFSET_NUM_PACKETS);
+        if (num_packets != 0 && num_packets != 0xffffffff)
+        {
+            pdu += (size_t)num_packets * USBIP_ISO_DESC_SIZE;
+        }
+        if (pdu > INT32_MAX) return -1;
+        return (int)pdu;
+    }
+    case CMD_UNLINK:
+        return USBIP_HEADER_SIZE;
+    default:
+        return -1;
+    }
+}
+
+esp_err_t usbip_framer_init(usbip_framer_t* framer, size_t size)
+{
+    framer->buf = (uint8_t*)malloc(size);
+    if (framer->buf == NULL) return ESP_ERR_NO_MEM;
+
+    framer->size = size;
+    framer->head = 0;
+    framer->tail = 0;
+    return ESP_OK;
+}
+
+void usbip_framer_deinit(usbip_framer_t* framer)
+{
+    free(framer->buf);
+    framer->buf = NULL;
+    framer->size = 0;
+}
+
+uint8_t* usbip_framer_write_ptr(usbip_framer_t* framer, size_t* space)
+{
+    if (framer->head == framer->tail)
+    {
+        framer->head = 0;
+        framer->tail = 0;
+    }
+    else if (framer->head && framer->size - framer->tail < framer->size / 4)
+    {
+        // whole PDUs are always consumed, so only the partial one at the head is moved
+        size_t pending = framer->tail - framer->head;
+        memmove(framer->buf, framer->buf + framer->head, pending);
+        framer->head = 0;
+        framer->tail = pending;
+    }
+
+    *space = framer->size - framer->tail;
+    if (*space == 0) return NULL;
+
+    return framer->buf + framer->tail;
+}
+
+void usbip_framer_commit(usbip_framer_t* framer, size_t len)
+{
+    framer->tail += len;
+}
+
+void usbip_framer_cut(usbip_framer_t* framer, uint8_t* data, size_t len)
+{
+    uint8_t* end = framer->buf + framer->tail;
+    memmove(data, data + len, end - (data + len));
+    framer->tail -= len;
+}
+
+int usbip_framer_peek(usbip_framer_t* framer, uint8_t** pdus)
+{
+    uint8_t* start = framer->buf + framer->head;
+    size_t avail = framer->tail - framer->head;
+    size_t total = 0;
+
+    *pdus = start;
+    while (total < avail)
+    {
+        int pdu = usbip_pdu_length(start + total, avail - total);
+        if (pdu < 0)
+        {
+            ESP_LOGE(TAG, "malformed PDU at offset %u", (unsigned)(framer->head + total));
+            return -1;
+        }
+        if (pdu == 0 || (size_t)pdu > avail - total)
+        {
+            break;
+        }
+        total += pdu;
+    }
+
+    return (int)total;
+}
+
+void usbip_framer_consume(usbip_framer_t* framer, size_t len)
+{
+    framer->head += len;
+}
+
+size_t usbip_framer_pending(usbip_framer_t* framer, uint8_t** data)
+{
+    *data = framer->buf + framer->head;
+    return framer->tail - framer->head;
+}
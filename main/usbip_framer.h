@@ -0,0 +1,73 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define USBIP_HEADER_SIZE           0x30    /*!< usbip_header_basic_t + command specific part */
+#define USBIP_OP_HEADER_SIZE        8       /*!< version + command + status */
+#define USBIP_ISO_DESC_SIZE         16      /*!< usbip_iso_packet_descriptor */
+
+/**
+ * @brief Per connection receive buffer that cuts the TCP byte stream into whole USB/IP PDUs.
+ *
+ * recv() writes straight into the free tail of the buffer, complete PDUs are handed out as
+ * pointers into the storage (no copy), and only a trailing partial PDU is ever moved back
+ * to the front when the tail runs out of space.
+ */
+typedef struct{
+    uint8_t* buf;
+    size_t size;
+    size_t head;    /*!< first byte not consumed by the dispatcher */
+    size_t tail;    /*!< end of received data */
+}usbip_framer_t;
+
+esp_err_t usbip_framer_init(usbip_framer_t* framer, size_t size);
+void usbip_framer_deinit(usbip_framer_t* framer);
+
+/**
+ * @brief Contiguous free space to recv() into; returns NULL when a single PDU does not fit the buffer.
+ */
+uint8_t* usbip_framer_write_ptr(usbip_framer_t* framer, size_t* space);
+void usbip_framer_commit(usbip_framer_t* framer, size_t len);
+
+/**
+ * @brief Returns length of the run of complete PDUs at the head of the buffer, 0 when none
+ * is complete yet and -1 on a malformed PDU. *pdus points into the framer storage and stays
+ * valid until usbip_framer_consume(). A PDU larger than the buffer shows up as a full buffer
+ * in usbip_framer_write_ptr(), unless it is taken over with usbip_framer_pending().
+ */
+int usbip_framer_peek(usbip_framer_t* framer, uint8_t** pdus);
+void usbip_framer_consume(usbip_framer_t* framer, size_t len);
+
+/**
+ * @brief Bytes received but not consumed yet, i.e. the incomplete PDU left after the last peek
+ */
+size_t usbip_framer_pending(usbip_framer_t* framer, uint8_t** data);
+
+/**
+ * @brief Removes a PDU handled out of order, len bytes at data, the bytes behind it move down
+ */
+void usbip_framer_cut(usbip_framer_t* framer, uint8_t* data, size_t len);
+
+/**
+ * @brief True when nothing more can be received before something is consumed
+ */
+static inline bool usbip_framer_full(const usbip_framer_t* framer)
+{
+    return framer->tail - framer->head >= framer->size;
+}
+
+/**
+ * @brief Size of the PDU starting at data, read from usbip_header_basic_t and usbip_submit_t.length/direction.
+ * Returns 0 when more bytes are needed to tell and -1 for an unknown command.
+ */
+int usbip_pdu_length(const uint8_t* data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
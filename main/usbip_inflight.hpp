@@ -0,0 +1,89 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * @brief seqnum -> URB slot of every URB that has not been answered yet.
+ *
+ * Open addressing with linear probing over at least twice as many buckets as slots. Seqnums are
+ * handed out in order, so the low bits alone spread them evenly. erase() moves the entries behind
+ * the hole back instead of leaving tombstones, so lookups never degrade. Not thread safe, it is
+ * only used from the URB task.
+ */
+template <typename T, uint16_t N>
+class InflightIndex
+{
+    static constexpr uint32_t buckets(uint32_t n) { return n <= 1 ? 1 : 2 * buckets((n + 1) / 2); }
+    static constexpr uint32_t SIZE = buckets(2 * N);
+    static constexpr uint32_t MASK = SIZE - 1;
+
+    struct entry_t{
+        uint32_t seqnum;
+        T* slot;        /*!< NULL for a free bucket */
+    };
+    entry_t table[SIZE];
+    uint16_t count = 0;
+
+public:
+    InflightIndex() { clear(); }
+
+    void clear()
+    {
+        memset(table, 0, sizeof(table));
+        count = 0;
+    }
+
+    bool insert(uint32_t seqnum, T* slot)
+    {
+        if (count >= N) return false;
+        uint32_t n = seqnum & MASK;
+        while (table[n].slot)
+        {
+            if (table[n].seqnum == seqnum)
+            {
+                table[n].slot = slot;
+                return true;
+            }
+            n = (n + 1) & MASK;
+        }
+        table[n].seqnum = seqnum;
+        table[n].slot = slot;
+        count++;
+        return true;
+    }
+
+    T* find(uint32_t seqnum) const
+    {
+        for (uint32_t n = seqnum & MASK; table[n].slot; n = (n + 1) & MASK)
+        {
+            if (table[n].seqnum == seqnum) return table[n].slot;
+        }
+        return nullptr;
+    }
+
+    /**
+     * @brief Removes seqnum if it maps to slot, a reused slot may already be indexed under a newer seqnum
+     */
+    void erase(uint32_t seqnum, const T* slot)
+    {
+        uint32_t n = seqnum & MASK;
+        while (table[n].slot && table[n].seqnum != seqnum) n = (n + 1) & MASK;
+        if (table[n].slot == nullptr || table[n].slot != slot) return;
+
+        // backward shift: pull later entries of the same probe run into the hole
+        uint32_t hole = n;
+        for (n = (n + 1) & MASK; table[n].slot; n = (n + 1) & MASK)
+        {
+            uint32_t home = table[n].seqnum & MASK;
+            if (((n - home) & MASK) >= ((n - hole) & MASK))
+            {
+                table[hole] = table[n];
+                hole = n;
+            }
+        }
+        table[hole].slot = nullptr;
+        count--;
+    }
+
+    uint16_t size() const { return count; }
+};
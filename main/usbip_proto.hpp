@@ -0,0 +1,273 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <type_traits>
+
+/**
+ * @brief Unsigned integer stored big endian, the byte order of every USB/IP field. Reads and writes
+ * convert, so a PDU struct made of these is used with host values and never swapped by hand.
+ * Alignment is 1: the structs below can be laid over any position of a receive buffer.
+ */
+template<typename T>
+class be_t
+{
+    static_assert(std::is_unsigned<T>::value && (sizeof(T) == 2 || sizeof(T) == 4),
+                  "be_t holds 16 and 32 bit unsigned integers, signed values are stored two's complement");
+
+public:
+    be_t() = default;
+    constexpr be_t(T value) : bytes{}
+    {
+        if constexpr (sizeof(T) == 4)
+        {
+            bytes[0] = (uint8_t)(value >> 24);
+            bytes[1] = (uint8_t)(value >> 16);
+            bytes[2] = (uint8_t)(value >> 8);
+            bytes[3] = (uint8_t)value;
+        } else {
+            bytes[0] = (uint8_t)(value >> 8);
+            bytes[1] = (uint8_t)value;
+        }
+    }
+    constexpr operator T() const { return get(); }
+    /**
+     * @brief Spelled out byte by byte, gcc merges it into one load and byte swap where the target has them
+     */
+    constexpr T get() const
+    {
+        if constexpr (sizeof(T) == 4)
+        {
+            return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+        } else {
+            return (uint16_t)((bytes[0] << 8) | bytes[1]);
+        }
+    }
+
+private:
+    uint8_t bytes[sizeof(T)];
+};
+
+typedef be_t<uint16_t> be16;
+typedef be_t<uint32_t> be32;
+
+static_assert(sizeof(be16) == 2 && alignof(be16) == 1, "be16 layout");
+static_assert(sizeof(be32) == 4 && alignof(be32) == 1, "be32 layout");
+static_assert(std::is_trivially_copyable<be32>::value && std::is_trivially_default_constructible<be32>::value, "be32 is plain data");
+static_assert(be32(0x01020304).get() == 0x01020304 && be16(0x8005).get() == 0x8005, "be_t round trip");
+
+#define USBIP_VERSION       0x0111  /*!< v1.11 */
+
+// OP_* requests and replies, the 16-bit code after the version
+#define OP_REQ_DEVLIST      0x8005
+#define OP_REP_DEVLIST      0x0005
+#define OP_REQ_IMPORT       0x8003
+#define OP_REP_IMPORT       0x0003
+
+// usbip_header_basic_t commands
+#define USBIP_CMD_SUBMIT    0x00000001
+#define USBIP_CMD_UNLINK    0x00000002
+#define USBIP_RET_SUBMIT    0x00000003
+#define USBIP_RET_UNLINK    0x00000004
+
+#define USBIP_DIR_OUT       0
+#define USBIP_DIR_IN        1
+
+// OP_REP_IMPORT status, usbip_device_status
+#define ST_OK               0x00
+#define ST_DEV_BUSY         0x02
+#define ST_NODEV            0x04
+
+// usb_device_speed of the Linux kernel
+#define USBIP_SPEED_LOW     1
+#define USBIP_SPEED_FULL    2
+
+#define USBIP_BUSID_SIZE    32
+
+typedef struct{
+    be16 version;
+    be16 command;
+    be32 status;
+}usbip_request_t;
+
+static_assert(sizeof(usbip_request_t) == 8, "OP header size");
+
+typedef struct{
+    uint8_t bInterfaceClass;
+    uint8_t bInterfaceSubClass;
+    uint8_t bInterfaceProtocol;
+    uint8_t padding;
+}usbip_interface_t;
+
+typedef struct{
+    usbip_request_t request;
+    be32 count;
+    char path[256];
+    char busid[USBIP_BUSID_SIZE];
+    be32 busnum;
+    be32 devnum;
+    be32 speed;
+    be16 idVendor;
+    be16 idProduct;
+    be16 bcdDevice;
+    uint8_t bDeviceClass;
+    uint8_t bDeviceSubClass;
+    uint8_t bDeviceProtocol;
+    uint8_t bConfigurationValue;
+    uint8_t bNumConfigurations;
+    uint8_t bNumInterfaces;
+    usbip_interface_t intfs[10];
+}usbip_devlist_t;
+
+// OP_REP_DEVLIST: header and count, then per device path to bNumInterfaces followed by its interfaces
+static_assert(offsetof(usbip_devlist_t, path) == 0x0c, "OP_REP_DEVLIST header size");
+static_assert(offsetof(usbip_devlist_t, intfs) - offsetof(usbip_devlist_t, path) == 0x138, "OP_REP_DEVLIST device size");
+
+typedef struct{
+    usbip_request_t request;
+    char path[256];
+    char busid[USBIP_BUSID_SIZE];
+    be32 busnum;
+    be32 devnum;
+    be32 speed;
+    be16 idVendor;
+    be16 idProduct;
+    be16 bcdDevice;
+    uint8_t bDeviceClass;
+    uint8_t bDeviceSubClass;
+    uint8_t bDeviceProtocol;
+    uint8_t bConfigurationValue;
+    uint8_t bNumConfigurations;
+    uint8_t bNumInterfaces;
+}usbip_import_t;
+
+static_assert(sizeof(usbip_import_t) == 8 + 0x138, "OP_REP_IMPORT size");
+
+typedef struct{
+    be32 command;   /*!< command */
+    be32 seqnum;    /*!< seqnum: sequential number that identifies requests and corresponding responses; incremented per connection */
+    be32 devid;     /*!< devid: specifies a remote USB device uniquely instead of busnum and devnum; for client (request), this value is ((busnum << 16) | devnum); for server (response), this shall be set to 0 */
+    be32 direction; /*!< direction: only used by client, for server this shall be 0 */
+    be32 ep;        /*!< ep: endpoint number only used by client, for server this shall be 0; for UNLINK, this shall be 0 */
+}usbip_header_basic_t;
+
+static_assert(sizeof(usbip_header_basic_t) == 20, "usbip_header_basic size");
+
+typedef struct{
+    usbip_header_basic_t header;
+    union{
+        be32 flags;                 /*!< cmd => transfer_flags: possible values depend on the URB transfer_flags (refer to URB doc in USB Request Block (URB)) but with URB_NO_TRANSFER_DMA_MAP masked. */
+        be32 status;                /*!< resp => status: zero for successful URB transaction, otherwise some kind of error happened. */
+    };
+    be32 length;                    /*!< transfer_buffer_length: use URB transfer_buffer_length */
+    be32 start_frame;               /*!< start_frame: use URB start_frame; initial frame for ISO transfer; shall be set to 0 if not ISO transfer */
+    be32 num_packets;               /*!< number_of_packets: number of ISO packets; shall be set to 0xffffffff if not ISO transfer */
+    union{
+        be32 interval;              /*!< cmd => interval: maximum time for the request on the server-side host controller */
+        be32 error_count;           /*!< resp => error_count */
+    };
+    union{
+        uint8_t setup[8];           /*!< cmd => setup: data bytes for USB setup, filled with zeros if not used. */
+        uint8_t padding[8];         /*!< resp => padding, shall be set to 0 */
+    };
+    /**
+     * @brief header only, on the wire it is followed by
+     * transfer_buffer. If direction is USBIP_DIR_OUT then n equals transfer_buffer_length; otherwise n equals 0. For ISO transfers the padding between each ISO packets is not transmitted.
+     * transfer_buffer. If direction is USBIP_DIR_IN then n equals actual_length; otherwise n equals 0. For ISO transfers the padding between each ISO packets is not transmitted.
+     */
+}usbip_submit_t;
+
+static_assert(sizeof(usbip_submit_t) == 48 && alignof(usbip_submit_t) == 1, "USB/IP header size");
+static_assert(offsetof(usbip_submit_t, length) == 24 && offsetof(usbip_submit_t, num_packets) == 32 &&
+              offsetof(usbip_submit_t, setup) == 40, "CMD_SUBMIT layout");
+
+typedef struct{
+    usbip_header_basic_t header;
+    union{
+        be32 unlink_seqnum;         /*!< cmd => seqnum of the CMD_SUBMIT to unlink */
+        be32 status;                /*!< resp => 0 or -ECONNRESET */
+    };
+    uint8_t padding[24];
+}usbip_unlink_t;
+
+static_assert(sizeof(usbip_unlink_t) == 48, "CMD_UNLINK size");
+
+/**
+ * @brief usbip_iso_packet_descriptor, num_packets of them follow the OUT data of CMD_SUBMIT and the IN data of RET_SUBMIT
+ */
+typedef struct{
+    be32 offset;                /*!< of the packet in the host URB buffer */
+    be32 length;
+    be32 actual_length;
+    be32 status;
+}usbip_iso_desc_t;
+
+static_assert(sizeof(usbip_iso_desc_t) == 16, "ISO packet descriptor size");
+
+/**
+ * @brief Non-owning view of a CMD_SUBMIT or CMD_UNLINK in the receive buffer. The header fields are
+ * decoded once when it is made, the PDU itself is not copied and has to outlive the view.
+ */
+class CmdView
+{
+public:
+    explicit CmdView(const uint8_t* pdu)
+        : hdr((const usbip_submit_t*)pdu),
+          command(hdr->header.command), seqnum(hdr->header.seqnum), devid(hdr->header.devid),
+          in(hdr->header.direction == USBIP_DIR_IN), ep(hdr->header.ep),
+          length(hdr->length), num_packets(hdr->num_packets) {}
+
+    const usbip_submit_t* header() const { return hdr; }
+    const usbip_unlink_t* unlink() const { return (const usbip_unlink_t*)hdr; }
+    const uint8_t* setup() const { return hdr->setup; }
+    /**
+     * @brief OUT data behind the header, the ISO descriptors follow it
+     */
+    const uint8_t* payload() const { return (const uint8_t*)(hdr + 1); }
+    bool iso() const { return num_packets != 0 && num_packets != 0xffffffff; }
+    /**
+     * @brief bEndpointAddress of the transfer
+     */
+    uint8_t address() const { return (ep & 0x0f) | (in ? 0x80 : 0); }
+
+private:
+    const usbip_submit_t* hdr;
+
+public:
+    const uint32_t command;
+    const uint32_t seqnum;
+    const uint32_t devid;
+    const bool in;
+    const uint32_t ep;
+    const uint32_t length;
+    const uint32_t num_packets;
+};
+
+/**
+ * @brief Code of an OP_* request or the command of a CMD_* or RET_* PDU, whichever the bytes at pdu are.
+ * OP_* codes are returned with the version in the upper half, so both kinds fit one switch.
+ */
+static inline uint32_t usbip_pdu_code(const uint8_t* pdu)
+{
+    const usbip_request_t* op = (const usbip_request_t*)pdu;
+    if (op->version == USBIP_VERSION) return ((uint32_t)USBIP_VERSION << 16) | op->command;
+    return ((const usbip_header_basic_t*)pdu)->command;
+}
+
+#define USBIP_OP(code)      (((uint32_t)USBIP_VERSION << 16) | (code))
+
+/**
+ * @brief Rewrites a CMD_SUBMIT header into its RET_SUBMIT, seqnum is kept. start_frame and
+ * num_packets are left to the caller, they are echoed for ISO transfers.
+ */
+static inline void usbip_ret_submit(usbip_submit_t* hdr, int32_t status, uint32_t actual_length, uint32_t error_count)
+{
+    hdr->header.command = USBIP_RET_SUBMIT;
+    hdr->header.devid = 0;
+    hdr->header.direction = 0;
+    hdr->header.ep = 0;
+    hdr->status = (uint32_t)status;
+    hdr->length = actual_length;
+    hdr->error_count = error_count;
+    memset(hdr->padding, 0, sizeof(hdr->padding));
+}
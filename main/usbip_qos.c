@@ -0,0 +1,18 @@
+#include <inttypes.h>
+#include "esp_log.h"
+
+#include "usbip_qos.h"
+
+static const char* lane_names[USBIP_LANES] = {"ctrl", "intr", "iso", "bulk"};
+
+void usbip_qos_log(const char* tag, const char* what, const usbip_lane_stats_t lanes[USBIP_LANES])
+{
+    for (int lane = 0; lane < USBIP_LANES; lane++)
+    {
+        const usbip_lane_stats_t* stats = &lanes[lane];
+        if (stats->count == 0) continue;
+        ESP_LOGI(tag, "%s %s: %" PRIu32 ", mean: %" PRIu32 " us, p99: <%" PRIu32 " us, max: %" PRIu32 " us, promoted: %" PRIu32,
+                 what, lane_names[lane], stats->count, (uint32_t)(stats->total_us / stats->count),
+                 usbip_qos_quantile(stats, 0.99f), stats->max_us, stats->promoted);
+    }
+}
@@ -0,0 +1,103 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Traffic classes, in the order they are served. A URB takes the lane of its endpoint type,
+ * its RET_SUBMIT goes out on the same lane; unlinks and every other reply use the control lane.
+ */
+typedef enum{
+    USBIP_LANE_CTRL = 0,        /*!< EP0, CMD_UNLINK/RET_UNLINK, OP_* replies and errors */
+    USBIP_LANE_INTR,
+    USBIP_LANE_ISO,
+    USBIP_LANE_BULK,
+    USBIP_LANES
+}usbip_lane_t;
+
+#define USBIP_QOS_BUCKETS   16  /*!< log2 us, the last one holds everything from 16 ms */
+
+typedef struct{
+    uint32_t count;
+    uint32_t promoted;          /*!< served ahead of a higher lane by the starvation guard */
+    uint64_t total_us;
+    uint32_t max_us;
+    uint32_t buckets[USBIP_QOS_BUCKETS];
+}usbip_lane_stats_t;
+
+/**
+ * @brief Strict priority between the lanes with a starvation guard: a lane that had work queued
+ * while CONFIG_USBIP_QOS_STARVATION_LIMIT items of higher lanes went first is served once.
+ * Only touched by the task that dequeues.
+ */
+typedef struct{
+    uint16_t skipped[USBIP_LANES];
+}usbip_qos_t;
+
+/**
+ * @brief Lane to serve next, ready has bit n set for every lane n with work queued (not 0)
+ */
+static inline usbip_lane_t usbip_qos_pick(const usbip_qos_t* qos, uint32_t ready)
+{
+    for (int lane = USBIP_LANES - 1; lane > 0; lane--)
+    {
+        if ((ready >> lane & 1) && qos->skipped[lane] >= CONFIG_USBIP_QOS_STARVATION_LIMIT) return (usbip_lane_t)lane;
+    }
+    return (usbip_lane_t)__builtin_ctz(ready);
+}
+
+/**
+ * @brief One item of lane was served while the lanes in ready had work queued.
+ * Returns true when the guard let it go ahead of a higher lane.
+ */
+static inline bool usbip_qos_served(usbip_qos_t* qos, usbip_lane_t lane, uint32_t ready)
+{
+    for (int n = lane + 1; n < USBIP_LANES; n++)
+    {
+        if (ready >> n & 1) qos->skipped[n]++;
+    }
+    qos->skipped[lane] = 0;
+    return (ready & ((1u << lane) - 1)) != 0;
+}
+
+/**
+ * @brief Time an item of the lane spent queued, from queued to dequeued (submit) or sent (reply)
+ */
+static inline void usbip_lane_wait(usbip_lane_stats_t* stats, uint32_t wait_us)
+{
+    int bucket = wait_us ? 32 - __builtin_clz(wait_us) : 0;
+    if (bucket >= USBIP_QOS_BUCKETS) bucket = USBIP_QOS_BUCKETS - 1;
+    stats->buckets[bucket]++;
+    stats->count++;
+    stats->total_us += wait_us;
+    if (wait_us > stats->max_us) stats->max_us = wait_us;
+}
+
+/**
+ * @brief Upper bound in us of the bucket holding the q quantile of the lane, 0 when it saw nothing
+ */
+static inline uint32_t usbip_qos_quantile(const usbip_lane_stats_t* stats, float q)
+{
+    uint32_t rank = (uint32_t)(q * stats->count);
+    uint32_t seen = 0;
+    if (stats->count == 0) return 0;
+    for (int n = 0; n < USBIP_QOS_BUCKETS; n++)
+    {
+        seen += stats->buckets[n];
+        if (seen > rank) return 1u << n;
+    }
+    return 1u << (USBIP_QOS_BUCKETS - 1);
+}
+
+/**
+ * @brief Logs count, mean, p99, max and promotions of every lane that saw traffic, prefixed with what
+ */
+void usbip_qos_log(const char* tag, const char* what, const usbip_lane_stats_t stats[USBIP_LANES]);
+
+#ifdef __cplusplus
+}
+#endif
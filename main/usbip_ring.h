@@ -0,0 +1,78 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Single producer, single consumer ring of pointers.
+ *
+ * Producer only writes tail, consumer only writes head, so push and pop need no lock and no
+ * critical section: the slot is filled before tail is published (release) and read before head
+ * is published. Both indexes run freely and wrap on 2^32, size has to be a power of 2.
+ */
+typedef struct{
+    void** slots;
+    uint32_t size;
+    uint32_t head;      /*!< next slot to pop, written by the consumer */
+    uint32_t tail;      /*!< next slot to push, written by the producer */
+}usbip_ring_t;
+
+static inline esp_err_t usbip_ring_init(usbip_ring_t* ring, uint32_t min_size)
+{
+    uint32_t size = 1;
+    while (size < min_size) size <<= 1;
+
+    ring->slots = (void**)calloc(size, sizeof(void*));
+    if (ring->slots == NULL) return ESP_ERR_NO_MEM;
+    ring->size = size;
+    ring->head = 0;
+    ring->tail = 0;
+    return ESP_OK;
+}
+
+static inline void usbip_ring_deinit(usbip_ring_t* ring)
+{
+    free(ring->slots);
+    ring->slots = NULL;
+    ring->size = 0;
+}
+
+/**
+ * @brief Producer side; returns false when the ring is full
+ */
+static inline bool usbip_ring_push(usbip_ring_t* ring, void* item)
+{
+    uint32_t tail = ring->tail;
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->size) return false;
+
+    ring->slots[tail & (ring->size - 1)] = item;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * @brief Consumer side; returns NULL when the ring is empty
+ */
+static inline void* usbip_ring_pop(usbip_ring_t* ring)
+{
+    uint32_t head = ring->head;
+    if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) return NULL;
+
+    void* item = ring->slots[head & (ring->size - 1)];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return item;
+}
+
+static inline uint32_t usbip_ring_count(const usbip_ring_t* ring)
+{
+    return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,102 @@
+#include <string.h>
+
+#include "usbip_sched.h"
+
+#define ANY_CORE    tskNO_AFFINITY
+
+/**
+ * Core 0 also runs the WiFi task (priority 23) and, unpinned, the lwIP tcpip task (18). The USB
+ * interrupt goes to the core that installed the host library, core 0 from app_main.
+ *
+ * balanced:   the layout before it was configurable, connections on core 1, URB task and events on core 0
+ * latency:    every hand-over wakes a task on a core that is not busy with WiFi; URB task and host library
+ *             client share core 1 above the connections, so a completion is turned into a reply right away.
+ *             The control plane and the library daemon run below the hot path
+ * throughput: connections and URB task share core 1 with the URB task one below, it drains the submits
+ *             a recv() brought in as one batch; the host library client gets core 0 to itself next to WiFi
+ */
+static const usbip_layout_t layouts[] = {
+    {
+        .name = "balanced",
+        .stage = {
+            [USBIP_STAGE_CONN]    = {.priority = 21, .core = 1,        .stack = 4096},
+            [USBIP_STAGE_URB]     = {.priority = 21, .core = 0,        .stack = 4096},
+            [USBIP_STAGE_USB]     = {.priority = 20, .core = ANY_CORE, .stack = 3072},
+            [USBIP_STAGE_USB_LIB] = {.priority = 20, .core = ANY_CORE, .stack = 3072},
+            [USBIP_STAGE_EVENTS]  = {.priority = 21, .core = 0,        .stack = 4096},
+        },
+    },
+    {
+        .name = "latency",
+        .stage = {
+            [USBIP_STAGE_CONN]    = {.priority = 20, .core = 0,        .stack = 4096},
+            [USBIP_STAGE_URB]     = {.priority = 22, .core = 1,        .stack = 4096},
+            [USBIP_STAGE_USB]     = {.priority = 22, .core = 1,        .stack = 3072},
+            [USBIP_STAGE_USB_LIB] = {.priority = 10, .core = ANY_CORE, .stack = 3072},
+            [USBIP_STAGE_EVENTS]  = {.priority = 10, .core = ANY_CORE, .stack = 4096},
+        },
+    },
+    {
+        .name = "throughput",
+        .stage = {
+            [USBIP_STAGE_CONN]    = {.priority = 21, .core = 1,        .stack = 4096},
+            [USBIP_STAGE_URB]     = {.priority = 20, .core = 1,        .stack = 4096},
+            [USBIP_STAGE_USB]     = {.priority = 21, .core = 0,        .stack = 3072},
+            [USBIP_STAGE_USB_LIB] = {.priority = 10, .core = 0,        .stack = 3072},
+            [USBIP_STAGE_EVENTS]  = {.priority = 10, .core = 0,        .stack = 4096},
+        },
+    },
+#ifdef CONFIG_USBIP_SCHED_CUSTOM
+#define CUSTOM_CORE(core) ((core) < 0 ? ANY_CORE : (core))
+    {
+        .name = "custom",
+        .stage = {
+            [USBIP_STAGE_CONN]    = {CONFIG_USBIP_SCHED_CONN_PRIO, CUSTOM_CORE(CONFIG_USBIP_SCHED_CONN_CORE), CONFIG_USBIP_SCHED_CONN_STACK},
+            [USBIP_STAGE_URB]     = {CONFIG_USBIP_SCHED_URB_PRIO, CUSTOM_CORE(CONFIG_USBIP_SCHED_URB_CORE), CONFIG_USBIP_SCHED_URB_STACK},
+            [USBIP_STAGE_USB]     = {CONFIG_USBIP_SCHED_USB_PRIO, CUSTOM_CORE(CONFIG_USBIP_SCHED_USB_CORE), CONFIG_USBIP_SCHED_USB_STACK},
+            [USBIP_STAGE_USB_LIB] = {CONFIG_USBIP_SCHED_USB_LIB_PRIO, CUSTOM_CORE(CONFIG_USBIP_SCHED_USB_LIB_CORE), CONFIG_USBIP_SCHED_USB_LIB_STACK},
+            [USBIP_STAGE_EVENTS]  = {CONFIG_USBIP_SCHED_EVENTS_PRIO, CUSTOM_CORE(CONFIG_USBIP_SCHED_EVENTS_CORE), CONFIG_USBIP_SCHED_EVENTS_STACK},
+        },
+    },
+#endif
+};
+
+#define LAYOUT_COUNT (sizeof(layouts) / sizeof(layouts[0]))
+
+#if defined(CONFIG_USBIP_SCHED_CUSTOM)
+const usbip_layout_t* usbip_layout = &layouts[3];
+#elif defined(CONFIG_USBIP_SCHED_THROUGHPUT)
+const usbip_layout_t* usbip_layout = &layouts[2];
+#elif defined(CONFIG_USBIP_SCHED_LATENCY)
+const usbip_layout_t* usbip_layout = &layouts[1];
+#else
+const usbip_layout_t* usbip_layout = &layouts[0];
+#endif
+
+bool usbip_sched_select(const char* name)
+{
+    for (size_t i = 0; i < LAYOUT_COUNT; i++)
+    {
+        if (strcmp(layouts[i].name, name) == 0)
+        {
+            usbip_layout = &layouts[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* usbip_sched_names(void)
+{
+#ifdef CONFIG_USBIP_SCHED_CUSTOM
+    return "balanced latency throughput custom";
+#else
+    return "balanced latency throughput";
+#endif
+}
+
+BaseType_t usbip_sched_create(usbip_stage_t stage, TaskFunction_t fn, const char* name, void* arg, TaskHandle_t* handle)
+{
+    const usbip_task_cfg_t* cfg = usbip_sched_stage(stage);
+    return xTaskCreatePinnedToCore(fn, name, cfg->stack, arg, cfg->priority, handle, cfg->core);
+}
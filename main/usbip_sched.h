@@ -0,0 +1,67 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Tasks a URB passes through. RX/parse and TX of a connection share its task, see usbip_connection().
+ */
+typedef enum{
+    USBIP_STAGE_CONN = 0,       /*!< per connection: recv and parse of CMD_*, send of the RET_* replies */
+    USBIP_STAGE_URB,            /*!< URB task: submits transfers and turns completions into replies */
+    USBIP_STAGE_USB,            /*!< host library client task, runs the transfer callbacks */
+    USBIP_STAGE_USB_LIB,        /*!< host library daemon: enumeration, hubs and freeing devices */
+    USBIP_STAGE_EVENTS,         /*!< usbip_events loop: OP_REQ_DEVLIST, OP_REQ_IMPORT, session close */
+    USBIP_STAGE_COUNT
+}usbip_stage_t;
+
+typedef struct{
+    UBaseType_t priority;
+    BaseType_t core;            /*!< 0, 1 or tskNO_AFFINITY */
+    uint32_t stack;             /*!< bytes */
+}usbip_task_cfg_t;
+
+/**
+ * @brief Placement of every stage, one of the presets or the custom layout of Kconfig
+ */
+typedef struct{
+    const char* name;
+    usbip_task_cfg_t stage[USBIP_STAGE_COUNT];
+}usbip_layout_t;
+
+/**
+ * @brief Layout the tasks are created with, CONFIG_USBIP_SCHED_* until usbip_sched_select() picks another
+ */
+extern const usbip_layout_t* usbip_layout;
+
+/**
+ * @brief Selects the layout by name: balanced, latency, throughput or custom. Only tasks created
+ * afterwards use it, so it is called before USBIP and the host library start.
+ * @return false for an unknown name, the layout is not changed
+ */
+bool usbip_sched_select(const char* name);
+
+/**
+ * @brief Names of the layouts, separated by spaces, for usage messages
+ */
+const char* usbip_sched_names(void);
+
+static inline const usbip_task_cfg_t* usbip_sched_stage(usbip_stage_t stage)
+{
+    return &usbip_layout->stage[stage];
+}
+
+/**
+ * @brief xTaskCreatePinnedToCore() with the priority, core and stack of the stage
+ */
+BaseType_t usbip_sched_create(usbip_stage_t stage, TaskFunction_t fn, const char* name, void* arg, TaskHandle_t* handle);
+
+#ifdef __cplusplus
+}
+#endif
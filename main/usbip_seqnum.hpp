@@ -0,0 +1,83 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * @brief Fixed size set of recently finished (answered or unlinked) seqnums.
+ *
+ * Linux assigns seqnums in increasing order per connection, so the set is kept as a bitmap
+ * over a window of the last BITS seqnums. Seqnums that fall behind the window are forgotten,
+ * the same way the old 999 entries list dropped its oldest entries. All operations are O(1)
+ * (amortized when the window slides) and never allocate.
+ */
+template <uint32_t BITS = 1024>
+class SeqnumWindow
+{
+    static_assert((BITS & (BITS - 1)) == 0 && BITS >= 32, "window size has to be a power of 2");
+
+    uint32_t bits[BITS / 32];
+    uint32_t base = 0;          /*!< oldest seqnum covered by the window */
+    bool empty = true;
+
+    static uint32_t word(uint32_t seqnum) { return (seqnum % BITS) / 32; }
+    static uint32_t mask(uint32_t seqnum) { return 1u << (seqnum % 32); }
+
+    void slide(uint32_t new_base)
+    {
+        uint32_t shift = new_base - base;
+        if (shift >= BITS)
+        {
+            memset(bits, 0, sizeof(bits));
+        } else {
+            for (uint32_t n = base; n != new_base; n++)
+            {
+                if ((n % 32) == 0 && new_base - n >= 32)
+                {
+                    bits[word(n)] = 0;
+                    n += 31;
+                } else {
+                    bits[word(n)] &= ~mask(n);
+                }
+            }
+        }
+        base = new_base;
+    }
+
+public:
+    SeqnumWindow() { clear(); }
+
+    void clear()
+    {
+        memset(bits, 0, sizeof(bits));
+        base = 0;
+        empty = true;
+    }
+
+    bool contains(uint32_t seqnum) const
+    {
+        if (empty || (int32_t)(seqnum - base) < 0 || seqnum - base >= BITS) return false;
+        return bits[word(seqnum)] & mask(seqnum);
+    }
+
+    void mark(uint32_t seqnum)
+    {
+        if (empty)
+        {
+            base = seqnum - (BITS - 1);
+            empty = false;
+        }
+        if ((int32_t)(seqnum - base) < 0) return; // older than the window, already forgotten
+        if (seqnum - base >= BITS) slide(seqnum - (BITS - 1));
+        bits[word(seqnum)] |= mask(seqnum);
+    }
+
+    /**
+     * @brief Marks seqnum and returns whether it was already marked.
+     */
+    bool test_and_mark(uint32_t seqnum)
+    {
+        if (contains(seqnum)) return true;
+        mark(seqnum);
+        return false;
+    }
+};
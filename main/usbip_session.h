@@ -0,0 +1,98 @@
+#pragma once
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "usbip_framer.h"
+#include "usbip_ring.h"
+#include "usbip_txq.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief State of one client connection
+ */
+typedef struct{
+    int sock;
+    usbip_framer_t framer;
+    usbip_txq_t txq;
+    TaskHandle_t task;          /*!< connection task, notified once the URB task let go of the session */
+    usbip_ring_t submits[USBIP_LANES];  /*!< prepared CMD_SUBMIT/CMD_UNLINK by lane, connection task -> URB task */
+    bool closing;
+    bool failed;                /*!< set by the URB task when a device the session imported went away, the connection is closed */
+    int slot;                   /*!< URB task slot, taken by usbip_session_attach() */
+    uint16_t gen;               /*!< generation of the slot, replies for an older session in it are dropped */
+    uint32_t inflight;          /*!< URB slots held for this session, added by the connection task, released by the URB task */
+    bool parked;                /*!< the URB task holds replies back for lack of TX queue space, see usbip_session_sent() */
+    bool waiting;               /*!< a CMD_SUBMIT did not fit the in-flight budgets or a CMD_UNLINK found no URB slot,
+                                     it stays in the receive buffer; the URB task wakes the session when it gives some back */
+    uint8_t* sink;              /*!< rest of a large CMD_SUBMIT OUT payload is received straight here */
+    size_t sink_left;           /*!< payload bytes still to receive, thrown away when sink is NULL */
+    void* sink_urb;
+    void* held;                 /*!< streamed CMD_SUBMITs received while they did not fit the in-flight budgets, in order,
+                                     admitted before the commands behind them; connection task only */
+    uint32_t held_eps;          /*!< usbip_ep_index() bits of the held URBs, later commands on them wait behind */
+    uint32_t rx_time;           /*!< last recv(), only kept while tracing, see usbip_trace.h */
+}usbip_session_t;
+
+/**
+ * @brief Serves one accepted client connection until it is closed, then closes sock.
+ * Runs in the calling task, which is the connection task of the session.
+ */
+void usbip_connection(int sock);
+
+/**
+ * @brief rx_buffer holds one or more complete PDUs, as cut by usbip_framer. Returns the bytes handled,
+ * less than len when it stopped at a CMD_SUBMIT that waits for the in-flight budgets or a CMD_UNLINK that
+ * waits for a URB slot. The commands behind a waiting CMD_SUBMIT which do not depend on it are handled
+ * anyway and cut out of the receive buffer.
+ */
+size_t parse_request(usbip_session_t* session, uint8_t* rx_buffer, size_t len);
+
+/**
+ * @brief Takes over an incomplete CMD_SUBMIT with at least CONFIG_USBIP_STREAM_THRESHOLD bytes of OUT data
+ * at the head of the receive buffer: its transfer is allocated right away and the rest of the payload is
+ * received into session->sink. One that does not fit the in-flight budgets is received anyway and held, within
+ * CONFIG_USBIP_HOLD_BYTES. Any other CMD_SUBMIT larger than the receive buffer (ISO with its descriptors) is
+ * answered with -EMSGSIZE and thrown away the same way. Returns the buffered bytes taken (to consume), 0 to leave
+ * the PDU alone.
+ */
+size_t usbip_session_stream(usbip_session_t* session, const uint8_t* data, size_t len);
+
+/**
+ * @brief The last byte of session->sink arrived, queues the URB, or holds it until it fits the in-flight budgets
+ */
+void usbip_session_stream_done(usbip_session_t* session);
+
+/**
+ * @brief Queues the held CMD_SUBMITs that fit the in-flight budgets now, before the receive buffer is parsed
+ */
+void usbip_session_admit_held(usbip_session_t* session);
+
+/**
+ * @brief The connection task wrote replies out of the TX queue, wakes the URB task when it parked some for the session
+ */
+void usbip_session_sent(usbip_session_t* session);
+
+/**
+ * @brief True while queued replies plus this session's URBs in flight would not fit the TX queue, or a CMD_SUBMIT
+ * waits for the in-flight budgets and the receive buffer is full behind it; the connection stops reading new
+ * commands until then, so TCP flow control throttles the client.
+ */
+bool usbip_session_throttled(usbip_session_t* session);
+
+/**
+ * @brief Hands the session to the URB task, fails when every session slot is taken
+ */
+esp_err_t usbip_session_attach(usbip_session_t* session);
+
+/**
+ * @brief Makes sure no reply gets queued to the session anymore, has to be called before it is freed
+ */
+void usbip_session_detach(usbip_session_t* session);
+
+#ifdef __cplusplus
+}
+#endif
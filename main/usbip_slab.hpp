@@ -0,0 +1,78 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+
+/**
+ * @brief Fixed array of N objects with a lock-free free list.
+ *
+ * The list head packs the first free index with a 16 bits tag that changes on every push/pop,
+ * so a compare-exchange can not succeed on a stale head (ABA). alloc() and free() are O(1) and
+ * can be called from different tasks at the same time.
+ */
+template <typename T, uint16_t N>
+class Slab
+{
+    static_assert(N > 0 && N < 0xffff, "slab size");
+    static constexpr uint16_t EMPTY = 0xffff;
+
+    T slots[N];
+    std::atomic<uint16_t> next[N];
+    std::atomic<uint32_t> head;
+    std::atomic<uint16_t> used{0};
+    std::atomic<uint16_t> peak{0};
+    std::atomic<uint32_t> exhausted{0};
+
+public:
+    Slab()
+    {
+        for (uint16_t n = 0; n < N; n++)
+        {
+            next[n].store(n + 1 < N ? n + 1 : EMPTY, std::memory_order_relaxed);
+        }
+        head.store(0, std::memory_order_release);
+    }
+
+    T* alloc()
+    {
+        uint32_t old = head.load(std::memory_order_acquire);
+        uint16_t idx;
+        uint32_t top;
+        do
+        {
+            idx = old & 0xffff;
+            if (idx == EMPTY)
+            {
+                exhausted++;
+                return nullptr;
+            }
+            top = ((old + 0x10000) & 0xffff0000) | next[idx].load(std::memory_order_relaxed);
+        } while (!head.compare_exchange_weak(old, top, std::memory_order_acq_rel, std::memory_order_acquire));
+
+        uint16_t now = ++used;
+        uint16_t max = peak.load(std::memory_order_relaxed);
+        while (now > max && !peak.compare_exchange_weak(max, now, std::memory_order_relaxed));
+        return &slots[idx];
+    }
+
+    void free(T* slot)
+    {
+        uint16_t idx = slot - slots;
+        uint32_t old = head.load(std::memory_order_relaxed);
+        uint32_t top;
+        do
+        {
+            next[idx].store(old & 0xffff, std::memory_order_relaxed);
+            top = ((old + 0x10000) & 0xffff0000) | idx;
+        } while (!head.compare_exchange_weak(old, top, std::memory_order_release, std::memory_order_relaxed));
+        used--;
+    }
+
+    uint16_t index(const T* slot) const { return slot - slots; }
+    T* at(uint16_t idx) { return &slots[idx]; }
+    bool owns(const T* slot) const { return slot >= slots && slot < slots + N; }
+
+    uint16_t inUse() const { return used; }
+    uint16_t peakUse() const { return peak; }
+    uint32_t exhaustedCount() const { return exhausted; }
+    static constexpr uint16_t size() { return N; }
+};
@@ -0,0 +1,192 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+
+#include "usbip_trace.h"
+
+#ifdef CONFIG_USBIP_TRACE
+
+#define TAG "usbip_trace"
+#define TRACE_SIZE  CONFIG_USBIP_TRACE_RECORDS
+#define TRACE_MASK  (TRACE_SIZE - 1)
+
+_Static_assert((TRACE_SIZE & TRACE_MASK) == 0, "CONFIG_USBIP_TRACE_RECORDS has to be a power of 2");
+
+bool usbip_trace_on = false;
+
+/**
+ * @brief Flight recorder: any task reserves a record with one atomic add and overwrites the oldest one.
+ * index works like a seqlock, it is 0 while the record is written and its stream position + 1 afterwards.
+ */
+static usbip_trace_record_t records[TRACE_SIZE];
+static uint32_t trace_head;     /*!< records reserved so far */
+static uint32_t dumped;         /*!< trace_head at the last dump, side channel task only */
+
+uint32_t usbip_trace_now(void)
+{
+    return (uint32_t)esp_timer_get_time();
+}
+
+void usbip_trace_stamp(uint8_t stage, uint8_t slot, uint32_t seqnum, uint8_t ep, uint32_t time_us)
+{
+    uint32_t pos = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+    usbip_trace_record_t* rec = &records[pos & TRACE_MASK];
+    __atomic_store_n(&rec->index, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    rec->time_us = time_us;
+    rec->seqnum = seqnum;
+    rec->stage = stage;
+    rec->ep = ep;
+    rec->slot = slot;
+    rec->reserved = 0;
+    __atomic_store_n(&rec->index, pos + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Copies the record at stream position pos, false when it is being written or already overwritten
+ */
+static bool read_record(uint32_t pos, usbip_trace_record_t* out)
+{
+    usbip_trace_record_t* rec = &records[pos & TRACE_MASK];
+    uint32_t before = __atomic_load_n(&rec->index, __ATOMIC_ACQUIRE);
+    memcpy(out, rec, sizeof(usbip_trace_record_t));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint32_t after = __atomic_load_n(&rec->index, __ATOMIC_RELAXED);
+    return before == pos + 1 && after == pos + 1;
+}
+
+static bool send_all(int sock, const void* data, size_t len)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    while (len)
+    {
+        ssize_t n = send(sock, p, len, 0);
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * @brief Sends what the ring holds, oldest first. Records written while it is sent are skipped or
+ * left for the next dump.
+ */
+static void dump(int sock)
+{
+    uint32_t head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    uint32_t start = head - dumped > TRACE_SIZE ? head - TRACE_SIZE : dumped;
+    usbip_trace_record_t* copy = (usbip_trace_record_t*)malloc(TRACE_SIZE * sizeof(usbip_trace_record_t));
+    if (copy == NULL)
+    {
+        ESP_LOGE(TAG, "no memory for the dump");
+        return;
+    }
+
+    // snapshot first, the socket is slow compared to the producers
+    uint32_t count = 0;
+    for (uint32_t pos = start; pos != head; pos++)
+    {
+        if (read_record(pos, &copy[count])) count++;
+    }
+    usbip_trace_dump_t hdr = {
+        .magic = USBIP_TRACE_MAGIC,
+        .version = 1,
+        .record_size = sizeof(usbip_trace_record_t),
+        .count = count,
+        .lost = start - dumped,
+    };
+    dumped = head;
+    ESP_LOGI(TAG, "dump of %" PRIu32 " records, %" PRIu32 " lost", hdr.count, hdr.lost);
+
+    if (send_all(sock, &hdr, sizeof(hdr))) send_all(sock, copy, count * sizeof(usbip_trace_record_t));
+    free(copy);
+}
+
+static void trace_server_task(void* arg)
+{
+    uint16_t port = (uint16_t)(uintptr_t)arg;
+    int listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if (listen_sock < 0)
+    {
+        ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+        vTaskDelete(NULL);
+        return;
+    }
+    int opt = 1;
+    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr)) || listen(listen_sock, 1))
+    {
+        ESP_LOGE(TAG, "Unable to listen on port %d: errno %d", port, errno);
+        close(listen_sock);
+        vTaskDelete(NULL);
+        return;
+    }
+
+    while (1)
+    {
+        int sock = accept(listen_sock, NULL, NULL);
+        if (sock < 0)
+        {
+            if (errno == EINTR) continue;
+            ESP_LOGE(TAG, "Unable to accept connection: errno %d", errno);
+            break;
+        }
+        char cmd = 0;
+        if (recv(sock, &cmd, 1, 0) == 1)
+        {
+            switch (cmd)
+            {
+            case '1':
+                __atomic_store_n(&usbip_trace_on, true, __ATOMIC_RELAXED);
+                ESP_LOGI(TAG, "tracing on");
+                break;
+            case '0':
+                __atomic_store_n(&usbip_trace_on, false, __ATOMIC_RELAXED);
+                ESP_LOGI(TAG, "tracing off");
+                break;
+            case 'd':
+                dump(sock);
+                break;
+            default:
+                ESP_LOGE(TAG, "unknown command %02x", cmd);
+                break;
+            }
+        }
+        shutdown(sock, SHUT_WR);
+        close(sock);
+    }
+    close(listen_sock);
+    vTaskDelete(NULL);
+}
+
+void usbip_trace_server_start(uint16_t port)
+{
+    xTaskCreatePinnedToCore(trace_server_task, "usbip_trace", 3 * 1024, (void*)(uintptr_t)port, 5, NULL, 1);
+}
+
+#else
+
+// the stamp points compile to if (0), unoptimized builds still reference these
+bool usbip_trace_on = false;
+
+uint32_t usbip_trace_now(void)
+{
+    return 0;
+}
+
+void usbip_trace_stamp(uint8_t stage, uint8_t slot, uint32_t seqnum, uint8_t ep, uint32_t time_us)
+{
+}
+
+#endif
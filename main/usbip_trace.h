@@ -0,0 +1,81 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Stages a URB is stamped at, in the order it passes them
+ */
+typedef enum{
+    USBIP_TRACE_RECV = 0,       /*!< recv() returned the bytes that completed the CMD_SUBMIT */
+    USBIP_TRACE_PARSE,          /*!< transfer prepared, handed to the URB task */
+    USBIP_TRACE_SUBMIT,         /*!< transfer posted to the USB host library */
+    USBIP_TRACE_COMPLETE,       /*!< transfer callback */
+    USBIP_TRACE_SEND,           /*!< last byte of the RET_SUBMIT accepted by the socket */
+}usbip_trace_stage_t;
+
+/**
+ * @brief One stamp, 16 bytes. Seqnums are per connection, so a URB is identified by slot and seqnum.
+ */
+typedef struct{
+    uint32_t time_us;           /*!< esp_timer_get_time(), wraps after 71 minutes */
+    uint32_t seqnum;
+    uint32_t index;             /*!< position in the record stream + 1, 0 while the record is written */
+    uint8_t stage;              /*!< usbip_trace_stage_t */
+    uint8_t ep;                 /*!< bEndpointAddress, 0xff when the stage does not know it */
+    uint8_t slot;               /*!< session slot */
+    uint8_t reserved;
+}usbip_trace_record_t;
+
+#define USBIP_TRACE_MAGIC   0x43525455  /*!< "UTRC" little endian, start of a dump */
+#define USBIP_TRACE_EP_NONE 0xff
+
+/**
+ * @brief Header of a dump on the side channel, followed by count records oldest first, little endian
+ */
+typedef struct{
+    uint32_t magic;
+    uint16_t version;           /*!< 1 */
+    uint16_t record_size;
+    uint32_t count;
+    uint32_t lost;              /*!< records overwritten since the previous dump */
+}usbip_trace_dump_t;
+
+extern bool usbip_trace_on;
+
+uint32_t usbip_trace_now(void);
+/**
+ * @brief Adds a record. Use through the macros below, so it costs a
+ * single not-taken branch while tracing is off and nothing when it is not compiled in.
+ */
+void usbip_trace_stamp(uint8_t stage, uint8_t slot, uint32_t seqnum, uint8_t ep, uint32_t time_us);
+
+/**
+ * @brief Starts the task serving the side channel: a client sends one byte, '1' starts tracing,
+ * '0' stops it and 'd' gets a usbip_trace_dump_t of what the ring holds; the connection is closed after it.
+ */
+void usbip_trace_server_start(uint16_t port);
+
+#ifdef CONFIG_USBIP_TRACE
+#define USBIP_TRACE_ON() __builtin_expect(__atomic_load_n(&usbip_trace_on, __ATOMIC_RELAXED), 0)
+#else
+#define USBIP_TRACE_ON() 0
+#endif
+
+#define USBIP_TRACE(stage, slot, seqnum, ep) do { \
+        if (USBIP_TRACE_ON()) usbip_trace_stamp(stage, slot, seqnum, ep, usbip_trace_now()); \
+    } while (0)
+/**
+ * @brief Keeps the current time for a later stamp, e.g. the recv() that completed a batch of PDUs
+ */
+#define USBIP_TRACE_TIME(var) do { \
+        if (USBIP_TRACE_ON()) (var) = usbip_trace_now(); \
+    } while (0)
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,320 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+#include "esp_vfs_eventfd.h"
+
+#include "usbip_txq.h"
+#include "usbip_trace.h"
+
+#define TAG "usbip_txq"
+#define TXQ_MAX_IOV 16
+
+esp_err_t usbip_txq_init(usbip_txq_t* txq, uint16_t size)
+{
+    memset(txq, 0, sizeof(usbip_txq_t));
+    txq->items = (usbip_tx_item_t*)calloc(size, sizeof(usbip_tx_item_t));
+    txq->free = (uint16_t*)calloc(size, sizeof(uint16_t));
+    txq->fifos = (uint16_t*)calloc(size * USBIP_LANES, sizeof(uint16_t));
+    txq->space = xSemaphoreCreateBinary();
+    txq->event_fd = eventfd(0, 0);
+    if (txq->items == NULL || txq->free == NULL || txq->fifos == NULL || txq->space == NULL || txq->event_fd < 0)
+    {
+        free(txq->items);
+        free(txq->free);
+        free(txq->fifos);
+        if (txq->space) vSemaphoreDelete(txq->space);
+        if (txq->event_fd >= 0) close(txq->event_fd);
+        return ESP_ERR_NO_MEM;
+    }
+    txq->size = size;
+    for (uint16_t n = 0; n < size; n++) txq->free[n] = size - 1 - n;
+    txq->free_count = size;
+    txq->current = -1;
+    portMUX_INITIALIZE(&txq->lock);
+
+    return ESP_OK;
+}
+
+static void complete(usbip_tx_item_t* item)
+{
+    if (item->done) item->done(item->arg);
+}
+
+static uint16_t* lane_fifo(usbip_txq_t* txq, int lane)
+{
+    return &txq->fifos[lane * txq->size];
+}
+
+void usbip_txq_deinit(usbip_txq_t* txq)
+{
+    taskENTER_CRITICAL(&txq->lock);
+    txq->closed = true;
+    taskEXIT_CRITICAL(&txq->lock);
+
+    if (txq->current >= 0) complete(&txq->items[txq->current]);
+    for (int lane = 0; lane < USBIP_LANES; lane++)
+    {
+        for (uint16_t n = 0; n < txq->lane_count[lane]; n++)
+        {
+            complete(&txq->items[lane_fifo(txq, lane)[(txq->lane_head[lane] + n) % txq->size]]);
+        }
+    }
+    txq->count = 0;
+    free(txq->items);
+    free(txq->free);
+    free(txq->fifos);
+    vSemaphoreDelete(txq->space);
+    close(txq->event_fd);
+    txq->items = NULL;
+    txq->event_fd = -1;
+}
+
+/**
+ * @brief Takes a free item for a copy of item, called in the critical section. False when the queue is full or closed.
+ */
+static bool insert(usbip_txq_t* txq, const usbip_tx_item_t* item, uint32_t now, bool* wake)
+{
+    if (txq->closed || txq->free_count == 0) return false;
+    int lane = item->lane < USBIP_LANES ? item->lane : USBIP_LANE_BULK;
+    uint16_t index = txq->free[--txq->free_count];
+    txq->items[index] = *item;
+    txq->items[index].lane = lane;
+    txq->items[index].queued_us = now;
+    lane_fifo(txq, lane)[(txq->lane_head[lane] + txq->lane_count[lane]++) % txq->size] = index;
+    *wake = txq->count++ == 0;
+    txq->stats.depth = txq->count;
+    if (txq->count > txq->stats.peak_depth) txq->stats.peak_depth = txq->count;
+    return true;
+}
+
+/**
+ * @brief The connection task drains until empty or stalled on the socket, so it only needs waking when idle
+ */
+static void inserted(usbip_txq_t* txq, bool wake)
+{
+    if (wake)
+    {
+        uint64_t one = 1;
+        write(txq->event_fd, &one, sizeof(one));
+    }
+}
+
+bool usbip_txq_push(usbip_txq_t* txq, const usbip_tx_item_t* item, TickType_t wait)
+{
+    TickType_t start = xTaskGetTickCount();
+    bool closed = false;
+    bool waited = false;
+    uint32_t now = (uint32_t)esp_timer_get_time();
+    while (1)
+    {
+        bool wake;
+        taskENTER_CRITICAL(&txq->lock);
+        closed = txq->closed;
+        if (insert(txq, item, now, &wake))
+        {
+            taskEXIT_CRITICAL(&txq->lock);
+            inserted(txq, wake);
+            return true;
+        }
+        if (!closed && !waited) txq->stats.full_waits++;
+        waited = true;
+        taskEXIT_CRITICAL(&txq->lock);
+
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        if (closed || elapsed >= wait) break;
+        xSemaphoreTake(txq->space, wait - elapsed);
+    }
+
+    if (!closed)
+    {
+        txq->stats.dropped++;
+        ESP_LOGE(TAG, "reply dropped, %u queued", txq->count);
+    }
+    complete((usbip_tx_item_t*)item);
+    return false;
+}
+
+bool usbip_txq_try_push(usbip_txq_t* txq, const usbip_tx_item_t* item)
+{
+    bool wake;
+    uint32_t now = (uint32_t)esp_timer_get_time();
+    taskENTER_CRITICAL(&txq->lock);
+    bool closed = txq->closed;
+    bool queued = insert(txq, item, now, &wake);
+    if (!queued && !closed) txq->stats.full_waits++;
+    taskEXIT_CRITICAL(&txq->lock);
+
+    if (queued) {
+        inserted(txq, wake);
+    } else if (closed) {
+        complete((usbip_tx_item_t*)item);
+    }
+    return queued || closed;
+}
+
+void usbip_txq_ack(usbip_txq_t* txq)
+{
+    uint64_t value;
+    read(txq->event_fd, &value, sizeof(value));
+}
+
+void usbip_txq_wake(usbip_txq_t* txq)
+{
+    uint64_t one = 1;
+    write(txq->event_fd, &one, sizeof(one));
+}
+
+static uint32_t ready_lanes(const uint16_t* lane_count)
+{
+    uint32_t ready = 0;
+    for (int lane = 0; lane < USBIP_LANES; lane++)
+    {
+        if (lane_count[lane]) ready |= 1u << lane;
+    }
+    return ready;
+}
+
+int usbip_txq_flush(usbip_txq_t* txq, int sock)
+{
+    while (1)
+    {
+        struct iovec iov[TXQ_MAX_IOV];
+        uint16_t order[TXQ_MAX_IOV / 2];
+        size_t n_iov = 0;
+        size_t total = 0;
+        size_t skip = txq->offset;
+        uint16_t lane_head[USBIP_LANES];
+        uint16_t lane_count[USBIP_LANES];
+
+        taskENTER_CRITICAL(&txq->lock);
+        memcpy(lane_head, txq->lane_head, sizeof(lane_head));
+        memcpy(lane_count, txq->lane_count, sizeof(lane_count));
+        uint16_t count = txq->count;
+        taskEXIT_CRITICAL(&txq->lock);
+        if (count == 0) return 0;
+
+        // the reply a partial write stopped in has to be finished, then the lanes take turns
+        bool resumed = txq->current >= 0;
+        uint16_t items = 0;
+        if (resumed) order[items++] = txq->current;
+        usbip_qos_t plan = txq->qos;
+        uint16_t taken[USBIP_LANES] = {};
+        uint32_t ready = ready_lanes(lane_count);
+        while (ready && items < TXQ_MAX_IOV / 2)
+        {
+            usbip_lane_t lane = usbip_qos_pick(&plan, ready);
+            usbip_qos_served(&plan, lane, ready);
+            order[items++] = lane_fifo(txq, lane)[(lane_head[lane] + taken[lane]) % txq->size];
+            if (++taken[lane] == lane_count[lane]) ready &= ~(1u << lane);
+        }
+
+        // gather as many queued replies as fit, skipping what a partial write already sent
+        for (uint16_t n = 0; n < items; n++)
+        {
+            usbip_tx_item_t* item = &txq->items[order[n]];
+            if (item->hdr_len > skip)
+            {
+                iov[n_iov].iov_base = item->hdr + skip;
+                iov[n_iov].iov_len = item->hdr_len - skip;
+                total += iov[n_iov++].iov_len;
+                skip = 0;
+            } else {
+                skip -= item->hdr_len;
+            }
+            if (item->data_len > skip)
+            {
+                iov[n_iov].iov_base = (uint8_t*)item->data + skip;
+                iov[n_iov].iov_len = item->data_len - skip;
+                total += iov[n_iov++].iov_len;
+            }
+            skip = 0;
+        }
+
+        struct msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n_iov;
+        ssize_t written = sendmsg(sock, &msg, MSG_DONTWAIT);
+        if (written < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                txq->stats.stalls++;
+                return count;
+            }
+            ESP_LOGE(TAG, "send failed: errno %d", errno);
+            return -1;
+        }
+        txq->stats.writes++;
+
+        // retire every reply the write covered; the one it stopped in leaves its lane and becomes current
+        size_t done = txq->offset + written;
+        uint16_t retired = 0;
+        uint16_t freed[TXQ_MAX_IOV / 2];
+        uint16_t left[USBIP_LANES];
+        memcpy(left, lane_count, sizeof(left));
+        memset(taken, 0, sizeof(taken));
+        uint32_t now = (uint32_t)esp_timer_get_time();
+        txq->offset = 0;
+        for (uint16_t n = 0; n < items; n++)
+        {
+            uint16_t index = order[n];
+            usbip_tx_item_t* item = &txq->items[index];
+            size_t len = item->hdr_len + item->data_len;
+            if (n == 0 && resumed)
+            {
+                txq->current = -1;
+            } else {
+                if (done == 0) break;
+                if (usbip_qos_served(&txq->qos, (usbip_lane_t)item->lane, ready_lanes(left))) txq->stats.lanes[item->lane].promoted++;
+                left[item->lane]--;
+                taken[item->lane]++;
+            }
+            if (done < len)
+            {
+                txq->current = index;
+                txq->offset = done;
+                break;
+            }
+            done -= len;
+            // RET_SUBMIT: command 3 and the seqnum up front, big endian
+            if (USBIP_TRACE_ON() && item->hdr_len == USBIP_HEADER_SIZE && item->hdr[3] == 3 && item->hdr[2] == 0)
+            {
+                const uint8_t* p = item->hdr + 4;
+                uint32_t seqnum = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+                usbip_trace_stamp(USBIP_TRACE_SEND, txq->trace_slot, seqnum, USBIP_TRACE_EP_NONE, usbip_trace_now());
+            }
+            usbip_lane_wait(&txq->stats.lanes[item->lane], now - item->queued_us);
+            complete(item);
+            freed[retired++] = index;
+        }
+        if (retired > 1) txq->stats.coalesced += retired - 1;
+        txq->stats.sent += retired;
+
+        taskENTER_CRITICAL(&txq->lock);
+        for (int lane = 0; lane < USBIP_LANES; lane++)
+        {
+            txq->lane_head[lane] = (txq->lane_head[lane] + taken[lane]) % txq->size;
+            txq->lane_count[lane] -= taken[lane];
+        }
+        for (uint16_t n = 0; n < retired; n++) txq->free[txq->free_count++] = freed[n];
+        txq->count -= retired;
+        txq->stats.depth = txq->count;
+        taskEXIT_CRITICAL(&txq->lock);
+        if (retired) xSemaphoreGive(txq->space);
+
+        if ((size_t)written < total)
+        {
+            txq->stats.partial_writes++;
+            return count - retired;
+        }
+    }
+}
+
+uint16_t usbip_txq_depth(usbip_txq_t* txq)
+{
+    return txq->count;
+}
@@ -0,0 +1,110 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_err.h"
+
+#include "usbip_framer.h"
+#include "usbip_qos.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void (*usbip_tx_done_cb_t)(void* arg);
+
+/**
+ * @brief One reply: an optional copied header followed by a payload that stays owned by the
+ * producer until done(arg) is called, once the last byte is accepted by the socket.
+ */
+typedef struct{
+    uint8_t hdr[USBIP_HEADER_SIZE];
+    uint8_t hdr_len;
+    uint8_t lane;               /*!< usbip_lane_t, a zeroed item goes out on the control lane */
+    uint32_t queued_us;         /*!< set by usbip_txq_push() */
+    const void* data;
+    size_t data_len;
+    usbip_tx_done_cb_t done;
+    void* arg;
+}usbip_tx_item_t;
+
+typedef struct{
+    uint32_t depth;
+    uint32_t peak_depth;
+    uint32_t sent;              /*!< replies fully written */
+    uint32_t writes;            /*!< sendmsg() calls that wrote something */
+    uint32_t coalesced;         /*!< replies that shared a sendmsg() with a previous one */
+    uint32_t partial_writes;    /*!< sendmsg() that stopped in the middle of a reply */
+    uint32_t stalls;            /*!< EAGAIN, socket send buffer full */
+    uint32_t full_waits;        /*!< producer found the queue full */
+    uint32_t dropped;           /*!< producer gave up waiting */
+    uint32_t throttled;         /*!< receive paused for backpressure */
+    usbip_lane_stats_t lanes[USBIP_LANES];  /*!< queued -> last byte written */
+}usbip_txq_stats_t;
+
+/**
+ * @brief Bounded reply queue of one connection. Any task can push, only the connection task
+ * writes to the socket, resuming partial writes and batching queued replies into one sendmsg().
+ * Replies wait in a FIFO per lane and are sent in lane order, see usbip_qos.h; size is the
+ * number of replies over all lanes.
+ */
+typedef struct{
+    usbip_tx_item_t* items;
+    uint16_t* free;             /*!< stack of unused items */
+    uint16_t free_count;
+    uint16_t* fifos;            /*!< size item indexes per lane */
+    uint16_t lane_head[USBIP_LANES];
+    uint16_t lane_count[USBIP_LANES];
+    uint16_t size;
+    uint16_t count;             /*!< items in use, queued or being written */
+    int16_t current;            /*!< item a write stopped in, out of its lane and finished first; -1 for none */
+    size_t offset;              /*!< bytes of current already written */
+    usbip_qos_t qos;            /*!< connection task only */
+    bool closed;
+    int event_fd;               /*!< eventfd signalled when the queue becomes non-empty, for select() */
+    portMUX_TYPE lock;
+    SemaphoreHandle_t space;    /*!< given every time the connection task frees items */
+    usbip_txq_stats_t stats;
+    uint8_t trace_slot;         /*!< session slot the SEND stamps are tagged with */
+}usbip_txq_t;
+
+esp_err_t usbip_txq_init(usbip_txq_t* txq, uint16_t size);
+/**
+ * @brief Completes all queued items without sending them
+ */
+void usbip_txq_deinit(usbip_txq_t* txq);
+
+/**
+ * @brief Queues a copy of item, waiting up to wait ticks for space. On a closed or full queue
+ * item->done is called right away and false is returned.
+ */
+bool usbip_txq_push(usbip_txq_t* txq, const usbip_tx_item_t* item, TickType_t wait);
+
+/**
+ * @brief Queues a copy of item if there is room right away, never waits. Returns false on a full
+ * queue and item stays with the caller; on a closed one item->done is called and true is returned.
+ */
+bool usbip_txq_try_push(usbip_txq_t* txq, const usbip_tx_item_t* item);
+
+/**
+ * @brief Clears the event_fd notification, call when select() reported it readable
+ */
+void usbip_txq_ack(usbip_txq_t* txq);
+
+/**
+ * @brief Signals event_fd without queueing anything, wakes the connection task for other reasons
+ */
+void usbip_txq_wake(usbip_txq_t* txq);
+
+/**
+ * @brief Writes as much as the socket accepts without blocking. Returns number of replies still
+ * queued or -1 on socket error.
+ */
+int usbip_txq_flush(usbip_txq_t* txq, int sock);
+uint16_t usbip_txq_depth(usbip_txq_t* txq);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,62 @@
+#pragma once
+#include <atomic>
+#include "esp_err.h"
+#include "usb/usb_host.h"
+
+/**
+ * @brief A USB device of the native build: what the host library and the device itself do on the
+ * target. The native USBhostDevice forwards to it, usb_device_handle_t is the backend pointer.
+ *
+ * submit() queues the transfer and returns, the backend finishes it later from any thread with
+ * usb_backend_complete(). flush() has to complete every queued transfer of the endpoint with
+ * USB_TRANSFER_STATUS_CANCELED before it returns.
+ */
+class USBbackend
+{
+public:
+    virtual ~USBbackend() {}
+
+    virtual const usb_device_desc_t* deviceDescriptor() = 0;
+    virtual const usb_config_desc_t* configDescriptor() = 0;
+    virtual usb_speed_t speed() { return USB_SPEED_FULL; }
+    /**
+     * @brief Strings the host library caches during enumeration, see USBhostDevice::stringDescriptor()
+     */
+    virtual const usb_str_desc_t* stringDescriptor(uint8_t index) { return NULL; }
+
+    virtual esp_err_t submit(usb_transfer_t* transfer) = 0;
+    virtual esp_err_t flush(uint8_t bEndpointAddress) = 0;
+    virtual esp_err_t setInterface(uint8_t bInterfaceNumber, uint8_t bAlternateSetting) { return ESP_OK; }
+
+    std::atomic<uint16_t> inflight[32] = {};    /*!< by endpoint number, IN ones from 16 */
+
+    usb_device_handle_t handle() { return (usb_device_handle_t)this; }
+    static int ep_slot(uint8_t bEndpointAddress) { return (bEndpointAddress & 0x0f) | ((bEndpointAddress & 0x80) >> 3); }
+    static USBbackend* fromHandle(usb_device_handle_t dev_hdl) { return (USBbackend*)dev_hdl; }
+};
+
+/**
+ * @brief Hands the finished transfer to the host library, transfer->callback is called from
+ * usb_host_client_handle_events() of the registered client like on the target.
+ *
+ * All callbacks run on that one client task, the completion ring of the URB task has a single producer.
+ */
+void usb_backend_complete(usb_transfer_t* transfer);
+
+#define USB_LATENCY_BUCKETS 24
+
+/**
+ * @brief Time from usb_backend_complete() to the callback. Bucket 0 counts callbacks within 1 us,
+ * bucket n those in [2^(n-1), 2^n) us, the last one everything above.
+ */
+typedef struct{
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[USB_LATENCY_BUCKETS];
+}usb_latency_t;
+
+/**
+ * @brief Copy of the callback latency histogram since the start
+ */
+void usb_backend_latency(usb_latency_t* latency);
@@ -0,0 +1,132 @@
+#include <inttypes.h>
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "usb_device.hpp"
+#include "usb_backend.hpp"
+
+/**
+ * USBhostDevice of the native build, transfers go to the USBbackend behind dev_hdl
+ */
+USBhostDevice::USBhostDevice()
+{
+}
+
+USBhostDevice::~USBhostDevice()
+{
+}
+
+esp_err_t USBhostDevice::init(usb_device_handle_t dev_hdl, size_t len)
+{
+    this->dev_hdl = dev_hdl;
+    config_desc = USBbackend::fromHandle(dev_hdl)->configDescriptor();
+    esp_err_t err = usb_host_transfer_alloc(len, 0, &xfer_ctrl);
+    if (err) return err;
+    xfer_ctrl->device_handle = dev_hdl;
+    xfer_ctrl->context = this;
+    xfer_ctrl->bEndpointAddress = 0;
+
+    return err;
+}
+
+usb_transfer_t *USBhostDevice::allocate(size_t _size, int num_isoc)
+{
+    usb_transfer_t *transfer = pool.get(_size, num_isoc);
+    if (transfer)
+    {
+        transfer->flags = 0;
+        transfer->context = this;
+        return transfer;
+    }
+
+    esp_err_t err = usb_host_transfer_alloc(_size, num_isoc, &transfer);
+    if (!err)
+    {
+        pool.countFallbackAlloc();
+        transfer->device_handle = dev_hdl;
+        transfer->context = this;
+    }
+    return transfer;
+}
+
+esp_err_t USBhostDevice::deallocate(usb_transfer_t *transfer)
+{
+    if (pool.put(transfer)) return ESP_OK;
+
+    pool.countFallbackFree();
+    return usb_host_transfer_free(transfer);
+}
+
+esp_err_t USBhostDevice::submitTransfer(usb_transfer_t *transfer)
+{
+    USBbackend* backend = USBbackend::fromHandle(transfer->device_handle);
+    std::atomic<uint16_t>& inflight = backend->inflight[USBbackend::ep_slot(transfer->bEndpointAddress)];
+    inflight++;
+    esp_err_t err = backend->submit(transfer);
+    if (err != ESP_OK) inflight--;
+    return err;
+}
+
+esp_err_t USBhostDevice::flushEndpoint(uint8_t bEndpointAddress)
+{
+    return USBbackend::fromHandle(dev_hdl)->flush(bEndpointAddress);
+}
+
+esp_err_t USBhostDevice::claimInterface(uint8_t bInterfaceNumber, uint8_t bAlternateSetting)
+{
+    return USBbackend::fromHandle(dev_hdl)->setInterface(bInterfaceNumber, bAlternateSetting);
+}
+
+esp_err_t USBhostDevice::releaseInterface(uint8_t bInterfaceNumber)
+{
+    // not while a transfer of one of its endpoints is on the way back, like on the target
+    USBbackend* backend = USBbackend::fromHandle(dev_hdl);
+    const usb_standard_desc_t* desc = (const usb_standard_desc_t*)config_desc;
+    int offset = 0;
+    bool match = false;
+    while ((desc = usb_parse_next_descriptor(desc, config_desc->wTotalLength, &offset)))
+    {
+        if (desc->bDescriptorType == USB_B_DESCRIPTOR_TYPE_INTERFACE)
+        {
+            match = ((const usb_intf_desc_t*)desc)->bInterfaceNumber == bInterfaceNumber;
+        }
+        else if (match && desc->bDescriptorType == USB_B_DESCRIPTOR_TYPE_ENDPOINT &&
+                 backend->inflight[USBbackend::ep_slot(((const usb_ep_desc_t*)desc)->bEndpointAddress)])
+        {
+            return ESP_ERR_INVALID_STATE;
+        }
+    }
+    return ESP_OK;
+}
+
+const usb_device_desc_t* USBhostDevice::deviceDescriptor()
+{
+    return USBbackend::fromHandle(dev_hdl)->deviceDescriptor();
+}
+
+const usb_str_desc_t* USBhostDevice::stringDescriptor(uint8_t index)
+{
+    return USBbackend::fromHandle(dev_hdl)->stringDescriptor(index);
+}
+
+usb_speed_t USBhostDevice::speed()
+{
+    return USBbackend::fromHandle(dev_hdl)->speed();
+}
+
+void USBhostDevice::onEvent(usb_host_event_cb_t _cb)
+{
+    event_cb = _cb;
+}
+
+bool USBhostDevice::deinit()
+{
+    usb_xfer_pool_stats_t stats = pool.stats();
+    ESP_LOGI("", "transfer pool hits: %" PRIu32 ", fallback allocs: %" PRIu32 ", fallback frees: %" PRIu32 ", peak in use: %" PRIu32,
+             stats.hits, stats.fallback_allocs, stats.fallback_frees, stats.peak_in_use);
+    pool.release();
+    usb_host_transfer_free(xfer_ctrl);
+    xfer_ctrl = NULL;
+
+    return true;
+}
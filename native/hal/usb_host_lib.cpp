@@ -0,0 +1,198 @@
+#include <string.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include "usb/usb_host.h"
+#include "usb_backend.hpp"
+
+/**
+ * Library and client event handling of the ESP-IDF host library, for USBhost. Devices are exported by
+ * the server directly instead of being enumerated, so a client never gets NEW_DEV or DEV_GONE and
+ * ALL_FREE never comes. What it does model is the way back of a transfer: the backend finishes it,
+ * the client is woken and its usb_host_client_handle_events() calls the callback.
+ */
+struct usb_host_client_handle_s
+{
+    usb_host_client_config_t config;
+    bool unblock;
+};
+
+typedef struct{
+    usb_transfer_t* transfer;
+    std::chrono::steady_clock::time_point time;
+}done_t;
+
+static std::mutex lib_lock;
+static std::condition_variable lib_cond;
+static std::condition_variable client_cond;
+static bool installed;
+static uint32_t lib_flags;
+static bool lib_unblocked;
+static usb_host_client_handle_t client;     /*!< one client, USBhost registers a single one */
+static std::deque<done_t> done_queue;
+static usb_latency_t latency;
+
+template <typename Pred>
+static bool wait_ticks(std::condition_variable& cond, std::unique_lock<std::mutex>& guard, TickType_t ticks, Pred pred)
+{
+    if (ticks == portMAX_DELAY)
+    {
+        cond.wait(guard, pred);
+        return true;
+    }
+    return cond.wait_for(guard, std::chrono::milliseconds(ticks * portTICK_PERIOD_MS), pred);
+}
+
+static void record_latency(std::chrono::steady_clock::duration delay)
+{
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(delay).count();
+    uint64_t us = ns / 1000;
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if (bucket >= USB_LATENCY_BUCKETS) bucket = USB_LATENCY_BUCKETS - 1;
+    latency.buckets[bucket]++;
+    latency.count++;
+    latency.total_ns += ns;
+    if (ns > latency.max_ns) latency.max_ns = ns;
+}
+
+void usb_backend_complete(usb_transfer_t* transfer)
+{
+    {
+        std::lock_guard<std::mutex> guard(lib_lock);
+        done_queue.push_back({transfer, std::chrono::steady_clock::now()});
+    }
+    client_cond.notify_all();
+}
+
+void usb_backend_latency(usb_latency_t* copy)
+{
+    std::lock_guard<std::mutex> guard(lib_lock);
+    *copy = latency;
+}
+
+esp_err_t usb_host_install(const usb_host_config_t* config)
+{
+    std::lock_guard<std::mutex> guard(lib_lock);
+    if (installed) return ESP_ERR_INVALID_STATE;
+    installed = true;
+    lib_flags = 0;
+    return ESP_OK;
+}
+
+esp_err_t usb_host_uninstall(void)
+{
+    std::lock_guard<std::mutex> guard(lib_lock);
+    if (!installed || client) return ESP_ERR_INVALID_STATE;
+    installed = false;
+    return ESP_OK;
+}
+
+esp_err_t usb_host_lib_handle_events(TickType_t timeout_ticks, uint32_t* event_flags_ret)
+{
+    std::unique_lock<std::mutex> guard(lib_lock);
+    bool woken = wait_ticks(lib_cond, guard, timeout_ticks, [] { return lib_flags || lib_unblocked; });
+    lib_unblocked = false;
+    if (event_flags_ret) *event_flags_ret = lib_flags;
+    lib_flags = 0;
+    return woken ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+esp_err_t usb_host_lib_unblock(void)
+{
+    {
+        std::lock_guard<std::mutex> guard(lib_lock);
+        lib_unblocked = true;
+    }
+    lib_cond.notify_all();
+    return ESP_OK;
+}
+
+esp_err_t usb_host_device_free_all(void)
+{
+    return ESP_OK;
+}
+
+esp_err_t usb_host_client_register(const usb_host_client_config_t* client_config, usb_host_client_handle_t* client_hdl_ret)
+{
+    std::lock_guard<std::mutex> guard(lib_lock);
+    if (!installed) return ESP_ERR_INVALID_STATE;
+    if (client) return ESP_ERR_NOT_SUPPORTED;
+    client = new usb_host_client_handle_s();
+    client->config = *client_config;
+    *client_hdl_ret = client;
+    return ESP_OK;
+}
+
+esp_err_t usb_host_client_deregister(usb_host_client_handle_t client_hdl)
+{
+    {
+        std::lock_guard<std::mutex> guard(lib_lock);
+        if (client_hdl == NULL || client_hdl != client) return ESP_ERR_INVALID_ARG;
+        delete client;
+        client = NULL;
+        lib_flags |= USB_HOST_LIB_EVENT_FLAGS_NO_CLIENTS;
+    }
+    lib_cond.notify_all();
+    return ESP_OK;
+}
+
+esp_err_t usb_host_client_handle_events(usb_host_client_handle_t client_hdl, TickType_t timeout_ticks)
+{
+    std::unique_lock<std::mutex> guard(lib_lock);
+    bool woken = wait_ticks(client_cond, guard, timeout_ticks, [client_hdl] { return !done_queue.empty() || client_hdl->unblock; });
+    client_hdl->unblock = false;
+    while (!done_queue.empty())
+    {
+        done_t done = done_queue.front();
+        done_queue.pop_front();
+        record_latency(std::chrono::steady_clock::now() - done.time);
+        USBbackend::fromHandle(done.transfer->device_handle)->inflight[USBbackend::ep_slot(done.transfer->bEndpointAddress)]--;
+        guard.unlock();
+        done.transfer->callback(done.transfer);
+        guard.lock();
+    }
+    return woken ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+esp_err_t usb_host_client_unblock(usb_host_client_handle_t client_hdl)
+{
+    {
+        std::lock_guard<std::mutex> guard(lib_lock);
+        client_hdl->unblock = true;
+    }
+    client_cond.notify_all();
+    return ESP_OK;
+}
+
+esp_err_t usb_host_device_open(usb_host_client_handle_t client_hdl, uint8_t dev_addr, usb_device_handle_t* dev_hdl_ret)
+{
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t usb_host_device_close(usb_host_client_handle_t client_hdl, usb_device_handle_t dev_hdl)
+{
+    return ESP_OK;
+}
+
+esp_err_t usb_host_device_info(usb_device_handle_t dev_hdl, usb_device_info_t* dev_info)
+{
+    USBbackend* backend = USBbackend::fromHandle(dev_hdl);
+    memset(dev_info, 0, sizeof(*dev_info));
+    dev_info->speed = backend->speed();
+    dev_info->bMaxPacketSize0 = backend->deviceDescriptor()->bMaxPacketSize0;
+    dev_info->bConfigurationValue = backend->configDescriptor()->bConfigurationValue;
+    return ESP_OK;
+}
+
+esp_err_t usb_host_get_device_descriptor(usb_device_handle_t dev_hdl, const usb_device_desc_t** device_desc)
+{
+    *device_desc = USBbackend::fromHandle(dev_hdl)->deviceDescriptor();
+    return ESP_OK;
+}
+
+esp_err_t usb_host_get_active_config_descriptor(usb_device_handle_t dev_hdl, const usb_config_desc_t** config_desc)
+{
+    *config_desc = USBbackend::fromHandle(dev_hdl)->configDescriptor();
+    return ESP_OK;
+}
@@ -0,0 +1,15 @@
+#pragma once
+#include <stdint.h>
+#include <time.h>
+
+typedef uint32_t esp_cpu_cycle_count_t;
+
+/**
+ * @brief Nanoseconds instead of CPU cycles, only differences of it are used
+ */
+static inline esp_cpu_cycle_count_t esp_cpu_get_cycle_count(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (esp_cpu_cycle_count_t)((uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec);
+}
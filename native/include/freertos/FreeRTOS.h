@@ -0,0 +1,52 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+#include "esp_attr.h"
+
+/**
+ * The subset of the FreeRTOS API the server core uses, on top of pthreads (native/port/freertos.cpp).
+ * Priorities and core affinity are accepted and ignored, one tick is one millisecond.
+ */
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE         0
+#define pdTRUE          1
+#define pdPASS          pdTRUE
+#define pdFAIL          pdFALSE
+#define portMAX_DELAY   ((TickType_t)0xffffffffUL)
+#define configTICK_RATE_HZ CONFIG_FREERTOS_HZ
+#define portTICK_PERIOD_MS (1000 / configTICK_RATE_HZ)
+#define pdMS_TO_TICKS(ms) ((TickType_t)(((TickType_t)(ms) * configTICK_RATE_HZ) / 1000))
+#define tskNO_AFFINITY  0x7fffffff
+
+typedef struct {
+    volatile int locked;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED {0}
+#define portMUX_INITIALIZE(mux) ((mux)->locked = 0)
+
+/**
+ * @brief Spinlock, like the SMP critical sections it only guards a few instructions
+ */
+static inline void native_critical_enter(portMUX_TYPE* mux)
+{
+    while (__atomic_exchange_n(&mux->locked, 1, __ATOMIC_ACQUIRE))
+    {
+        while (__atomic_load_n(&mux->locked, __ATOMIC_RELAXED));
+    }
+}
+
+static inline void native_critical_exit(portMUX_TYPE* mux)
+{
+    __atomic_store_n(&mux->locked, 0, __ATOMIC_RELEASE);
+}
+
+#define taskENTER_CRITICAL(mux) native_critical_enter(mux)
+#define taskEXIT_CRITICAL(mux) native_critical_exit(mux)
+#define taskENTER_CRITICAL_ISR(mux) native_critical_enter(mux)
+#define taskEXIT_CRITICAL_ISR(mux) native_critical_exit(mux)
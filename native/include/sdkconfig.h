@@ -0,0 +1,140 @@
+#pragma once
+/**
+ * Configuration of the native build, the Kconfig defaults of main/Kconfig.projbuild.
+ * Every value can be overridden from CMake, e.g. -DCONFIG_USBIP_MAX_INFLIGHT_URBS=128.
+ */
+#define CONFIG_IDF_TARGET_LINUX 1
+#define CONFIG_IDF_TARGET "linux"
+
+#ifndef CONFIG_FREERTOS_HZ
+#define CONFIG_FREERTOS_HZ 1000
+#endif
+#ifndef CONFIG_EXAMPLE_PORT
+#define CONFIG_EXAMPLE_PORT 3240
+#endif
+#ifndef CONFIG_USBIP_MAX_DEVICES
+#define CONFIG_USBIP_MAX_DEVICES 4
+#endif
+#ifndef CONFIG_USBIP_MAX_SESSIONS
+#define CONFIG_USBIP_MAX_SESSIONS 4
+#endif
+#ifndef CONFIG_USBIP_RX_BUFFER_SIZE
+#define CONFIG_USBIP_RX_BUFFER_SIZE 8192
+#endif
+#ifndef CONFIG_USBIP_TX_QUEUE_DEPTH
+#define CONFIG_USBIP_TX_QUEUE_DEPTH 64
+#endif
+#ifndef CONFIG_USBIP_QOS_STARVATION_LIMIT
+#define CONFIG_USBIP_QOS_STARVATION_LIMIT 8
+#endif
+#ifndef CONFIG_USBIP_XFER_POOL_CTRL_SIZE
+#define CONFIG_USBIP_XFER_POOL_CTRL_SIZE 1024
+#endif
+#ifndef CONFIG_USBIP_XFER_POOL_CTRL_COUNT
+#define CONFIG_USBIP_XFER_POOL_CTRL_COUNT 4
+#endif
+#ifndef CONFIG_USBIP_XFER_POOL_BULK_SIZE
+#define CONFIG_USBIP_XFER_POOL_BULK_SIZE 1024
+#endif
+#ifndef CONFIG_USBIP_XFER_POOL_EP_COUNT
+#define CONFIG_USBIP_XFER_POOL_EP_COUNT 4
+#endif
+#ifndef CONFIG_USBIP_MAX_INFLIGHT_URBS
+#define CONFIG_USBIP_MAX_INFLIGHT_URBS 32
+#endif
+#ifndef CONFIG_USBIP_BUDGET_BYTES
+#define CONFIG_USBIP_BUDGET_BYTES 196608
+#endif
+#ifndef CONFIG_USBIP_DEVICE_BUDGET_URBS
+#define CONFIG_USBIP_DEVICE_BUDGET_URBS 24
+#endif
+#ifndef CONFIG_USBIP_DEVICE_BUDGET_BYTES
+#define CONFIG_USBIP_DEVICE_BUDGET_BYTES 131072
+#endif
+#ifndef CONFIG_USBIP_HOLD_BYTES
+#define CONFIG_USBIP_HOLD_BYTES 393216
+#endif
+#ifndef CONFIG_USBIP_EP_DEPTH_CTRL
+#define CONFIG_USBIP_EP_DEPTH_CTRL 1
+#endif
+#ifndef CONFIG_USBIP_EP_DEPTH_INTR
+#define CONFIG_USBIP_EP_DEPTH_INTR 2
+#endif
+#ifndef CONFIG_USBIP_EP_DEPTH_ISO
+#define CONFIG_USBIP_EP_DEPTH_ISO 8
+#endif
+#ifndef CONFIG_USBIP_EP_DEPTH_BULK
+#define CONFIG_USBIP_EP_DEPTH_BULK 8
+#endif
+#ifndef CONFIG_USBIP_STREAM_THRESHOLD
+#define CONFIG_USBIP_STREAM_THRESHOLD 2048
+#endif
+#ifndef CONFIG_USBIP_MAX_URB_SIZE
+#define CONFIG_USBIP_MAX_URB_SIZE 65536
+#endif
+#ifndef CONFIG_USBIP_ISO_POOL_PACKETS
+#define CONFIG_USBIP_ISO_POOL_PACKETS 8
+#endif
+#if CONFIG_USBIP_TRACE
+#ifndef CONFIG_USBIP_TRACE_RECORDS
+#define CONFIG_USBIP_TRACE_RECORDS 1024
+#endif
+#ifndef CONFIG_USBIP_TRACE_PORT
+#define CONFIG_USBIP_TRACE_PORT 3241
+#endif
+#endif
+#if CONFIG_USBIP_READAHEAD
+#ifndef CONFIG_USBIP_READAHEAD_BULK_DEPTH
+#define CONFIG_USBIP_READAHEAD_BULK_DEPTH 2
+#endif
+#ifndef CONFIG_USBIP_READAHEAD_INTR_DEPTH
+#define CONFIG_USBIP_READAHEAD_INTR_DEPTH 2
+#endif
+#endif
+#if CONFIG_USBIP_SCHED_CUSTOM
+#ifndef CONFIG_USBIP_SCHED_CONN_PRIO
+#define CONFIG_USBIP_SCHED_CONN_PRIO 21
+#endif
+#ifndef CONFIG_USBIP_SCHED_CONN_CORE
+#define CONFIG_USBIP_SCHED_CONN_CORE 1
+#endif
+#ifndef CONFIG_USBIP_SCHED_CONN_STACK
+#define CONFIG_USBIP_SCHED_CONN_STACK 4096
+#endif
+#ifndef CONFIG_USBIP_SCHED_URB_PRIO
+#define CONFIG_USBIP_SCHED_URB_PRIO 21
+#endif
+#ifndef CONFIG_USBIP_SCHED_URB_CORE
+#define CONFIG_USBIP_SCHED_URB_CORE 0
+#endif
+#ifndef CONFIG_USBIP_SCHED_URB_STACK
+#define CONFIG_USBIP_SCHED_URB_STACK 4096
+#endif
+#ifndef CONFIG_USBIP_SCHED_USB_PRIO
+#define CONFIG_USBIP_SCHED_USB_PRIO 20
+#endif
+#ifndef CONFIG_USBIP_SCHED_USB_CORE
+#define CONFIG_USBIP_SCHED_USB_CORE -1
+#endif
+#ifndef CONFIG_USBIP_SCHED_USB_STACK
+#define CONFIG_USBIP_SCHED_USB_STACK 3072
+#endif
+#ifndef CONFIG_USBIP_SCHED_USB_LIB_PRIO
+#define CONFIG_USBIP_SCHED_USB_LIB_PRIO 20
+#endif
+#ifndef CONFIG_USBIP_SCHED_USB_LIB_CORE
+#define CONFIG_USBIP_SCHED_USB_LIB_CORE -1
+#endif
+#ifndef CONFIG_USBIP_SCHED_USB_LIB_STACK
+#define CONFIG_USBIP_SCHED_USB_LIB_STACK 3072
+#endif
+#ifndef CONFIG_USBIP_SCHED_EVENTS_PRIO
+#define CONFIG_USBIP_SCHED_EVENTS_PRIO 21
+#endif
+#ifndef CONFIG_USBIP_SCHED_EVENTS_CORE
+#define CONFIG_USBIP_SCHED_EVENTS_CORE 0
+#endif
+#ifndef CONFIG_USBIP_SCHED_EVENTS_STACK
+#define CONFIG_USBIP_SCHED_EVENTS_STACK 4096
+#endif
+#endif
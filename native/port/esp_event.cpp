@@ -0,0 +1,108 @@
+#include <string.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+#include "esp_event.h"
+#include "freertos/task.h"
+
+/**
+ * esp_event loop with a dedicated task: posts copy their data into a bounded queue, the task
+ * calls the matching handlers one event at a time.
+ */
+struct esp_event_loop
+{
+    struct handler_t{
+        esp_event_base_t base;
+        int32_t id;
+        esp_event_handler_t fn;
+        void* arg;
+    };
+    struct event_t{
+        esp_event_base_t base;
+        int32_t id;
+        std::vector<uint8_t> data;
+    };
+
+    std::mutex lock;
+    std::condition_variable cond;
+    std::deque<event_t> queue;
+    std::vector<handler_t> handlers;
+    size_t queue_size;
+    bool running = true;
+};
+
+static void loop_task(void* arg)
+{
+    esp_event_loop* loop = (esp_event_loop*)arg;
+    std::unique_lock<std::mutex> lock(loop->lock);
+    while (loop->running)
+    {
+        loop->cond.wait(lock, [loop] { return !loop->queue.empty() || !loop->running; });
+        if (loop->queue.empty()) continue;
+
+        esp_event_loop::event_t event = std::move(loop->queue.front());
+        loop->queue.pop_front();
+        std::vector<esp_event_loop::handler_t> handlers = loop->handlers;
+        lock.unlock();
+        loop->cond.notify_all();
+
+        for (auto& h : handlers)
+        {
+            if (h.base != ESP_EVENT_ANY_BASE && strcmp(h.base, event.base)) continue;
+            if (h.id != ESP_EVENT_ANY_ID && h.id != event.id) continue;
+            h.fn(h.arg, event.base, event.id, event.data.empty() ? NULL : event.data.data());
+        }
+        lock.lock();
+    }
+    lock.unlock();
+    delete loop;
+    vTaskDelete(NULL);
+}
+
+extern "C" esp_err_t esp_event_loop_create(const esp_event_loop_args_t* event_loop_args, esp_event_loop_handle_t* event_loop)
+{
+    esp_event_loop* loop = new esp_event_loop();
+    loop->queue_size = event_loop_args->queue_size;
+    if (pdPASS != xTaskCreatePinnedToCore(loop_task, event_loop_args->task_name, event_loop_args->task_stack_size, loop,
+                                          event_loop_args->task_priority, NULL, event_loop_args->task_core_id))
+    {
+        delete loop;
+        return ESP_FAIL;
+    }
+    *event_loop = loop;
+    return ESP_OK;
+}
+
+extern "C" esp_err_t esp_event_loop_delete(esp_event_loop_handle_t event_loop)
+{
+    {
+        std::lock_guard<std::mutex> guard(event_loop->lock);
+        event_loop->running = false;
+    }
+    event_loop->cond.notify_all();
+    return ESP_OK;
+}
+
+extern "C" esp_err_t esp_event_handler_register_with(esp_event_loop_handle_t event_loop, esp_event_base_t event_base, int32_t event_id,
+                                                     esp_event_handler_t event_handler, void* event_handler_arg)
+{
+    std::lock_guard<std::mutex> guard(event_loop->lock);
+    event_loop->handlers.push_back({event_base, event_id, event_handler, event_handler_arg});
+    return ESP_OK;
+}
+
+extern "C" esp_err_t esp_event_post_to(esp_event_loop_handle_t event_loop, esp_event_base_t event_base, int32_t event_id,
+                                       const void* event_data, size_t event_data_size, TickType_t ticks_to_wait)
+{
+    std::unique_lock<std::mutex> lock(event_loop->lock);
+    auto has_room = [event_loop] { return event_loop->queue.size() < event_loop->queue_size; };
+    if (ticks_to_wait == portMAX_DELAY) event_loop->cond.wait(lock, has_room);
+    else if (!event_loop->cond.wait_for(lock, std::chrono::milliseconds(ticks_to_wait * portTICK_PERIOD_MS), has_room)) return ESP_ERR_TIMEOUT;
+
+    const uint8_t* data = (const uint8_t*)event_data;
+    event_loop->queue.push_back({event_base, event_id, std::vector<uint8_t>(data, data + (data ? event_data_size : 0))});
+    lock.unlock();
+    event_loop->cond.notify_all();
+    return ESP_OK;
+}
@@ -0,0 +1,58 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "esp_err.h"
+#include "esp_log.h"
+
+esp_log_level_t esp_log_level = ESP_LOG_INFO;
+
+static const char level_chars[] = "NEWIDV";
+
+void esp_log_level_set(const char* tag, esp_log_level_t level)
+{
+    esp_log_level = level;
+}
+
+void esp_log_write(esp_log_level_t level, const char* tag, const char* format, ...)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    char line[512];
+    int len = snprintf(line, sizeof(line), "%c (%ld.%03ld) %s: ", level_chars[level], (long)ts.tv_sec, ts.tv_nsec / 1000000, tag);
+    va_list args;
+    va_start(args, format);
+    if (len < (int)sizeof(line)) vsnprintf(line + len, sizeof(line) - len, format, args);
+    va_end(args);
+    fprintf(stderr, "%s\n", line);
+}
+
+void esp_log_buffer_hex_internal(const char* tag, const void* buffer, uint16_t buff_len, esp_log_level_t level)
+{
+    const uint8_t* bytes = (const uint8_t*)buffer;
+    for (uint16_t off = 0; off < buff_len; off += 16)
+    {
+        char line[16 * 3 + 1] = {0};
+        for (uint16_t n = 0; n < 16 && off + n < buff_len; n++) sprintf(line + 3 * n, "%02x ", bytes[off + n]);
+        esp_log_write(level, tag, "%s", line);
+    }
+}
+
+const char* esp_err_to_name(esp_err_t code)
+{
+    switch (code)
+    {
+    case ESP_OK: return "ESP_OK";
+    case ESP_FAIL: return "ESP_FAIL";
+    case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE: return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND: return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_NOT_SUPPORTED: return "ESP_ERR_NOT_SUPPORTED";
+    case ESP_ERR_TIMEOUT: return "ESP_ERR_TIMEOUT";
+    case ESP_ERR_NOT_FINISHED: return "ESP_ERR_NOT_FINISHED";
+    default: return "UNKNOWN ERROR";
+    }
+}
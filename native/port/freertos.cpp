@@ -0,0 +1,174 @@
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+/**
+ * FreeRTOS tasks, notifications and semaphores on pthreads. Every task is a detached thread,
+ * the handle lives as long as the process: a session may still notify a task that just ended.
+ * A pinned task is bound to CPU xCoreID of the machine, modulo its CPU count; priorities are ignored,
+ * ordering threads by them would need realtime scheduling.
+ */
+struct tskTaskControlBlock
+{
+    std::mutex lock;
+    std::condition_variable cond;
+    uint32_t notify = 0;
+    TaskFunction_t fn = nullptr;
+    void* arg = nullptr;
+    char name[16] = {};
+};
+
+struct QueueDefinition
+{
+    std::mutex lock;
+    std::condition_variable cond;
+    UBaseType_t count;
+    UBaseType_t max;
+};
+
+static thread_local TaskHandle_t current_task;
+
+static std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+template <typename Lock, typename Pred>
+static bool wait_ticks(std::condition_variable& cond, Lock& lock, TickType_t ticks, Pred pred)
+{
+    if (ticks == portMAX_DELAY)
+    {
+        cond.wait(lock, pred);
+        return true;
+    }
+    return cond.wait_for(lock, std::chrono::milliseconds(ticks * portTICK_PERIOD_MS), pred);
+}
+
+static void* task_entry(void* arg)
+{
+    TaskHandle_t task = (TaskHandle_t)arg;
+    current_task = task;
+    pthread_setname_np(pthread_self(), task->name);
+    task->fn(task->arg);
+    return NULL;
+}
+
+extern "C" BaseType_t xTaskCreatePinnedToCore(TaskFunction_t pvTaskCode, const char* pcName, uint32_t usStackDepth, void* pvParameters,
+                                              UBaseType_t uxPriority, TaskHandle_t* pvCreatedTask, BaseType_t xCoreID)
+{
+    TaskHandle_t task = new tskTaskControlBlock();
+    task->fn = pvTaskCode;
+    task->arg = pvParameters;
+    strncpy(task->name, pcName ? pcName : "task", sizeof(task->name) - 1);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (xCoreID != tskNO_AFFINITY && xCoreID >= 0)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(xCoreID % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+    pthread_t thread;
+    int rc = pthread_create(&thread, &attr, task_entry, task);
+    pthread_attr_destroy(&attr);
+    if (rc != 0)
+    {
+        delete task;
+        return pdFAIL;
+    }
+    if (pvCreatedTask) *pvCreatedTask = task;
+    return pdPASS;
+}
+
+extern "C" void vTaskDelete(TaskHandle_t xTaskToDelete)
+{
+    if (xTaskToDelete == NULL || xTaskToDelete == current_task) pthread_exit(NULL);
+    abort();
+}
+
+extern "C" void vTaskDelay(TickType_t xTicksToDelay)
+{
+    struct timespec ts = {
+        .tv_sec = (time_t)(xTicksToDelay * portTICK_PERIOD_MS / 1000),
+        .tv_nsec = (long)(xTicksToDelay * portTICK_PERIOD_MS % 1000) * 1000000L
+    };
+    nanosleep(&ts, NULL);
+}
+
+extern "C" TickType_t xTaskGetTickCount(void)
+{
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_time);
+    return (TickType_t)(ms.count() / portTICK_PERIOD_MS);
+}
+
+extern "C" TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    if (current_task == NULL)
+    {
+        current_task = new tskTaskControlBlock();
+        pthread_getname_np(pthread_self(), current_task->name, sizeof(current_task->name));
+    }
+    return current_task;
+}
+
+extern "C" BaseType_t xTaskNotifyGive(TaskHandle_t xTaskToNotify)
+{
+    {
+        std::lock_guard<std::mutex> guard(xTaskToNotify->lock);
+        xTaskToNotify->notify++;
+    }
+    xTaskToNotify->cond.notify_one();
+    return pdPASS;
+}
+
+extern "C" uint32_t ulTaskNotifyTake(BaseType_t xClearCountOnExit, TickType_t xTicksToWait)
+{
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    std::unique_lock<std::mutex> lock(task->lock);
+    if (!wait_ticks(task->cond, lock, xTicksToWait, [task] { return task->notify > 0; })) return 0;
+
+    uint32_t value = task->notify;
+    if (xClearCountOnExit) task->notify = 0;
+    else task->notify--;
+    return value;
+}
+
+extern "C" SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t uxMaxCount, UBaseType_t uxInitialCount)
+{
+    SemaphoreHandle_t sem = new QueueDefinition();
+    sem->count = uxInitialCount;
+    sem->max = uxMaxCount;
+    return sem;
+}
+
+extern "C" void vSemaphoreDelete(SemaphoreHandle_t xSemaphore)
+{
+    delete xSemaphore;
+}
+
+extern "C" BaseType_t xSemaphoreTake(SemaphoreHandle_t xSemaphore, TickType_t xBlockTime)
+{
+    std::unique_lock<std::mutex> lock(xSemaphore->lock);
+    if (!wait_ticks(xSemaphore->cond, lock, xBlockTime, [xSemaphore] { return xSemaphore->count > 0; })) return pdFALSE;
+    xSemaphore->count--;
+    return pdTRUE;
+}
+
+extern "C" BaseType_t xSemaphoreGive(SemaphoreHandle_t xSemaphore)
+{
+    {
+        std::lock_guard<std::mutex> guard(xSemaphore->lock);
+        if (xSemaphore->count >= xSemaphore->max) return pdFALSE;
+        xSemaphore->count++;
+    }
+    xSemaphore->cond.notify_one();
+    return pdTRUE;
+}
@@ -0,0 +1,94 @@
+#include <stdlib.h>
+#include <string.h>
+#include "usb/usb_host.h"
+
+/**
+ * Transfer allocation and descriptor parsing with the semantics of the ESP-IDF host library
+ */
+esp_err_t usb_host_transfer_alloc(size_t data_buffer_size, int num_isoc_packets, usb_transfer_t** transfer)
+{
+    usb_transfer_t* t = calloc(1, sizeof(usb_transfer_t) + num_isoc_packets * sizeof(usb_isoc_packet_desc_t));
+    uint8_t* buffer = data_buffer_size ? malloc(data_buffer_size) : NULL;
+    if (t == NULL || (data_buffer_size && buffer == NULL))
+    {
+        free(t);
+        free(buffer);
+        return ESP_ERR_NO_MEM;
+    }
+
+    usb_transfer_t init = {
+        .data_buffer = buffer,
+        .data_buffer_size = data_buffer_size,
+        .num_isoc_packets = num_isoc_packets,
+    };
+    memcpy(t, &init, sizeof(usb_transfer_t));
+    *transfer = t;
+    return ESP_OK;
+}
+
+esp_err_t usb_host_transfer_free(usb_transfer_t* transfer)
+{
+    if (transfer == NULL) return ESP_OK;
+    free(transfer->data_buffer);
+    free(transfer);
+    return ESP_OK;
+}
+
+const usb_standard_desc_t* usb_parse_next_descriptor(const usb_standard_desc_t* cur_desc, uint16_t wTotalLength, int* offset)
+{
+    if (*offset >= wTotalLength || *offset + cur_desc->bLength >= wTotalLength) return NULL;
+    if (cur_desc->bLength == 0) return NULL;
+
+    *offset += cur_desc->bLength;
+    return (const usb_standard_desc_t*)((const uint8_t*)cur_desc + cur_desc->bLength);
+}
+
+const usb_standard_desc_t* usb_parse_next_descriptor_of_type(const usb_standard_desc_t* cur_desc, uint16_t wTotalLength,
+                                                             uint8_t bDescriptorType, int* offset)
+{
+    int _offset = *offset;
+    const usb_standard_desc_t* desc = cur_desc;
+    while ((desc = usb_parse_next_descriptor(desc, wTotalLength, &_offset)))
+    {
+        if (desc->bDescriptorType == bDescriptorType)
+        {
+            *offset = _offset;
+            return desc;
+        }
+    }
+    return NULL;
+}
+
+const usb_intf_desc_t* usb_parse_interface_descriptor(const usb_config_desc_t* config_desc, uint8_t bInterfaceNumber,
+                                                      uint8_t bAlternateSetting, int* offset)
+{
+    if (bInterfaceNumber >= config_desc->bNumInterfaces) return NULL;
+
+    int _offset = 0;
+    const usb_standard_desc_t* desc = (const usb_standard_desc_t*)config_desc;
+    while ((desc = usb_parse_next_descriptor_of_type(desc, config_desc->wTotalLength, USB_B_DESCRIPTOR_TYPE_INTERFACE, &_offset)))
+    {
+        const usb_intf_desc_t* intf = (const usb_intf_desc_t*)desc;
+        if (intf->bInterfaceNumber == bInterfaceNumber && intf->bAlternateSetting == bAlternateSetting)
+        {
+            if (offset) *offset = _offset;
+            return intf;
+        }
+    }
+    return NULL;
+}
+
+const usb_ep_desc_t* usb_parse_endpoint_descriptor_by_index(const usb_intf_desc_t* intf_desc, int index, int wTotalLength, int* offset)
+{
+    if (index >= intf_desc->bNumEndpoints) return NULL;
+
+    int _offset = *offset;
+    const usb_standard_desc_t* desc = (const usb_standard_desc_t*)intf_desc;
+    for (int n = 0; n <= index; n++)
+    {
+        desc = usb_parse_next_descriptor_of_type(desc, wTotalLength, USB_B_DESCRIPTOR_TYPE_ENDPOINT, &_offset);
+        if (desc == NULL) return NULL;
+    }
+    *offset = _offset;
+    return (const usb_ep_desc_t*)desc;
+}
@@ -0,0 +1,257 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <thread>
+#include <vector>
+#include "esp_log.h"
+#include "lwip/sockets.h"
+#include "usbip.hpp"
+#include "usbip_session.h"
+#include "usbip_sched.h"
+#include "usbip_trace.h"
+#include "usb_host.hpp"
+#include "usb_backend.hpp"
+#include "sim_device.hpp"
+
+/**
+ * Native USB/IP server: the core of main/ over host sockets, exporting simulated devices. Every
+ * connection gets its own task, like the tcp_tx tasks on the target. SIGINT and SIGTERM print the
+ * completion to callback latency of the host library as JSON before it exits.
+ */
+static const char *TAG = "usbip_server";
+
+static void usage(const char* name)
+{
+    sim_timing_t timing = SIM_TIMING_DEFAULT;
+    fprintf(stderr, "usage: %s [-p port] [-d device]... [-L us] [-B bps] [-N us] [-W bytes] [-T port] [-S layout] [-v]...\n"
+                    "  -p port   TCP port to listen on, default %d\n"
+                    "  -d device simulated device to export: loopback, hid, cdc, combo or msc[=KiB], repeat for more\n"
+                    "  -L us     latency from the last packet to the completion, default %" PRIu32 "\n"
+                    "  -B bps    bus bandwidth, 0 for unlimited, default %" PRIu32 " (full speed)\n"
+                    "  -N us     retry interval of a bulk endpoint that NAKed, default %" PRIu32 "\n"
+                    "  -W bytes  socket send buffer, e.g. 5744 for the lwIP default; the host default otherwise\n"
+#ifdef CONFIG_USBIP_TRACE
+                    "  -T port   URB trace side channel, default %d, see bench/usbip_trace.py\n"
+#endif
+                    "  -S layout task layout: %s, default %s\n"
+                    "  -v        errors, -vv warnings and so on; logging is off by default like on the target\n"
+                    "SIGUSR1 unplugs the devices, SIGINT or SIGTERM prints the callback latency and exits\n",
+            name, CONFIG_EXAMPLE_PORT, timing.latency_us, timing.bandwidth_bps, timing.nak_retry_us
+#ifdef CONFIG_USBIP_TRACE
+            , CONFIG_USBIP_TRACE_PORT
+#endif
+            , usbip_sched_names(), usbip_layout->name);
+}
+
+/**
+ * @brief Upper bound in us of the bucket holding the q quantile
+ */
+static uint64_t latency_quantile(const usb_latency_t* latency, double q)
+{
+    uint64_t rank = (uint64_t)(q * latency->count);
+    uint64_t seen = 0;
+    for (int n = 0; n < USB_LATENCY_BUCKETS; n++)
+    {
+        seen += latency->buckets[n];
+        if (seen > rank) return 1ull << n;
+    }
+    return 1ull << (USB_LATENCY_BUCKETS - 1);
+}
+
+static void report_task(sigset_t signals)
+{
+    int sig;
+    sigwait(&signals, &sig);
+
+    usb_latency_t latency;
+    usb_backend_latency(&latency);
+    printf("{\"callback_latency_us\": {\"count\": %" PRIu64 ", \"mean\": %.1f, \"p50\": %" PRIu64 ", \"p99\": %" PRIu64 ", \"max\": %.1f, \"buckets\": [",
+           latency.count, latency.count ? latency.total_ns / 1000.0 / latency.count : 0.0,
+           latency_quantile(&latency, 0.5), latency_quantile(&latency, 0.99), latency.max_ns / 1000.0);
+    for (int n = 0; n < USB_LATENCY_BUCKETS; n++) printf("%s%" PRIu64, n ? ", " : "", latency.buckets[n]);
+    printf("]}}\n");
+    fflush(stdout);
+    _exit(0);
+}
+
+/**
+ * @brief Unplugs the devices on SIGUSR1, like a USB_HOST_CLIENT_EVENT_DEV_GONE on the target
+ */
+static void unplug_task(sigset_t signals, SimBus* bus, std::vector<SimDevice*> devices)
+{
+    int sig;
+    sigwait(&signals, &sig);
+    for (SimDevice* device : devices)
+    {
+        bus->unplug(device);
+        USBipDevice* dev = USBipDevice::find(device->handle());
+        if (dev) dev->retire();
+    }
+}
+
+static void connection_task(void* arg)
+{
+    usbip_connection((int)(intptr_t)arg);
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief Exports the device like a USB_HOST_CLIENT_EVENT_NEW_DEV on the target
+ */
+static bool attach(USBbackend* backend)
+{
+    USBipDevice* device = new USBipDevice();
+    if (!device->init(NULL, backend->handle()))
+    {
+        delete device;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    int port = CONFIG_EXAMPLE_PORT;
+    int sndbuf = 0;
+    esp_log_level_t level = ESP_LOG_NONE;
+    sim_timing_t timing = SIM_TIMING_DEFAULT;
+    std::vector<const char*> names;
+#ifdef CONFIG_USBIP_TRACE
+    int trace_port = CONFIG_USBIP_TRACE_PORT;
+#endif
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:d:L:B:N:W:T:S:vh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'd':
+            names.push_back(optarg);
+            break;
+        case 'L':
+            timing.latency_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'B':
+            timing.bandwidth_bps = strtoul(optarg, NULL, 0);
+            break;
+        case 'N':
+            timing.nak_retry_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'W':
+            sndbuf = atoi(optarg);
+            break;
+#ifdef CONFIG_USBIP_TRACE
+        case 'T':
+            trace_port = atoi(optarg);
+            break;
+#endif
+        case 'S':
+            if (!usbip_sched_select(optarg))
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'v':
+            if (level < ESP_LOG_VERBOSE) level = (esp_log_level_t)(level + 1);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    esp_log_level_set("*", level);
+    ESP_LOGI(TAG, "task layout %s", usbip_layout->name);
+
+    // a host that disconnects while a reply is sent must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    // blocked before any task starts, so only the report task takes them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigset_t unplug;
+    sigemptyset(&unplug);
+    sigaddset(&unplug, SIGUSR1);
+    sigset_t blocked = signals;
+    sigaddset(&blocked, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &blocked, NULL);
+    std::thread(report_task, signals).detach();
+
+    new USBIP();
+    // host library and client event tasks, the simulated devices complete transfers through them
+    USBhost* host = new USBhost();
+    const usbip_task_cfg_t* usb = usbip_sched_stage(USBIP_STAGE_USB);
+    host->clientTaskConfig(usb->priority, usb->core, usb->stack);
+    const usbip_task_cfg_t* lib = usbip_sched_stage(USBIP_STAGE_USB_LIB);
+    host->libTaskConfig(lib->priority, lib->core, lib->stack);
+    host->init();
+#ifdef CONFIG_USBIP_TRACE
+    usbip_trace_server_start(trace_port);
+#endif
+
+    SimBus* bus = new SimBus(timing);
+    std::vector<SimDevice*> devices;
+    for (const char* name : names)
+    {
+        SimDevice* device = sim_device_create(bus, name);
+        if (device == NULL || !attach(device))
+        {
+            ESP_LOGE(TAG, "can not export device %s", name);
+            return 1;
+        }
+        devices.push_back(device);
+    }
+    std::thread(unplug_task, unplug, bus, devices).detach();
+
+    int listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if (listen_sock < 0)
+    {
+        ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+        return 1;
+    }
+    int on = 1;
+    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr)) || listen(listen_sock, CONFIG_USBIP_MAX_SESSIONS))
+    {
+        ESP_LOGE(TAG, "Unable to listen on port %d: errno %d", port, errno);
+        close(listen_sock);
+        return 1;
+    }
+    ESP_LOGW(TAG, "listening on port %d", port);
+
+    while (1)
+    {
+        struct sockaddr_in source_addr;
+        socklen_t addr_len = sizeof(source_addr);
+        int sock = accept(listen_sock, (struct sockaddr *)&source_addr, &addr_len);
+        if (sock < 0)
+        {
+            if (errno == EINTR) continue;
+            ESP_LOGE(TAG, "Unable to accept connection: errno %d", errno);
+            break;
+        }
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        // replies the kernel buffers are out of the TX queue's hands, the target has a few KiB
+        if (sndbuf) setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+        char addr_str[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &source_addr.sin_addr, addr_str, sizeof(addr_str));
+        ESP_LOGI(TAG, "Socket accepted ip address: %s", addr_str);
+        usbip_sched_create(USBIP_STAGE_CONN, connection_task, "tcp_tx", (void*)(intptr_t)sock, NULL);
+    }
+
+    close(listen_sock);
+    return 1;
+}
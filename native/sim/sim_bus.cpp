@@ -0,0 +1,273 @@
+#include <string.h>
+#include <chrono>
+#include "esp_log.h"
+#include "sim_device.hpp"
+
+static const char *TAG = "sim_bus";
+
+// sync, PIDs, address, CRCs, EOPs and the handshake around every data packet, in bytes
+#define PACKET_OVERHEAD     13
+// the bus runs ahead of real time by up to this much instead of sleeping for every packet
+#define SLACK_US            500
+
+static uint64_t now_us()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+SimBus::SimBus(const sim_timing_t& timing) : _timing(timing)
+{
+    bus_time = now_us();
+    thread = std::thread(&SimBus::run, this);
+}
+
+SimBus::~SimBus()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        running = false;
+    }
+    cond.notify_one();
+    thread.join();
+}
+
+void SimBus::attach(SimDevice* device)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    devices.push_back(device);
+}
+
+uint64_t SimBus::wire_us(int bytes, int packets) const
+{
+    if (_timing.bandwidth_bps == 0) return 0;
+    return (uint64_t)(bytes + packets * PACKET_OVERHEAD) * 8 * 1000000 / _timing.bandwidth_bps;
+}
+
+esp_err_t SimBus::submit(SimDevice* device, usb_transfer_t* transfer)
+{
+    ep_t* ep = device->ep(transfer->bEndpointAddress);
+    bool ctrl = (transfer->bEndpointAddress & 0x0f) == 0;
+    if (transfer->num_isoc_packets || (!ctrl && ep->mps == 0)) return ESP_ERR_NOT_SUPPORTED;
+    if (ctrl && transfer->num_bytes < (int)sizeof(usb_setup_packet_t)) return ESP_ERR_INVALID_SIZE;
+    if (transfer->num_bytes > (int)transfer->data_buffer_size) return ESP_ERR_INVALID_SIZE;
+
+    transfer->actual_num_bytes = 0;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (device->unplugged) return ESP_ERR_INVALID_STATE;
+        if (ep->queue.empty()) ep->done = 0;
+        ep->queue.push_back(transfer);
+    }
+    cond.notify_one();
+    return ESP_OK;
+}
+
+esp_err_t SimBus::flush(SimDevice* device, uint8_t bEndpointAddress)
+{
+    ep_t* ep = device->ep(bEndpointAddress);
+    std::lock_guard<std::mutex> guard(lock);
+
+    // transfers that are done but still in their latency come back first, like on a real host
+    for (auto it = finished.begin(); it != finished.end();)
+    {
+        usb_transfer_t* transfer = it->second;
+        if (transfer->device_handle == device->handle() && transfer->bEndpointAddress == bEndpointAddress)
+        {
+            usb_backend_complete(transfer);
+            it = finished.erase(it);
+        }
+        else it++;
+    }
+
+    bool head = true;
+    for (usb_transfer_t* transfer : ep->queue)
+    {
+        transfer->status = USB_TRANSFER_STATUS_CANCELED;
+        transfer->actual_num_bytes = head && (bEndpointAddress & 0x0f) ? ep->done : 0;
+        usb_backend_complete(transfer);
+        head = false;
+    }
+    ep->queue.clear();
+    ep->done = 0;
+    return ESP_OK;
+}
+
+void SimBus::unplug(SimDevice* device)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    device->unplugged = true;
+    // done ones keep their status, like on a real host they were finished before the disconnect
+    for (auto it = finished.begin(); it != finished.end();)
+    {
+        if (it->second->device_handle == device->handle())
+        {
+            usb_backend_complete(it->second);
+            it = finished.erase(it);
+        }
+        else it++;
+    }
+    for (ep_t& ep : device->eps)
+    {
+        for (usb_transfer_t* transfer : ep.queue)
+        {
+            transfer->status = USB_TRANSFER_STATUS_NO_DEVICE;
+            transfer->actual_num_bytes = 0;
+            usb_backend_complete(transfer);
+        }
+        ep.queue.clear();
+        ep.done = 0;
+    }
+}
+
+void SimBus::finish(ep_t* ep, usb_transfer_status_t status, int actual)
+{
+    usb_transfer_t* transfer = ep->queue.front();
+    ep->queue.pop_front();
+    ep->done = 0;
+    transfer->status = status;
+    transfer->actual_num_bytes = actual;
+    finished.emplace(bus_time + _timing.latency_us, transfer);
+}
+
+/**
+ * @brief Next endpoint to poll at bus_time; control and interrupt before bulk, bulk round robin
+ */
+bool SimBus::pick(SimDevice** device, ep_t** ep, uint64_t* next_ready)
+{
+    ep_t* bulk = nullptr;
+    SimDevice* bulk_dev = nullptr;
+    size_t total = devices.size() * 32;
+    *next_ready = UINT64_MAX;
+
+    for (size_t i = 0; i < total; i++)
+    {
+        size_t idx = (rr + i) % total;
+        SimDevice* dev = devices[idx / 32];
+        ep_t* e = &dev->eps[idx % 32];
+        if (e->queue.empty()) continue;
+        if (e->ready_at > bus_time)
+        {
+            if (e->ready_at < *next_ready) *next_ready = e->ready_at;
+            continue;
+        }
+        if (e->type != USB_TRANSFER_TYPE_BULK)
+        {
+            *device = dev;
+            *ep = e;
+            return true;
+        }
+        if (bulk == nullptr)
+        {
+            bulk = e;
+            bulk_dev = dev;
+            rr = idx + 1;
+        }
+    }
+    *device = bulk_dev;
+    *ep = bulk;
+    return bulk != nullptr;
+}
+
+void SimBus::control(SimDevice* device, ep_t* ep, usb_transfer_t* transfer)
+{
+    usb_setup_packet_t* setup = (usb_setup_packet_t*)transfer->data_buffer;
+    uint8_t* data = transfer->data_buffer + sizeof(usb_setup_packet_t);
+    int length = transfer->num_bytes - sizeof(usb_setup_packet_t);
+    if (setup->wLength < length) length = setup->wLength;
+    bool in = setup->bmRequestType & USB_BM_REQUEST_TYPE_DIR_IN;
+
+    int n = device->control(setup, data, length);
+    int mps0 = device->dev_desc.bMaxPacketSize0;
+    if (n >= 0 && in && n < length) length = n;
+    // setup, data packets and the status stage
+    bus_time += wire_us(sizeof(usb_setup_packet_t) + length, 2 + (length + mps0 - 1) / mps0);
+
+    if (n < 0) finish(ep, USB_TRANSFER_STATUS_STALL, sizeof(usb_setup_packet_t));
+    else finish(ep, USB_TRANSFER_STATUS_COMPLETED, sizeof(usb_setup_packet_t) + length);
+}
+
+void SimBus::transact(SimDevice* device, ep_t* ep)
+{
+    usb_transfer_t* transfer = ep->queue.front();
+    uint8_t address = transfer->bEndpointAddress;
+    if ((address & 0x0f) == 0)
+    {
+        control(device, ep, transfer);
+        return;
+    }
+
+    bool in = address & 0x80;
+    int remaining = transfer->num_bytes - ep->done;
+    int len = remaining < ep->mps ? remaining : ep->mps;
+    if (in && remaining == 0)
+    {
+        finish(ep, USB_TRANSFER_STATUS_COMPLETED, ep->done);
+        return;
+    }
+
+    int n = in ? device->in(address, transfer->data_buffer + ep->done, len)
+               : device->out(address, transfer->data_buffer + ep->done, len);
+    if (ep->type == USB_TRANSFER_TYPE_INTR) ep->ready_at = bus_time + ep->interval_us;
+
+    if (n == SIM_NAK)
+    {
+        bus_time += wire_us(0, 1);
+        if (ep->type != USB_TRANSFER_TYPE_INTR) ep->ready_at = bus_time + _timing.nak_retry_us;
+        return;
+    }
+    if (n == SIM_STALL)
+    {
+        bus_time += wire_us(0, 1);
+        finish(ep, USB_TRANSFER_STATUS_STALL, ep->done);
+        return;
+    }
+
+    bus_time += wire_us(n, 1);
+    ep->done += n;
+    // IN ends with a short packet, OUT once everything is sent (one zero length packet for an empty transfer)
+    if (ep->done >= transfer->num_bytes || (in && n < ep->mps))
+    {
+        finish(ep, USB_TRANSFER_STATUS_COMPLETED, ep->done);
+    }
+}
+
+void SimBus::run()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while (running)
+    {
+        uint64_t now = now_us();
+        while (!finished.empty() && finished.begin()->first <= now)
+        {
+            usb_backend_complete(finished.begin()->second);
+            finished.erase(finished.begin());
+        }
+
+        // an idle bus catches up with real time
+        if (bus_time < now) bus_time = now;
+        uint64_t wake = UINT64_MAX;
+        while (bus_time <= now + SLACK_US)
+        {
+            SimDevice* device;
+            ep_t* ep;
+            uint64_t next_ready;
+            if (pick(&device, &ep, &next_ready))
+            {
+                transact(device, ep);
+                continue;
+            }
+            if (next_ready > now + SLACK_US)
+            {
+                wake = next_ready;
+                break;
+            }
+            bus_time = next_ready;
+        }
+        if (bus_time > now + SLACK_US && bus_time - SLACK_US < wake) wake = bus_time - SLACK_US;
+        if (!finished.empty() && finished.begin()->first < wake) wake = finished.begin()->first;
+
+        if (wake == UINT64_MAX) cond.wait(guard);
+        else if (wake > now) cond.wait_for(guard, std::chrono::microseconds(wake - now));
+    }
+    ESP_LOGI(TAG, "bus stopped");
+}
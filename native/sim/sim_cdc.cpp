@@ -0,0 +1,69 @@
+#include <string.h>
+#include "sim_device.hpp"
+
+#define CDC_REQUEST_SET_LINE_CODING         0x20
+#define CDC_REQUEST_GET_LINE_CODING         0x21
+#define CDC_REQUEST_SET_CONTROL_LINE_STATE  0x22
+
+/**
+ * CDC-ACM serial port with a loopback plug: bytes written to the data interface are read back,
+ * the notification endpoint always NAKs. Line coding is stored and returned, nothing else uses it.
+ */
+class SimCdc : public SimDevice
+{
+    SimFifo fifo{4 * 1024};
+    uint8_t line_coding[7] = {0x00, 0xc2, 0x01, 0x00, 0, 0, 8};   // 115200 8N1
+
+public:
+    SimCdc(SimBus* bus) : SimDevice(bus, 0x0003, "cdc acm")
+    {
+        dev_desc.bDeviceClass = USB_CLASS_COMM;
+        addInterface(0, USB_CLASS_COMM, 2, 1, 1);
+        addDescriptor({5, 0x24, 0x00, 0x10, 0x01});     // header, CDC 1.10
+        addDescriptor({5, 0x24, 0x01, 0x00, 1});        // call management, data interface 1
+        addDescriptor({4, 0x24, 0x02, 0x02});           // ACM, line coding and serial state
+        addDescriptor({5, 0x24, 0x06, 0, 1});           // union
+        addEndpoint(0x83, USB_BM_ATTRIBUTES_XFER_INT, 8, 16);
+        addInterface(1, USB_CLASS_CDC_DATA, 0, 0, 2);
+        addEndpoint(0x02, USB_BM_ATTRIBUTES_XFER_BULK, 64, 0);
+        addEndpoint(0x82, USB_BM_ATTRIBUTES_XFER_BULK, 64, 0);
+    }
+
+protected:
+    int in(uint8_t ep, uint8_t* data, int len) override
+    {
+        if (ep == 0x83 || fifo.used() == 0) return SIM_NAK;
+        if ((size_t)len > fifo.used()) len = fifo.used();
+        fifo.read(data, len);
+        return len;
+    }
+
+    int out(uint8_t ep, const uint8_t* data, int len) override
+    {
+        if (fifo.room() < (size_t)len) return SIM_NAK;
+        fifo.write(data, len);
+        return len;
+    }
+
+    int classRequest(const usb_setup_packet_t* setup, uint8_t* data, int length) override
+    {
+        switch (setup->bRequest)
+        {
+        case CDC_REQUEST_SET_LINE_CODING:
+            if (length < (int)sizeof(line_coding)) return SIM_STALL;
+            memcpy(line_coding, data, sizeof(line_coding));
+            return 0;
+        case CDC_REQUEST_GET_LINE_CODING:
+            return reply(data, length, line_coding, sizeof(line_coding));
+        case CDC_REQUEST_SET_CONTROL_LINE_STATE:
+            return 0;
+        default:
+            return SIM_STALL;
+        }
+    }
+};
+
+SimDevice* sim_cdc_create(SimBus* bus)
+{
+    return new SimCdc(bus);
+}
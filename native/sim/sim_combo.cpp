@@ -0,0 +1,49 @@
+#include <string.h>
+#include "sim_device.hpp"
+
+/**
+ * Composite device: a boot keyboard whose interrupt IN endpoint reports on every 1 ms poll, next to
+ * a vendor interface with a bulk source (EP2 IN) and sink (EP2 OUT) like the loopback device. Both
+ * share one USB/IP connection, so key reports and bulk replies compete for the same socket.
+ */
+class SimCombo : public SimDevice
+{
+    uint8_t pattern = 0;
+    uint8_t key = 0;
+
+public:
+    SimCombo(SimBus* bus) : SimDevice(bus, 0x0005, "combo")
+    {
+        addInterface(0, USB_CLASS_HID, 1, 1, 1);
+        addEndpoint(0x81, USB_BM_ATTRIBUTES_XFER_INT, 8, 1);
+        addInterface(1, USB_CLASS_VENDOR_SPEC, 0, 0, 2);
+        addEndpoint(0x02, USB_BM_ATTRIBUTES_XFER_BULK, 64, 0);
+        addEndpoint(0x82, USB_BM_ATTRIBUTES_XFER_BULK, 64, 0);
+    }
+
+protected:
+    int in(uint8_t ep, uint8_t* data, int len) override
+    {
+        if (ep == 0x82)
+        {
+            for (int n = 0; n < len; n++) data[n] = pattern++;
+            return len;
+        }
+        if (len < 8) return SIM_STALL;
+        // no modifiers, one key pressed, a-z over and over
+        memset(data, 0, 8);
+        data[2] = 0x04 + key++ % 26;
+        return 8;
+    }
+
+    int out(uint8_t ep, const uint8_t* data, int len) override
+    {
+        if (ep == 0x02) return len;
+        return SIM_STALL;
+    }
+};
+
+SimDevice* sim_combo_create(SimBus* bus)
+{
+    return new SimCombo(bus);
+}
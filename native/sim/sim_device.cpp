@@ -0,0 +1,144 @@
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "sim_device.hpp"
+
+static const char *TAG = "sim_device";
+
+// pid.codes test VID, the simulated devices use its test PIDs
+#define SIM_VID     0x1209
+
+static int serial_count;
+
+SimDevice::SimDevice(SimBus* bus, uint16_t idProduct, const char* product) : bus(bus)
+{
+    dev_desc.bLength = sizeof(usb_device_desc_t);
+    dev_desc.bDescriptorType = USB_B_DESCRIPTOR_TYPE_DEVICE;
+    dev_desc.bcdUSB = 0x0200;
+    dev_desc.bMaxPacketSize0 = 64;
+    dev_desc.idVendor = SIM_VID;
+    dev_desc.idProduct = idProduct;
+    dev_desc.bcdDevice = 0x0100;
+    dev_desc.iManufacturer = 1;
+    dev_desc.iProduct = 2;
+    dev_desc.iSerialNumber = 3;
+    dev_desc.bNumConfigurations = 1;
+
+    char serial[16];
+    snprintf(serial, sizeof(serial), "SIM%04d", ++serial_count);
+    for (std::string str : {"usbip simulator", product, (const char*)serial})
+    {
+        std::vector<uint8_t> desc = {(uint8_t)(2 + 2 * str.size()), USB_B_DESCRIPTOR_TYPE_STRING};
+        for (char c : str)
+        {
+            desc.push_back(c);
+            desc.push_back(0);
+        }
+        strings.push_back(desc);
+    }
+
+    config = {9, USB_B_DESCRIPTOR_TYPE_CONFIGURATION, 9, 0, 0, 1, 0, 0x80, 50};
+    eps[0].type = USB_TRANSFER_TYPE_CTRL;
+    eps[0].mps = 64;
+}
+
+void SimDevice::addDescriptor(const std::vector<uint8_t>& desc)
+{
+    config.insert(config.end(), desc.begin(), desc.end());
+    config[2] = config.size() & 0xff;
+    config[3] = config.size() >> 8;
+}
+
+void SimDevice::addInterface(uint8_t number, uint8_t cls, uint8_t subclass, uint8_t protocol, uint8_t numEndpoints)
+{
+    addDescriptor({9, USB_B_DESCRIPTOR_TYPE_INTERFACE, number, 0, numEndpoints, cls, subclass, protocol, 0});
+    config[4]++;
+}
+
+void SimDevice::addEndpoint(uint8_t address, uint8_t type, uint16_t mps, uint8_t interval)
+{
+    addDescriptor({7, USB_B_DESCRIPTOR_TYPE_ENDPOINT, address, type, (uint8_t)(mps & 0xff), (uint8_t)(mps >> 8), interval});
+    SimBus::ep_t* e = ep(address);
+    e->type = type;
+    e->mps = mps;
+    // full speed bInterval is in frames of 1 ms
+    e->interval_us = type == USB_TRANSFER_TYPE_INTR ? interval * 1000 : 0;
+}
+
+esp_err_t SimDevice::setInterface(uint8_t bInterfaceNumber, uint8_t bAlternateSetting)
+{
+    if (bInterfaceNumber >= config[4] || bAlternateSetting != 0) return ESP_ERR_NOT_SUPPORTED;
+    return ESP_OK;
+}
+
+int SimDevice::reply(uint8_t* data, int length, const void* src, int len)
+{
+    if (len > length) len = length;
+    memcpy(data, src, len);
+    return len;
+}
+
+int SimDevice::control(const usb_setup_packet_t* setup, uint8_t* data, int length)
+{
+    bool standard = (setup->bmRequestType & USB_BM_REQUEST_TYPE_TYPE_MASK) == USB_BM_REQUEST_TYPE_TYPE_STANDARD;
+    bool device = (setup->bmRequestType & USB_BM_REQUEST_TYPE_RECIP_MASK) == USB_BM_REQUEST_TYPE_RECIP_DEVICE;
+    if (!standard) return classRequest(setup, data, length);
+
+    uint8_t zero[2] = {0, 0};
+    switch (setup->bRequest)
+    {
+    case USB_B_REQUEST_GET_DESCRIPTOR:
+    {
+        // interface descriptors like the HID report descriptor belong to the class
+        if (!device) return classRequest(setup, data, length);
+        uint8_t type = setup->wValue >> 8;
+        uint8_t index = setup->wValue & 0xff;
+        if (type == USB_B_DESCRIPTOR_TYPE_DEVICE) return reply(data, length, &dev_desc, sizeof(dev_desc));
+        if (type == USB_B_DESCRIPTOR_TYPE_CONFIGURATION && index == 0) return reply(data, length, config.data(), config.size());
+        if (type == USB_B_DESCRIPTOR_TYPE_STRING && index == 0)
+        {
+            const uint8_t langid[] = {4, USB_B_DESCRIPTOR_TYPE_STRING, 0x09, 0x04};
+            return reply(data, length, langid, sizeof(langid));
+        }
+        if (type == USB_B_DESCRIPTOR_TYPE_STRING && index <= strings.size())
+        {
+            return reply(data, length, strings[index - 1].data(), strings[index - 1].size());
+        }
+        return SIM_STALL;
+    }
+    case USB_B_REQUEST_SET_CONFIGURATION:
+        if ((setup->wValue & 0xff) > 1) return SIM_STALL;
+        configuration = setup->wValue & 0xff;
+        return 0;
+    case USB_B_REQUEST_GET_CONFIGURATION:
+        return reply(data, length, &configuration, 1);
+    case USB_B_REQUEST_SET_INTERFACE:
+        return setInterface(setup->wIndex, setup->wValue) == ESP_OK ? 0 : SIM_STALL;
+    case USB_B_REQUEST_GET_INTERFACE:
+        return reply(data, length, zero, 1);
+    case USB_B_REQUEST_GET_STATUS:
+        return reply(data, length, zero, 2);
+    case USB_B_REQUEST_CLEAR_FEATURE:
+    case USB_B_REQUEST_SET_FEATURE:
+    case USB_B_REQUEST_SET_ADDRESS:
+        return 0;
+    default:
+        ESP_LOGW(TAG, "standard request 0x%02x not supported", setup->bRequest);
+        return SIM_STALL;
+    }
+}
+
+SimDevice* sim_device_create(SimBus* bus, const char* name)
+{
+    SimDevice* device = NULL;
+    if (!strcmp(name, "loopback")) device = sim_loopback_create(bus);
+    else if (!strcmp(name, "hid")) device = sim_hid_create(bus);
+    else if (!strcmp(name, "cdc")) device = sim_cdc_create(bus);
+    else if (!strcmp(name, "combo")) device = sim_combo_create(bus);
+    else if (!strncmp(name, "msc", 3) && (name[3] == 0 || name[3] == '='))
+    {
+        device = sim_msc_create(bus, name[3] ? atoi(name + 4) : 4096);
+    }
+    if (device) bus->attach(device);
+    return device;
+}
@@ -0,0 +1,172 @@
+#pragma once
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "usb_backend.hpp"
+
+/**
+ * Simulated USB devices for the native build, to measure the bridge without hardware.
+ *
+ * All devices share one SimBus, a full-speed bus with a single task that moves one packet at a time,
+ * round robin over the endpoints with queued transfers (control and interrupt first). Every packet
+ * costs wire time at the configured bandwidth, a device that has no data or no room NAKs and the
+ * endpoint is retried later. A transfer completes after the configured latency once its last packet
+ * went over the bus.
+ */
+
+#define SIM_NAK     -1
+#define SIM_STALL   -2
+
+typedef struct {
+    uint32_t latency_us;        /*!< last packet on the wire -> transfer callback */
+    uint32_t bandwidth_bps;     /*!< bus bandwidth, 0 for no limit */
+    uint32_t nak_retry_us;      /*!< delay before a bulk endpoint that NAKed is polled again */
+} sim_timing_t;
+
+#define SIM_TIMING_DEFAULT { .latency_us = 100, .bandwidth_bps = 12000000, .nak_retry_us = 50 }
+
+class SimDevice;
+
+/**
+ * @brief Byte ring for devices that loop OUT data back to IN
+ */
+class SimFifo
+{
+    std::vector<uint8_t> buf;
+    size_t head = 0;
+    size_t count = 0;
+
+public:
+    SimFifo(size_t size) : buf(size) {}
+
+    size_t used() const { return count; }
+    size_t room() const { return buf.size() - count; }
+
+    void write(const uint8_t* data, size_t len)
+    {
+        for (size_t n = 0; n < len; n++) buf[(head + count + n) % buf.size()] = data[n];
+        count += len;
+    }
+
+    void read(uint8_t* data, size_t len)
+    {
+        for (size_t n = 0; n < len; n++) data[n] = buf[(head + n) % buf.size()];
+        head = (head + len) % buf.size();
+        count -= len;
+    }
+};
+
+class SimBus
+{
+public:
+    struct ep_t{
+        std::deque<usb_transfer_t*> queue;
+        uint64_t ready_at = 0;  /*!< bus time the endpoint may be polled again */
+        int done = 0;           /*!< bytes of the head transfer already moved */
+        uint8_t type = 0;
+        uint16_t mps = 0;
+        uint32_t interval_us = 0;
+    };
+
+    SimBus(const sim_timing_t& timing);
+    ~SimBus();
+
+    void attach(SimDevice* device);
+    esp_err_t submit(SimDevice* device, usb_transfer_t* transfer);
+    esp_err_t flush(SimDevice* device, uint8_t bEndpointAddress);
+    /**
+     * @brief Disconnects the device: its transfers come back with USB_TRANSFER_STATUS_NO_DEVICE and new
+     * ones are refused, like on the target before USB_HOST_CLIENT_EVENT_DEV_GONE
+     */
+    void unplug(SimDevice* device);
+
+    const sim_timing_t& timing() const { return _timing; }
+
+private:
+    sim_timing_t _timing;
+    std::mutex lock;
+    std::condition_variable cond;
+    std::thread thread;
+    bool running = true;
+
+    std::vector<SimDevice*> devices;
+    size_t rr = 0;              /*!< round robin position among bulk endpoints */
+    uint64_t bus_time = 0;      /*!< time the bus is busy until, in us */
+    std::multimap<uint64_t, usb_transfer_t*> finished;  /*!< by completion time */
+
+    void run();
+    bool pick(SimDevice** device, ep_t** ep, uint64_t* next_ready);
+    void transact(SimDevice* device, ep_t* ep);
+    void control(SimDevice* device, ep_t* ep, usb_transfer_t* transfer);
+    void finish(ep_t* ep, usb_transfer_status_t status, int actual);
+    uint64_t wire_us(int bytes, int packets) const;
+};
+
+/**
+ * @brief Device side of a simulated device: descriptors, standard requests and the endpoints.
+ *
+ * in()/out() move one packet of at most wMaxPacketSize and return the bytes moved, SIM_NAK or SIM_STALL.
+ * They and classRequest() are called from the bus task only.
+ */
+class SimDevice : public USBbackend
+{
+    friend class SimBus;
+
+public:
+    SimDevice(SimBus* bus, uint16_t idProduct, const char* product);
+
+    const usb_device_desc_t* deviceDescriptor() override { return &dev_desc; }
+    const usb_config_desc_t* configDescriptor() override { return (const usb_config_desc_t*)config.data(); }
+    esp_err_t submit(usb_transfer_t* transfer) override { return bus->submit(this, transfer); }
+    esp_err_t flush(uint8_t bEndpointAddress) override { return bus->flush(this, bEndpointAddress); }
+    esp_err_t setInterface(uint8_t bInterfaceNumber, uint8_t bAlternateSetting) override;
+    /**
+     * @brief Like the host library, which reads manufacturer, product and serial number while enumerating
+     */
+    const usb_str_desc_t* stringDescriptor(uint8_t index) override
+    {
+        return index && index <= 3 && index <= strings.size() ? (const usb_str_desc_t*)strings[index - 1].data() : NULL;
+    }
+
+protected:
+    SimBus* bus;
+    usb_device_desc_t dev_desc = {};
+    std::vector<uint8_t> config;
+    std::vector<std::vector<uint8_t>> strings;  /*!< string descriptor 1..n, language 0x0409 */
+    SimBus::ep_t eps[32];               /*!< by endpoint number, IN endpoints at +16 */
+
+    void addInterface(uint8_t number, uint8_t cls, uint8_t subclass, uint8_t protocol, uint8_t numEndpoints);
+    void addEndpoint(uint8_t address, uint8_t type, uint16_t mps, uint8_t interval);
+    void addDescriptor(const std::vector<uint8_t>& desc);
+
+    virtual int in(uint8_t ep, uint8_t* data, int len) = 0;
+    virtual int out(uint8_t ep, const uint8_t* data, int len) = 0;
+    /**
+     * @brief Class, vendor and interface requests with length bytes of data stage: returns the IN data
+     * length or SIM_STALL
+     */
+    virtual int classRequest(const usb_setup_packet_t* setup, uint8_t* data, int length) { return SIM_STALL; }
+    static int reply(uint8_t* data, int length, const void* src, int len);
+
+private:
+    uint8_t configuration = 0;
+    bool unplugged = false;     /*!< under the bus lock */
+    int control(const usb_setup_packet_t* setup, uint8_t* data, int length);
+    SimBus::ep_t* ep(uint8_t bEndpointAddress) { return &eps[(bEndpointAddress & 0x0f) | ((bEndpointAddress & 0x80) >> 3)]; }
+};
+
+SimDevice* sim_loopback_create(SimBus* bus);
+SimDevice* sim_hid_create(SimBus* bus);
+SimDevice* sim_cdc_create(SimBus* bus);
+SimDevice* sim_msc_create(SimBus* bus, uint32_t size_kib);
+SimDevice* sim_combo_create(SimBus* bus);
+
+/**
+ * @brief Device by name: loopback, hid, cdc, combo or msc[=size in KiB], the device is attached to the bus
+ */
+SimDevice* sim_device_create(SimBus* bus, const char* name);
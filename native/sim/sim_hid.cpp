@@ -0,0 +1,102 @@
+#include <string.h>
+#include "sim_device.hpp"
+
+#define HID_DESCRIPTOR_HID          0x21
+#define HID_DESCRIPTOR_REPORT       0x22
+#define HID_REQUEST_GET_REPORT      0x01
+#define HID_REQUEST_GET_IDLE        0x02
+#define HID_REQUEST_SET_IDLE        0x0a
+#define HID_REQUEST_SET_PROTOCOL    0x0b
+
+/**
+ * Boot protocol mouse moving in a square. Its interrupt IN endpoint is polled every 10 ms, the mouse
+ * moves on every 4th poll and NAKs the others, unless an idle rate set by the host repeats the last
+ * report earlier.
+ */
+class SimHid : public SimDevice
+{
+    static constexpr uint8_t report_desc[] = {
+        0x05, 0x01, 0x09, 0x02, 0xa1, 0x01, 0x09, 0x01, 0xa1, 0x00,     // mouse, pointer
+        0x05, 0x09, 0x19, 0x01, 0x29, 0x03, 0x15, 0x00, 0x25, 0x01,     // 3 buttons
+        0x95, 0x03, 0x75, 0x01, 0x81, 0x02, 0x95, 0x01, 0x75, 0x05, 0x81, 0x01,
+        0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x09, 0x38, 0x15, 0x81, 0x25, 0x7f,  // X, Y, wheel
+        0x75, 0x08, 0x95, 0x03, 0x81, 0x06, 0xc0, 0xc0
+    };
+    uint32_t polls = 0;
+    uint32_t reported = 0;  /*!< poll of the last report */
+    uint8_t idle = 0;       /*!< in 4 ms units, 0 reports changes only */
+
+public:
+    SimHid(SimBus* bus) : SimDevice(bus, 0x0002, "hid mouse")
+    {
+        addInterface(0, USB_CLASS_HID, 1, 2, 1);
+        addDescriptor({9, HID_DESCRIPTOR_HID, 0x11, 0x01, 0, 1, HID_DESCRIPTOR_REPORT, sizeof(report_desc), 0});
+        addEndpoint(0x81, USB_BM_ATTRIBUTES_XFER_INT, 8, 10);
+    }
+
+protected:
+    void report(uint8_t* data)
+    {
+        static const int8_t moves[4][2] = {{4, 0}, {0, 4}, {-4, 0}, {0, -4}};
+        const int8_t* move = moves[(polls / 64) % 4];
+        data[0] = 0;
+        data[1] = move[0];
+        data[2] = move[1];
+        data[3] = 0;
+    }
+
+    int in(uint8_t ep, uint8_t* data, int len) override
+    {
+        polls++;
+        bool moved = polls % 4 == 0;
+        bool repeat = idle && (polls - reported) * 10 >= idle * 4u;
+        if (!moved && !repeat) return SIM_NAK;
+        if (len < 4) return SIM_STALL;
+        reported = polls;
+        report(data);
+        return 4;
+    }
+
+    int out(uint8_t ep, const uint8_t* data, int len) override
+    {
+        return SIM_STALL;
+    }
+
+    int classRequest(const usb_setup_packet_t* setup, uint8_t* data, int length) override
+    {
+        if ((setup->bmRequestType & USB_BM_REQUEST_TYPE_TYPE_MASK) == USB_BM_REQUEST_TYPE_TYPE_STANDARD)
+        {
+            if (setup->bRequest == USB_B_REQUEST_GET_DESCRIPTOR && (setup->wValue >> 8) == HID_DESCRIPTOR_REPORT)
+            {
+                return reply(data, length, report_desc, sizeof(report_desc));
+            }
+            return SIM_STALL;
+        }
+
+        switch (setup->bRequest)
+        {
+        case HID_REQUEST_GET_REPORT:
+        {
+            uint8_t buf[4];
+            report(buf);
+            return reply(data, length, buf, sizeof(buf));
+        }
+        case HID_REQUEST_GET_IDLE:
+            return reply(data, length, &idle, 1);
+        case HID_REQUEST_SET_IDLE:
+            idle = setup->wValue >> 8;
+            return 0;
+        case HID_REQUEST_SET_PROTOCOL:
+            return 0;
+        default:
+            return SIM_STALL;
+        }
+    }
+};
+
+constexpr uint8_t SimHid::report_desc[];
+
+SimDevice* sim_hid_create(SimBus* bus)
+{
+    return new SimHid(bus);
+}
@@ -0,0 +1,50 @@
+#include <string.h>
+#include "sim_device.hpp"
+
+/**
+ * Vendor specific device in the spirit of the Linux gadget zero:
+ * EP1 OUT/IN loop data back through a FIFO, IN NAKs while it is empty and OUT while it is full.
+ * EP2 OUT sinks everything, EP2 IN is a source that never runs dry.
+ */
+class SimLoopback : public SimDevice
+{
+    SimFifo fifo{16 * 1024};
+    uint8_t pattern = 0;
+
+public:
+    SimLoopback(SimBus* bus) : SimDevice(bus, 0x0001, "loopback")
+    {
+        addInterface(0, USB_CLASS_VENDOR_SPEC, 0, 0, 4);
+        addEndpoint(0x01, USB_BM_ATTRIBUTES_XFER_BULK, 64, 0);
+        addEndpoint(0x81, USB_BM_ATTRIBUTES_XFER_BULK, 64, 0);
+        addEndpoint(0x02, USB_BM_ATTRIBUTES_XFER_BULK, 64, 0);
+        addEndpoint(0x82, USB_BM_ATTRIBUTES_XFER_BULK, 64, 0);
+    }
+
+protected:
+    int in(uint8_t ep, uint8_t* data, int len) override
+    {
+        if (ep == 0x82)
+        {
+            for (int n = 0; n < len; n++) data[n] = pattern++;
+            return len;
+        }
+        if (fifo.used() == 0) return SIM_NAK;
+        if ((size_t)len > fifo.used()) len = fifo.used();
+        fifo.read(data, len);
+        return len;
+    }
+
+    int out(uint8_t ep, const uint8_t* data, int len) override
+    {
+        if (ep == 0x02) return len;
+        if (fifo.room() < (size_t)len) return SIM_NAK;
+        fifo.write(data, len);
+        return len;
+    }
+};
+
+SimDevice* sim_loopback_create(SimBus* bus)
+{
+    return new SimLoopback(bus);
+}
@@ -0,0 +1,273 @@
+#include <string.h>
+#include "esp_log.h"
+#include "sim_device.hpp"
+
+static const char *TAG = "sim_msc";
+
+#define MSC_REQUEST_RESET           0xff
+#define MSC_REQUEST_GET_MAX_LUN     0xfe
+#define CBW_SIGNATURE               0x43425355
+#define CSW_SIGNATURE               0x53425355
+#define BLOCK_SIZE                  512
+
+#define SCSI_TEST_UNIT_READY        0x00
+#define SCSI_REQUEST_SENSE          0x03
+#define SCSI_INQUIRY                0x12
+#define SCSI_MODE_SENSE_6           0x1a
+#define SCSI_START_STOP_UNIT        0x1b
+#define SCSI_PREVENT_ALLOW_REMOVAL  0x1e
+#define SCSI_READ_FORMAT_CAPACITIES 0x23
+#define SCSI_READ_CAPACITY_10       0x25
+#define SCSI_READ_10                0x28
+#define SCSI_WRITE_10               0x2a
+#define SCSI_VERIFY_10              0x2f
+#define SCSI_SYNCHRONIZE_CACHE_10   0x35
+
+typedef struct __attribute__((packed)) {
+    uint32_t signature;
+    uint32_t tag;
+    uint32_t data_length;
+    uint8_t flags;
+    uint8_t lun;
+    uint8_t cb_length;
+    uint8_t cb[16];
+} msc_cbw_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t signature;
+    uint32_t tag;
+    uint32_t residue;
+    uint8_t status;
+} msc_csw_t;
+
+static uint32_t be32(const uint8_t* p) { return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+static uint16_t be16(const uint8_t* p) { return (p[0] << 8) | p[1]; }
+static void put_be32(uint8_t* p, uint32_t v) { p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v; }
+
+/**
+ * Bulk-only transport mass storage with a SCSI RAM disk. A command goes through CBW on EP2 OUT,
+ * the data stage on EP1 IN or EP2 OUT and the CSW on EP1 IN; IN NAKs while there is nothing to send.
+ * Unsupported commands fail with ILLEGAL REQUEST sense and an empty data stage.
+ */
+class SimMsc : public SimDevice
+{
+    enum state_t { IDLE, DATA_IN, DATA_OUT, STATUS };
+
+    std::vector<uint8_t> disk;
+    state_t state = IDLE;
+    msc_cbw_t cbw;
+    uint8_t status = 0;
+    uint32_t transferred = 0;
+    const uint8_t* in_data = nullptr;   /*!< DATA_IN source, the disk or reply */
+    uint32_t in_length = 0;
+    uint8_t* out_data = nullptr;        /*!< DATA_OUT target in the disk, NULL discards */
+    uint32_t out_length = 0;
+    bool zlp = false;                   /*!< data ended on a packet boundary short of the host's length */
+    uint8_t reply_buf[36];
+    uint8_t sense[3] = {0, 0, 0};       /*!< key, ASC, ASCQ */
+
+public:
+    SimMsc(SimBus* bus, uint32_t size_kib) : SimDevice(bus, 0x0004, "ram disk"), disk((size_t)size_kib * 1024)
+    {
+        addInterface(0, USB_CLASS_MASS_STORAGE, 0x06, 0x50, 2);
+        addEndpoint(0x81, USB_BM_ATTRIBUTES_XFER_BULK, 64, 0);
+        addEndpoint(0x02, USB_BM_ATTRIBUTES_XFER_BULK, 64, 0);
+    }
+
+protected:
+    uint32_t blocks() const { return disk.size() / BLOCK_SIZE; }
+
+    void fail(uint8_t key, uint8_t asc)
+    {
+        status = 1;
+        sense[0] = key;
+        sense[1] = asc;
+        sense[2] = 0;
+    }
+
+    void dataIn(const void* data, uint32_t len)
+    {
+        in_data = (const uint8_t*)data;
+        in_length = len < cbw.data_length ? len : cbw.data_length;
+        state = DATA_IN;
+    }
+
+    /**
+     * @brief Checks the LBA range of READ(10)/WRITE(10), returns the disk offset or -1
+     */
+    int64_t range(uint32_t* length)
+    {
+        uint32_t lba = be32(&cbw.cb[2]);
+        uint32_t count = be16(&cbw.cb[7]);
+        if ((uint64_t)lba + count > blocks())
+        {
+            fail(0x05, 0x21);   // LBA out of range
+            return -1;
+        }
+        *length = count * BLOCK_SIZE;
+        return (int64_t)lba * BLOCK_SIZE;
+    }
+
+    void command()
+    {
+        status = 0;
+        transferred = 0;
+        zlp = false;
+        bool in = cbw.flags & 0x80;
+        uint32_t length;
+
+        switch (cbw.cb[0])
+        {
+        case SCSI_TEST_UNIT_READY:
+        case SCSI_START_STOP_UNIT:
+        case SCSI_PREVENT_ALLOW_REMOVAL:
+        case SCSI_VERIFY_10:
+        case SCSI_SYNCHRONIZE_CACHE_10:
+            break;
+        case SCSI_INQUIRY:
+        {
+            memset(reply_buf, 0, 36);
+            reply_buf[1] = 0x80;    // removable
+            reply_buf[2] = 0x04;    // SPC-2
+            reply_buf[3] = 0x02;
+            reply_buf[4] = 31;
+            memcpy(&reply_buf[8], "usbip   ", 8);
+            memcpy(&reply_buf[16], "RAM disk        ", 16);
+            memcpy(&reply_buf[32], "1.0 ", 4);
+            dataIn(reply_buf, 36);
+            return;
+        }
+        case SCSI_REQUEST_SENSE:
+            memset(reply_buf, 0, 18);
+            reply_buf[0] = 0x70;
+            reply_buf[2] = sense[0];
+            reply_buf[7] = 10;
+            reply_buf[12] = sense[1];
+            reply_buf[13] = sense[2];
+            memset(sense, 0, sizeof(sense));
+            dataIn(reply_buf, 18);
+            return;
+        case SCSI_MODE_SENSE_6:
+            memset(reply_buf, 0, 4);
+            reply_buf[0] = 3;
+            dataIn(reply_buf, 4);
+            return;
+        case SCSI_READ_CAPACITY_10:
+            put_be32(&reply_buf[0], blocks() - 1);
+            put_be32(&reply_buf[4], BLOCK_SIZE);
+            dataIn(reply_buf, 8);
+            return;
+        case SCSI_READ_FORMAT_CAPACITIES:
+            memset(reply_buf, 0, 12);
+            reply_buf[3] = 8;
+            put_be32(&reply_buf[4], blocks());
+            put_be32(&reply_buf[8], (0x02 << 24) | BLOCK_SIZE);    // formatted media
+            dataIn(reply_buf, 12);
+            return;
+        case SCSI_READ_10:
+        {
+            int64_t offset = range(&length);
+            if (offset < 0) break;
+            dataIn(disk.data() + offset, length);
+            return;
+        }
+        case SCSI_WRITE_10:
+        {
+            int64_t offset = range(&length);
+            if (offset < 0) break;
+            out_data = disk.data() + offset;
+            out_length = length < cbw.data_length ? length : cbw.data_length;
+            state = DATA_OUT;
+            return;
+        }
+        default:
+            ESP_LOGW(TAG, "SCSI command 0x%02x not supported", cbw.cb[0]);
+            fail(0x05, 0x20);   // invalid command operation code
+            break;
+        }
+
+        // no data from the device: an expected IN stage ends with a zero length packet, OUT data is discarded
+        if (cbw.data_length == 0) state = STATUS;
+        else if (in) dataIn(NULL, 0);
+        else
+        {
+            out_data = NULL;
+            out_length = cbw.data_length;
+            state = DATA_OUT;
+        }
+    }
+
+    int in(uint8_t ep, uint8_t* data, int len) override
+    {
+        if (state == DATA_IN)
+        {
+            uint32_t n = in_length - transferred;
+            if (n > (uint32_t)len) n = len;
+            if (n) memcpy(data, in_data + transferred, n);
+            transferred += n;
+            if (transferred == in_length)
+            {
+                // a full last packet does not end the host's transfer when it expects more
+                zlp = n == (uint32_t)len && transferred < cbw.data_length;
+                state = STATUS;
+            }
+            return n;
+        }
+        if (state == STATUS)
+        {
+            if (zlp)
+            {
+                zlp = false;
+                return 0;
+            }
+            if (len < (int)sizeof(msc_csw_t)) return SIM_STALL;
+            msc_csw_t csw = {CSW_SIGNATURE, cbw.tag, cbw.data_length - transferred, status};
+            memcpy(data, &csw, sizeof(csw));
+            state = IDLE;
+            return sizeof(csw);
+        }
+        return SIM_NAK;
+    }
+
+    int out(uint8_t ep, const uint8_t* data, int len) override
+    {
+        if (state == IDLE)
+        {
+            if (len != sizeof(msc_cbw_t)) return SIM_STALL;
+            memcpy(&cbw, data, sizeof(cbw));
+            if (cbw.signature != CBW_SIGNATURE) return SIM_STALL;
+            command();
+            return len;
+        }
+        if (state == DATA_OUT)
+        {
+            uint32_t n = out_length - transferred;
+            if (n > (uint32_t)len) n = len;
+            if (out_data) memcpy(out_data + transferred, data, n);
+            transferred += n;
+            if (transferred == out_length) state = STATUS;
+            return len;
+        }
+        return SIM_NAK;
+    }
+
+    int classRequest(const usb_setup_packet_t* setup, uint8_t* data, int length) override
+    {
+        uint8_t lun = 0;
+        switch (setup->bRequest)
+        {
+        case MSC_REQUEST_GET_MAX_LUN:
+            return reply(data, length, &lun, 1);
+        case MSC_REQUEST_RESET:
+            state = IDLE;
+            return 0;
+        default:
+            return SIM_STALL;
+        }
+    }
+};
+
+SimDevice* sim_msc_create(SimBus* bus, uint32_t size_kib)
+{
+    return new SimMsc(bus, size_kib);
+}
@@ -0,0 +1,79 @@
+/**
+ * Isochronous OUT CMD_SUBMIT larger than the receive buffer: ISO PDUs are not streamed, their
+ * descriptors follow the payload, so 8 full speed packets of 1023 bytes and their descriptors never fit
+ * the 8192 bytes of CONFIG_USBIP_RX_BUFFER_SIZE. The URB has to be answered with -EMSGSIZE and its PDU
+ * thrown away, the connection keeps working. Before, it filled the buffer and the connection was
+ * dropped with "Receive buffer full".
+ *
+ *   iso_oversize build/usbip_server
+ */
+#include "test_client.hpp"
+
+#define PACKETS             8
+#define PACKET_SIZE         1023
+
+static int fail(const char* what, const reply_t& reply)
+{
+    fprintf(stderr, "FAIL: %s, got command %u seqnum %u status %d, %zu bytes\n", what, reply.command, reply.seqnum, reply.status, reply.data.size());
+    return 1;
+}
+
+static int run(uint16_t port)
+{
+    int sock = connect_server(port);
+    uint32_t devid = sock < 0 ? 0 : import(sock, "1-1");
+    if (devid == 0)
+    {
+        fprintf(stderr, "FAIL: can not import 1-1\n");
+        return 1;
+    }
+    reply_t reply;
+
+    uint32_t length = PACKETS * PACKET_SIZE;
+    std::vector<uint8_t> pdu(HEADER_SIZE + length + PACKETS * 16);
+    put32(&pdu[0], USBIP_CMD_SUBMIT);
+    put32(&pdu[4], 1);
+    put32(&pdu[8], devid);
+    put32(&pdu[12], USBIP_DIR_OUT);
+    put32(&pdu[16], 1);
+    put32(&pdu[24], length);
+    put32(&pdu[32], PACKETS);
+    memset(&pdu[HEADER_SIZE], 0x5a, length);
+    for (uint32_t n = 0; n < PACKETS; n++)
+    {
+        uint8_t* desc = &pdu[HEADER_SIZE + length + n * 16];
+        put32(desc, n * PACKET_SIZE);
+        put32(desc + 4, PACKET_SIZE);
+    }
+    if (!send_all(sock, pdu.data(), pdu.size())) return 1;
+    if (!recv_reply(sock, &reply, [](uint32_t) { return false; }) || reply.command != USBIP_RET_SUBMIT || reply.seqnum != 1 || reply.status != -EMSGSIZE_WIRE)
+    {
+        return fail("want RET_SUBMIT -EMSGSIZE", reply);
+    }
+
+    // GET_STATUS of the device right behind it, the connection is still there
+    const uint8_t get_status[8] = {0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00};
+    if (!send_submit(sock, 2, devid, USBIP_DIR_IN, 0, 2, get_status)) return 1;
+    if (!recv_reply(sock, &reply, [](uint32_t) { return true; }) || reply.command != USBIP_RET_SUBMIT || reply.seqnum != 2 || reply.status != 0)
+    {
+        return fail("want RET_SUBMIT of GET_STATUS", reply);
+    }
+    printf("ok: ISO OUT of %zu bytes refused, connection kept\n", pdu.size());
+    close(sock);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s usbip_server\n", argv[0]);
+        return 2;
+    }
+    uint16_t port;
+    pid_t server = start_server(argv[1], {"loopback"}, &port);
+    if (server == 0) return 1;
+    int ret = run(port);
+    stop_server(server);
+    return ret;
+}
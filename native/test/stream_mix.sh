@@ -0,0 +1,29 @@
+#!/bin/sh
+# Control requests next to a bulk OUT stream of 64 KiB URBs, more of them than the in-flight budgets
+# admit: the payloads that do not fit are held (CONFIG_USBIP_HOLD_BYTES) instead of stopping the
+# connection at the head of the receive buffer, so the control requests behind them in TCP keep
+# being answered. Fails when fewer than MIN_CTRL control URBs complete.
+#
+#   native/test/stream_mix.sh [build dir]
+set -e
+BUILD=${1:-build}
+PORT=${PORT:-$((20000 + $$ % 20000))}
+MIN_CTRL=${MIN_CTRL:-1000}
+
+"$BUILD/usbip_server" -p "$PORT" -d combo -d loopback >/dev/null &
+SERVER=$!
+trap 'kill $SERVER 2>/dev/null' EXIT
+sleep 0.5
+
+RESULT=$("$BUILD/usbip_load" -p "$PORT" -b 1-2 -t 2 -w 0 bulk-out:size=65536,depth=8 ctrl)
+echo "$RESULT"
+stream() {
+    echo "$RESULT" | grep "\"kind\": \"$1\"" | sed -n "s/.*\"$2\": \([0-9]*\).*/\1/p"
+}
+CTRL=$(stream ctrl urbs)
+BULK=$(stream bulk-out urbs)
+if [ "$(stream ctrl errors)" != 0 ] || [ "$(stream bulk-out errors)" != 0 ] || [ "${BULK:-0}" -eq 0 ] || [ "${CTRL:-0}" -lt "$MIN_CTRL" ]; then
+    echo "FAIL: $CTRL control URBs next to $BULK bulk OUT URBs, want at least $MIN_CTRL without errors"
+    exit 1
+fi
+echo "ok: $CTRL control URBs next to $BULK bulk OUT URBs"
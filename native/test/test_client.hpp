@@ -0,0 +1,196 @@
+#pragma once
+/**
+ * Minimal USB/IP client for the tests of native/test: starts usbip_server on a port of its own,
+ * imports busids and writes raw commands. Only what the tests need, see bench/usbip_load.cpp for
+ * a complete client.
+ */
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#define USBIP_VERSION       0x0111
+#define OP_REQ_IMPORT       0x8003
+#define USBIP_CMD_SUBMIT    1
+#define USBIP_CMD_UNLINK    2
+#define USBIP_RET_SUBMIT    3
+#define USBIP_RET_UNLINK    4
+#define USBIP_DIR_OUT       0
+#define USBIP_DIR_IN        1
+#define HEADER_SIZE         48
+#define IMPORT_REPLY_SIZE   (8 + 0x138)
+#define ECONNRESET_WIRE     104
+#define EMSGSIZE_WIRE       90
+#define REPLY_TIMEOUT_MS    3000
+
+static inline void put32(uint8_t* p, uint32_t v) { p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v; }
+static inline uint32_t get32(const uint8_t* p) { return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+
+/**
+ * @brief Forks usbip_server with the given -d devices on a port derived from the pid, 0 on failure
+ */
+static inline pid_t start_server(const char* path, const std::vector<const char*>& devices, uint16_t* port)
+{
+    *port = 20000 + getpid() % 20000;
+    std::string port_arg = std::to_string(*port);
+    std::vector<const char*> args = {path, "-p", port_arg.c_str()};
+    for (const char* device : devices)
+    {
+        args.push_back("-d");
+        args.push_back(device);
+    }
+    args.push_back(NULL);
+
+    pid_t server = fork();
+    if (server == 0)
+    {
+        if (freopen("/dev/null", "w", stdout) == NULL) _exit(127);
+        execv(path, (char* const*)args.data());
+        perror("exec");
+        _exit(127);
+    }
+    if (server < 0) perror("fork");
+    return server < 0 ? 0 : server;
+}
+
+static inline void stop_server(pid_t server)
+{
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+}
+
+static inline int connect_server(uint16_t port)
+{
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    // the server needs a moment to listen
+    for (int tries = 0; tries < 50; tries++)
+    {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0) return -1;
+        if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0)
+        {
+            int one = 1;
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            return sock;
+        }
+        close(sock);
+        usleep(100 * 1000);
+    }
+    return -1;
+}
+
+static inline bool send_all(int sock, const uint8_t* buf, size_t len)
+{
+    while (len)
+    {
+        ssize_t n = send(sock, buf, len, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * @brief Reads len bytes, false on error or when they do not arrive within timeout_ms
+ */
+static inline bool recv_all(int sock, uint8_t* buf, size_t len, int timeout_ms)
+{
+    while (len)
+    {
+        struct pollfd pfd = {sock, POLLIN, 0};
+        if (poll(&pfd, 1, timeout_ms) <= 0) return false;
+        ssize_t n = recv(sock, buf, len, 0);
+        if (n <= 0) return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * @brief Imports busid, returns its devid or 0
+ */
+static inline uint32_t import(int sock, const char* busid)
+{
+    uint8_t req[8 + 32] = {};
+    req[0] = USBIP_VERSION >> 8;
+    req[1] = USBIP_VERSION & 0xff;
+    req[2] = OP_REQ_IMPORT >> 8;
+    req[3] = OP_REQ_IMPORT & 0xff;
+    strncpy((char*)req + 8, busid, 31);
+    uint8_t reply[IMPORT_REPLY_SIZE];
+    if (!send_all(sock, req, sizeof(req)) || !recv_all(sock, reply, 8, REPLY_TIMEOUT_MS) || get32(reply + 4) != 0) return 0;
+    if (!recv_all(sock, reply + 8, IMPORT_REPLY_SIZE - 8, REPLY_TIMEOUT_MS)) return 0;
+    return (get32(reply + 8 + 288) << 16) | get32(reply + 8 + 292);
+}
+
+/**
+ * @brief CMD_SUBMIT of length bytes, OUT data (length bytes) and the setup packet of EP0 are optional
+ */
+static inline bool send_submit(int sock, uint32_t seqnum, uint32_t devid, uint32_t direction, uint32_t ep, uint32_t length,
+                               const uint8_t* setup = NULL, const uint8_t* data = NULL)
+{
+    std::vector<uint8_t> pdu(HEADER_SIZE + (direction == USBIP_DIR_OUT && data ? length : 0));
+    put32(&pdu[0], USBIP_CMD_SUBMIT);
+    put32(&pdu[4], seqnum);
+    put32(&pdu[8], devid);
+    put32(&pdu[12], direction);
+    put32(&pdu[16], ep);
+    put32(&pdu[24], length);
+    if (setup) memcpy(&pdu[40], setup, 8);
+    if (pdu.size() > HEADER_SIZE) memcpy(&pdu[HEADER_SIZE], data, length);
+    return send_all(sock, pdu.data(), pdu.size());
+}
+
+static inline bool send_unlink(int sock, uint32_t seqnum, uint32_t devid, uint32_t victim)
+{
+    uint8_t pdu[HEADER_SIZE] = {};
+    put32(pdu, USBIP_CMD_UNLINK);
+    put32(pdu + 4, seqnum);
+    put32(pdu + 8, devid);
+    put32(pdu + 20, victim);
+    return send_all(sock, pdu, sizeof(pdu));
+}
+
+struct reply_t{
+    uint32_t command;
+    uint32_t seqnum;
+    int32_t status;
+    std::vector<uint8_t> data;      /*!< IN data of a RET_SUBMIT */
+};
+
+/**
+ * @brief Reads one RET_SUBMIT or RET_UNLINK, false when none arrives within timeout_ms.
+ * in tells whether a RET_SUBMIT seqnum was an IN URB, only those carry data.
+ */
+template <typename IsIn>
+static inline bool recv_reply(int sock, reply_t* reply, IsIn in, int timeout_ms = REPLY_TIMEOUT_MS)
+{
+    uint8_t hdr[HEADER_SIZE];
+    if (!recv_all(sock, hdr, sizeof(hdr), timeout_ms)) return false;
+    reply->command = get32(hdr);
+    reply->seqnum = get32(hdr + 4);
+    reply->status = (int32_t)get32(hdr + 20);
+    reply->data.clear();
+    uint32_t actual = get32(hdr + 24);
+    if (reply->command == USBIP_RET_SUBMIT && actual && in(reply->seqnum))
+    {
+        reply->data.resize(actual);
+        return recv_all(sock, reply->data.data(), actual, timeout_ms);
+    }
+    return true;
+}
@@ -0,0 +1,90 @@
+/**
+ * CMD_UNLINK of a URB that waited through a lot of traffic: a bulk IN on the loopback EP1 waits for
+ * data (it NAKs while the FIFO is empty), more than the seqnum window of finished_seqnums worth of
+ * control requests go by, then the IN is unlinked. It must get RET_UNLINK -ECONNRESET and never a
+ * RET_SUBMIT, also not once an OUT puts data into the FIFO; that data belongs to the next IN. Before,
+ * the unlink was only remembered in the window, which had forgotten seqnums that old: the URB was
+ * posted again and answered after its RET_UNLINK, which vhci-hcd takes for a protocol error.
+ *
+ *   unlink_late build/usbip_server
+ */
+#include "test_client.hpp"
+
+#define REQUESTS            1100    /*!< more than the 1024 seqnums SeqnumWindow keeps */
+#define DATA_SIZE           16
+#define SILENCE_MS          500
+
+static int fail(const char* what, const reply_t& reply)
+{
+    fprintf(stderr, "FAIL: %s, got command %u seqnum %u status %d, %zu bytes\n", what, reply.command, reply.seqnum, reply.status, reply.data.size());
+    return 1;
+}
+
+static int run(uint16_t port)
+{
+    int sock = connect_server(port);
+    uint32_t devid = sock < 0 ? 0 : import(sock, "1-1");
+    if (devid == 0)
+    {
+        fprintf(stderr, "FAIL: can not import 1-1\n");
+        return 1;
+    }
+    uint32_t seqnum = 1;
+    uint32_t victim = seqnum++;
+    uint32_t out = 0;
+    auto in = [&](uint32_t n) { return n != victim && n != out; };
+    reply_t reply;
+
+    if (!send_submit(sock, victim, devid, USBIP_DIR_IN, 1, DATA_SIZE)) return 1;
+    // GET_STATUS of the device, answered from the descriptor cache without touching the bus
+    const uint8_t get_status[8] = {0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00};
+    for (int n = 0; n < REQUESTS; n++)
+    {
+        uint32_t request = seqnum++;
+        if (!send_submit(sock, request, devid, USBIP_DIR_IN, 0, 2, get_status)) return 1;
+        if (!recv_reply(sock, &reply, [](uint32_t) { return true; })) return fail("no reply to GET_STATUS", reply);
+        if (reply.command != USBIP_RET_SUBMIT || reply.seqnum != request || reply.status != 0) return fail("GET_STATUS failed", reply);
+    }
+
+    uint32_t unlink = seqnum++;
+    if (!send_unlink(sock, unlink, devid, victim)) return 1;
+    if (!recv_reply(sock, &reply, in) || reply.command != USBIP_RET_UNLINK || reply.seqnum != unlink || reply.status != -ECONNRESET_WIRE)
+    {
+        return fail("want RET_UNLINK -ECONNRESET", reply);
+    }
+
+    uint8_t data[DATA_SIZE];
+    memset(data, 0x5a, sizeof(data));
+    out = seqnum++;
+    if (!send_submit(sock, out, devid, USBIP_DIR_OUT, 1, DATA_SIZE, NULL, data)) return 1;
+    if (!recv_reply(sock, &reply, in) || reply.command != USBIP_RET_SUBMIT || reply.seqnum != out || reply.status != 0)
+    {
+        return fail("want RET_SUBMIT of the OUT", reply);
+    }
+    if (recv_reply(sock, &reply, in, SILENCE_MS)) return fail("reply after RET_UNLINK", reply);
+
+    uint32_t next = seqnum++;
+    if (!send_submit(sock, next, devid, USBIP_DIR_IN, 1, DATA_SIZE)) return 1;
+    if (!recv_reply(sock, &reply, in) || reply.command != USBIP_RET_SUBMIT || reply.seqnum != next || reply.data.size() != DATA_SIZE)
+    {
+        return fail("want the data in the next IN", reply);
+    }
+    printf("ok: no RET_SUBMIT for a URB unlinked %d requests later\n", REQUESTS);
+    close(sock);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s usbip_server\n", argv[0]);
+        return 2;
+    }
+    uint16_t port;
+    pid_t server = start_server(argv[1], {"loopback"}, &port);
+    if (server == 0) return 1;
+    int ret = run(port);
+    stop_server(server);
+    return ret;
+}
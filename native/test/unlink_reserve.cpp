@@ -0,0 +1,67 @@
+/**
+ * CMD_UNLINK with every URB slot busy: four loopback devices get CMD_SUBMITs on their EP1 IN, which
+ * NAKs while the FIFO is empty, until the global URB budget is used up and the endpoints behind it
+ * wait with their first URB. A CMD_UNLINK then still has to find one of the slots kept for it
+ * (URB_UNLINK_RESERVE) and be answered with -ECONNRESET; before, the first URB of an endpoint was
+ * admitted over the global URB count and took those slots, so the unlink waited forever.
+ *
+ *   unlink_reserve build/usbip_server
+ */
+#include "test_client.hpp"
+
+#define DEVICES             4
+#define SUBMITS             24      /*!< CONFIG_USBIP_DEVICE_BUDGET_URBS, more than the global budget left for the last ones */
+
+static int run(uint16_t port)
+{
+    int socks[DEVICES];
+    uint32_t devids[DEVICES];
+    for (int n = 0; n < DEVICES; n++)
+    {
+        std::string busid = "1-" + std::to_string(n + 1);
+        socks[n] = connect_server(port);
+        devids[n] = socks[n] < 0 ? 0 : import(socks[n], busid.c_str());
+        if (devids[n] == 0)
+        {
+            fprintf(stderr, "FAIL: can not import %s\n", busid.c_str());
+            return 1;
+        }
+        for (uint32_t seqnum = 1; seqnum <= SUBMITS; seqnum++)
+        {
+            if (!send_submit(socks[n], seqnum, devids[n], USBIP_DIR_IN, 1, 64)) return 1;
+        }
+        // one device after the other, so the last ones find the global budget used up
+        usleep(200 * 1000);
+    }
+
+    if (!send_unlink(socks[0], SUBMITS + 1, devids[0], 1)) return 1;
+    reply_t reply;
+    if (!recv_reply(socks[0], &reply, [](uint32_t) { return true; }))
+    {
+        fprintf(stderr, "FAIL: no RET_UNLINK within %d ms, the URB slots kept for CMD_UNLINK are taken\n", REPLY_TIMEOUT_MS);
+        return 1;
+    }
+    if (reply.command != USBIP_RET_UNLINK || reply.seqnum != SUBMITS + 1 || reply.status != -ECONNRESET_WIRE)
+    {
+        fprintf(stderr, "FAIL: got command %u seqnum %u status %d, want RET_UNLINK %u -%d\n", reply.command, reply.seqnum, reply.status, SUBMITS + 1, ECONNRESET_WIRE);
+        return 1;
+    }
+    printf("ok: RET_UNLINK with every URB slot busy\n");
+    for (int n = 0; n < DEVICES; n++) close(socks[n]);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s usbip_server\n", argv[0]);
+        return 2;
+    }
+    uint16_t port;
+    pid_t server = start_server(argv[1], {"loopback", "loopback", "loopback", "loopback"}, &port);
+    if (server == 0) return 1;
+    int ret = run(port);
+    stop_server(server);
+    return ret;
+}